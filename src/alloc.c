@@ -0,0 +1,255 @@
+/*
+ * alloc.c
+ *
+ * Bitmap allocator with a one level summary, see alloc.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "bitmap.h"
+
+#define WORD_BITS BITMAP_BITS_PER_WORD
+
+static void alloc_update_summary(vrs_allocator *alloc, uint32_t word)
+{
+	if (alloc->map[word] == ~0ULL) {
+		alloc->summary[word / WORD_BITS] |= (1ULL << (word % WORD_BITS));
+	} else {
+		alloc->summary[word / WORD_BITS] &= ~(1ULL << (word % WORD_BITS));
+	}
+}
+
+/*
+ * Find the first map word at or after @start_word that has a free bit.
+ * Returns alloc->nwords if there is none.
+ */
+static uint32_t alloc_find_word(const vrs_allocator *alloc, uint32_t start_word)
+{
+	uint32_t nsummary = (alloc->nwords + WORD_BITS - 1) / WORD_BITS;
+	uint32_t s = start_word / WORD_BITS;
+	if (s >= nsummary) {
+		return alloc->nwords;
+	}
+
+	uint64_t open = ~alloc->summary[s] & (~0ULL << (start_word % WORD_BITS));
+	while (open == 0) {
+		if (++s >= nsummary) {
+			return alloc->nwords;
+		}
+		open = ~alloc->summary[s];
+	}
+
+	return s * WORD_BITS + __builtin_ctzll(open);
+}
+
+/** Set up an allocator for @nbits objects, all of them free
+ *
+ * Returns 0 on success, or -1 when out of memory.
+ */
+int alloc_init(vrs_allocator *alloc, uint32_t nbits)
+{
+	uint32_t nwords = (nbits + WORD_BITS - 1) / WORD_BITS;
+	uint32_t nsummary = (nwords + WORD_BITS - 1) / WORD_BITS;
+
+	memset(alloc, 0, sizeof(vrs_allocator));
+	pthread_mutex_init(&alloc->lock, NULL);
+	alloc->map = calloc(nwords ? nwords : 1, sizeof(uint64_t));
+	alloc->summary = calloc(nsummary ? nsummary : 1, sizeof(uint64_t));
+	if ((alloc->map == NULL) || (alloc->summary == NULL)) {
+		alloc_destroy(alloc);
+		return -1;
+	}
+
+	alloc->nbits = nbits;
+	alloc->nfree = nbits;
+	alloc->nwords = nwords;
+
+	// Bits past the last object are permanently in use
+	if (nbits % WORD_BITS) {
+		alloc->map[nwords - 1] = ~0ULL << (nbits % WORD_BITS);
+		alloc_update_summary(alloc, nwords - 1);
+	}
+
+	// So are summary bits past the last word
+	if (nwords % WORD_BITS) {
+		alloc->summary[nsummary - 1] |= ~0ULL << (nwords % WORD_BITS);
+	}
+
+	return 0;
+}
+
+void alloc_destroy(vrs_allocator *alloc)
+{
+	free(alloc->map);
+	free(alloc->summary);
+	pthread_mutex_destroy(&alloc->lock);
+	memset(alloc, 0, sizeof(vrs_allocator));
+}
+
+/** Mark the objects in use according to a block of the on-disk bitmap
+ *
+ * @bitmap holds @nbits bits for the objects starting at @first_bit, which
+ * has to be a multiple of 64.
+ */
+void alloc_load(vrs_allocator *alloc, uint32_t first_bit, const void *bitmap, uint32_t nbits)
+{
+	pthread_mutex_lock(&alloc->lock);
+	uint32_t i = 0;
+	for (i = 0; i < nbits; i += WORD_BITS) {
+		uint32_t word = (first_bit + i) / WORD_BITS;
+		if (word >= alloc->nwords) {
+			break;
+		}
+
+		uint64_t used = bitmap_word(bitmap, i / WORD_BITS);
+		if (nbits - i < WORD_BITS) {
+			used &= (1ULL << (nbits - i)) - 1;
+		}
+
+		uint64_t newly_used = used & ~alloc->map[word];
+		alloc->nfree -= __builtin_popcountll(newly_used);
+		alloc->map[word] |= used;
+		alloc_update_summary(alloc, word);
+	}
+	pthread_mutex_unlock(&alloc->lock);
+}
+
+/*
+ * Find the first free object at or after @start, wrapping around to the
+ * beginning once.  Returns alloc->nbits if everything is in use.
+ */
+static uint32_t alloc_find_free(const vrs_allocator *alloc, uint32_t start)
+{
+	uint32_t word = alloc->nwords;
+	if (start < alloc->nbits) {
+		word = start / WORD_BITS;
+		uint64_t free_bits = ~alloc->map[word] & (~0ULL << (start % WORD_BITS));
+		if (free_bits != 0) {
+			return word * WORD_BITS + __builtin_ctzll(free_bits);
+		}
+		word = alloc_find_word(alloc, word + 1);
+	}
+
+	if (word >= alloc->nwords) {
+		word = alloc_find_word(alloc, 0);
+		if (word >= alloc->nwords) {
+			return alloc->nbits;
+		}
+	}
+
+	return word * WORD_BITS + __builtin_ctzll(~alloc->map[word]);
+}
+
+static int alloc_test(const vrs_allocator *alloc, uint32_t bit)
+{
+	if (bit >= alloc->nbits) {
+		return 0;
+	}
+
+	return (alloc->map[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1;
+}
+
+static void alloc_take(vrs_allocator *alloc, uint32_t bit)
+{
+	uint32_t word = bit / WORD_BITS;
+	alloc->map[word] |= (1ULL << (bit % WORD_BITS));
+	alloc_update_summary(alloc, word);
+	alloc->nfree--;
+}
+
+/** Take a free object
+ *
+ * Searching starts where the previous allocation left off.  Returns the
+ * object number, or alloc->nbits if everything is in use.
+ */
+uint32_t alloc_get(vrs_allocator *alloc)
+{
+	pthread_mutex_lock(&alloc->lock);
+	uint32_t bit = alloc->nbits;
+	if (alloc->nfree > 0) {
+		bit = alloc_find_free(alloc, alloc->hint);
+		if (bit < alloc->nbits) {
+			alloc_take(alloc, bit);
+			alloc->hint = bit + 1;
+		}
+	}
+	pthread_mutex_unlock(&alloc->lock);
+
+	return bit;
+}
+
+/** Take up to @count free objects with consecutive numbers
+ *
+ * The run starts at @goal if that is free, otherwise at the next free
+ * object after it.  It ends after @count objects or at the first object in
+ * use, whichever comes first, and its length is stored in @run_len.
+ * Returns the first object of the run, or alloc->nbits if everything is
+ * in use.
+ */
+uint32_t alloc_get_run(vrs_allocator *alloc, uint32_t goal, uint32_t count, uint32_t *run_len)
+{
+	*run_len = 0;
+	if (count == 0) {
+		return alloc->nbits;
+	}
+
+	pthread_mutex_lock(&alloc->lock);
+	uint32_t start = alloc->nbits;
+	if (alloc->nfree > 0) {
+		start = alloc_find_free(alloc, goal);
+	}
+
+	uint32_t len = 0;
+	if (start < alloc->nbits) {
+		while ((len < count) && (start + len < alloc->nbits) && !alloc_test(alloc, start + len)) {
+			alloc_take(alloc, start + len);
+			++len;
+		}
+		alloc->hint = start + len;
+	}
+	pthread_mutex_unlock(&alloc->lock);
+
+	*run_len = len;
+	return start;
+}
+
+/** Give an object back
+ *
+ * Returns 0 on success, or -1 if it was not in use.
+ */
+int alloc_put(vrs_allocator *alloc, uint32_t bit)
+{
+	pthread_mutex_lock(&alloc->lock);
+	int retstat = -1;
+	if (alloc_test(alloc, bit)) {
+		uint32_t word = bit / WORD_BITS;
+		alloc->map[word] &= ~(1ULL << (bit % WORD_BITS));
+		alloc_update_summary(alloc, word);
+		alloc->nfree++;
+		retstat = 0;
+	}
+	pthread_mutex_unlock(&alloc->lock);
+
+	return retstat;
+}
+
+int alloc_is_used(vrs_allocator *alloc, uint32_t bit)
+{
+	pthread_mutex_lock(&alloc->lock);
+	int used = alloc_test(alloc, bit);
+	pthread_mutex_unlock(&alloc->lock);
+
+	return used;
+}
+
+/* Number of objects not in use */
+uint32_t alloc_nfree(vrs_allocator *alloc)
+{
+	pthread_mutex_lock(&alloc->lock);
+	uint32_t nfree = alloc->nfree;
+	pthread_mutex_unlock(&alloc->lock);
+
+	return nfree;
+}
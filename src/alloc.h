@@ -0,0 +1,44 @@
+/*
+ * alloc.h
+ *
+ * In-memory allocator for inode numbers and data blocks.  It keeps a copy
+ * of the on-disk bitmap (set = in use) plus a summary level with one bit
+ * per bitmap word that is set once the word is full, so a free object is
+ * found by looking at a handful of words whatever the size of the disk.
+ * Every call takes the allocator's own lock, so it can be shared between
+ * threads.
+ */
+
+#ifndef SRC_ALLOC_H_
+#define SRC_ALLOC_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+typedef struct {
+	uint32_t nbits;		/* Number of objects managed */
+	uint32_t nfree;		/* Number of free objects */
+	uint32_t hint;		/* Where the next search starts */
+	uint32_t nwords;
+	uint64_t *map;		/* One bit per object, set = in use */
+	uint64_t *summary;	/* One bit per map word, set = word is full */
+	pthread_mutex_t lock;	/* Protects all of the above */
+} vrs_allocator;
+
+int alloc_init(vrs_allocator *alloc, uint32_t nbits);
+
+void alloc_destroy(vrs_allocator *alloc);
+
+void alloc_load(vrs_allocator *alloc, uint32_t first_bit, const void *bitmap, uint32_t nbits);
+
+uint32_t alloc_get(vrs_allocator *alloc);
+
+uint32_t alloc_get_run(vrs_allocator *alloc, uint32_t goal, uint32_t count, uint32_t *run_len);
+
+int alloc_put(vrs_allocator *alloc, uint32_t bit);
+
+int alloc_is_used(vrs_allocator *alloc, uint32_t bit);
+
+uint32_t alloc_nfree(vrs_allocator *alloc);
+
+#endif /* SRC_ALLOC_H_ */
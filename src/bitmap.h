@@ -0,0 +1,101 @@
+/*
+ * bitmap.h
+ *
+ * Bit-level bitmaps as stored on disk: bit n lives in byte n / 8 at bit
+ * position n % 8, a set bit means the object is in use.  Searches work on
+ * 64 bits at a time, so the map length must be a multiple of 8 bytes.
+ */
+
+#ifndef SRC_BITMAP_H_
+#define SRC_BITMAP_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define BITMAP_BITS_PER_WORD 64
+
+#ifdef __GNUC__
+#define _INLINE_ static __inline__
+#else
+#define _INLINE_ static inline
+#endif
+
+_INLINE_ uint64_t bitmap_word(const void *map, uint32_t word)
+{
+	uint64_t w;
+	memcpy(&w, (const char *)map + (size_t)word * sizeof(uint64_t), sizeof(w));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	w = __builtin_bswap64(w);
+#endif
+	return w;
+}
+
+_INLINE_ int bitmap_test(const void *map, uint32_t bit)
+{
+	return (((const uint8_t *)map)[bit / 8] >> (bit % 8)) & 1;
+}
+
+_INLINE_ void bitmap_set(void *map, uint32_t bit)
+{
+	((uint8_t *)map)[bit / 8] |= (uint8_t)(1 << (bit % 8));
+}
+
+_INLINE_ void bitmap_clear(void *map, uint32_t bit)
+{
+	((uint8_t *)map)[bit / 8] &= (uint8_t)~(1 << (bit % 8));
+}
+
+/**
+ * bitmap_find_zero - find the first clear bit
+ * @map:	the bitmap
+ * @nbits:	number of valid bits in @map
+ * @start:	bit to start searching from
+ *
+ * Returns the index of the first clear bit at or after @start, or @nbits
+ * if there is none.
+ */
+_INLINE_ uint32_t bitmap_find_zero(const void *map, uint32_t nbits, uint32_t start)
+{
+	if (start >= nbits) {
+		return nbits;
+	}
+
+	uint32_t word = start / BITMAP_BITS_PER_WORD;
+	uint32_t nwords = (nbits + BITMAP_BITS_PER_WORD - 1) / BITMAP_BITS_PER_WORD;
+	uint64_t free_bits = ~bitmap_word(map, word) & (~0ULL << (start % BITMAP_BITS_PER_WORD));
+
+	while (free_bits == 0) {
+		if (++word >= nwords) {
+			return nbits;
+		}
+		free_bits = ~bitmap_word(map, word);
+	}
+
+	uint32_t bit = word * BITMAP_BITS_PER_WORD + __builtin_ctzll(free_bits);
+	return (bit < nbits) ? bit : nbits;
+}
+
+/**
+ * bitmap_count - count the set bits
+ * @map:	the bitmap
+ * @nbits:	number of valid bits in @map
+ */
+_INLINE_ uint32_t bitmap_count(const void *map, uint32_t nbits)
+{
+	uint32_t count = 0;
+	uint32_t word = 0;
+	for (word = 0; word < nbits / BITMAP_BITS_PER_WORD; ++word) {
+		count += __builtin_popcountll(bitmap_word(map, word));
+	}
+
+	if (nbits % BITMAP_BITS_PER_WORD) {
+		uint64_t mask = (1ULL << (nbits % BITMAP_BITS_PER_WORD)) - 1;
+		count += __builtin_popcountll(bitmap_word(map, word) & mask);
+	}
+
+	return count;
+}
+
+#undef _INLINE_
+
+#endif /* SRC_BITMAP_H_ */
@@ -5,17 +5,434 @@
   See the file COPYING.
 */
 
+#include "config.h"
+
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "block.h"
+#include "list.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Both are set by disk_open() and block_set_size() before any request is
+// served and only read afterwards
+static int diskfile = -1;
+int block_size = BLOCK_SIZE_MIN;
+
+// Set by every write to the disk file, cleared by block_flush()
+static int disk_unflushed = 0;
+
+/*
+ * Write-back buffer cache.
+ *
+ * Every cached block lives in one hash bucket (keyed by block number) and
+ * on the LRU list, most recently used at the head.  Dirty blocks are only
+ * written to the disk file when they get evicted or on block_sync().
+ *
+ * With the journal on (journal.h), every block written belongs to the
+ * transaction that was running at the time.  Such a block is pinned: it
+ * is not written to its place on the disk, and not evicted, before that
+ * transaction has been committed to the journal.  Pinned blocks may push
+ * the cache past its budget until then.
+ *
+ * With the cache disabled (a budget of 0), blocks are still held while
+ * operations run (block_op_begin()), up to CACHE_OP_BLOCKS of them, so
+ * that an operation reading and changing the same block several times
+ * costs one read and one write.  The dirty ones are written once the
+ * last operation ends, and all of them let go.
+ *
+ * cache_lock protects all of it, including the data of cached blocks.
+ * Reads and writes that go around the cache do their I/O without it, so
+ * threads working on different files do not wait on each other's disk
+ * requests.  Keeping two threads from writing the same block at once is
+ * up to the callers (see the inode locks in inode.h).
+ */
+typedef struct block_buf {
+    int block_num;
+    int status;     // What block_read() returns for this block
+    int dirty;
+    uint32_t tid;   // Transaction that last wrote the block, 0 if none
+    struct block_buf *hash_next;
+    list_t lru;
+    char data[];    // BLOCK_SIZE bytes
+} block_buf_t;
+
+static block_buf_t **cache_hash = NULL;
+static unsigned int cache_hash_mask = 0;
+static unsigned int cache_max_blocks = 0;
+static unsigned int cache_num_blocks = 0;
+static LIST_HEAD(cache_lru);
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t cache_tid = 0; // Running transaction, 0 with the journal off
+static uint32_t cache_committed = 0; // Last transaction committed
+static unsigned int cache_tid_blocks = 0; // Blocks written by the running transaction
+static unsigned int cache_ops = 0; // Operations running, counted with the cache disabled only
+
+#define CACHE_EVICT_SCAN 64 // Pinned blocks skipped looking for one to evict
+#define CACHE_OP_BLOCKS 256 // Blocks held for running operations with the cache disabled
+
+// Whether @bb may not be written to its place yet
+static int cache_pinned(const block_buf_t *bb)
+{
+    return bb->dirty && (bb->tid > cache_committed);
+}
+
+static unsigned int cache_bucket(const int block_num)
+{
+    return ((unsigned int)block_num * 2654435761u) & cache_hash_mask;
+}
+
+static block_buf_t *cache_find(const int block_num)
+{
+    block_buf_t *bb = NULL;
+    if (cache_hash == NULL) {
+	return NULL;
+    }
+
+    for (bb = cache_hash[cache_bucket(block_num)]; bb != NULL; bb = bb->hash_next) {
+	if (bb->block_num == block_num) {
+	    return bb;
+	}
+    }
+
+    return NULL;
+}
+
+// Same as cache_find() but also marks the block as most recently used
+static block_buf_t *cache_lookup(const int block_num)
+{
+    block_buf_t *bb = cache_find(block_num);
+    if (bb != NULL) {
+	list_del(&bb->lru);
+	list_add(&bb->lru, &cache_lru);
+    }
+
+    return bb;
+}
+
+static void cache_unhash(block_buf_t *bb)
+{
+    block_buf_t **pp = &cache_hash[cache_bucket(bb->block_num)];
+    while (*pp != bb) {
+	pp = &(*pp)->hash_next;
+    }
+    *pp = bb->hash_next;
+}
+
+static int cache_writeback(block_buf_t *bb)
+{
+    int retstat = pwrite(diskfile, bb->data, BLOCK_SIZE, (off_t)bb->block_num * BLOCK_SIZE);
+    __atomic_store_n(&disk_unflushed, 1, __ATOMIC_RELAXED);
+    if (retstat < 0) {
+	perror("block_write failed");
+    } else {
+	bb->dirty = 0;
+    }
+
+    return retstat;
+}
+
+/*
+ * Get a free buffer for @block_num, evicting the least recently used block
+ * once the memory budget is used up.  Returns NULL when the block is not to
+ * be cached.
+ */
+static block_buf_t *cache_alloc(const int block_num)
+{
+    block_buf_t *bb = NULL;
+    if (cache_max_blocks == 0) {
+	// Nothing is evicted here, block_op_end() lets go of everything
+	if ((cache_hash == NULL) || (cache_ops == 0) || (cache_num_blocks >= CACHE_OP_BLOCKS)) {
+	    return NULL;
+	}
+	bb = malloc(sizeof(block_buf_t) + BLOCK_SIZE);
+	if (bb == NULL) {
+	    return NULL;
+	}
+	++cache_num_blocks;
+    } else if (cache_num_blocks < cache_max_blocks) {
+	bb = malloc(sizeof(block_buf_t) + BLOCK_SIZE);
+	if (bb == NULL) {
+	    return NULL;
+	}
+	++cache_num_blocks;
+    } else {
+	// The least recently used block that is not pinned, or a new buffer
+	// past the budget if none is found soon
+	list_t *pos = cache_lru.prev;
+	int scanned = 0;
+	while ((pos != &cache_lru) && (scanned < CACHE_EVICT_SCAN) &&
+	       cache_pinned(list_entry(pos, block_buf_t, lru))) {
+	    pos = pos->prev;
+	    ++scanned;
+	}
+
+	if ((pos == &cache_lru) || (scanned == CACHE_EVICT_SCAN)) {
+	    bb = malloc(sizeof(block_buf_t) + BLOCK_SIZE);
+	    if (bb == NULL) {
+		return NULL;
+	    }
+	    ++cache_num_blocks;
+	} else {
+	    bb = list_entry(pos, block_buf_t, lru);
+	    if (bb->dirty && cache_writeback(bb) < 0) {
+		return NULL;
+	    }
+	    list_del(&bb->lru);
+	    cache_unhash(bb);
+	}
+    }
+
+    unsigned int bucket = cache_bucket(block_num);
+    bb->block_num = block_num;
+    bb->dirty = 0;
+    bb->tid = 0;
+    bb->hash_next = cache_hash[bucket];
+    cache_hash[bucket] = bb;
+    list_add(&bb->lru, &cache_lru);
+
+    return bb;
+}
+
+/** Set the block size used for all further I/O
+ *
+ * The size has to be a power of two between @BLOCK_SIZE_MIN and
+ * @BLOCK_SIZE_MAX, and can only be changed before the cache is set up.
+ * Returns 0 on success, or -1 if the size was rejected.
+ */
+int block_set_size(int size)
+{
+    if ((size < BLOCK_SIZE_MIN) || (size > BLOCK_SIZE_MAX) || ((size & (size - 1)) != 0)) {
+	return -1;
+    }
+
+    if ((cache_hash != NULL) && (size != block_size)) {
+	return -1;
+    }
+
+    block_size = size;
+    return 0;
+}
+
+void block_cache_init(size_t cache_size)
+{
+    if (cache_hash != NULL) {
+	return;
+    }
+
+    // Without a budget, the table still holds the blocks of running operations
+    cache_max_blocks = cache_size / BLOCK_SIZE;
+    unsigned int num_buckets = 64;
+    while (num_buckets < cache_max_blocks) {
+	num_buckets <<= 1;
+    }
+
+    cache_hash = calloc(num_buckets, sizeof(block_buf_t *));
+    if (cache_hash == NULL) {
+	perror("block_cache_init failed");
+	cache_max_blocks = 0;
+	return;
+    }
+    cache_hash_mask = num_buckets - 1;
+}
+
+static void block_cache_destroy()
+{
+    list_t *pos = NULL, *pnext = NULL;
+    list_for_each_safe(pos, pnext, &cache_lru) {
+	free(list_entry(pos, block_buf_t, lru));
+    }
+    INIT_LIST_HEAD(&cache_lru);
+
+    free(cache_hash);
+    cache_hash = NULL;
+    cache_hash_mask = 0;
+    cache_max_blocks = 0;
+    cache_num_blocks = 0;
+    cache_tid = 0;
+    cache_committed = 0;
+    cache_tid_blocks = 0;
+    cache_ops = 0;
+}
+
+static int block_vec_cmp(const void *a, const void *b)
+{
+    int na = ((const block_vec_t *)a)->block_num;
+    int nb = ((const block_vec_t *)b)->block_num;
+    return (na > nb) - (na < nb);
+}
+
+/*
+ * Find the end of the run of physically contiguous blocks starting at
+ * vec[start], limited to IOV_MAX entries.  @vec must be sorted.
+ */
+static int block_run_end(const block_vec_t *vec, int start, int count)
+{
+    int end = start + 1;
+    while ((end < count) && (end - start < IOV_MAX) &&
+	   (vec[end].block_num == vec[end - 1].block_num + 1)) {
+	++end;
+    }
+
+    return end;
+}
+
+/*
+ * Write vec[start..end), a run found by block_run_end(), with a single
+ * pwritev().  Returns non-zero if the write failed.
+ */
+static int disk_write_run(const block_vec_t *vec, int start, int end)
+{
+    struct iovec iov[IOV_MAX];
+    int i = 0;
+    for (i = start; i < end; ++i) {
+	iov[i - start].iov_base = vec[i].buf;
+	iov[i - start].iov_len = BLOCK_SIZE;
+    }
+
+    ssize_t len = pwritev(diskfile, iov, end - start, (off_t)vec[start].block_num * BLOCK_SIZE);
+    __atomic_store_n(&disk_unflushed, 1, __ATOMIC_RELAXED);
+    if (len < (ssize_t)(end - start) * BLOCK_SIZE) {
+	perror("block_writev failed");
+	return 1;
+    }
+
+    return 0;
+}
+
+/* block_sync() with cache_lock held */
+static int cache_sync_locked()
+{
+    int retstat = 0;
+    int num_dirty = 0;
+    list_t *pos = NULL;
+
+    list_for_each(pos, &cache_lru) {
+	block_buf_t *bb = list_entry(pos, block_buf_t, lru);
+	if (bb->dirty && !cache_pinned(bb)) {
+	    ++num_dirty;
+	}
+    }
+
+    block_vec_t *vec = (num_dirty > 0) ? malloc(num_dirty * sizeof(block_vec_t)) : NULL;
+    if (vec == NULL) {
+	// Nothing to write, or no memory to sort: write them one at a time
+	list_for_each(pos, &cache_lru) {
+	    block_buf_t *bb = list_entry(pos, block_buf_t, lru);
+	    if (bb->dirty && !cache_pinned(bb) && cache_writeback(bb) < 0) {
+		retstat = -1;
+	    }
+	}
+	return retstat;
+    }
+
+    int i = 0;
+    list_for_each(pos, &cache_lru) {
+	block_buf_t *bb = list_entry(pos, block_buf_t, lru);
+	if (bb->dirty && !cache_pinned(bb)) {
+	    vec[i].block_num = bb->block_num;
+	    vec[i].buf = bb->data;
+	    ++i;
+	}
+    }
+
+    // The buffers are the cached blocks themselves, so they are written
+    // with the lock held
+    qsort(vec, num_dirty, sizeof(block_vec_t), block_vec_cmp);
+    int start = 0;
+    while (start < num_dirty) {
+	int end = block_run_end(vec, start, num_dirty);
+	int failed = disk_write_run(vec, start, end);
+	if (failed) {
+	    retstat = -1;
+	}
+	for (i = start; i < end; ++i) {
+	    cache_find(vec[i].block_num)->dirty = failed;
+	}
+	start = end;
+    }
+    free(vec);
+
+    return retstat;
+}
+
+/** Write all dirty cached blocks back to the disk file
+ *
+ * Dirty blocks are written in block order so that neighbouring blocks go
+ * out in a single pwritev().  Blocks of transactions not committed yet are
+ * left out.  Returns 0 on success, or a negative value if any write failed.
+ */
+int block_sync()
+{
+    pthread_mutex_lock(&cache_lock);
+    int retstat = cache_sync_locked();
+    pthread_mutex_unlock(&cache_lock);
+
+    return retstat;
+}
+
+/** Start an operation that may read and write the same blocks more than once
+ *
+ * Only does something with the cache disabled: until the matching
+ * block_op_end(), the blocks it reads and writes are held in memory
+ * rather than read and written every time.
+ */
+void block_op_begin()
+{
+    if (cache_max_blocks != 0) {
+	return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    ++cache_ops;
+    pthread_mutex_unlock(&cache_lock);
+}
 
-int diskfile = -1;
+/** End an operation started with block_op_begin()
+ *
+ * Once no other operation is running, or too many blocks are held, each
+ * block changed meanwhile is written once and all of them are let go.
+ * Returns 0 on success, or a negative value if a write failed.
+ */
+int block_op_end()
+{
+    if (cache_max_blocks != 0) {
+	return 0;
+    }
+
+    int retstat = 0;
+    pthread_mutex_lock(&cache_lock);
+    --cache_ops;
+    if ((cache_ops == 0) || (cache_num_blocks >= CACHE_OP_BLOCKS)) {
+	retstat = cache_sync_locked();
+
+	// Blocks that failed to write stay for the next try
+	list_t *pos = NULL, *pnext = NULL;
+	list_for_each_safe(pos, pnext, &cache_lru) {
+	    block_buf_t *bb = list_entry(pos, block_buf_t, lru);
+	    if (!bb->dirty) {
+		list_del(&bb->lru);
+		cache_unhash(bb);
+		free(bb);
+		--cache_num_blocks;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return retstat;
+}
 
 void disk_open(const char* diskfile_path)
 {
@@ -33,10 +450,29 @@ void disk_open(const char* diskfile_path)
 void disk_close()
 {
     if(diskfile >= 0){
+	block_sync();
+	block_cache_destroy();
 	close(diskfile);
+	diskfile = -1;
+	block_size = BLOCK_SIZE_MIN;
     }
 }
 
+/** Resize the open file to hold exactly @num_blocks blocks
+ *
+ * Growing the file does not allocate any space, the new blocks read back
+ * as zeros until they are written.  Returns 0 on success, or a negative
+ * value when failed.
+ */
+int disk_truncate(const int num_blocks)
+{
+    int retstat = ftruncate(diskfile, (off_t)num_blocks * BLOCK_SIZE);
+    if (retstat < 0)
+	perror("disk_truncate failed");
+
+    return retstat;
+}
+
 /** Read a block from an open file
  *
  * Read should return (1) exactly @BLOCK_SIZE when succeeded, or (2) 0 when the requested block has never been touched before, or (3) a negtive value when failed.
@@ -45,13 +481,33 @@ void disk_close()
 int block_read(const int block_num, void *buf)
 {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    pthread_mutex_lock(&cache_lock);
+    block_buf_t *bb = cache_lookup(block_num);
+    if (bb != NULL) {
+	memcpy(buf, bb->data, BLOCK_SIZE);
+	retstat = bb->status;
+	pthread_mutex_unlock(&cache_lock);
+	return retstat;
+    }
+
+    // Misses are read with the lock held, or a block written and evicted
+    // meanwhile could come back into the cache with its old contents
+    retstat = pread(diskfile, buf, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
     if (retstat <= 0){
 	memset(buf, 0, BLOCK_SIZE);
 	if(retstat<0)
 	perror("block_read failed");
     }
 
+    if (retstat >= 0) {
+	bb = cache_alloc(block_num);
+	if (bb != NULL) {
+	    memcpy(bb->data, buf, BLOCK_SIZE);
+	    bb->status = retstat;
+	}
+    }
+    pthread_mutex_unlock(&cache_lock);
+
     return retstat;
 }
 
@@ -62,7 +518,27 @@ int block_read(const int block_num, void *buf)
 int block_write(const int block_num, const void *buf)
 {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    pthread_mutex_lock(&cache_lock);
+    block_buf_t *bb = cache_lookup(block_num);
+    if (bb == NULL) {
+	bb = cache_alloc(block_num);
+    }
+
+    if (bb != NULL) {
+	memcpy(bb->data, buf, BLOCK_SIZE);
+	bb->status = BLOCK_SIZE;
+	bb->dirty = 1;
+	if ((cache_tid != 0) && (bb->tid != cache_tid)) {
+	    bb->tid = cache_tid;
+	    ++cache_tid_blocks;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return BLOCK_SIZE;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    retstat = pwrite(diskfile, buf, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+    __atomic_store_n(&disk_unflushed, 1, __ATOMIC_RELAXED);
     if (retstat < 0)
 	perror("block_write failed");
 
@@ -70,18 +546,282 @@ int block_write(const int block_num, const void *buf)
 }
 
 int block_write_padded(const int block_num, const void *buf, int size)
+{
+    char *tmp_buffer = malloc(BLOCK_SIZE);
+    if (tmp_buffer == NULL) {
+	return -1;
+    }
+    memset(tmp_buffer, '0', BLOCK_SIZE);
+    memcpy(tmp_buffer, buf, size);
+
+    int retstat = block_write(block_num, tmp_buffer);
+    free(tmp_buffer);
+    return retstat;
+}
+
+/** Read several blocks from an open file
+ *
+ * Blocks found in the cache are copied from there, the rest are sorted and
+ * read with one preadv() per run of contiguous blocks.  Blocks that were
+ * never written are returned as zeros.  Blocks read from the disk are not
+ * added to the cache, so large file reads do not push metadata out of it.
+ * Returns 0 on success, or a negative value when failed.
+ */
+int block_readv(const block_vec_t *vec, int count)
 {
     int retstat = 0;
-    char tmp_buffer[BLOCK_SIZE];
-    memset(tmp_buffer, '0', sizeof(tmp_buffer));
+    int i = 0, num_misses = 0;
+    block_vec_t *misses = malloc(count * sizeof(block_vec_t));
+    if (misses == NULL) {
+	for (i = 0; i < count; ++i) {
+	    if (block_read(vec[i].block_num, vec[i].buf) < 0) {
+		retstat = -1;
+	    }
+	}
+	return retstat;
+    }
 
-    retstat = pwrite(diskfile, tmp_buffer, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat >= 0) {
-        retstat = pwrite(diskfile, buf, size, block_num*BLOCK_SIZE);
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < count; ++i) {
+	block_buf_t *bb = cache_lookup(vec[i].block_num);
+	if (bb != NULL) {
+	    memcpy(vec[i].buf, bb->data, BLOCK_SIZE);
+	} else {
+	    misses[num_misses++] = vec[i];
+	}
     }
+    pthread_mutex_unlock(&cache_lock);
 
-    if (retstat < 0)
-    	perror("block_write failed");
+    qsort(misses, num_misses, sizeof(block_vec_t), block_vec_cmp);
+
+    struct iovec iov[IOV_MAX];
+    int start = 0;
+    while (start < num_misses) {
+	int end = block_run_end(misses, start, num_misses);
+	for (i = start; i < end; ++i) {
+	    iov[i - start].iov_base = misses[i].buf;
+	    iov[i - start].iov_len = BLOCK_SIZE;
+	}
+
+	ssize_t len = preadv(diskfile, iov, end - start, (off_t)misses[start].block_num * BLOCK_SIZE);
+	if (len < 0) {
+	    perror("block_readv failed");
+	    retstat = -1;
+	    len = 0;
+	}
+
+	// Zero whatever lies beyond the end of the disk file
+	for (i = start; i < end; ++i) {
+	    ssize_t done = len - (ssize_t)(i - start) * BLOCK_SIZE;
+	    if (done < BLOCK_SIZE) {
+		done = (done < 0) ? 0 : done;
+		memset((char *)misses[i].buf + done, 0, BLOCK_SIZE - done);
+	    }
+	}
+
+	start = end;
+    }
+
+    free(misses);
+
+    return retstat;
+}
+
+/** Hint that @count blocks from @block_num on will be read soon
+ *
+ * The disk file is asked to start reading them in the background.  Like
+ * block_readv(), this leaves the cache alone.
+ */
+void block_readahead(const int block_num, int count)
+{
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(diskfile, (off_t)block_num * BLOCK_SIZE, (off_t)count * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/** Write several blocks to an open file
+ *
+ * The blocks are sorted and written with one pwritev() per run of
+ * contiguous blocks.  Cached copies of the blocks are updated and marked
+ * clean.  Returns 0 on success, or a negative value when failed.
+ */
+int block_writev(const block_vec_t *vec, int count)
+{
+    int retstat = 0;
+    int i = 0;
+    block_vec_t *sorted = malloc(count * sizeof(block_vec_t));
+    if (sorted == NULL) {
+	for (i = 0; i < count; ++i) {
+	    if (block_write(vec[i].block_num, vec[i].buf) < 0) {
+		retstat = -1;
+	    }
+	}
+	return retstat;
+    }
+
+    memcpy(sorted, vec, count * sizeof(block_vec_t));
+    qsort(sorted, count, sizeof(block_vec_t), block_vec_cmp);
+
+    int start = 0;
+    while (start < count) {
+	int end = block_run_end(sorted, start, count);
+	int failed = disk_write_run(sorted, start, end);
+	if (failed) {
+	    retstat = -1;
+	}
+
+	// Keep cached copies coherent, a failed block stays dirty for a retry
+	pthread_mutex_lock(&cache_lock);
+	for (i = start; i < end; ++i) {
+	    block_buf_t *bb = cache_find(sorted[i].block_num);
+	    if (bb != NULL) {
+		memcpy(bb->data, sorted[i].buf, BLOCK_SIZE);
+		bb->status = BLOCK_SIZE;
+		bb->dirty = failed;
+		bb->tid = 0;
+	    }
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	start = end;
+    }
+
+    free(sorted);
+
+    return retstat;
+}
+
+/** Keep a clean copy of block @block_num, just written as @buf, in the cache
+ *
+ * block_writev() leaves file data out of the cache.  This is for the
+ * block a file ends in, which the next append will merge with.
+ */
+void block_keep(const int block_num, const void *buf)
+{
+    pthread_mutex_lock(&cache_lock);
+    block_buf_t *bb = cache_lookup(block_num);
+    if (bb == NULL) {
+	bb = cache_alloc(block_num);
+	if (bb != NULL) {
+	    memcpy(bb->data, buf, BLOCK_SIZE);
+	    bb->status = BLOCK_SIZE;
+	}
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/** Flush what was written to the disk file down to stable storage
+ *
+ * Does nothing if nothing was written since the last flush.  Returns 0 on
+ * success, or a negative value when failed.
+ */
+int block_flush()
+{
+    // Cleared first: a write racing with the flush gets flushed next time
+    if (__atomic_exchange_n(&disk_unflushed, 0, __ATOMIC_ACQ_REL) == 0) {
+	return 0;
+    }
+
+#ifdef HAVE_FDATASYNC
+    int retstat = fdatasync(diskfile);
+#else
+    int retstat = fsync(diskfile);
+#endif
+    if (retstat < 0) {
+	perror("block_flush failed");
+	__atomic_store_n(&disk_unflushed, 1, __ATOMIC_RELAXED);
+    }
 
     return retstat;
 }
+
+/** Start transaction @tid
+ *
+ * Blocks written from now on belong to it and stay pinned in the cache
+ * until block_set_committed() is called with @tid or a later one.  0 stops
+ * tagging blocks.  Returns 0 on success, or -1 if there is no cache to hold
+ * the blocks.
+ */
+int block_set_transaction(uint32_t tid)
+{
+    if ((tid != 0) && (cache_max_blocks == 0)) {
+	return -1;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    cache_tid = tid;
+    cache_tid_blocks = 0;
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
+
+/** Let the blocks of transactions up to @tid be written to their place */
+void block_set_committed(uint32_t tid)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_committed = tid;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Number of blocks written by the running transaction so far
+unsigned int block_transaction_size()
+{
+    pthread_mutex_lock(&cache_lock);
+    unsigned int count = cache_tid_blocks;
+    pthread_mutex_unlock(&cache_lock);
+
+    return count;
+}
+
+/** Copy out the blocks written by transaction @tid
+ *
+ * On return *@vec holds one entry per block, sorted by block number, and
+ * *@data the copies they point into.  Both are to be freed by the caller.
+ * Returns the number of blocks, or -1 when out of memory.
+ */
+int block_collect(uint32_t tid, block_vec_t **vec, char **data)
+{
+    list_t *pos = NULL;
+    int count = 0, i = 0;
+
+    *vec = NULL;
+    *data = NULL;
+    pthread_mutex_lock(&cache_lock);
+    list_for_each(pos, &cache_lru) {
+	block_buf_t *bb = list_entry(pos, block_buf_t, lru);
+	if (bb->dirty && (bb->tid == tid)) {
+	    ++count;
+	}
+    }
+
+    if (count > 0) {
+	*vec = malloc(count * sizeof(block_vec_t));
+	*data = malloc((size_t)count * BLOCK_SIZE);
+	if ((*vec == NULL) || (*data == NULL)) {
+	    pthread_mutex_unlock(&cache_lock);
+	    free(*vec);
+	    free(*data);
+	    *vec = NULL;
+	    *data = NULL;
+	    return -1;
+	}
+
+	list_for_each(pos, &cache_lru) {
+	    block_buf_t *bb = list_entry(pos, block_buf_t, lru);
+	    if (bb->dirty && (bb->tid == tid)) {
+		(*vec)[i].block_num = bb->block_num;
+		(*vec)[i].buf = *data + (size_t)i * BLOCK_SIZE;
+		memcpy((*vec)[i].buf, bb->data, BLOCK_SIZE);
+		++i;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (count > 1) {
+	qsort(*vec, count, sizeof(block_vec_t), block_vec_cmp);
+    }
+
+    return count;
+}
@@ -8,12 +8,45 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
-#define BLOCK_SIZE 512
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOCK_SIZE_MIN 512
+#define BLOCK_SIZE_MAX (64 * 1024)
+#define BLOCK_SIZE_DEFAULT 4096
+
+// Block size of the open disk.  It is BLOCK_SIZE_MIN until block_set_size()
+// is called with the size recorded in the superblock.
+extern int block_size;
+#define BLOCK_SIZE (block_size)
+
+#define BLOCK_CACHE_SIZE_DEFAULT (8 * 1024 * 1024) // Memory budget of the buffer cache in bytes
+
+// One block of a vectored request
+typedef struct {
+    int block_num;
+    void *buf;
+} block_vec_t;
 
 void disk_open(const char* diskfile_path);
 void disk_close();
+int disk_truncate(const int num_blocks);
+int block_set_size(int size);
+void block_cache_init(size_t cache_size);
+int block_sync();
+void block_op_begin();
+int block_op_end();
 int block_read(const int block_num, void *buf);
 int block_write(const int block_num, const void *buf);
 int block_write_padded(const int block_num, const void *buf, int size);
+int block_readv(const block_vec_t *vec, int count);
+int block_writev(const block_vec_t *vec, int count);
+void block_readahead(const int block_num, int count);
+void block_keep(const int block_num, const void *buf);
+int block_flush();
+int block_set_transaction(uint32_t tid);
+void block_set_committed(uint32_t tid);
+unsigned int block_transaction_size();
+int block_collect(uint32_t tid, block_vec_t **vec, char **data);
 
 #endif
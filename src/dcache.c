@@ -0,0 +1,240 @@
+/*
+ * dcache.c
+ *
+ * Directory lookup cache, see dcache.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+
+/* FNV-1a over the name, seeded with the parent inode */
+static uint32_t dcache_hash(uint32_t parent, const char *name)
+{
+	uint32_t hash = 2166136261u ^ (parent * 2654435761u);
+	for (; *name != '\0'; ++name) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static vrs_dcache_entry *dcache_find(const vrs_dcache *dcache, uint32_t hash, uint32_t parent, const char *name)
+{
+	vrs_dcache_entry *entry = NULL;
+	for (entry = dcache->hash[hash & dcache->hash_mask]; entry != NULL; entry = entry->hash_next) {
+		if ((entry->hash == hash) && (entry->parent == parent) && (strcmp(entry->name, name) == 0)) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static void dcache_unhash(vrs_dcache *dcache, vrs_dcache_entry *entry)
+{
+	vrs_dcache_entry **pp = &dcache->hash[entry->hash & dcache->hash_mask];
+	while (*pp != entry) {
+		pp = &(*pp)->hash_next;
+	}
+	*pp = entry->hash_next;
+}
+
+static void dcache_drop(vrs_dcache *dcache, vrs_dcache_entry *entry)
+{
+	list_del(&entry->lru);
+	dcache_unhash(dcache, entry);
+	--dcache->num_entries;
+	free(entry);
+}
+
+int dcache_init(vrs_dcache *dcache, uint32_t max_entries)
+{
+	memset(dcache, 0, sizeof(*dcache));
+	dcache->max_entries = max_entries;
+	INIT_LIST_HEAD(&dcache->lru);
+
+	uint32_t num_buckets = 64;
+	while (num_buckets < max_entries) {
+		num_buckets <<= 1;
+	}
+
+	dcache->hash = calloc(num_buckets, sizeof(vrs_dcache_entry *));
+	if (dcache->hash == NULL) {
+		return -1;
+	}
+	dcache->hash_mask = num_buckets - 1;
+	pthread_mutex_init(&dcache->lock, NULL);
+
+	return 0;
+}
+
+void dcache_destroy(vrs_dcache *dcache)
+{
+	list_t *pos = NULL, *pnext = NULL;
+	list_for_each_safe(pos, pnext, &dcache->lru) {
+		free(list_entry(pos, vrs_dcache_entry, lru));
+	}
+
+	free(dcache->hash);
+	pthread_mutex_destroy(&dcache->lock);
+	memset(dcache, 0, sizeof(*dcache));
+	INIT_LIST_HEAD(&dcache->lru);
+}
+
+/** Look up @name in directory @parent
+ *
+ * Returns DCACHE_HIT and sets *@ino if the name is cached, DCACHE_NEGATIVE
+ * if it is cached as missing and DCACHE_MISS if the directory has to be
+ * searched.
+ */
+int dcache_lookup(vrs_dcache *dcache, uint32_t parent, const char *name, uint32_t *ino)
+{
+	if (dcache->max_entries == 0) {
+		return DCACHE_MISS;
+	}
+
+	int found = DCACHE_MISS;
+	pthread_mutex_lock(&dcache->lock);
+	vrs_dcache_entry *entry = dcache_find(dcache, dcache_hash(parent, name), parent, name);
+	if (entry != NULL) {
+		list_del(&entry->lru);
+		list_add(&entry->lru, &dcache->lru);
+
+		if (entry->negative) {
+			found = DCACHE_NEGATIVE;
+		} else {
+			*ino = entry->ino;
+			found = DCACHE_HIT;
+		}
+	}
+	pthread_mutex_unlock(&dcache->lock);
+
+	return found;
+}
+
+/*
+ * Called with the lock held.  A @cold entry goes to the least recently
+ * used end, where the next insert evicts it unless a lookup used it
+ * first; a name already cached keeps its place then.
+ */
+static void dcache_insert(vrs_dcache *dcache, uint32_t parent, const char *name, uint32_t ino, int negative, int cold)
+{
+	uint32_t hash = dcache_hash(parent, name);
+	vrs_dcache_entry *entry = dcache_find(dcache, hash, parent, name);
+	if (entry != NULL) {
+		if (cold) {
+			entry->ino = ino;
+			entry->negative = negative;
+			return;
+		}
+		list_del(&entry->lru);
+	} else {
+		if (dcache->num_entries >= dcache->max_entries) {
+			dcache_drop(dcache, list_entry(dcache->lru.prev, vrs_dcache_entry, lru));
+		}
+
+		size_t len = strlen(name);
+		entry = malloc(sizeof(vrs_dcache_entry) + len + 1);
+		if (entry == NULL) {
+			return;
+		}
+		memcpy(entry->name, name, len + 1);
+		entry->parent = parent;
+		entry->hash = hash;
+		entry->hash_next = dcache->hash[hash & dcache->hash_mask];
+		dcache->hash[hash & dcache->hash_mask] = entry;
+		++dcache->num_entries;
+	}
+
+	entry->ino = ino;
+	entry->negative = negative;
+	if (cold) {
+		list_add_tail(&entry->lru, &dcache->lru);
+	} else {
+		list_add(&entry->lru, &dcache->lru);
+	}
+}
+
+void dcache_add(vrs_dcache *dcache, uint32_t parent, const char *name, uint32_t ino)
+{
+	if (dcache->max_entries == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&dcache->lock);
+	dcache_insert(dcache, parent, name, ino, 0, 0);
+	pthread_mutex_unlock(&dcache->lock);
+}
+
+/*
+ * Same as dcache_add() for names nobody asked for yet, as a directory
+ * listing finds them: however many are added, they only ever take the
+ * place of one entry that was used before.
+ */
+void dcache_add_cold(vrs_dcache *dcache, uint32_t parent, const char *name, uint32_t ino)
+{
+	if (dcache->max_entries == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&dcache->lock);
+	dcache_insert(dcache, parent, name, ino, 0, 1);
+	pthread_mutex_unlock(&dcache->lock);
+}
+
+void dcache_add_negative(vrs_dcache *dcache, uint32_t parent, const char *name)
+{
+	if (dcache->max_entries == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&dcache->lock);
+	dcache_insert(dcache, parent, name, 0, 1, 0);
+	pthread_mutex_unlock(&dcache->lock);
+}
+
+/* Current generation, to be passed to dcache_add_since() */
+uint32_t dcache_generation(vrs_dcache *dcache)
+{
+	pthread_mutex_lock(&dcache->lock);
+	uint32_t generation = dcache->generation;
+	pthread_mutex_unlock(&dcache->lock);
+
+	return generation;
+}
+
+/*
+ * Same as dcache_add(), unless anything was purged after @generation was
+ * taken.  For names found without holding the directory's lock, which may
+ * have been removed in the meantime.
+ */
+void dcache_add_since(vrs_dcache *dcache, uint32_t parent, const char *name, uint32_t ino, uint32_t generation)
+{
+	if (dcache->max_entries == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&dcache->lock);
+	if (dcache->generation == generation) {
+		dcache_insert(dcache, parent, name, ino, 0, 0);
+	}
+	pthread_mutex_unlock(&dcache->lock);
+}
+
+/* Forget every name cached for directory @parent, when it goes away */
+void dcache_purge_parent(vrs_dcache *dcache, uint32_t parent)
+{
+	pthread_mutex_lock(&dcache->lock);
+	list_t *pos = NULL, *pnext = NULL;
+	list_for_each_safe(pos, pnext, &dcache->lru) {
+		vrs_dcache_entry *entry = list_entry(pos, vrs_dcache_entry, lru);
+		if (entry->parent == parent) {
+			dcache_drop(dcache, entry);
+		}
+	}
+	++dcache->generation;
+	pthread_mutex_unlock(&dcache->lock);
+}
@@ -0,0 +1,66 @@
+/*
+ * dcache.h
+ *
+ * Cache of directory lookups: (parent inode, name) -> inode.  Names that
+ * were looked up and not found are cached too (negative entries), so a
+ * repeated miss does not scan the directory again.  Entries are evicted
+ * least recently used first once the budget is used up.  Calls may come
+ * from several threads; keeping entries in step with the directories is
+ * up to the callers, which change a directory and its entries under the
+ * directory's lock.
+ */
+
+#ifndef SRC_DCACHE_H_
+#define SRC_DCACHE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "list.h"
+
+#define DCACHE_SIZE_DEFAULT 8192 // Directory entries kept in memory
+
+// What dcache_lookup() found
+#define DCACHE_MISS		(-1)	// Nothing known about the name
+#define DCACHE_NEGATIVE	0		// The name is known not to exist
+#define DCACHE_HIT		1		// The name exists, *ino is set
+
+typedef struct vrs_dcache_entry {
+	uint32_t parent;
+	uint32_t ino;
+	int negative;
+	uint32_t hash;
+	struct vrs_dcache_entry *hash_next;
+	list_t lru;
+	char name[];
+} vrs_dcache_entry;
+
+typedef struct {
+	uint32_t max_entries;
+	uint32_t num_entries;
+	uint32_t hash_mask;
+	vrs_dcache_entry **hash;
+	list_t lru;		/* Most recently used first */
+	uint32_t generation;	/* Bumped by every dcache_purge_parent() */
+	pthread_mutex_t lock;	/* Protects all of the above */
+} vrs_dcache;
+
+int dcache_init(vrs_dcache *dcache, uint32_t max_entries);
+
+void dcache_destroy(vrs_dcache *dcache);
+
+int dcache_lookup(vrs_dcache *dcache, uint32_t parent, const char *name, uint32_t *ino);
+
+void dcache_add(vrs_dcache *dcache, uint32_t parent, const char *name, uint32_t ino);
+
+void dcache_add_cold(vrs_dcache *dcache, uint32_t parent, const char *name, uint32_t ino);
+
+void dcache_add_negative(vrs_dcache *dcache, uint32_t parent, const char *name);
+
+uint32_t dcache_generation(vrs_dcache *dcache);
+
+void dcache_add_since(vrs_dcache *dcache, uint32_t parent, const char *name, uint32_t ino, uint32_t generation);
+
+void dcache_purge_parent(vrs_dcache *dcache, uint32_t parent);
+
+#endif /* SRC_DCACHE_H_ */
@@ -0,0 +1,436 @@
+/*
+ * icache.c
+ *
+ * Inode table cache, see icache.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "icache.h"
+
+static uint32_t icache_bucket(const vrs_icache *icache, uint32_t ino)
+{
+	return (ino * 2654435761u) & icache->hash_mask;
+}
+
+static vrs_icache_entry *icache_find(const vrs_icache *icache, uint32_t ino)
+{
+	vrs_icache_entry *entry = NULL;
+	for (entry = icache->hash[icache_bucket(icache, ino)]; entry != NULL; entry = entry->hash_next) {
+		if (entry->ino == ino) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static void icache_unhash(vrs_icache *icache, vrs_icache_entry *entry)
+{
+	vrs_icache_entry **pp = &icache->hash[icache_bucket(icache, entry->ino)];
+	while (*pp != entry) {
+		pp = &(*pp)->hash_next;
+	}
+	*pp = entry->hash_next;
+}
+
+int icache_init(vrs_icache *icache, uint32_t table_block, uint32_t record_size, uint32_t max_entries)
+{
+	memset(icache, 0, sizeof(*icache));
+	icache->table_block = table_block;
+	icache->record_size = record_size;
+	icache->max_entries = (max_entries > 0) ? max_entries : 1;
+	INIT_LIST_HEAD(&icache->lru);
+	INIT_LIST_HEAD(&icache->pinned);
+	INIT_LIST_HEAD(&icache->dirty);
+
+	uint32_t num_buckets = 64;
+	while (num_buckets < icache->max_entries) {
+		num_buckets <<= 1;
+	}
+
+	icache->hash = calloc(num_buckets, sizeof(vrs_icache_entry *));
+	icache->block = malloc(BLOCK_SIZE);
+	if ((icache->hash == NULL) || (icache->block == NULL)) {
+		free(icache->hash);
+		free(icache->block);
+		icache->hash = NULL;
+		icache->block = NULL;
+		return -1;
+	}
+	icache->hash_mask = num_buckets - 1;
+	pthread_mutex_init(&icache->lock, NULL);
+
+	return 0;
+}
+
+/* Drops every entry, dirty or not; call icache_flush() first */
+void icache_destroy(vrs_icache *icache)
+{
+	list_t *pos = NULL, *pnext = NULL;
+	list_for_each_safe(pos, pnext, &icache->lru) {
+		free(list_entry(pos, vrs_icache_entry, lru));
+	}
+	list_for_each_safe(pos, pnext, &icache->pinned) {
+		free(list_entry(pos, vrs_icache_entry, lru));
+	}
+
+	free(icache->hash);
+	free(icache->block);
+	pthread_mutex_destroy(&icache->lock);
+	memset(icache, 0, sizeof(*icache));
+	INIT_LIST_HEAD(&icache->lru);
+	INIT_LIST_HEAD(&icache->pinned);
+	INIT_LIST_HEAD(&icache->dirty);
+}
+
+static int icache_cmp(const void *a, const void *b)
+{
+	uint32_t ia = (*(vrs_icache_entry * const *)a)->ino;
+	uint32_t ib = (*(vrs_icache_entry * const *)b)->ino;
+	return (ia > ib) - (ia < ib);
+}
+
+/** Write every dirty inode back to the inode table
+ *
+ * Dirty inodes are sorted so that each inode table block is read and
+ * written once however many of its inodes changed.  Returns 0 on success,
+ * or -1 if a write failed; those inodes stay dirty.
+ */
+static int icache_flush_locked(vrs_icache *icache)
+{
+	if (icache->num_dirty == 0) {
+		return 0;
+	}
+
+	vrs_icache_entry **dirty = malloc(icache->num_dirty * sizeof(vrs_icache_entry *));
+	if (dirty == NULL) {
+		return -1;
+	}
+
+	uint32_t n = 0;
+	list_t *pos = NULL;
+	list_for_each(pos, &icache->dirty) {
+		dirty[n++] = list_entry(pos, vrs_icache_entry, dirty_link);
+	}
+	qsort(dirty, n, sizeof(vrs_icache_entry *), icache_cmp);
+
+	uint32_t per_block = BLOCK_SIZE / icache->record_size;
+	char *buffer = icache->block;
+	int retstat = 0;
+	uint32_t i = 0;
+	while (i < n) {
+		uint32_t table_offset = dirty[i]->ino / per_block;
+		uint32_t j = i;
+
+		block_read(icache->table_block + table_offset, buffer);
+		for (j = i; (j < n) && (dirty[j]->ino / per_block == table_offset); ++j) {
+			memcpy(buffer + (dirty[j]->ino % per_block) * icache->record_size, dirty[j]->data, icache->record_size);
+		}
+
+		if (block_write(icache->table_block + table_offset, buffer) < 0) {
+			retstat = -1;
+		} else {
+			for (; i < j; ++i) {
+				dirty[i]->dirty = 0;
+				list_del(&dirty[i]->dirty_link);
+				--icache->num_dirty;
+			}
+		}
+		i = j;
+	}
+
+	free(dirty);
+	return retstat;
+}
+
+int icache_flush(vrs_icache *icache)
+{
+	pthread_mutex_lock(&icache->lock);
+	int retstat = icache_flush_locked(icache);
+	pthread_mutex_unlock(&icache->lock);
+
+	return retstat;
+}
+
+/*
+ * Get an entry to hold @ino, reusing the least recently used clean entry
+ * once the budget is used up.  Dirty inodes are flushed first so the
+ * entry can be dropped.
+ */
+static vrs_icache_entry *icache_alloc(vrs_icache *icache, uint32_t ino)
+{
+	vrs_icache_entry *entry = NULL;
+
+	if ((icache->num_entries >= icache->max_entries) && !list_empty(&icache->lru)) {
+		entry = list_entry(icache->lru.prev, vrs_icache_entry, lru);
+		if (entry->dirty && (icache_flush_locked(icache) < 0)) {
+			entry = NULL;
+		} else {
+			list_del(&entry->lru);
+			icache_unhash(icache, entry);
+		}
+	}
+
+	if (entry == NULL) {
+		entry = malloc(sizeof(vrs_icache_entry) + icache->record_size);
+		if (entry == NULL) {
+			return NULL;
+		}
+		++icache->num_entries;
+	}
+
+	uint32_t bucket = icache_bucket(icache, ino);
+	entry->ino = ino;
+	entry->dirty = 0;
+	entry->pins = 0;
+	entry->hash_next = icache->hash[bucket];
+	icache->hash[bucket] = entry;
+	list_add(&entry->lru, &icache->lru);
+
+	return entry;
+}
+
+/*
+ * Get the entry of inode @ino, reading it in on a miss.  Called with the
+ * lock held.  Returns NULL if no memory was left for the entry.
+ */
+static vrs_icache_entry *icache_get(vrs_icache *icache, uint32_t ino)
+{
+	vrs_icache_entry *entry = icache_find(icache, ino);
+	if (entry != NULL) {
+		if (entry->pins == 0) {
+			list_del(&entry->lru);
+			list_add(&entry->lru, &icache->lru);
+		}
+		return entry;
+	}
+
+	entry = icache_alloc(icache, ino);
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	uint32_t per_block = BLOCK_SIZE / icache->record_size;
+	char *buffer = icache->block;
+	block_read(icache->table_block + ino / per_block, buffer);
+	memcpy(entry->data, buffer + (ino % per_block) * icache->record_size, icache->record_size);
+
+	return entry;
+}
+
+/** Copy the first @size bytes of inode @ino into @record
+ *
+ * The inode is read in on a miss.  Returns 0 on success, or -1 if no
+ * memory was left for the entry.
+ */
+int icache_read(vrs_icache *icache, uint32_t ino, void *record, size_t size)
+{
+	pthread_mutex_lock(&icache->lock);
+	vrs_icache_entry *entry = icache_get(icache, ino);
+	if (entry != NULL) {
+		memcpy(record, entry->data, size);
+	}
+	pthread_mutex_unlock(&icache->lock);
+
+	return (entry != NULL) ? 0 : -1;
+}
+
+/** Replace the first @size bytes of the cached copy of inode @ino
+ *
+ * The inode is written back to the table later.  Returns 0 on success,
+ * or -1 if no memory was left for the entry.
+ */
+int icache_write(vrs_icache *icache, uint32_t ino, const void *record, size_t size)
+{
+	pthread_mutex_lock(&icache->lock);
+	vrs_icache_entry *entry = icache_get(icache, ino);
+	if (entry != NULL) {
+		memcpy(entry->data, record, size);
+		if (!entry->dirty) {
+			entry->dirty = 1;
+			list_add_tail(&entry->dirty_link, &icache->dirty);
+			++icache->num_dirty;
+		}
+	}
+	pthread_mutex_unlock(&icache->lock);
+
+	return (entry != NULL) ? 0 : -1;
+}
+
+/** Cache the record of a new inode @ino: @record, padded with zeros
+ *
+ * Whatever the table held for @ino is replaced whole, so it is not read
+ * in.  Returns 0 on success, or -1 if no memory was left for the entry.
+ */
+int icache_create(vrs_icache *icache, uint32_t ino, const void *record, size_t size)
+{
+	pthread_mutex_lock(&icache->lock);
+	vrs_icache_entry *entry = icache_find(icache, ino);
+	if (entry == NULL) {
+		entry = icache_alloc(icache, ino);
+	}
+	if (entry != NULL) {
+		memset(entry->data, 0, icache->record_size);
+		memcpy(entry->data, record, size);
+		if (!entry->dirty) {
+			entry->dirty = 1;
+			list_add_tail(&entry->dirty_link, &icache->dirty);
+			++icache->num_dirty;
+		}
+	}
+	pthread_mutex_unlock(&icache->lock);
+
+	return (entry != NULL) ? 0 : -1;
+}
+
+static int icache_block_cmp(const void *a, const void *b)
+{
+	uint32_t ba = *(const uint32_t *)a;
+	uint32_t bb = *(const uint32_t *)b;
+	return (ba > bb) - (ba < bb);
+}
+
+/** Read the @count inodes in @inos into the cache ahead of use
+ *
+ * The inode table blocks of the inodes not cached yet are read in one
+ * sorted vector, so neighbouring blocks come in with a single request and
+ * each block is read once.  Returns the number of inodes read in, or -1
+ * if no memory was left or the read failed.
+ */
+int icache_prefetch(vrs_icache *icache, const uint32_t *inos, int count)
+{
+	uint32_t per_block = BLOCK_SIZE / icache->record_size;
+	uint32_t *missing = malloc(2 * count * sizeof(uint32_t));
+	if (missing == NULL) {
+		return -1;
+	}
+	uint32_t *blocks = missing + count;
+
+	int nmissing = 0;
+	int i = 0;
+	pthread_mutex_lock(&icache->lock);
+	for (i = 0; i < count; ++i) {
+		if (icache_find(icache, inos[i]) == NULL) {
+			missing[nmissing] = inos[i];
+			blocks[nmissing++] = inos[i] / per_block;
+		}
+	}
+	pthread_mutex_unlock(&icache->lock);
+	if (nmissing == 0) {
+		free(missing);
+		return 0;
+	}
+
+	qsort(blocks, nmissing, sizeof(uint32_t), icache_block_cmp);
+	int unique = 1;
+	for (i = 1; i < nmissing; ++i) {
+		if (blocks[i] != blocks[unique - 1]) {
+			blocks[unique++] = blocks[i];
+		}
+	}
+
+	char *buffer = malloc(unique * BLOCK_SIZE);
+	block_vec_t *vec = malloc(unique * sizeof(block_vec_t));
+	if ((buffer == NULL) || (vec == NULL)) {
+		free(buffer);
+		free(vec);
+		free(missing);
+		return -1;
+	}
+	for (i = 0; i < unique; ++i) {
+		vec[i].block_num = icache->table_block + blocks[i];
+		vec[i].buf = buffer + i * BLOCK_SIZE;
+	}
+	if (block_readv(vec, unique) < 0) {
+		free(vec);
+		free(buffer);
+		free(missing);
+		return -1;
+	}
+
+	// Only inodes that were not cached while the blocks were read are
+	// filled from them; anything else may have changed since
+	int loaded = 0;
+	pthread_mutex_lock(&icache->lock);
+	for (i = 0; i < nmissing; ++i) {
+		uint32_t table_offset = missing[i] / per_block;
+		if (icache_find(icache, missing[i]) != NULL) {
+			continue;
+		}
+
+		vrs_icache_entry *entry = icache_alloc(icache, missing[i]);
+		if (entry == NULL) {
+			break;
+		}
+		const uint32_t *at = bsearch(&table_offset, blocks, unique, sizeof(uint32_t), icache_block_cmp);
+		memcpy(entry->data, buffer + (at - blocks) * BLOCK_SIZE + (missing[i] % per_block) * icache->record_size,
+				icache->record_size);
+		++loaded;
+	}
+	pthread_mutex_unlock(&icache->lock);
+
+	free(vec);
+	free(buffer);
+	free(missing);
+	return loaded;
+}
+
+/* Drop @ino without writing it back, for inodes that were freed */
+void icache_forget(vrs_icache *icache, uint32_t ino)
+{
+	pthread_mutex_lock(&icache->lock);
+	vrs_icache_entry *entry = icache_find(icache, ino);
+	if (entry != NULL) {
+		if (entry->dirty) {
+			list_del(&entry->dirty_link);
+			--icache->num_dirty;
+		}
+		list_del(&entry->lru);
+		icache_unhash(icache, entry);
+		--icache->num_entries;
+		free(entry);
+	}
+	pthread_mutex_unlock(&icache->lock);
+}
+
+/** Keep inode @ino cached until a matching icache_unpin()
+ *
+ * Returns 0 on success, or -1 if no memory was left for the entry.
+ */
+int icache_pin(vrs_icache *icache, uint32_t ino)
+{
+	pthread_mutex_lock(&icache->lock);
+	vrs_icache_entry *entry = icache_get(icache, ino);
+	if ((entry != NULL) && (entry->pins++ == 0)) {
+		list_del(&entry->lru);
+		list_add(&entry->lru, &icache->pinned);
+	}
+	pthread_mutex_unlock(&icache->lock);
+
+	return (entry != NULL) ? 0 : -1;
+}
+
+void icache_unpin(vrs_icache *icache, uint32_t ino)
+{
+	pthread_mutex_lock(&icache->lock);
+	vrs_icache_entry *entry = icache_find(icache, ino);
+	if ((entry != NULL) && (entry->pins > 0) && (--entry->pins == 0)) {
+		list_del(&entry->lru);
+		list_add(&entry->lru, &icache->lru);
+	}
+	pthread_mutex_unlock(&icache->lock);
+}
+
+/* Number of pins held on @ino */
+int icache_pinned(vrs_icache *icache, uint32_t ino)
+{
+	pthread_mutex_lock(&icache->lock);
+	const vrs_icache_entry *entry = icache_find(icache, ino);
+	int pins = (entry != NULL) ? entry->pins : 0;
+	pthread_mutex_unlock(&icache->lock);
+
+	return pins;
+}
@@ -0,0 +1,70 @@
+/*
+ * icache.h
+ *
+ * Write-back cache of the inode table.  Inodes are kept in memory keyed
+ * by inode number, so looking one up or changing it does not touch the
+ * disk.  Dirty inodes are written back a whole inode table block at a
+ * time, when an entry has to be evicted or on icache_flush().  Pinned
+ * inodes (open files) are never evicted.  Records are copied in and out
+ * under the cache's lock, so threads never see an inode half written.
+ */
+
+#ifndef SRC_ICACHE_H_
+#define SRC_ICACHE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "list.h"
+
+#define ICACHE_SIZE_DEFAULT 4096 // Inodes kept in memory
+
+typedef struct vrs_icache_entry {
+	uint32_t ino;
+	int dirty;
+	int pins;
+	struct vrs_icache_entry *hash_next;
+	list_t lru;		/* On the LRU list unless pinned */
+	list_t dirty_link;	/* On the dirty list while dirty */
+	char data[];		/* record_size bytes, as in the inode table */
+} vrs_icache_entry;
+
+typedef struct {
+	uint32_t table_block;	/* First block of the inode table */
+	uint32_t record_size;	/* Bytes per inode in the table */
+	uint32_t max_entries;	/* Memory budget, pinned entries may exceed it */
+	uint32_t num_entries;
+	uint32_t num_dirty;
+	uint32_t hash_mask;
+	vrs_icache_entry **hash;
+	list_t lru;		/* Unpinned entries, most recently used first */
+	list_t pinned;
+	list_t dirty;		/* Entries not written back yet */
+	char *block;		/* An inode table block being read or written */
+	pthread_mutex_t lock;	/* Protects the cache and every record in it */
+} vrs_icache;
+
+int icache_init(vrs_icache *icache, uint32_t table_block, uint32_t record_size, uint32_t max_entries);
+
+void icache_destroy(vrs_icache *icache);
+
+int icache_read(vrs_icache *icache, uint32_t ino, void *record, size_t size);
+
+int icache_write(vrs_icache *icache, uint32_t ino, const void *record, size_t size);
+
+int icache_create(vrs_icache *icache, uint32_t ino, const void *record, size_t size);
+
+int icache_prefetch(vrs_icache *icache, const uint32_t *inos, int count);
+
+void icache_forget(vrs_icache *icache, uint32_t ino);
+
+int icache_pin(vrs_icache *icache, uint32_t ino);
+
+void icache_unpin(vrs_icache *icache, uint32_t ino);
+
+int icache_pinned(vrs_icache *icache, uint32_t ino);
+
+int icache_flush(vrs_icache *icache);
+
+#endif /* SRC_ICACHE_H_ */
@@ -8,14 +8,21 @@
 #include "inode.h"
 #include "params.h"
 #include "block.h"
+#include "bitmap.h"
+#include "journal.h"
 #include "log.h"
 #include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
  // Local functions
-void read_dentry_from_block(uint32_t block_id, vrs_dentry_t* dentries, int num_entries);
-
 uint32_t path_2_ino_internal(const char *path, uint32_t ino_parent);
 
+uint32_t path_2_parent(const char *path, const char **name);
+
 void free_ino(uint32_t ino);
 
 uint32_t get_ino();
@@ -24,516 +31,3007 @@ void free_block_no(uint32_t b_no);
 
 uint32_t get_block_no();
 
-void update_inode_bitmap(uint32_t ino, char ch);
+uint32_t get_block_run(uint32_t ino, uint32_t goal, uint32_t count, uint32_t *run_len);
+
+void update_inode_bitmap(uint32_t ino, int used);
+
+void update_block_bitmap(uint32_t bno, int used);
 
-void update_block_bitmap(uint32_t bno, char ch);
+void update_block_bitmap_run(uint32_t bno, uint32_t count, int used);
 
-void update_inode_data(uint32_t ino, vrs_inode_t *inode);
+int update_inode_data(uint32_t ino, vrs_inode_t *inode);
 
 void update_block_data(uint32_t bno, char* buffer);
 
-void create_dentry(const char *name, vrs_inode_t *inode, uint32_t ino_parent);
+int create_dentry(const char *name, vrs_inode_t *inode, uint32_t ino_parent);
 
-void remove_dentry(vrs_inode_t *inode, uint32_t ino_parent);
+int remove_dentry(const char *name, vrs_inode_t *inode, uint32_t ino_parent);
+
+uint32_t dx_lookup(vrs_inode_t *dir, const char *name);
+
+uint32_t dir_lookup_flat(vrs_inode_t *dir, const char *name);
 
 // Function defs
-uint32_t path_2_ino(const char *path) {
-	if (strcmp(path, "/") == 0) {
-		return (VRS_DATA->ino_root);
-	} else if (*path == '/') {
-		return path_2_ino_internal(path+1, VRS_DATA->ino_root);
-	} else {
-		log_msg("\npath_2_no invalid path");
+void vrs_compute_geometry(vrs_geometry *geometry, uint32_t block_size, uint32_t ninodes, uint32_t nblocks_data,
+		uint32_t nblocks_journal) {
+	uint32_t bits_per_block = block_size * 8;
+	uint32_t inodes_per_block = block_size / VRS_INODE_SIZE;
+
+	geometry->block_size = block_size;
+	geometry->ninodes = ninodes;
+	geometry->nblocks_data = nblocks_data;
+	geometry->nblocks_journal = nblocks_journal;
+	geometry->nblocks_inode = (ninodes + inodes_per_block - 1) / inodes_per_block;
+	geometry->nblocks_inode_bitmap = (ninodes + bits_per_block - 1) / bits_per_block;
+	geometry->nblocks_data_bitmap = (nblocks_data + bits_per_block - 1) / bits_per_block;
+
+	geometry->block_journal = VRS_BLOCK_SUPERBLOCK + 1;
+	geometry->block_inode_bitmap = geometry->block_journal + nblocks_journal;
+	geometry->block_data_bitmap = geometry->block_inode_bitmap + geometry->nblocks_inode_bitmap;
+	geometry->block_inodes = geometry->block_data_bitmap + geometry->nblocks_data_bitmap;
+	geometry->block_data = geometry->block_inodes + geometry->nblocks_inode;
+
+	log_msg("\nvrs_compute_geometry block_size=%u inodes=%u@%u data=%u@%u", block_size,
+			ninodes, geometry->block_inodes, nblocks_data, geometry->block_data);
+}
+
+/*
+ * Directory paths resolved before are kept in the dentry cache as names
+ * under this pseudo parent, so the walk down to a file's directory is a
+ * single lookup the second time around.
+ */
+#define VRS_DCACHE_PATHS UINT32_MAX
+
+/* Set up one lock per inode of the mounted disk */
+int inode_locks_init(void) {
+	VRS_DATA->inode_locks = malloc(VRS_NINODES * sizeof(pthread_rwlock_t));
+	if (VRS_DATA->inode_locks == NULL) {
+		return -1;
+	}
+
+	uint32_t i = 0;
+	for (i = 0; i < VRS_NINODES; ++i) {
+		pthread_rwlock_init(VRS_DATA->inode_locks + i, NULL);
 	}
 
-	return VRS_INVALID_INO;
+	return 0;
 }
 
-uint32_t path_2_ino_internal(const char *path, uint32_t ino_parent) {
+void inode_locks_destroy(void) {
+	uint32_t i = 0;
+	for (i = 0; (VRS_DATA->inode_locks != NULL) && (i < VRS_NINODES); ++i) {
+		pthread_rwlock_destroy(VRS_DATA->inode_locks + i);
+	}
 
-	uint32_t ino_path = VRS_INVALID_INO;
-	char buffer[VRS_DENTRY_SIZE * VRS_NINODES];
-	memset(buffer, 0, sizeof(buffer));
+	free(VRS_DATA->inode_locks);
+	VRS_DATA->inode_locks = NULL;
+}
 
-	vrs_inode_t inode;
-	get_inode(ino_parent, &inode);
+void inode_lock_shared(uint32_t ino) {
+	pthread_rwlock_rdlock(VRS_DATA->inode_locks + ino);
+}
+
+void inode_lock(uint32_t ino) {
+	pthread_rwlock_wrlock(VRS_DATA->inode_locks + ino);
+}
 
-	int num_dentries = (inode.size / VRS_DENTRY_SIZE);
-	if (num_dentries > 0) {
-		log_msg("\npath_2_ino_internal num_dentries=%d", num_dentries);
+void inode_unlock(uint32_t ino) {
+	pthread_rwlock_unlock(VRS_DATA->inode_locks + ino);
+}
 
-		vrs_dentry_t* dentries = malloc(sizeof(vrs_dentry_t) * num_dentries);
-	    read_dentries(&inode, dentries);
+/*
+ * Walk @path, relative to directory @ino, one component at a time.
+ * @path is changed during the walk but restored before returning.
+ */
+static uint32_t path_walk(char *path, uint32_t ino) {
+	while ((ino != VRS_INVALID_INO) && (*path != '\0')) {
+		char *slash = strchr(path, '/');
+		if (slash != NULL) {
+			*slash = '\0';
+		}
 
-	    int i = 0;
-	    for (i = 0; i < num_dentries; ++i) {
-			log_msg("\npath_2_ino_internal Entry%d = %s, path=%s", i, dentries[i].name,path);
-	    	if (strcmp(dentries[i].name, path) == 0) {
-	    		ino_path = dentries[i].inode_number;
-	    		log_msg("\npath_2_ino: Dentry found ino = %d", ino_path);
+		if (*path != '\0') {
+			ino = path_2_ino_internal(path, ino);
+		}
 
-	    		break;
-	    	}
-	    }
-	    free(dentries);
+		if (slash == NULL) {
+			break;
+		}
+		*slash = '/';
+		path = slash + 1;
 	}
 
-	log_msg("\npath_2_ino: test outer");
-	return ino_path;
+	return ino;
 }
 
-void get_inode(uint32_t ino, vrs_inode_t *inode_data) {
-	if (ino < VRS_NINODES) {
-		if ((VRS_DATA->state_inodes[ino].node.next == VRS_DATA->state_inodes[ino].node.prev) &&
-			(VRS_DATA->free_inodes != &(VRS_DATA->state_inodes[ino].node))) {
-			int block_offset = ino / (BLOCK_SIZE / VRS_INODE_SIZE);
-			int inside_block_offset = ino % (BLOCK_SIZE / VRS_INODE_SIZE);
+/*
+ * Resolve the directory holding the last component of @path, which is
+ * returned in @name.
+ */
+uint32_t path_2_parent(const char *path, const char **name) {
+	const char *slash = strrchr(path, '/');
+	if ((*path != '/') || (slash == NULL)) {
+		log_msg("\npath_2_parent invalid path %s", path);
+		return VRS_INVALID_INO;
+	}
 
-			char buffer[BLOCK_SIZE];
-	    	block_read(VRS_BLOCK_INODES + block_offset, buffer);
+	*name = slash + 1;
+	if (slash == path) {
+		return VRS_DATA->ino_root;
+	}
 
-		    log_msg("\n here block_offset=%d inside_block_offset=%d", block_offset, inside_block_offset);
-	    	memcpy(inode_data, buffer + inside_block_offset*VRS_INODE_SIZE, sizeof(vrs_inode_t));
-		    log_msg("\n inode number %d successfully found", inode_data->ino);
-		} else {
-		    log_msg("\n inode number %d not in use", ino);
+	size_t len = slash - path;
+	char *dir = malloc(len + 1);
+	if (dir == NULL) {
+		return VRS_INVALID_INO;
+	}
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+
+	uint32_t ino = VRS_INVALID_INO;
+	if (dcache_lookup(&VRS_DATA->dcache, VRS_DCACHE_PATHS, dir, &ino) != DCACHE_HIT) {
+		// No lock is held across the walk, so the path is only cached if
+		// no directory went away meanwhile
+		uint32_t generation = dcache_generation(&VRS_DATA->dcache);
+		ino = path_walk(dir + 1, VRS_DATA->ino_root);
+		if (ino != VRS_INVALID_INO) {
+			vrs_inode_t inode;
+			get_inode(ino, &inode);
+			if (S_ISDIR(inode.mode)) {
+				dcache_add_since(&VRS_DATA->dcache, VRS_DCACHE_PATHS, dir, ino, generation);
+			} else {
+				ino = VRS_INVALID_INO;
+			}
 		}
-	} else {
-	    log_msg("\n Invalid inode number %d", ino);
 	}
+
+	free(dir);
+	return ino;
 }
 
-uint32_t create_inode(const char *path, mode_t mode) {
-	uint32_t ino_path = path_2_ino(path);
-	if (ino_path == VRS_INVALID_INO) {
-		ino_path = get_ino();
-		uint32_t block_no = get_block_no();
+uint32_t path_2_ino(const char *path) {
+	const char *name = NULL;
+	uint32_t ino_parent = path_2_parent(path, &name);
+	if ((ino_parent == VRS_INVALID_INO) || (*name == '\0')) {
+		return ino_parent;
+	}
 
-		if ((ino_path != VRS_INVALID_INO) && (block_no != VRS_INVALID_BLOCK_NO)) {
-			// Step 1: Update the inode bitmap to reflect availability
-			update_inode_bitmap(ino_path, '0');
+	return path_2_ino_internal(name, ino_parent);
+}
 
-			// Step 2: Update Data n=bitmap
-			update_block_bitmap(block_no, '0');
+/*
+ * Look @path up in directory @ino_parent, which the caller holds locked.
+ * The answer goes into the dentry cache.
+ */
+static uint32_t dir_lookup(const char *path, uint32_t ino_parent) {
 
-			// Step 3: Create Inode
-			vrs_inode_t inode;
-			memset(&inode, 0, sizeof(inode));
-			inode.atime = inode.ctime = inode.mtime = time(NULL);
-			inode.nblocks = 1;
-			inode.ino = ino_path;
-			inode.blocks[0] = block_no;
-			inode.size = 0;
-			inode.nlink = 0;
-			inode.mode = mode;
+	uint32_t ino_path = VRS_INVALID_INO;
 
-			// Step 4: Write inode to disk
-			update_inode_data(ino_path, &inode);
+	int cached = dcache_lookup(&VRS_DATA->dcache, ino_parent, path, &ino_path);
+	if (cached == DCACHE_HIT) {
+		return ino_path;
+	} else if (cached == DCACHE_NEGATIVE) {
+		return VRS_INVALID_INO;
+	}
 
-			// Step 5: Create a directory entry
-			create_dentry(path+1, &inode, path_2_ino("/"));
+	vrs_inode_t inode;
+	get_inode(ino_parent, &inode);
+	if (!S_ISDIR(inode.mode)) {
+		return VRS_INVALID_INO;
+	}
 
-			return inode.ino;
+	if (inode.flags & VRS_INODE_INDEXED) {
+		ino_path = dx_lookup(&inode, path);
+		if (ino_path != VRS_INVALID_INO) {
+			dcache_add(&VRS_DATA->dcache, ino_parent, path, ino_path);
+		} else {
+			dcache_add_negative(&VRS_DATA->dcache, ino_parent, path);
 		}
+		return ino_path;
+	}
+
+	ino_path = dir_lookup_flat(&inode, path);
+	if (ino_path != VRS_INVALID_INO) {
+		log_msg("\npath_2_ino: Dentry found ino = %d", ino_path);
+		dcache_add(&VRS_DATA->dcache, ino_parent, path, ino_path);
 	} else {
-		log_msg("\nError path already exists!");
+		dcache_add_negative(&VRS_DATA->dcache, ino_parent, path);
 	}
 
-	return VRS_INVALID_INO;
+	return ino_path;
 }
 
-int remove_inode(const char *path) {
-	uint32_t ino_path = path_2_ino(path);
-	if (ino_path != VRS_INVALID_INO) {
-		vrs_inode_t inode_data;
-		get_inode(ino_path, &inode_data);
-
-		int num_blocks = inode_data.nblocks;
-		while (num_blocks > 0) {
+uint32_t path_2_ino_internal(const char *path, uint32_t ino_parent) {
+	if (ino_parent >= VRS_NINODES) {
+		return VRS_INVALID_INO;
+	}
 
-			free_block_no(inode_data.blocks[num_blocks - 1]);
-			update_block_bitmap(inode_data.blocks[num_blocks - 1], '1');
+	// Cached names need no lock, the directory is only searched under it
+	uint32_t ino_path = VRS_INVALID_INO;
+	int cached = dcache_lookup(&VRS_DATA->dcache, ino_parent, path, &ino_path);
+	if (cached == DCACHE_HIT) {
+		return ino_path;
+	} else if (cached == DCACHE_NEGATIVE) {
+		return VRS_INVALID_INO;
+	}
 
-			--num_blocks;
-		}
+	inode_lock_shared(ino_parent);
+	ino_path = dir_lookup(path, ino_parent);
+	inode_unlock(ino_parent);
 
-		free_ino(inode_data.ino);
-		update_inode_bitmap(inode_data.ino, '1');
+	return ino_path;
+}
 
-		log_msg("inode removed..now proceeding to remove dentry");
-		remove_dentry(&inode_data, VRS_DATA->ino_root);
+/* Whether inode @ino is in use */
+int inode_exists(uint32_t ino) {
+	return (ino < VRS_NINODES) && alloc_is_used(&VRS_DATA->inode_alloc, ino);
+}
 
-		return 0;
+void get_inode(uint32_t ino, vrs_inode_t *inode_data) {
+	if (ino < VRS_NINODES) {
+		if (alloc_is_used(&VRS_DATA->inode_alloc, ino)) {
+			if (icache_read(&VRS_DATA->icache, ino, inode_data, sizeof(vrs_inode_t)) == 0) {
+				log_msg("\n inode number %d successfully found", inode_data->ino);
+			}
+		} else {
+		    log_msg("\n inode number %d not in use", ino);
+		}
 	} else {
-		log_msg("\nError no such path exists!");
+	    log_msg("\n Invalid inode number %d", ino);
 	}
-
-	return -ENOENT;
 }
 
-int write_inode(vrs_inode_t *inode_data, const char* buffer, int size, int offset) {
+/*
+ * Split logical block @lblk of a file into the path through its block
+ * tree: offsets[0] indexes inode->blocks[], offsets[1..depth] index the
+ * indirect blocks below it.  Returns the depth (0 for a direct block), or
+ * -1 if @lblk is beyond triple indirection.
+ */
+static int inode_block_path(uint32_t lblk, uint32_t offsets[4]) {
+	uint64_t idx = lblk;
+	uint64_t nind = VRS_NIND_BLOCKS;
 
-	int capacity = (VRS_NDIR_BLOCKS - (offset / BLOCK_SIZE))*BLOCK_SIZE - (offset % BLOCK_SIZE);
-	if (size > capacity) {
-		log_msg("Can't write a file of this size");
+	if (idx < VRS_NDIR_BLOCKS) {
+		offsets[0] = idx;
 		return 0;
 	}
 
-	int i = 0;
-	int orig_offset = offset;
-	char tmp_buf[BLOCK_SIZE];
-	int bytes_written = 0;
-	int num_new_blocks = 0;
-	int start_block_idx = (offset / BLOCK_SIZE);
-	offset = offset % BLOCK_SIZE;
+	idx -= VRS_NDIR_BLOCKS;
+	if (idx < nind) {
+		offsets[0] = VRS_IND_BLOCK;
+		offsets[1] = idx;
+		return 1;
+	}
 
-	for (i = start_block_idx; (bytes_written < size) && (i < VRS_NDIR_BLOCKS);++i) {
-		if (i >= inode_data->nblocks) {
-			inode_data->blocks[i] = get_block_no();
-			++num_new_blocks;
-			log_msg("\nAllocated a new block for file");
-		}
+	idx -= nind;
+	if (idx < nind * nind) {
+		offsets[0] = VRS_DIND_BLOCK;
+		offsets[1] = idx / nind;
+		offsets[2] = idx % nind;
+		return 2;
+	}
 
-		if (offset != 0) {
-			int bytes_to_write = (BLOCK_SIZE - offset) > size ? size : (BLOCK_SIZE - offset);
-			block_read(VRS_BLOCK_DATA + inode_data->blocks[i], tmp_buf);
-			memcpy(tmp_buf + offset, buffer, bytes_to_write);
-			update_block_data(inode_data->blocks[i], tmp_buf);
+	idx -= nind * nind;
+	if (idx < nind * nind * nind) {
+		offsets[0] = VRS_TIND_BLOCK;
+		offsets[1] = idx / (nind * nind);
+		offsets[2] = (idx / nind) % nind;
+		offsets[3] = idx % nind;
+		return 3;
+	}
 
-			bytes_written += bytes_to_write;
+	return -1;
+}
 
-			log_msg("\norig offset = %d Offset = %d written %d bytes", orig_offset, offset, bytes_written);
+static void read_indirect_block(uint32_t bno, uint32_t *ptrs) {
+	block_read(VRS_BLOCK_DATA + bno, ptrs);
+}
 
-			offset = 0;
-		} else {
-			int bytes_to_write = (size - bytes_written) > BLOCK_SIZE ? BLOCK_SIZE : (size - bytes_written);
-			memcpy(tmp_buf, buffer + bytes_written, bytes_to_write);
-			update_block_data(inode_data->blocks[i], tmp_buf);
+/*
+ * Readers of a file share its lock but all update its bmap cache, so the
+ * cache is copied in and out under a lock of its own.
+ */
+static pthread_mutex_t bmap_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
-			log_msg("\nUpdated block %d offset = %d num bytes written = %d",inode_data->blocks[i], offset, bytes_to_write);
+static void bmap_cache_load(uint32_t ino, vrs_bmap_cache *run) {
+	pthread_mutex_lock(&bmap_cache_lock);
+	*run = VRS_DATA->bmap_cache[ino];
+	pthread_mutex_unlock(&bmap_cache_lock);
+}
 
-			bytes_written += bytes_to_write;
-		}
+static void bmap_cache_store(uint32_t ino, const vrs_bmap_cache *run) {
+	pthread_mutex_lock(&bmap_cache_lock);
+	VRS_DATA->bmap_cache[ino] = *run;
+	pthread_mutex_unlock(&bmap_cache_lock);
+}
+
+static void bmap_cache_invalidate(uint32_t ino) {
+	vrs_bmap_cache run = { 0, 0, 0 };
+	bmap_cache_store(ino, &run);
+}
+
+/*
+ * Get a zeroed block to hold block pointers.  It is placed right after
+ * @goal when possible, so it stays close to the data it maps.
+ */
+static uint32_t new_indirect_block(uint32_t goal) {
+	char *buffer = calloc(1, BLOCK_SIZE);
+	if (buffer == NULL) {
+		log_msg("\nnew_indirect_block out of memory");
+		return VRS_INVALID_BLOCK_NO;
 	}
 
-	inode_data->nblocks += num_new_blocks;
-	inode_data->size = orig_offset + size;
+	uint32_t run_len = 0;
+	uint32_t bno = alloc_get_run(&VRS_DATA->block_alloc, goal, 1, &run_len);
+	if (bno >= VRS_NBLOCKS_DATA) {
+		log_msg("\nError: Data blocks limit reached!!!");
+		free(buffer);
+		return VRS_INVALID_BLOCK_NO;
+	}
 
-	update_inode_data(inode_data->ino, inode_data);
+	update_block_bitmap(bno, 1);
+	block_write(VRS_BLOCK_DATA + bno, buffer);
+	free(buffer);
 
-	return bytes_written;
+	return bno;
 }
 
-int read_inode(vrs_inode_t *inode_data, char* buffer, int size, int offset) {
-
-	log_msg("\nread_inode");
-	int i = 0;
-	int orig_offset = offset;
-	char tmp_buf[BLOCK_SIZE];
-	int bytes_read = 0;
-	int num_new_blocks = 0;
-	int start_block_idx = (offset / BLOCK_SIZE);
-	offset = offset % BLOCK_SIZE;
+static void release_block(uint32_t bno) {
+	free_block_no(bno);
+	update_block_bitmap(bno, 0);
+}
 
-	for (i = start_block_idx; (bytes_read < inode_data->size) && (i < VRS_NDIR_BLOCKS);++i) {
+/*
+ * Extent mapped inodes (VRS_INODE_EXTENTS) keep a tree of extents in
+ * blocks[] instead of block pointers.  The root node lives inline in the
+ * inode, deeper nodes are data blocks; leaves (depth 0) hold extents and
+ * interior nodes hold the first logical block and location of each child.
+ * Files only grow and shrink at the end, so all changes happen along the
+ * rightmost path of the tree.
+ */
+static vrs_extent_header_t *extent_root(vrs_inode_t *inode) {
+	return (vrs_extent_header_t *)inode->blocks;
+}
 
-		if (offset != 0) {
-			int bytes_to_read = (BLOCK_SIZE - offset) > inode_data->size ? inode_data->size : (BLOCK_SIZE - inode_data->size);
-			block_read(VRS_BLOCK_DATA + inode_data->blocks[i], tmp_buf);
-			memcpy(buffer, tmp_buf + offset, bytes_to_read);
+static vrs_extent_t *extent_entries(vrs_extent_header_t *eh) {
+	return (vrs_extent_t *)(eh + 1);
+}
 
-			bytes_read += bytes_to_read;
+static vrs_extent_idx_t *extent_index(vrs_extent_header_t *eh) {
+	return (vrs_extent_idx_t *)(eh + 1);
+}
 
-			log_msg("Offset = %d read %d bytes", offset, bytes_read);
+static void extent_init_node(vrs_extent_header_t *eh, uint16_t max, uint16_t depth) {
+	eh->count = 0;
+	eh->max = max;
+	eh->depth = depth;
+	eh->unused = 0;
+}
 
-			offset = 0;
-		} else {
-			int bytes_to_read = (inode_data->size - bytes_read) > BLOCK_SIZE ? BLOCK_SIZE : (inode_data->size - bytes_to_read);
-			block_read(VRS_BLOCK_DATA + inode_data->blocks[i], tmp_buf);
-			log_msg("\ntmp_buf = %s", tmp_buf);
-			memcpy(buffer + bytes_read, tmp_buf, bytes_to_read);
+/*
+ * Nodes from the root down to the rightmost leaf.  path[0] is the inline
+ * root, path[i].bno is the data block holding path[i] for i > 0.
+ */
+typedef struct {
+	vrs_extent_header_t *eh;
+	uint32_t bno;
+} extent_path_t;
+
+static void extent_free_path(extent_path_t *path, int depth) {
+	int level = 1;
+	for (level = 1; level <= depth; ++level) {
+		free(path[level].eh);
+	}
+	free(path);
+}
 
-			//log_msg("\nRead block %d offset = %d num bytes read = %d",inode_data->blocks[i], offset, bytes_to_read);
+/* Returns NULL if there is no memory for the path */
+static extent_path_t *extent_load_tail(vrs_inode_t *inode) {
+	int depth = extent_root(inode)->depth;
+	extent_path_t *path = calloc(depth + 1, sizeof(extent_path_t));
+	if (path == NULL) {
+		return NULL;
+	}
 
-			log_msg("\nRead Buffer = %s", buffer);
-			log_msg("\ntmp_buf1 = %s", tmp_buf);
-			bytes_read += bytes_to_read;
+	path[0].eh = extent_root(inode);
+	int level = 1;
+	for (level = 1; level <= depth; ++level) {
+		vrs_extent_header_t *parent = path[level - 1].eh;
+		path[level].bno = extent_index(parent)[parent->count - 1].node;
+		path[level].eh = malloc(BLOCK_SIZE);
+		if (path[level].eh == NULL) {
+			extent_free_path(path, level - 1);
+			return NULL;
 		}
+		block_read(VRS_BLOCK_DATA + path[level].bno, path[level].eh);
 	}
 
-	return bytes_read;
+	return path;
 }
 
-void fill_stat_from_ino(const vrs_inode_t* inode, struct stat *statbuf) {
-	statbuf->st_dev = 0;
-	statbuf->st_ino = inode->ino;
-	statbuf->st_mode = inode->mode;
-	statbuf->st_nlink = inode->nlink;
-	statbuf->st_uid = getuid();
-	statbuf->st_gid = getgid();
-	statbuf->st_rdev = 0;
-	statbuf->st_size = inode->size;
-	statbuf->st_blksize = BLOCK_SIZE;
-	statbuf->st_blocks = inode->nblocks;
-	statbuf->st_atime = inode->atime;
-	statbuf->st_mtime = inode->mtime;
-	statbuf->st_ctime = inode->ctime;
+static void extent_write_node(extent_path_t *path, int level) {
+	if (level > 0) {
+		block_write(VRS_BLOCK_DATA + path[level].bno, path[level].eh);
+	}
 }
 
-void read_dentries(vrs_inode_t *inode_data, vrs_dentry_t* dentries) {
-	if (S_ISDIR(inode_data->mode)) {
-		int num_blocks_read = 0;
-		int num_bytes_read = 0;
-		int num_entries = 0;
-		int entry_offset = 0;
+static void release_block_run(uint32_t bno, uint32_t count) {
+	uint32_t i = 0;
+	for (i = 0; i < count; ++i) {
+		free_block_no(bno + i);
+	}
+	update_block_bitmap_run(bno, count, 0);
+}
 
-		while ((num_blocks_read < inode_data->nblocks) && (num_bytes_read < inode_data->size)) {
-			if (inode_data->size - num_bytes_read < BLOCK_SIZE) {
-				num_entries = ((inode_data->size - num_bytes_read) / VRS_DENTRY_SIZE);
+/*
+ * Find the extent holding @lblk.  Returns 0 and fills @extent, -1 if
+ * @lblk is not mapped or -ENOMEM.
+ */
+static int extent_lookup(vrs_inode_t *inode, uint32_t lblk, vrs_extent_t *extent) {
+	vrs_extent_header_t *eh = extent_root(inode);
+	char *buffer = NULL;
+	int retstat = -1;
+
+	while (eh->count > 0) {
+		// Last entry starting at or before @lblk
+		int lo = 0, hi = eh->count - 1;
+		while (lo < hi) {
+			int mid = (lo + hi + 1) / 2;
+			if (extent_entries(eh)[mid].lblk <= lblk) {
+				lo = mid;
 			} else {
-				num_entries = (BLOCK_SIZE / VRS_DENTRY_SIZE);
+				hi = mid - 1;
 			}
+		}
 
-			log_msg("\n read_dentries num_entries=%d", num_entries);
-
-			if (num_blocks_read < VRS_NDIR_BLOCKS) {
-				read_dentry_from_block(inode_data->blocks[num_blocks_read], dentries + entry_offset, num_entries);
+		if (eh->depth == 0) {
+			vrs_extent_t *e = extent_entries(eh) + lo;
+			if ((lblk >= e->lblk) && (lblk - e->lblk < e->len)) {
+				*extent = *e;
+				retstat = 0;
 			}
+			break;
+		}
 
-			++num_blocks_read;
-			num_bytes_read += (num_entries * VRS_DENTRY_SIZE);
-			entry_offset += num_entries;
+		if ((buffer == NULL) && ((buffer = malloc(BLOCK_SIZE)) == NULL)) {
+			retstat = -ENOMEM;
+			break;
 		}
-	} else {
-	    log_msg("\n Invalid inode number %d, not a directory", inode_data->ino);
+		block_read(VRS_BLOCK_DATA + extent_index(eh)[lo].node, buffer);
+		eh = (vrs_extent_header_t *)buffer;
 	}
-}
 
-void read_dentry_from_block(uint32_t block_id, vrs_dentry_t* dentries, int num_entries) {
+	free(buffer);
+	return retstat;
+}
 
-	char buffer[BLOCK_SIZE];
-	block_read(VRS_BLOCK_DATA + block_id, buffer);
+/* Returns 0, or -ENOMEM */
+static int extent_map_range(vrs_inode_t *inode, uint32_t lblk, uint32_t count, uint32_t *pblks) {
+	vrs_bmap_cache cached;
+	vrs_bmap_cache *cache = &cached;
+	bmap_cache_load(inode->ino, cache);
+
+	while (count > 0) {
+		if (!((lblk >= cache->lblk) && (lblk - cache->lblk < cache->len))) {
+			vrs_extent_t extent;
+			int found = extent_lookup(inode, lblk, &extent);
+			if (found == -ENOMEM) {
+				return found;
+			}
+			if (found < 0) {
+				*pblks++ = VRS_INVALID_BLOCK_NO;
+				++lblk;
+				--count;
+				continue;
+			}
+			cache->lblk = extent.lblk;
+			cache->pblk = extent.start;
+			cache->len = extent.len;
+			bmap_cache_store(inode->ino, cache);
+		}
 
-	int entries_read = 0;
-	int bytes_read = 0;
-	while ((bytes_read < BLOCK_SIZE) && (entries_read < num_entries)) {
-		log_msg("\nread_dentry_from_block Entries read = %d", entries_read);
-		memcpy(dentries + entries_read, buffer + bytes_read, sizeof(vrs_dentry_t));
-	    ++entries_read;
-	    bytes_read += VRS_DENTRY_SIZE;
+		uint32_t n = cache->len - (lblk - cache->lblk);
+		n = (n < count) ? n : count;
+		uint32_t i = 0;
+		for (i = 0; i < n; ++i) {
+			pblks[i] = cache->pblk + (lblk - cache->lblk) + i;
+		}
+		lblk += n;
+		pblks += n;
+		count -= n;
 	}
-}
 
-void free_ino(uint32_t ino) {
-	if (ino < VRS_NINODES) {
-		if ((VRS_DATA->state_inodes[ino].node.next
-				== VRS_DATA->state_inodes[ino].node.prev)
-				&& (VRS_DATA->free_inodes != &(VRS_DATA->state_inodes[ino].node))) {
+	return 0;
+}
 
-			list_add_tail(&(VRS_DATA->state_inodes[ino].node), VRS_DATA->free_inodes);
-			log_msg("\nSuccess: Inode added to the free list");
+/*
+ * Free the extent tree node in data block @bno at @depth, everything it
+ * maps and the block itself.
+ */
+static void extent_free_tree(uint32_t bno, int depth) {
+	char *buffer = malloc(BLOCK_SIZE);
+	if (buffer == NULL) {
+		log_msg("\nextent_free_tree out of memory, blocks below %d are lost", bno);
+		return;
+	}
+	block_read(VRS_BLOCK_DATA + bno, buffer);
+	vrs_extent_header_t *eh = (vrs_extent_header_t *)buffer;
 
+	int i = 0;
+	for (i = 0; i < eh->count; ++i) {
+		if (depth == 0) {
+			release_block_run(extent_entries(eh)[i].start, extent_entries(eh)[i].len);
 		} else {
-			log_msg("\nError: Inode already in the free list");
+			extent_free_tree(extent_index(eh)[i].node, depth - 1);
 		}
 	}
-}
 
-uint32_t get_ino() {
-	if (list_empty(VRS_DATA->free_inodes))  {
-		log_msg("\nError: Inode limit reached!!!");
-	} else {
-		list_t *ino_node = VRS_DATA->free_inodes;
-		list_del(VRS_DATA->free_inodes);
+	free(buffer);
+	release_block(bno);
+}
 
-		VRS_DATA->free_inodes = ino_node->next;
+/*
+ * Free the new nodes extent_append() chained below @bno at @depth when
+ * it could not finish, but not the run the leaf maps: that is still the
+ * caller's.  @buffer is room for one node.
+ */
+static void extent_free_chain(uint32_t bno, int depth, char *buffer) {
+	while (depth > 0) {
+		block_read(VRS_BLOCK_DATA + bno, buffer);
+		uint32_t child = extent_index((vrs_extent_header_t *)buffer)[0].node;
+		release_block(bno);
+		bno = child;
+		--depth;
+	}
+	release_block(bno);
+}
 
-		INIT_LIST_HEAD(ino_node);
+/*
+ * Append the extent (@lblk, @pblk, @count) past the end of the file,
+ * merging it into the last extent when it continues it on disk.  The
+ * blocks of the extent stay the caller's to free if this fails.
+ */
+static int extent_append(vrs_inode_t *inode, uint32_t lblk, uint32_t pblk, uint32_t count) {
+	int depth = extent_root(inode)->depth;
+	extent_path_t *path = extent_load_tail(inode);
+	if (path == NULL) {
+		return -ENOMEM;
+	}
+	vrs_extent_header_t *leaf = path[depth].eh;
+	char *buffer = NULL;
+	int retstat = 0;
+
+	if (leaf->count > 0) {
+		vrs_extent_t *last = extent_entries(leaf) + leaf->count - 1;
+		if (lblk < last->lblk + last->len) {
+			log_msg("\nextent_append lblk %d is already mapped", lblk);
+			retstat = -EINVAL;
+			goto out;
+		}
 
-		vrs_free_list *ptr = list_entry(ino_node, vrs_free_list, node);
-		if (ptr != NULL) {
-			log_msg("\nSuccess: Free ino found = %d", ptr->id);
-			return ptr->id;
-		} else {
-			log_msg("\nError: Free ino couldn't be retrieved");
+		if ((last->lblk + last->len == lblk) && (last->start + last->len == pblk)) {
+			last->len += count;
+			extent_write_node(path, depth);
+			goto out;
 		}
 	}
 
-	return VRS_INVALID_INO;
-}
+	if (leaf->count < leaf->max) {
+		vrs_extent_t *e = extent_entries(leaf) + leaf->count++;
+		e->lblk = lblk;
+		e->start = pblk;
+		e->len = count;
+		extent_write_node(path, depth);
+		goto out;
+	}
 
-void free_block_no(uint32_t b_no) {
-	if (b_no < VRS_NBLOCKS_DATA) {
-		if ((VRS_DATA->state_data_blocks[b_no].node.next
-				== VRS_DATA->state_data_blocks[b_no].node.prev)
-				&& (VRS_DATA->free_data_blocks != &(VRS_DATA->state_data_blocks[b_no].node))) {
+	// The leaf is full: find the lowest interior node with room
+	int level = depth - 1;
+	while ((level >= 0) && (path[level].eh->count == path[level].eh->max)) {
+		--level;
+	}
 
-			list_add_tail(&(VRS_DATA->state_data_blocks[b_no].node), VRS_DATA->free_data_blocks);
-			log_msg("\nSuccess: Data block added to the free list");
-		} else {
-			log_msg("\nError: Data block already in the free list");
-		}
+	// New nodes are built here before they are written
+	buffer = malloc(BLOCK_SIZE);
+	if (buffer == NULL) {
+		retstat = -ENOMEM;
+		goto out;
 	}
-}
 
-uint32_t get_block_no() {
-	if (list_empty(VRS_DATA->free_data_blocks))  {
-		log_msg("\nError: Data blocks limit reached!!!");
-	} else {
-		list_t *data_block_node = VRS_DATA->free_data_blocks;
-		list_del(VRS_DATA->free_data_blocks);
+	if (level < 0) {
+		// Every node is full, push the root down into a new block and
+		// make the tree one level deeper
+		uint32_t bno = new_indirect_block(pblk);
+		if (bno == VRS_INVALID_BLOCK_NO) {
+			retstat = -ENOSPC;
+			goto out;
+		}
 
-		VRS_DATA->free_data_blocks = data_block_node->next;
+		vrs_extent_header_t *root = extent_root(inode);
+		memset(buffer, 0, BLOCK_SIZE);
+		vrs_extent_header_t *eh = (vrs_extent_header_t *)buffer;
+		extent_init_node(eh, VRS_EXTENTS_PER_BLOCK, root->depth);
+		eh->count = root->count;
+		memcpy(eh + 1, root + 1, root->count * sizeof(vrs_extent_t));
+		block_write(VRS_BLOCK_DATA + bno, buffer);
+
+		uint32_t first_lblk = extent_entries(root)[0].lblk;
+		extent_init_node(root, VRS_EXTENTS_INLINE, root->depth + 1);
+		root->count = 1;
+		extent_index(root)[0].lblk = first_lblk;
+		extent_index(root)[0].node = bno;
+		extent_index(root)[0].unused = 0;
+
+		log_msg("\nextent_append tree of ino %d now has depth %d", inode->ino, root->depth);
+		free(buffer);
+		extent_free_path(path, depth);
+		return extent_append(inode, lblk, pblk, count);
+	}
 
-		INIT_LIST_HEAD(data_block_node);
+	// Build a new chain of nodes from below @level down to a leaf holding
+	// the extent, bottom up so each node knows its child
+	uint32_t child = VRS_INVALID_BLOCK_NO;
+	int d = 0;
+	for (d = 0; d < depth - level; ++d) {
+		uint32_t bno = new_indirect_block(pblk);
+		if (bno == VRS_INVALID_BLOCK_NO) {
+			if (child != VRS_INVALID_BLOCK_NO) {
+				extent_free_chain(child, d - 1, buffer);
+			}
+			retstat = -ENOSPC;
+			goto out;
+		}
 
-		vrs_free_list *ptr = list_entry(data_block_node, vrs_free_list, node);
-		if (ptr != NULL) {
-			log_msg("\nSuccess: Free data block found = %d", ptr->id);
-			return ptr->id;
+		memset(buffer, 0, BLOCK_SIZE);
+		vrs_extent_header_t *eh = (vrs_extent_header_t *)buffer;
+		extent_init_node(eh, VRS_EXTENTS_PER_BLOCK, d);
+		eh->count = 1;
+		if (d == 0) {
+			extent_entries(eh)[0].lblk = lblk;
+			extent_entries(eh)[0].start = pblk;
+			extent_entries(eh)[0].len = count;
 		} else {
-			log_msg("\nError: Free data block couldn't be retrieved");
+			extent_index(eh)[0].lblk = lblk;
+			extent_index(eh)[0].node = child;
 		}
+		block_write(VRS_BLOCK_DATA + bno, buffer);
+		child = bno;
 	}
 
-	return VRS_INVALID_BLOCK_NO;
+	vrs_extent_idx_t *idx = extent_index(path[level].eh) + path[level].eh->count++;
+	idx->lblk = lblk;
+	idx->node = child;
+	idx->unused = 0;
+	extent_write_node(path, level);
+
+out:
+	free(buffer);
+	extent_free_path(path, depth);
+	return retstat;
 }
 
-void update_inode_bitmap(uint32_t ino, char ch) {
+static void extent_free_all(vrs_inode_t *inode) {
+	vrs_extent_header_t *root = extent_root(inode);
+
 	int i = 0;
-	char buffer[BLOCK_SIZE];
-	block_read(VRS_BLOCK_INODE_BITMAP + ino / BLOCK_SIZE, buffer);
-	buffer[ino] = ch;
-	block_write(VRS_BLOCK_INODE_BITMAP + ino / BLOCK_SIZE, buffer);
+	for (i = 0; i < root->count; ++i) {
+		if (root->depth == 0) {
+			release_block_run(extent_entries(root)[i].start, extent_entries(root)[i].len);
+		} else {
+			extent_free_tree(extent_index(root)[i].node, root->depth - 1);
+		}
+	}
 
-	log_msg("\nupdate_inode_bitmap Successful update");
+	memset(inode->blocks, 0, sizeof(inode->blocks));
+	extent_init_node(root, VRS_EXTENTS_INLINE, 0);
 }
 
-void update_block_bitmap(uint32_t bno, char ch) {
-	char buffer[BLOCK_SIZE];
-	block_read(VRS_BLOCK_DATA_BITMAP + bno / BLOCK_SIZE, buffer);
-	buffer[bno] = ch;
-	block_write(VRS_BLOCK_DATA_BITMAP + bno / BLOCK_SIZE, buffer);
+/*
+ * Unmap and free every block of the file from @lblk on, dropping nodes
+ * that become empty.
+ */
+static void extent_truncate(vrs_inode_t *inode, uint32_t lblk) {
+	for (;;) {
+		int depth = extent_root(inode)->depth;
+		extent_path_t *path = extent_load_tail(inode);
+		if (path == NULL) {
+			log_msg("\nextent_truncate out of memory, blocks of ino %d from %d are lost", inode->ino, lblk);
+			break;
+		}
+		vrs_extent_header_t *leaf = path[depth].eh;
 
-	log_msg("\nupdate_block_bitmap Successful update");
-}
+		if (leaf->count == 0) {
+			extent_free_path(path, depth);
+			break;
+		}
 
-void update_inode_data(uint32_t ino, vrs_inode_t *inode) {
-	char buffer[BLOCK_SIZE];
-	inode->mtime = time(NULL);
+		vrs_extent_t *last = extent_entries(leaf) + leaf->count - 1;
+		if (last->lblk + last->len <= lblk) {
+			extent_free_path(path, depth);
+			break;
+		}
 
-	block_read(VRS_BLOCK_INODES + ino / (BLOCK_SIZE / VRS_INODE_SIZE), buffer);
-	memcpy(buffer + ((ino % (BLOCK_SIZE / VRS_INODE_SIZE)) * VRS_INODE_SIZE), inode, sizeof(vrs_inode_t));
-	block_write(VRS_BLOCK_INODES + ino / (BLOCK_SIZE / VRS_INODE_SIZE), buffer);
+		if (last->lblk < lblk) {
+			uint32_t keep = lblk - last->lblk;
+			release_block_run(last->start + keep, last->len - keep);
+			last->len = keep;
+			extent_write_node(path, depth);
+			extent_free_path(path, depth);
+			break;
+		}
 
-	log_msg("\nupdate_inode_data Successful update");
-}
+		release_block_run(last->start, last->len);
+		--leaf->count;
 
-void update_block_data(uint32_t bno, char* buffer) {
-	block_write(VRS_BLOCK_DATA + bno, buffer);
+		// Drop emptied nodes on the way up, the root always stays
+		int level = depth;
+		while ((level > 0) && (path[level].eh->count == 0)) {
+			release_block(path[level].bno);
+			--path[level - 1].eh->count;
+			--level;
+		}
+		extent_write_node(path, level);
 
-	log_msg("\nupdate_block_data Successful update");
-}
+		if (extent_root(inode)->count == 0) {
+			extent_init_node(extent_root(inode), VRS_EXTENTS_INLINE, 0);
+		}
 
-void create_dentry(const char *name, vrs_inode_t *inode, uint32_t ino_parent) {
-	log_msg("\ncreate_dentry path=%s ino = %d ino_parent=%d", name, inode->ino, ino_parent);
-	vrs_inode_t inode_parent;
-	get_inode(ino_parent, &inode_parent);
+		extent_free_path(path, depth);
+	}
+}
 
-	vrs_dentry_t dentry;
-	dentry.inode_number = inode->ino;
-	strcpy(dentry.name, name);
+/*
+ * Look up the physical data blocks of @count logical blocks of a file
+ * starting at @lblk.  Each indirect block on the way is read once per
+ * call, and the run of contiguous blocks found around @lblk is remembered
+ * per inode so sequential accesses skip the walk entirely.  Blocks that
+ * are not mapped come back as VRS_INVALID_BLOCK_NO.  Returns 0, or
+ * -ENOMEM if there was no memory to read an indirect block into.
+ */
+int inode_bmap_range(vrs_inode_t *inode, uint32_t lblk, uint32_t count, uint32_t *pblks) {
+	if (inode->flags & VRS_INODE_EXTENTS) {
+		return extent_map_range(inode, lblk, count, pblks);
+	}
 
-	char buffer[BLOCK_SIZE];
+	vrs_bmap_cache cached;
+	vrs_bmap_cache *cache = &cached;
+	uint32_t *ptrs = NULL;
+	uint32_t offsets[4];
+	bmap_cache_load(inode->ino, cache);
+
+	while (count > 0) {
+		if ((lblk >= cache->lblk) && (lblk - cache->lblk < cache->len)) {
+			uint32_t n = cache->len - (lblk - cache->lblk);
+			n = (n < count) ? n : count;
+			uint32_t i = 0;
+			for (i = 0; i < n; ++i) {
+				pblks[i] = cache->pblk + (lblk - cache->lblk) + i;
+			}
+			lblk += n;
+			pblks += n;
+			count -= n;
+			continue;
+		}
 
-	int num_dentries = (inode_parent.size / VRS_DENTRY_SIZE);
-	int idx = num_dentries / (BLOCK_SIZE / VRS_DENTRY_SIZE);
-	int int_idx = num_dentries % (BLOCK_SIZE / VRS_DENTRY_SIZE);
+		int depth = inode_block_path(lblk, offsets);
+		if (depth < 0) {
+			*pblks++ = VRS_INVALID_BLOCK_NO;
+			++lblk;
+			--count;
+			continue;
+		}
 
-	if ((int_idx == 0) && (num_dentries != 0)) {
-		inode_parent.blocks[idx] = get_block_no();
-		update_block_bitmap(inode_parent.blocks[idx], '0');
-		inode_parent.nblocks += 1;
-	}
+		if (depth == 0) {
+			*pblks++ = inode->blocks[offsets[0]];
+			++lblk;
+			--count;
+			continue;
+		}
 
-	block_read(VRS_BLOCK_DATA + inode_parent.blocks[idx], buffer);
-	memcpy(buffer + (int_idx * VRS_DENTRY_SIZE), &dentry, sizeof(vrs_dentry_t));
-	block_write(VRS_BLOCK_DATA + inode_parent.blocks[idx], buffer);
+		if ((ptrs == NULL) && ((ptrs = malloc(BLOCK_SIZE)) == NULL)) {
+			log_msg("\ninode_bmap_range out of memory");
+			return -ENOMEM;
+		}
 
-	inode_parent.size += VRS_DENTRY_SIZE;
-	update_inode_data(inode_parent.ino, &inode_parent);
-}
+		// Walk down to the leaf indirect block
+		uint32_t bno = inode->blocks[offsets[0]];
+		int level = 1;
+		for (level = 1; (level < depth) && (bno != 0); ++level) {
+			read_indirect_block(bno, ptrs);
+			bno = ptrs[offsets[level]];
+		}
 
-void remove_dentry(vrs_inode_t *inode, uint32_t ino_parent) {
-	vrs_inode_t inode_parent;
-	get_inode(ino_parent, &inode_parent);
-	if (S_ISDIR(inode_parent.mode)) {
-		int num_blocks_read = 0;
-		int num_bytes_read = 0;
-		int num_entries = 0;
-		int entry_offset = 0;
-
-		while ((num_blocks_read < inode_parent.nblocks)
-				&& (num_bytes_read < inode_parent.size)) {
-			if (inode_parent.size - num_bytes_read < BLOCK_SIZE) {
-				num_entries = ((inode_parent.size - num_bytes_read) / VRS_DENTRY_SIZE);
-			} else {
-				num_entries = (BLOCK_SIZE / VRS_DENTRY_SIZE);
+		uint32_t n = VRS_NIND_BLOCKS - offsets[depth];
+		n = (n < count) ? n : count;
+		uint32_t i = 0;
+		if (bno == 0) {
+			for (i = 0; i < n; ++i) {
+				pblks[i] = VRS_INVALID_BLOCK_NO;
+			}
+		} else {
+			read_indirect_block(bno, ptrs);
+			for (i = 0; i < n; ++i) {
+				pblks[i] = ptrs[offsets[depth] + i] ? ptrs[offsets[depth] + i] : VRS_INVALID_BLOCK_NO;
 			}
 
-			log_msg("\n read_dentries num_entries=%d", num_entries);
-
-			if (num_blocks_read < VRS_NDIR_BLOCKS) {
-				char buffer[BLOCK_SIZE];
-				block_read(VRS_BLOCK_DATA + inode_parent.blocks[num_blocks_read], buffer);
-
-				int entries_read = 0;
-				int bytes_read = 0;
-				while ((bytes_read < BLOCK_SIZE) && (entries_read < num_entries)) {
-					log_msg("\nread_dentry_from_block Entries read = %d", entries_read);
-					vrs_dentry_t dentry;
-					memcpy(&dentry, buffer + bytes_read, sizeof(vrs_dentry_t));
-					if (dentry.inode_number == inode->ino) {
-						log_msg("\nEntry to be deleted found");
-						// Now i am going to overwrite it with the last dentry
-
-						int total_entries = (inode_parent.size / VRS_DENTRY_SIZE);
-						if (total_entries > 1) {
-							int idx = (total_entries - 1) / (BLOCK_SIZE / VRS_DENTRY_SIZE);
-							int int_idx = (total_entries - 1) % (BLOCK_SIZE / VRS_DENTRY_SIZE);
-
-							char buffer_last[BLOCK_SIZE];
-							block_read(VRS_BLOCK_DATA + inode_parent.blocks[idx], buffer_last);
-							vrs_dentry_t dentry_last;
-							memcpy(&dentry_last, buffer_last + VRS_DENTRY_SIZE * int_idx, sizeof(vrs_dentry_t));
-
-							if (int_idx == 0) {
-								inode_parent.nblocks--;
-								free_block_no(inode_parent.blocks[idx]);
-								update_block_bitmap(inode_parent.blocks[idx], '1');
-							}
-
-							memcpy(buffer + bytes_read, &dentry_last, sizeof(vrs_dentry_t));
-							update_block_data(inode_parent.blocks[num_blocks_read], buffer);
-							inode_parent.size -= VRS_DENTRY_SIZE;
-						} else {
-							inode_parent.size -= VRS_DENTRY_SIZE;
-						}
-
-						update_inode_data(inode_parent.ino, &inode_parent);
-						log_msg("\n Item deleted successfully");
-						return;
-					}
-					++entries_read;
-					bytes_read += VRS_DENTRY_SIZE;
+			// Remember the contiguous run starting here, up to the end of the leaf
+			if (ptrs[offsets[depth]] != 0) {
+				uint32_t run = 1;
+				while ((offsets[depth] + run < VRS_NIND_BLOCKS) &&
+						(ptrs[offsets[depth] + run] == ptrs[offsets[depth]] + run)) {
+					++run;
 				}
+				cache->lblk = lblk;
+				cache->pblk = ptrs[offsets[depth]];
+				cache->len = run;
+				bmap_cache_store(inode->ino, cache);
 			}
-
-			++num_blocks_read;
-			num_bytes_read += (num_entries * VRS_DENTRY_SIZE);
-			entry_offset += num_entries;
 		}
-	} else {
-		log_msg("\n Invalid inode number %d, not a directory", inode_parent.ino);
+
+		lblk += n;
+		pblks += n;
+		count -= n;
 	}
+
+	free(ptrs);
+	return 0;
+}
+
+uint32_t inode_bmap(vrs_inode_t *inode, uint32_t lblk) {
+	uint32_t pblk = VRS_INVALID_BLOCK_NO;
+	if (inode_bmap_range(inode, lblk, 1, &pblk) < 0) {
+		return VRS_INVALID_BLOCK_NO;
+	}
+	return pblk;
+}
+
+/*
+ * Map @count logical blocks of a file starting at @lblk to the physical
+ * blocks @pblk, @pblk + 1, ...  Missing indirect blocks are allocated on
+ * the way, and every leaf indirect block is updated once.  The caller
+ * writes the inode back.  Returns 0 on success, -EFBIG past triple
+ * indirection, -ENOSPC or -ENOMEM.
+ */
+int inode_bmap_set_run(vrs_inode_t *inode, uint32_t lblk, uint32_t pblk, uint32_t count) {
+	uint32_t *ptrs = NULL;
+	uint32_t offsets[4];
+	int retstat = 0;
+
+	bmap_cache_invalidate(inode->ino);
+
+	if (inode->flags & VRS_INODE_EXTENTS) {
+		return extent_append(inode, lblk, pblk, count);
+	}
+
+	while (count > 0) {
+		int depth = inode_block_path(lblk, offsets);
+		if (depth < 0) {
+			retstat = -EFBIG;
+			break;
+		}
+
+		if (depth == 0) {
+			inode->blocks[offsets[0]] = pblk;
+			++lblk;
+			++pblk;
+			--count;
+			continue;
+		}
+
+		if ((ptrs == NULL) && ((ptrs = malloc(BLOCK_SIZE)) == NULL)) {
+			retstat = -ENOMEM;
+			break;
+		}
+
+		uint32_t bno = inode->blocks[offsets[0]];
+		if (bno == 0) {
+			bno = new_indirect_block(pblk);
+			if (bno == VRS_INVALID_BLOCK_NO) {
+				retstat = -ENOSPC;
+				break;
+			}
+			inode->blocks[offsets[0]] = bno;
+		}
+
+		int level = 1;
+		for (level = 1; level < depth; ++level) {
+			read_indirect_block(bno, ptrs);
+			uint32_t next = ptrs[offsets[level]];
+			if (next == 0) {
+				next = new_indirect_block(pblk);
+				if (next == VRS_INVALID_BLOCK_NO) {
+					retstat = -ENOSPC;
+					break;
+				}
+				ptrs[offsets[level]] = next;
+				block_write(VRS_BLOCK_DATA + bno, ptrs);
+			}
+			bno = next;
+		}
+		if (retstat < 0) {
+			break;
+		}
+
+		uint32_t n = VRS_NIND_BLOCKS - offsets[depth];
+		n = (n < count) ? n : count;
+		read_indirect_block(bno, ptrs);
+		uint32_t i = 0;
+		for (i = 0; i < n; ++i) {
+			ptrs[offsets[depth] + i] = pblk + i;
+		}
+		block_write(VRS_BLOCK_DATA + bno, ptrs);
+
+		lblk += n;
+		pblk += n;
+		count -= n;
+	}
+
+	free(ptrs);
+	return retstat;
+}
+
+/*
+ * Free the indirect block @bno at @level (1 = leaf) along with the first
+ * @nblocks data blocks it maps.  Pointers past @nblocks are stale (a
+ * directory that shrank), but indirect blocks below them are still
+ * allocated and get freed too.  Returns how many data blocks were covered.
+ */
+static uint64_t free_indirect_tree(uint32_t bno, int level, uint64_t nblocks) {
+	uint64_t span = 1;
+	int i = 0;
+	for (i = 1; i < level; ++i) {
+		span *= VRS_NIND_BLOCKS;
+	}
+
+	uint32_t *ptrs = malloc(BLOCK_SIZE);
+	if (ptrs == NULL) {
+		log_msg("\nfree_indirect_tree out of memory, blocks below %d are lost", bno);
+		return (nblocks < span * VRS_NIND_BLOCKS) ? nblocks : span * VRS_NIND_BLOCKS;
+	}
+	read_indirect_block(bno, ptrs);
+
+	uint64_t covered = 0;
+	uint32_t j = 0;
+	for (j = 0; j < VRS_NIND_BLOCKS; ++j) {
+		uint64_t n = (nblocks - covered < span) ? (nblocks - covered) : span;
+		if (ptrs[j] != 0) {
+			if (level > 1) {
+				free_indirect_tree(ptrs[j], level - 1, n);
+			} else if (n > 0) {
+				release_block(ptrs[j]);
+			}
+		}
+		covered += n;
+	}
+
+	free(ptrs);
+	release_block(bno);
+	return covered;
+}
+
+/*
+ * Set up the block map of a new file, its first block being @first_block.
+ */
+void inode_bmap_init(vrs_inode_t *inode, uint32_t flags, uint32_t first_block) {
+	memset(inode->blocks, 0, sizeof(inode->blocks));
+	inode->flags = flags;
+	inode->nblocks = 1;
+
+	if (flags & VRS_INODE_EXTENTS) {
+		vrs_extent_header_t *root = extent_root(inode);
+		extent_init_node(root, VRS_EXTENTS_INLINE, 0);
+		root->count = 1;
+		extent_entries(root)[0].lblk = 0;
+		extent_entries(root)[0].start = first_block;
+		extent_entries(root)[0].len = 1;
+	} else {
+		inode->blocks[0] = first_block;
+	}
+}
+
+/*
+ * Free every data block of a file from logical block @nblocks on.  Block
+ * pointers past the new end are left behind and overwritten when the file
+ * grows again.  The caller writes the inode back.
+ */
+void inode_bmap_truncate(vrs_inode_t *inode, uint32_t nblocks) {
+	if (nblocks >= inode->nblocks) {
+		return;
+	}
+
+	if (inode->flags & VRS_INODE_EXTENTS) {
+		extent_truncate(inode, nblocks);
+	} else {
+		uint32_t lblk = 0;
+		for (lblk = nblocks; lblk < inode->nblocks; ++lblk) {
+			release_block(inode_bmap(inode, lblk));
+		}
+	}
+
+	inode->nblocks = nblocks;
+	bmap_cache_invalidate(inode->ino);
+}
+
+/*
+ * Free every data block of a file along with the blocks used to map
+ * them.  The caller writes the inode back.
+ */
+void inode_free_blocks(vrs_inode_t *inode) {
+	if (inode->flags & VRS_INODE_EXTENTS) {
+		extent_free_all(inode);
+	} else {
+		uint64_t remaining = inode->nblocks;
+		uint32_t i = 0;
+		for (i = 0; (i < VRS_NDIR_BLOCKS) && (remaining > 0); ++i, --remaining) {
+			release_block(inode->blocks[i]);
+		}
+
+		int level = 1;
+		for (level = 1; level <= 3; ++level) {
+			uint32_t bno = inode->blocks[VRS_NDIR_BLOCKS + level - 1];
+			if (bno != 0) {
+				uint64_t covered = free_indirect_tree(bno, level, remaining);
+				remaining -= (covered < remaining) ? covered : remaining;
+			}
+		}
+
+		memset(inode->blocks, 0, sizeof(inode->blocks));
+	}
+
+	inode->nblocks = 0;
+	bmap_cache_invalidate(inode->ino);
+}
+
+/*
+ * Create the file or directory @path with @mode; @ino gets its inode
+ * number.  Returns 0 or a negative errno, -ENOENT when there is no
+ * directory to create it in.
+ */
+int create_inode(const char *path, mode_t mode, uint32_t *ino) {
+	const char *name = NULL;
+	uint32_t ino_parent = path_2_parent(path, &name);
+	if ((ino_parent == VRS_INVALID_INO) || (*name == '\0')) {
+		log_msg("\nError no parent directory for %s", path);
+		return -ENOENT;
+	}
+
+	return create_inode_at(ino_parent, name, mode, ino);
+}
+
+/* create_inode_at() with the directory locked */
+static int create_inode_locked(uint32_t ino_parent, const char *name, mode_t mode, uint32_t *ino) {
+	uint32_t ino_path = dir_lookup(name, ino_parent);
+	if (ino_path == VRS_INVALID_INO) {
+		// The directory may have been removed since its path was walked
+		if (!inode_exists(ino_parent)) {
+			return -ENOENT;
+		}
+
+		vrs_inode_t inode_parent;
+		get_inode(ino_parent, &inode_parent);
+		if (!S_ISDIR(inode_parent.mode)) {
+			return -ENOTDIR;
+		}
+
+		ino_path = get_ino();
+		uint32_t block_no = get_block_no();
+
+		if ((ino_path != VRS_INVALID_INO) && (block_no != VRS_INVALID_BLOCK_NO)) {
+			// Step 1: Update the inode bitmap to reflect availability
+			update_inode_bitmap(ino_path, 1);
+
+			// Step 2: Update Data n=bitmap
+			update_block_bitmap(block_no, 1);
+
+			// Step 3: Create Inode, under a generation the last inode
+			// by this number did not have
+			vrs_inode_t old, inode;
+			memset(&old, 0, sizeof(old));
+			icache_read(&VRS_DATA->icache, ino_path, &old, sizeof(old));
+			memset(&inode, 0, sizeof(inode));
+			inode.generation = old.generation + 1;
+			inode.atime = inode.ctime = inode.mtime = time(NULL);
+			inode.ino = ino_path;
+			inode_bmap_init(&inode, VRS_DATA->extents ? VRS_INODE_EXTENTS : 0, block_no);
+			inode.size = 0;
+			inode.nlink = 1;
+			inode.mode = mode;
+
+			// Step 4: Write inode to disk, nothing of the old one is kept
+			if (icache_create(&VRS_DATA->icache, ino_path, &inode, sizeof(inode)) < 0) {
+				log_msg("\nError no memory to cache inode %d", ino_path);
+				inode_free_blocks(&inode);
+				free_ino(ino_path);
+				update_inode_bitmap(ino_path, 0);
+				return -ENOMEM;
+			}
+
+			// Step 5: Create a directory entry
+			int retstat = create_dentry(name, &inode, ino_parent);
+			if (retstat < 0) {
+				log_msg("\nError no room for %s in its directory", name);
+				inode_free_blocks(&inode);
+				free_ino(ino_path);
+				update_inode_bitmap(ino_path, 0);
+				icache_forget(&VRS_DATA->icache, ino_path);
+				return retstat;
+			}
+
+			*ino = inode.ino;
+			return 0;
+		}
+
+		// Give back whichever of the two was found
+		if (ino_path != VRS_INVALID_INO) {
+			free_ino(ino_path);
+		}
+		if (block_no != VRS_INVALID_BLOCK_NO) {
+			free_block_no(block_no);
+		}
+		return -ENOSPC;
+	}
+
+	log_msg("\nError path already exists!");
+	return -EEXIST;
+}
+
+/*
+ * Create @name with @mode in directory @ino_parent, and return its inode
+ * number in @ino.  Returns 0 on success or a negative errno.
+ */
+int create_inode_at(uint32_t ino_parent, const char *name, mode_t mode, uint32_t *ino) {
+	if (strlen(name) >= VRS_MAX_LENGTH_FILE_NAME) {
+		log_msg("\nError name too long %s", name);
+		return -ENAMETOOLONG;
+	}
+	if (ino_parent >= VRS_NINODES) {
+		return -ENOENT;
+	}
+
+	journal_begin();
+	inode_lock(ino_parent);
+	int retstat = create_inode_locked(ino_parent, name, mode, ino);
+	inode_unlock(ino_parent);
+	if ((journal_end() < 0) && (retstat >= 0)) {
+		retstat = -EIO;
+	}
+
+	return retstat;
+}
+
+/* Give back the blocks and the number of an inode nothing refers to */
+static void release_inode(vrs_inode_t *inode_data) {
+	inode_free_blocks(inode_data);
+
+	release_prealloc(inode_data->ino);
+	free_ino(inode_data->ino);
+	update_inode_bitmap(inode_data->ino, 0);
+
+	// Only the generation stays, for the next inode by this number to
+	// pick another one
+	vrs_inode_t dead;
+	memset(&dead, 0, sizeof(dead));
+	dead.ino = inode_data->ino;
+	dead.generation = inode_data->generation;
+	if (icache_create(&VRS_DATA->icache, dead.ino, &dead, sizeof(dead)) < 0) {
+		log_msg("\nrelease_inode no memory to keep the generation of inode %d", dead.ino);
+		icache_forget(&VRS_DATA->icache, dead.ino);
+	}
+}
+
+/* Whether open handles or the kernel still refer to inode @ino */
+static int inode_in_use(uint32_t ino) {
+	return (icache_pinned(&VRS_DATA->icache, ino) > 0) || (VRS_DATA->nlookup[ino] > 0);
+}
+
+/* Free inode @ino, which the caller holds locked, if it lost its name and nothing refers to it */
+static void inode_put_orphan(uint32_t ino) {
+	if (inode_in_use(ino)) {
+		return;
+	}
+
+	vrs_inode_t inode_data;
+	get_inode(ino, &inode_data);
+	if (inode_data.flags & VRS_INODE_ORPHAN) {
+		release_inode(&inode_data);
+	}
+}
+
+/*
+ * Count a reference the kernel takes on inode @ino by being handed its
+ * entry, and fill in @inode_data.  Returns 0, or -ENOENT if the inode
+ * is gone.
+ */
+int inode_ref(uint32_t ino, vrs_inode_t *inode_data) {
+	if (ino >= VRS_NINODES) {
+		return -ENOENT;
+	}
+
+	int retstat = -ENOENT;
+	inode_lock(ino);
+	if (inode_exists(ino)) {
+		get_inode(ino, inode_data);
+		++VRS_DATA->nlookup[ino];
+		retstat = 0;
+	}
+	inode_unlock(ino);
+
+	return retstat;
+}
+
+/*
+ * Look @name up in directory @ino_parent and count a reference on what
+ * it names, as inode_ref() does.  The directory stays locked throughout,
+ * so the inode can't be removed and its number reused in between.
+ */
+int lookup_inode_at(uint32_t ino_parent, const char *name, vrs_inode_t *inode_data) {
+	if (ino_parent >= VRS_NINODES) {
+		return -ENOENT;
+	}
+
+	int retstat = -ENOENT;
+	inode_lock_shared(ino_parent);
+	if (inode_exists(ino_parent)) {
+		uint32_t ino = dir_lookup(name, ino_parent);
+		if (ino != VRS_INVALID_INO) {
+			retstat = inode_ref(ino, inode_data);
+		}
+	}
+	inode_unlock(ino_parent);
+
+	return retstat;
+}
+
+/*
+ * Drop @nlookup of the references inode_ref() counted on @ino.  Once it
+ * has neither a name nor references nor open handles the inode is freed.
+ */
+void inode_forget(uint32_t ino, uint64_t nlookup) {
+	if (ino >= VRS_NINODES) {
+		return;
+	}
+
+	journal_begin();
+	inode_lock(ino);
+	if (inode_exists(ino)) {
+		uint64_t *count = &VRS_DATA->nlookup[ino];
+		*count -= (nlookup < *count) ? nlookup : *count;
+		inode_put_orphan(ino);
+	}
+	inode_unlock(ino);
+	journal_end();
+}
+
+/*
+ * Open inode @ino and return the handle in @file: the inode stays in the
+ * inode cache until close_inode(), and is not freed before then even if
+ * it is removed.  Returns 0 on success, -ENOENT if the inode was removed
+ * before it could be opened or -ENOMEM.
+ */
+int open_inode(uint32_t ino, vrs_file_t **file) {
+	if (ino >= VRS_NINODES) {
+		return -ENOENT;
+	}
+
+	*file = calloc(1, sizeof(vrs_file_t));
+	if (*file == NULL) {
+		return -ENOMEM;
+	}
+	(*file)->ino = ino;
+	pthread_mutex_init(&(*file)->ra_lock, NULL);
+
+	// Removal checks for pins under the exclusive lock
+	int retstat = 0;
+	inode_lock_shared(ino);
+	if (!inode_exists(ino)) {
+		retstat = -ENOENT;
+	} else if (icache_pin(&VRS_DATA->icache, ino) < 0) {
+		retstat = -ENOMEM;
+	}
+	inode_unlock(ino);
+
+	if (retstat < 0) {
+		pthread_mutex_destroy(&(*file)->ra_lock);
+		free(*file);
+		*file = NULL;
+	}
+
+	return retstat;
+}
+
+void close_inode(vrs_file_t *file) {
+	uint32_t ino = file->ino;
+	pthread_mutex_destroy(&file->ra_lock);
+	free(file);
+
+	journal_begin();
+	inode_lock(ino);
+	icache_unpin(&VRS_DATA->icache, ino);
+	if (icache_pinned(&VRS_DATA->icache, ino) == 0) {
+		// Give back the blocks set aside for the file's next writes
+		release_prealloc(ino);
+		inode_put_orphan(ino);
+	}
+	inode_unlock(ino);
+	journal_end();
+}
+
+/*
+ * Free the inodes a crash left orphaned: removed while in use, they were
+ * to go once unused, which never came.  Called at mount, before
+ * anything is open.  Returns how many were freed.
+ */
+int release_orphans(void) {
+	int count = 0;
+	uint32_t ino = 0;
+	for (ino = 0; ino < VRS_NINODES; ++ino) {
+		if (!alloc_is_used(&VRS_DATA->inode_alloc, ino)) {
+			continue;
+		}
+
+		vrs_inode_t inode_data;
+		journal_begin();
+		inode_lock(ino);
+		get_inode(ino, &inode_data);
+		if (inode_data.flags & VRS_INODE_ORPHAN) {
+			log_msg("\nrelease_orphans inode %d was removed while in use", ino);
+			release_inode(&inode_data);
+			++count;
+		}
+		inode_unlock(ino);
+		journal_end();
+	}
+
+	return count;
+}
+
+/*
+ * Read from open file @file with its inode locked shared, so reads of
+ * one file go on side by side.  Returns the number of bytes read or a
+ * negative errno.
+ */
+int file_read(vrs_file_t *file, char *buffer, size_t size, off_t offset) {
+	vrs_inode_t inode;
+
+	inode_lock_shared(file->ino);
+	get_inode(file->ino, &inode);
+	int retstat = read_inode(&inode, buffer, size, offset);
+	if (retstat > 0) {
+		file_readahead(file, &inode, offset, retstat);
+	}
+	inode_unlock(file->ino);
+
+	return retstat;
+}
+
+/*
+ * Write to open file @file with its inode locked.  Returns the number of
+ * bytes written or a negative errno.
+ */
+int file_write(vrs_file_t *file, const char *buffer, size_t size, off_t offset) {
+	vrs_inode_t inode;
+
+	journal_begin();
+	inode_lock(file->ino);
+	get_inode(file->ino, &inode);
+	int retstat = write_inode(&inode, buffer, size, offset);
+	inode_unlock(file->ino);
+	if ((journal_end() < 0) && (retstat >= 0)) {
+		retstat = -EIO;
+	}
+
+	return retstat;
+}
+
+/*
+ * Readahead of an open file.  A read that starts where the previous one
+ * ended doubles the window, up to VRS_READAHEAD_MAX blocks; any other
+ * read closes it.  Blocks of the window not hinted yet are passed to
+ * the disk in physically contiguous runs.
+ */
+void file_readahead(vrs_file_t *file, vrs_inode_t *inode, off_t offset, size_t size) {
+	pthread_mutex_lock(&file->ra_lock);
+	if ((size > 0) && ((uint64_t)offset == file->ra_next)) {
+		file->ra_blocks = (file->ra_blocks == 0) ? VRS_READAHEAD_MIN : (file->ra_blocks * 2);
+		if (file->ra_blocks > VRS_READAHEAD_MAX) {
+			file->ra_blocks = VRS_READAHEAD_MAX;
+		}
+	} else {
+		file->ra_blocks = 0;
+		file->ra_end = 0;
+	}
+	file->ra_next = offset + size;
+	if (file->ra_blocks == 0) {
+		pthread_mutex_unlock(&file->ra_lock);
+		return;
+	}
+
+	uint32_t file_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t start = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t end = start + file->ra_blocks;
+	if (end > file_blocks) {
+		end = file_blocks;
+	}
+	if (start < file->ra_end) {
+		start = file->ra_end;
+	}
+	if (start >= end) {
+		pthread_mutex_unlock(&file->ra_lock);
+		return;
+	}
+	file->ra_end = end;
+	pthread_mutex_unlock(&file->ra_lock);
+
+	uint32_t pblks[VRS_READAHEAD_MAX];
+	uint32_t count = end - start;
+	if (inode_bmap_range(inode, start, count, pblks) < 0) {
+		return;
+	}
+
+	uint32_t i = 0;
+	while (i < count) {
+		uint32_t j = i + 1;
+		while ((j < count) && (pblks[i] != VRS_INVALID_BLOCK_NO) && (pblks[j] == pblks[j - 1] + 1)) {
+			++j;
+		}
+		if (pblks[i] != VRS_INVALID_BLOCK_NO) {
+			block_readahead(VRS_BLOCK_DATA + pblks[i], j - i);
+		}
+		i = j;
+	}
+}
+
+static int dir_has_entry(void *arg, const vrs_dentry_t *dentry, uint64_t key) {
+	return 1;
+}
+
+/* Whether directory @dir holds no entries */
+int dir_is_empty(vrs_inode_t *dir) {
+	return iterate_dentries(dir, 0, dir_has_entry, NULL) == 0;
+}
+
+/* remove_inode_at() with the directory and the inode @ino_path locked */
+static int remove_inode_locked(uint32_t ino_parent, const char *name, int dir, uint32_t ino_path) {
+	vrs_inode_t inode_data;
+	get_inode(ino_path, &inode_data);
+	if (dir && !S_ISDIR(inode_data.mode)) {
+		return -ENOTDIR;
+	} else if (!dir && S_ISDIR(inode_data.mode)) {
+		return -EISDIR;
+	} else if (dir && !dir_is_empty(&inode_data)) {
+		return -ENOTEMPTY;
+	}
+
+	int retstat = remove_dentry(name, &inode_data, ino_parent);
+	if (retstat < 0) {
+		return retstat;
+	}
+	if (S_ISDIR(inode_data.mode)) {
+		dcache_purge_parent(&VRS_DATA->dcache, inode_data.ino);
+		dcache_purge_parent(&VRS_DATA->dcache, VRS_DCACHE_PATHS);
+	}
+
+	// An inode that is open or known to the kernel lives on without its
+	// name until the last release or forget
+	if (inode_in_use(ino_path)) {
+		log_msg("\nremove_inode %d is in use, freeing it once unused", ino_path);
+		inode_data.flags |= VRS_INODE_ORPHAN;
+		inode_data.nlink = 0;
+		retstat = update_inode_data(ino_path, &inode_data);
+	} else {
+		release_inode(&inode_data);
+	}
+
+	return retstat;
+}
+
+/*
+ * Remove @name from directory @ino_parent.  With @dir set it has to be an
+ * empty directory, otherwise anything but a directory.  Returns 0 on
+ * success or a negative errno.
+ */
+int remove_inode_at(uint32_t ino_parent, const char *name, int dir) {
+	if (ino_parent >= VRS_NINODES) {
+		return -ENOENT;
+	}
+
+	// The directory first, then the inode it names
+	journal_begin();
+	inode_lock(ino_parent);
+	uint32_t ino_path = dir_lookup(name, ino_parent);
+	int retstat = -ENOENT;
+	if (ino_path != VRS_INVALID_INO) {
+		inode_lock(ino_path);
+		retstat = remove_inode_locked(ino_parent, name, dir, ino_path);
+		inode_unlock(ino_path);
+	} else {
+		log_msg("\nError no such path exists!");
+	}
+	inode_unlock(ino_parent);
+	if ((journal_end() < 0) && (retstat >= 0)) {
+		retstat = -EIO;
+	}
+
+	return retstat;
+}
+
+static int remove_path(const char *path, int dir) {
+	const char *name = NULL;
+	uint32_t ino_parent = path_2_parent(path, &name);
+	if ((ino_parent == VRS_INVALID_INO) || (*name == '\0')) {
+		log_msg("\nError no such path exists!");
+		return -ENOENT;
+	}
+
+	return remove_inode_at(ino_parent, name, dir);
+}
+
+int remove_inode(const char *path) {
+	return remove_path(path, 0);
+}
+
+int remove_directory(const char *path) {
+	return remove_path(path, 1);
+}
+
+/*
+ * Build in @buf block @i of the file, mapped to @block_no, as it is after
+ * writing @buffer over [@offset, @end).  The block is only read when data
+ * of the file lies in it outside the write; blocks new to the file
+ * (@is_new) and anything beyond the end of the file are zeros.
+ */
+static void write_merge_block(const vrs_inode_t *inode_data, uint32_t i, int block_no, int is_new,
+		const char *buffer, off_t offset, off_t end, char *buf) {
+	off_t block_start = (off_t)i * BLOCK_SIZE;
+	off_t block_end = block_start + BLOCK_SIZE;
+	off_t valid_end = (inode_data->size < block_end) ? inode_data->size : block_end;
+	if (is_new || (valid_end < block_start)) {
+		valid_end = block_start;
+	}
+
+	if ((valid_end > block_start) && ((offset > block_start) || (valid_end > end))) {
+		block_read(block_no, buf);
+		memset(buf + (valid_end - block_start), 0, block_end - valid_end);
+	} else {
+		memset(buf, 0, BLOCK_SIZE);
+	}
+
+	off_t copy_start = (offset > block_start) ? offset : block_start;
+	off_t copy_end = (end < block_end) ? end : block_end;
+	if (copy_end > copy_start) {
+		memcpy(buf + (copy_start - block_start), buffer + (copy_start - offset), copy_end - copy_start);
+	}
+}
+
+int write_inode(vrs_inode_t *inode_data, const char* buffer, int size, off_t offset) {
+
+	if (size <= 0) {
+		return 0;
+	}
+
+	off_t end = offset + size;
+	off_t max_size = (inode_data->flags & VRS_INODE_EXTENTS) ? (off_t)UINT32_MAX : VRS_MAX_FILE_SIZE;
+	if (end > max_size) {
+		log_msg("Can't write a file of this size");
+		return -EFBIG;
+	}
+
+	uint32_t first_block_idx = offset / BLOCK_SIZE;
+	uint32_t last_block_idx = (end - 1) / BLOCK_SIZE;
+	uint32_t first_new_idx = inode_data->nblocks;
+
+	// Blocks from the one the file ends in up to the write turn into a
+	// hole.  Those already mapped may hold anything beyond the end of the
+	// file, the rest are new.
+	uint32_t size_blocks = (inode_data->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t hole_idx = (size_blocks < first_new_idx) ? size_blocks : first_new_idx;
+	uint32_t eof_idx = VRS_INVALID_BLOCK_NO;
+	if ((inode_data->size % BLOCK_SIZE != 0) && (size_blocks - 1 < first_block_idx)
+			&& (size_blocks - 1 < first_new_idx)) {
+		eof_idx = size_blocks - 1;
+	}
+
+	// One vector entry per block written plus one per hole being zeroed,
+	// and one for the end of the block the file ends in
+	uint32_t num_holes = ((first_block_idx > hole_idx) ? (first_block_idx - hole_idx) : 0) + 1;
+	uint32_t num_blocks = last_block_idx - first_block_idx + 1;
+	block_vec_t *vec = malloc((num_holes + num_blocks) * sizeof(block_vec_t));
+	uint32_t *pblks = malloc(num_blocks * sizeof(uint32_t));
+	char *zero_block = (num_holes > 1) ? calloc(1, BLOCK_SIZE) : NULL;
+	// Partial blocks at the start and end of the write, and the block the
+	// file ends in, are merged here
+	char *merge_buf = malloc(3 * BLOCK_SIZE);
+	if ((vec == NULL) || (pblks == NULL) || ((num_holes > 1) && (zero_block == NULL)) || (merge_buf == NULL)) {
+		log_msg("\nwrite_inode no memory for %u blocks", num_blocks);
+		free(merge_buf);
+		free(zero_block);
+		free(pblks);
+		free(vec);
+		return -ENOMEM;
+	}
+	char *head_buf = merge_buf;
+	char *tail_buf = merge_buf + BLOCK_SIZE;
+	char *eof_buf = merge_buf + 2 * BLOCK_SIZE;
+	int num_vec = 0;
+	int retstat = 0;
+
+	// Allocate every missing block up to the last one written, blocks
+	// skipped over by the write are zeroed so holes read back as zeros.
+	// New blocks are asked for in runs that continue the file on disk.
+	uint32_t goal = 0;
+	if (inode_data->nblocks > 0) {
+		goal = inode_bmap(inode_data, inode_data->nblocks - 1) + 1;
+	}
+
+	while (inode_data->nblocks <= last_block_idx) {
+		uint32_t run_len = 0;
+		uint32_t block_no = get_block_run(inode_data->ino, goal, last_block_idx + 1 - inode_data->nblocks, &run_len);
+		if (block_no == VRS_INVALID_BLOCK_NO) {
+			log_msg("\nwrite_inode no free data blocks");
+			retstat = -ENOSPC;
+			goto out;
+		}
+
+		update_block_bitmap_run(block_no, run_len, 1);
+		log_msg("\nAllocated %d new blocks at %d for file, goal %d", run_len, block_no, goal);
+
+		retstat = inode_bmap_set_run(inode_data, inode_data->nblocks, block_no, run_len);
+		if (retstat < 0) {
+			// Blocks mapped before the map ran out of room stay with the
+			// file, the rest of the run is ours to give back
+			uint32_t mapped = 0;
+			while ((mapped < run_len)
+					&& (inode_bmap(inode_data, inode_data->nblocks + mapped) == block_no + mapped)) {
+				++mapped;
+			}
+			inode_data->nblocks += mapped;
+			release_block_run(block_no + mapped, run_len - mapped);
+			goto out;
+		}
+
+		uint32_t j = 0;
+		for (j = 0; j < run_len; ++j) {
+			if (inode_data->nblocks < first_block_idx) {
+				vec[num_vec].block_num = VRS_BLOCK_DATA + block_no + j;
+				vec[num_vec].buf = zero_block;
+				++num_vec;
+			}
+			++inode_data->nblocks;
+		}
+
+		goal = block_no + run_len;
+	}
+
+	uint32_t i = 0;
+	if (eof_idx != VRS_INVALID_BLOCK_NO) {
+		vec[num_vec].block_num = VRS_BLOCK_DATA + inode_bmap(inode_data, eof_idx);
+		write_merge_block(inode_data, eof_idx, vec[num_vec].block_num, 0, NULL, 0, 0, eof_buf);
+		vec[num_vec].buf = eof_buf;
+		++num_vec;
+	}
+	for (i = size_blocks; (i < first_block_idx) && (i < first_new_idx); ++i) {
+		vec[num_vec].block_num = VRS_BLOCK_DATA + inode_bmap(inode_data, i);
+		vec[num_vec].buf = zero_block;
+		++num_vec;
+	}
+
+	if (inode_bmap_range(inode_data, first_block_idx, num_blocks, pblks) < 0) {
+		retstat = -ENOMEM;
+		goto out;
+	}
+
+	// Full blocks go straight from the caller's buffer.  Partial blocks at
+	// either end are only merged with what is on disk when they hold data
+	// of the file besides what is written, so appends do not read.
+	for (i = first_block_idx; i <= last_block_idx; ++i) {
+		off_t block_start = (off_t)i * BLOCK_SIZE;
+		int block_no = VRS_BLOCK_DATA + pblks[i - first_block_idx];
+
+		vec[num_vec].block_num = block_no;
+		if ((block_start >= offset) && (block_start + BLOCK_SIZE <= end)) {
+			vec[num_vec].buf = (void *)(buffer + (block_start - offset));
+		} else {
+			char *buf = (i == first_block_idx) ? head_buf : tail_buf;
+			write_merge_block(inode_data, i, block_no, i >= first_new_idx, buffer, offset, end, buf);
+			vec[num_vec].buf = buf;
+		}
+		++num_vec;
+	}
+
+	if (block_writev(vec, num_vec) < 0) {
+		retstat = -EIO;
+		goto out;
+	}
+
+	// The next append goes to the block the file now ends in
+	if ((end % BLOCK_SIZE != 0) && (end >= inode_data->size)) {
+		block_keep(VRS_BLOCK_DATA + pblks[num_blocks - 1], (num_blocks == 1) ? head_buf : tail_buf);
+	}
+
+	log_msg("\nwrite_inode offset = %lld written %d bytes in %d blocks", (long long)offset, size, num_vec);
+
+	if (end > inode_data->size) {
+		inode_data->size = end;
+	}
+	retstat = size;
+
+out:
+	// Blocks that did get allocated are recorded even if the write failed
+	if ((update_inode_data(inode_data->ino, inode_data) < 0) && (retstat >= 0)) {
+		retstat = -ENOMEM;
+	}
+
+	free(merge_buf);
+	free(zero_block);
+	free(pblks);
+	free(vec);
+
+	return retstat;
+}
+
+int read_inode(vrs_inode_t *inode_data, char* buffer, int size, off_t offset) {
+
+	log_msg("\nread_inode size=%d offset=%lld", size, (long long)offset);
+	if ((size <= 0) || (offset >= inode_data->size)) {
+		return 0;
+	}
+
+	off_t end = offset + size;
+	if (end > inode_data->size) {
+		end = inode_data->size;
+	}
+
+	uint32_t first_block_idx = offset / BLOCK_SIZE;
+	uint32_t last_block_idx = (end - 1) / BLOCK_SIZE;
+	uint32_t num_blocks = last_block_idx - first_block_idx + 1;
+	block_vec_t *vec = malloc(num_blocks * sizeof(block_vec_t));
+	uint32_t *pblks = malloc(num_blocks * sizeof(uint32_t));
+
+	char *head_buf = NULL, *tail_buf = NULL;
+	int retstat = -ENOMEM;
+	if ((vec == NULL) || (pblks == NULL)) {
+		goto out;
+	}
+	retstat = inode_bmap_range(inode_data, first_block_idx, num_blocks, pblks);
+	if (retstat < 0) {
+		goto out;
+	}
+
+	// Full blocks are read straight into the caller's buffer, partial
+	// blocks at either end go through a bounce buffer.
+	if ((offset % BLOCK_SIZE != 0) || (end % BLOCK_SIZE != 0)) {
+		head_buf = malloc(2 * BLOCK_SIZE);
+		if (head_buf == NULL) {
+			retstat = -ENOMEM;
+			goto out;
+		}
+		tail_buf = head_buf + BLOCK_SIZE;
+	}
+	int head_used = 0, tail_used = 0;
+	int num_vec = 0;
+	uint32_t i = 0;
+	for (i = first_block_idx; i <= last_block_idx; ++i) {
+		off_t block_start = (off_t)i * BLOCK_SIZE;
+
+		vec[num_vec].block_num = VRS_BLOCK_DATA + pblks[i - first_block_idx];
+		if ((block_start >= offset) && (block_start + BLOCK_SIZE <= end)) {
+			vec[num_vec].buf = buffer + (block_start - offset);
+		} else if (i == first_block_idx) {
+			vec[num_vec].buf = head_buf;
+			head_used = 1;
+		} else {
+			vec[num_vec].buf = tail_buf;
+			tail_used = 1;
+		}
+		++num_vec;
+	}
+
+	if (block_readv(vec, num_vec) < 0) {
+		retstat = -EIO;
+		goto out;
+	}
+
+	if (head_used) {
+		off_t block_start = (off_t)first_block_idx * BLOCK_SIZE;
+		off_t copy_end = (block_start + BLOCK_SIZE < end) ? (block_start + BLOCK_SIZE) : end;
+		memcpy(buffer, head_buf + (offset - block_start), copy_end - offset);
+	}
+
+	if (tail_used) {
+		off_t block_start = (off_t)last_block_idx * BLOCK_SIZE;
+		memcpy(buffer + (block_start - offset), tail_buf, end - block_start);
+	}
+
+	log_msg("\nread_inode read %d bytes in %d blocks", (int)(end - offset), num_vec);
+	retstat = end - offset;
+
+out:
+	free(head_buf);
+	free(pblks);
+	free(vec);
+	return retstat;
+}
+
+void fill_stat_from_ino(const vrs_inode_t* inode, struct stat *statbuf) {
+	statbuf->st_dev = 0;
+	statbuf->st_ino = inode->ino;
+	statbuf->st_mode = inode->mode;
+	statbuf->st_nlink = inode->nlink;
+	statbuf->st_uid = getuid();
+	statbuf->st_gid = getgid();
+	statbuf->st_rdev = 0;
+	statbuf->st_size = inode->size;
+	statbuf->st_blksize = BLOCK_SIZE;
+	statbuf->st_blocks = (blkcnt_t)inode->nblocks * (BLOCK_SIZE / 512);
+	statbuf->st_atime = inode->atime;
+	statbuf->st_mtime = inode->mtime;
+	statbuf->st_ctime = inode->ctime;
+}
+
+static void dir_read_block(vrs_inode_t *dir, uint32_t lblk, void *buffer) {
+	block_read(VRS_BLOCK_DATA + inode_bmap(dir, lblk), buffer);
+}
+
+static void dir_write_block(vrs_inode_t *dir, uint32_t lblk, const void *buffer) {
+	block_write(VRS_BLOCK_DATA + inode_bmap(dir, lblk), buffer);
+}
+
+/*
+ * Add a block at the end of directory @dir.  Returns its logical block
+ * number, or VRS_INVALID_BLOCK_NO if the disk is full.  The caller writes
+ * the block and the inode.
+ */
+static uint32_t dir_append_block(vrs_inode_t *dir) {
+	uint32_t block_no = get_block_no();
+	if (block_no == VRS_INVALID_BLOCK_NO) {
+		return VRS_INVALID_BLOCK_NO;
+	}
+
+	update_block_bitmap(block_no, 1);
+	if (inode_bmap_set_run(dir, dir->nblocks, block_no, 1) < 0) {
+		release_block(block_no);
+		return VRS_INVALID_BLOCK_NO;
+	}
+
+	return dir->nblocks++;
+}
+
+/* FNV-1a hash of a file name, the key of the directory index */
+static uint32_t dentry_hash(const char *name) {
+	uint32_t hash = 2166136261u;
+	for (; *name != '\0'; ++name) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * Readdir key of @dentry: its name hash above VRS_DENTRY_KEY_LOW_BITS
+ * of a second hash, so entries sharing a name hash still get keys of
+ * their own.  Keys only depend on the name, whatever slot or leaf holds
+ * the entry.
+ */
+static uint64_t dentry_key(const vrs_dentry_t *dentry) {
+	uint32_t low = 5381;
+	int i = 0;
+	for (i = 0; i < dentry->name_len; ++i) {
+		low = low * 33 + (unsigned char)dentry->name[i];
+	}
+
+	return ((uint64_t)dentry->hash << VRS_DENTRY_KEY_LOW_BITS) | (low & ((1u << VRS_DENTRY_KEY_LOW_BITS) - 1));
+}
+
+/* Fill in @dentry for @name, which must fit */
+static void dentry_init(vrs_dentry_t *dentry, const char *name, uint32_t ino) {
+	memset(dentry, 0, sizeof(vrs_dentry_t));
+	dentry->inode_number = ino;
+	dentry->hash = dentry_hash(name);
+	dentry->name_len = strlen(name);
+	memcpy(dentry->name, name, dentry->name_len);
+}
+
+static uint32_t dentry_slot_hash(const char *block, int slot) {
+	uint32_t hash;
+	memcpy(&hash, block + slot * VRS_DENTRY_SIZE + offsetof(vrs_dentry_t, hash), sizeof(hash));
+	return hash;
+}
+
+static int dentry_slot_matches(const char *block, int slot, const char *name, uint8_t len) {
+	const char *dentry = block + slot * VRS_DENTRY_SIZE;
+	return ((uint8_t)dentry[offsetof(vrs_dentry_t, name_len)] == len)
+			&& (memcmp(dentry + offsetof(vrs_dentry_t, name), name, len) == 0);
+}
+
+/*
+ * Slot of @name, whose dentry_hash() is @hash, among the first @nslots
+ * slots of the directory block @block, or -1.  Only the stored hashes
+ * are looked at until one matches, several slots at a time where the
+ * CPU allows; free slots never match since their length is 0.
+ */
+static int dentry_block_find(const char *block, int nslots, const char *name, uint32_t hash) {
+	uint8_t len = strlen(name);
+	int slot = 0;
+
+#if defined(__AVX2__)
+	const __m256i want = _mm256_set1_epi32((int)hash);
+	const __m256i stride = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i offsets = _mm256_mullo_epi32(stride, _mm256_set1_epi32(VRS_DENTRY_SIZE / sizeof(uint32_t)));
+	for (; slot + 8 <= nslots; slot += 8) {
+		const int *base = (const int *)(block + slot * VRS_DENTRY_SIZE + offsetof(vrs_dentry_t, hash));
+		__m256i hashes = _mm256_i32gather_epi32(base, offsets, sizeof(uint32_t));
+		unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(hashes, want)));
+		for (; mask != 0; mask &= mask - 1) {
+			int hit = slot + __builtin_ctz(mask);
+			if (dentry_slot_matches(block, hit, name, len)) {
+				return hit;
+			}
+		}
+	}
+#elif defined(__SSE2__)
+	const __m128i want = _mm_set1_epi32((int)hash);
+	for (; slot + 4 <= nslots; slot += 4) {
+		__m128i hashes = _mm_setr_epi32((int)dentry_slot_hash(block, slot), (int)dentry_slot_hash(block, slot + 1),
+				(int)dentry_slot_hash(block, slot + 2), (int)dentry_slot_hash(block, slot + 3));
+		unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(hashes, want)));
+		for (; mask != 0; mask &= mask - 1) {
+			int hit = slot + __builtin_ctz(mask);
+			if (dentry_slot_matches(block, hit, name, len)) {
+				return hit;
+			}
+		}
+	}
+#endif
+
+	for (; slot < nslots; ++slot) {
+		if ((dentry_slot_hash(block, slot) == hash) && dentry_slot_matches(block, slot, name, len)) {
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Directory index.
+ *
+ * A directory that outgrows VRS_DX_THRESHOLD blocks gets indexed
+ * (VRS_INODE_INDEXED): its first block becomes the root of a B-tree keyed
+ * by name hash, the other blocks are either interior index nodes or leaf
+ * blocks of dentries.  Each index entry holds the lowest hash found below
+ * it, so a lookup reads one block per level plus one leaf.  A full leaf is
+ * split in two by hash, a full index node likewise, and the root grows a
+ * level when everything on the way down is full.  Free slots in leaves
+ * have an empty name.
+ */
+typedef struct {
+	uint32_t lblk;
+	char *buf;
+	int pos;	/* Entry followed to the next level */
+} dx_frame_t;
+
+typedef struct {
+	uint32_t hash;
+	vrs_dentry_t dentry;
+} dx_sort_t;
+
+static vrs_dx_entry_t *dx_entries(vrs_dx_header_t *node) {
+	return (vrs_dx_entry_t *)(node + 1);
+}
+
+static void dx_init_node(void *buffer) {
+	vrs_dx_header_t *node = (vrs_dx_header_t *)buffer;
+	memset(buffer, 0, BLOCK_SIZE);
+	node->magic = VRS_DX_MAGIC;
+	node->limit = VRS_DX_LIMIT;
+}
+
+static int dx_is_index(const void *buffer) {
+	return ((const vrs_dx_header_t *)buffer)->magic == VRS_DX_MAGIC;
+}
+
+static int dx_sort_cmp(const void *a, const void *b) {
+	uint32_t ha = ((const dx_sort_t *)a)->hash;
+	uint32_t hb = ((const dx_sort_t *)b)->hash;
+	return (ha > hb) - (ha < hb);
+}
+
+/* Last entry of @node whose hash is not above @hash */
+static int dx_search(vrs_dx_header_t *node, uint32_t hash) {
+	int lo = 0, hi = node->count - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (dx_entries(node)[mid].hash <= hash) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return lo;
+}
+
+static void dx_insert_at(vrs_dx_header_t *node, int pos, uint32_t hash, uint32_t lblk) {
+	vrs_dx_entry_t *entries = dx_entries(node);
+	memmove(entries + pos + 1, entries + pos, (node->count - pos) * sizeof(vrs_dx_entry_t));
+	entries[pos].hash = hash;
+	entries[pos].block = lblk;
+	++node->count;
+}
+
+/* Free the index nodes dx_walk() left in @frames[0..@depth] */
+static void dx_free_frames(dx_frame_t *frames, int depth) {
+	int level = 0;
+	for (level = 0; level <= depth; ++level) {
+		free(frames[level].buf);
+	}
+}
+
+/*
+ * Walk the index of @dir down to the leaf covering @hash, with the
+ * nodes on the way in @frames[0..*depth].  Returns the leaf's logical
+ * block, or VRS_INVALID_BLOCK_NO with nothing left to free if there was
+ * no memory for the nodes.
+ */
+static uint32_t dx_walk(vrs_inode_t *dir, uint32_t hash, dx_frame_t *frames, int *depth) {
+	frames[0].lblk = 0;
+	frames[0].buf = malloc(BLOCK_SIZE);
+	if (frames[0].buf == NULL) {
+		return VRS_INVALID_BLOCK_NO;
+	}
+	dir_read_block(dir, 0, frames[0].buf);
+
+	int levels = ((vrs_dx_header_t *)frames[0].buf)->levels;
+	int level = 0;
+	for (level = 0; level < levels; ++level) {
+		vrs_dx_header_t *node = (vrs_dx_header_t *)frames[level].buf;
+		frames[level].pos = dx_search(node, hash);
+		frames[level + 1].lblk = dx_entries(node)[frames[level].pos].block;
+		frames[level + 1].buf = malloc(BLOCK_SIZE);
+		if (frames[level + 1].buf == NULL) {
+			dx_free_frames(frames, level);
+			return VRS_INVALID_BLOCK_NO;
+		}
+		dir_read_block(dir, frames[level + 1].lblk, frames[level + 1].buf);
+	}
+
+	vrs_dx_header_t *node = (vrs_dx_header_t *)frames[levels].buf;
+	frames[levels].pos = dx_search(node, hash);
+	*depth = levels;
+
+	return dx_entries(node)[frames[levels].pos].block;
+}
+
+/*
+ * Step @frames, as left by dx_walk(), on to the leaf after the current
+ * one in hash order.  Returns it, or VRS_INVALID_BLOCK_NO after the last.
+ */
+static uint32_t dx_next_leaf(vrs_inode_t *dir, dx_frame_t *frames, int depth) {
+	int level = depth;
+	while ((level >= 0) && (frames[level].pos + 1 >= ((vrs_dx_header_t *)frames[level].buf)->count)) {
+		--level;
+	}
+	if (level < 0) {
+		return VRS_INVALID_BLOCK_NO;
+	}
+
+	++frames[level].pos;
+	for (; level < depth; ++level) {
+		vrs_dx_header_t *node = (vrs_dx_header_t *)frames[level].buf;
+		frames[level + 1].lblk = dx_entries(node)[frames[level].pos].block;
+		frames[level + 1].pos = 0;
+		dir_read_block(dir, frames[level + 1].lblk, frames[level + 1].buf);
+	}
+
+	return dx_entries((vrs_dx_header_t *)frames[depth].buf)[frames[depth].pos].block;
+}
+
+/* Slot of @name in a leaf block, or -1 */
+static int dx_leaf_find(const char *buffer, const char *name, uint32_t hash) {
+	return dentry_block_find(buffer, BLOCK_SIZE / VRS_DENTRY_SIZE, name, hash);
+}
+
+uint32_t dx_lookup(vrs_inode_t *dir, const char *name) {
+	dx_frame_t frames[VRS_DX_MAX_LEVELS + 2];
+	int depth = 0;
+	uint32_t hash = dentry_hash(name);
+	uint32_t leaf = dx_walk(dir, hash, frames, &depth);
+	if (leaf == VRS_INVALID_BLOCK_NO) {
+		return VRS_INVALID_INO;
+	}
+	dx_free_frames(frames, depth);
+
+	char *buffer = malloc(BLOCK_SIZE);
+	if (buffer == NULL) {
+		return VRS_INVALID_INO;
+	}
+	dir_read_block(dir, leaf, buffer);
+	uint32_t ino = VRS_INVALID_INO;
+	int slot = dx_leaf_find(buffer, name, hash);
+	if (slot >= 0) {
+		ino = ((vrs_dentry_t *)(buffer + slot * VRS_DENTRY_SIZE))->inode_number;
+	}
+
+	free(buffer);
+	return ino;
+}
+
+/* Inode of @name in the flat directory @dir, one block at a time */
+uint32_t dir_lookup_flat(vrs_inode_t *dir, const char *name) {
+	int per_block = BLOCK_SIZE / VRS_DENTRY_SIZE;
+	int num_dentries = dir->size / VRS_DENTRY_SIZE;
+	uint32_t hash = dentry_hash(name);
+	uint32_t ino = VRS_INVALID_INO;
+	char *buffer = malloc(BLOCK_SIZE);
+	if (buffer == NULL) {
+		return VRS_INVALID_INO;
+	}
+
+	int i = 0;
+	for (i = 0; i < num_dentries; i += per_block) {
+		dir_read_block(dir, i / per_block, buffer);
+		int nslots = (num_dentries - i < per_block) ? (num_dentries - i) : per_block;
+		int slot = dentry_block_find(buffer, nslots, name, hash);
+		if (slot >= 0) {
+			ino = ((vrs_dentry_t *)(buffer + slot * VRS_DENTRY_SIZE))->inode_number;
+			break;
+		}
+	}
+
+	free(buffer);
+	return ino;
+}
+
+/*
+ * Make sure the lowest index node on the path has room for one more
+ * entry, splitting full nodes top down and growing the root if every
+ * node is full.  @frames is kept pointing at the nodes covering the hash
+ * that was walked.  The block the caller splits the leaf into is added
+ * too, last, and returned in @leaf_lblk.  Every block and buffer needed
+ * is got before anything changes, so on failure the index is as it was.
+ */
+static int dx_make_room(vrs_inode_t *dir, dx_frame_t *frames, int *depth, uint32_t *leaf_lblk) {
+	int level = *depth;
+	while ((level >= 0) && (((vrs_dx_header_t *)frames[level].buf)->count == VRS_DX_LIMIT)) {
+		--level;
+	}
+
+	vrs_dx_header_t *root = (vrs_dx_header_t *)frames[0].buf;
+	if ((level < 0) && (root->levels >= VRS_DX_MAX_LEVELS)) {
+		log_msg("\ndx_make_room directory %d index is full", dir->ino);
+		return -ENOSPC;
+	}
+
+	// One node per split, one more to grow the root into
+	int nnodes = *depth - level + ((level < 0) ? 1 : 0);
+	uint32_t lblks[VRS_DX_MAX_LEVELS + 2];
+	char *bufs[VRS_DX_MAX_LEVELS + 2];
+	uint32_t first = dir->nblocks;
+	int retstat = 0;
+	int n = 0;
+	for (n = 0; n < nnodes; ++n) {
+		bufs[n] = malloc(BLOCK_SIZE);
+		if (bufs[n] == NULL) {
+			retstat = -ENOMEM;
+			break;
+		}
+		lblks[n] = dir_append_block(dir);
+		if (lblks[n] == VRS_INVALID_BLOCK_NO) {
+			free(bufs[n]);
+			retstat = -ENOSPC;
+			break;
+		}
+	}
+	if (retstat == 0) {
+		*leaf_lblk = dir_append_block(dir);
+		if (*leaf_lblk == VRS_INVALID_BLOCK_NO) {
+			retstat = -ENOSPC;
+		}
+	}
+	if (retstat < 0) {
+		while (n-- > 0) {
+			free(bufs[n]);
+		}
+		inode_bmap_truncate(dir, first);
+		return retstat;
+	}
+
+	n = 0;
+	if (level < 0) {
+		// Move the root's entries down into a new node below it
+		uint32_t lblk = lblks[n];
+		char *buf = bufs[n++];
+		memcpy(buf, root, BLOCK_SIZE);
+		((vrs_dx_header_t *)buf)->levels = 0;
+		dir_write_block(dir, lblk, buf);
+
+		root->count = 0;
+		++root->levels;
+		dx_insert_at(root, 0, 0, lblk);
+		dir_write_block(dir, 0, root);
+
+		memmove(frames + 2, frames + 1, *depth * sizeof(dx_frame_t));
+		frames[1].lblk = lblk;
+		frames[1].buf = buf;
+		frames[1].pos = frames[0].pos;
+		frames[0].pos = 0;
+		++*depth;
+		level = 0;
+	}
+
+	int k = 0;
+	for (k = level + 1; k <= *depth; ++k) {
+		vrs_dx_header_t *node = (vrs_dx_header_t *)frames[k].buf;
+		uint32_t lblk = lblks[n];
+		char *right = bufs[n++];
+
+		dx_init_node(right);
+		int half = node->count / 2;
+		((vrs_dx_header_t *)right)->count = node->count - half;
+		memcpy(dx_entries((vrs_dx_header_t *)right), dx_entries(node) + half, (node->count - half) * sizeof(vrs_dx_entry_t));
+		node->count = half;
+		dir_write_block(dir, frames[k].lblk, node);
+		dir_write_block(dir, lblk, right);
+
+		vrs_dx_header_t *parent = (vrs_dx_header_t *)frames[k - 1].buf;
+		dx_insert_at(parent, frames[k - 1].pos + 1, dx_entries((vrs_dx_header_t *)right)[0].hash, lblk);
+		dir_write_block(dir, frames[k - 1].lblk, parent);
+
+		if (frames[k].pos >= half) {
+			free(frames[k].buf);
+			frames[k].buf = right;
+			frames[k].lblk = lblk;
+			frames[k].pos -= half;
+			++frames[k - 1].pos;
+		} else {
+			free(right);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Split the full leaf @leaf (contents in @buffer) in two by hash into the
+ * new block @right_leaf, adding @dentry to the right half.  Equal hashes
+ * always stay in one leaf.
+ */
+static int dx_split_leaf(vrs_inode_t *dir, dx_frame_t *frames, int depth, uint32_t leaf, char *buffer,
+		const vrs_dentry_t *dentry, uint32_t hash, uint32_t right_leaf) {
+	int per_leaf = BLOCK_SIZE / VRS_DENTRY_SIZE;
+	int n = per_leaf + 1;
+	dx_sort_t *all = malloc(n * sizeof(dx_sort_t));
+	char *right = malloc(BLOCK_SIZE);
+	if ((all == NULL) || (right == NULL)) {
+		free(all);
+		free(right);
+		return -ENOMEM;
+	}
+
+	int i = 0;
+	for (i = 0; i < per_leaf; ++i) {
+		memcpy(&all[i].dentry, buffer + i * VRS_DENTRY_SIZE, sizeof(vrs_dentry_t));
+		all[i].hash = all[i].dentry.hash;
+	}
+	all[per_leaf].dentry = *dentry;
+	all[per_leaf].hash = hash;
+	qsort(all, n, sizeof(dx_sort_t), dx_sort_cmp);
+
+	// Cut as close to the middle as the hashes allow
+	int split = -1;
+	int d = 0;
+	for (d = 0; (d <= n / 2) && (split < 0); ++d) {
+		int c = n / 2 - d;
+		if ((c >= 1) && (all[c - 1].hash != all[c].hash)) {
+			split = c;
+		}
+		c = n / 2 + d;
+		if ((split < 0) && (c < n) && (all[c - 1].hash != all[c].hash)) {
+			split = c;
+		}
+	}
+
+	if (split < 0) {
+		log_msg("\ndx_split_leaf can't split leaf %d of directory %d", leaf, dir->ino);
+		free(right);
+		free(all);
+		return -ENOSPC;
+	}
+
+	memset(buffer, 0, BLOCK_SIZE);
+	memset(right, 0, BLOCK_SIZE);
+	for (i = 0; i < n; ++i) {
+		char *dst = (i < split) ? (buffer + i * VRS_DENTRY_SIZE) : (right + (i - split) * VRS_DENTRY_SIZE);
+		memcpy(dst, &all[i].dentry, sizeof(vrs_dentry_t));
+	}
+	dir_write_block(dir, leaf, buffer);
+	dir_write_block(dir, right_leaf, right);
+
+	vrs_dx_header_t *parent = (vrs_dx_header_t *)frames[depth].buf;
+	dx_insert_at(parent, frames[depth].pos + 1, all[split].hash, right_leaf);
+	dir_write_block(dir, frames[depth].lblk, parent);
+
+	free(right);
+	free(all);
+	return 0;
+}
+
+static int dx_add(vrs_inode_t *dir, const vrs_dentry_t *dentry) {
+	uint32_t hash = dentry->hash;
+	dx_frame_t frames[VRS_DX_MAX_LEVELS + 2];
+	int depth = 0;
+	char *buffer = malloc(BLOCK_SIZE);
+	if (buffer == NULL) {
+		return -ENOMEM;
+	}
+	uint32_t leaf = dx_walk(dir, hash, frames, &depth);
+	if (leaf == VRS_INVALID_BLOCK_NO) {
+		free(buffer);
+		return -ENOMEM;
+	}
+	int retstat = 0;
+
+	dir_read_block(dir, leaf, buffer);
+	int slot = 0;
+	for (slot = 0; slot < BLOCK_SIZE / VRS_DENTRY_SIZE; ++slot) {
+		if (((vrs_dentry_t *)(buffer + slot * VRS_DENTRY_SIZE))->name_len == 0) {
+			memcpy(buffer + slot * VRS_DENTRY_SIZE, dentry, sizeof(vrs_dentry_t));
+			dir_write_block(dir, leaf, buffer);
+			goto out;
+		}
+	}
+
+	uint32_t right_leaf = VRS_INVALID_BLOCK_NO;
+	retstat = dx_make_room(dir, frames, &depth, &right_leaf);
+	if (retstat == 0) {
+		retstat = dx_split_leaf(dir, frames, depth, leaf, buffer, dentry, hash, right_leaf);
+		if (retstat < 0) {
+			// The index has room to spare, but the new leaf is not used
+			inode_bmap_truncate(dir, right_leaf);
+		}
+	}
+
+out:
+	dx_free_frames(frames, depth);
+	free(buffer);
+	return retstat;
+}
+
+static int dx_remove(vrs_inode_t *dir, const char *name) {
+	dx_frame_t frames[VRS_DX_MAX_LEVELS + 2];
+	int depth = 0;
+	uint32_t hash = dentry_hash(name);
+	uint32_t leaf = dx_walk(dir, hash, frames, &depth);
+	if (leaf == VRS_INVALID_BLOCK_NO) {
+		return -ENOMEM;
+	}
+	dx_free_frames(frames, depth);
+
+	char *buffer = malloc(BLOCK_SIZE);
+	if (buffer == NULL) {
+		return -ENOMEM;
+	}
+	dir_read_block(dir, leaf, buffer);
+	int retstat = -ENOENT;
+	int slot = dx_leaf_find(buffer, name, hash);
+	if (slot >= 0) {
+		memset(buffer + slot * VRS_DENTRY_SIZE, 0, VRS_DENTRY_SIZE);
+		dir_write_block(dir, leaf, buffer);
+		retstat = 0;
+	}
+
+	free(buffer);
+	return retstat;
+}
+
+/*
+ * Turn the flat directory @dir into an indexed one: its entries are
+ * sorted by hash into leaves filled to three quarters, and the first
+ * block becomes the index root.  Nothing is written unless everything
+ * fits.
+ */
+static int dx_create_index(vrs_inode_t *dir) {
+	int per_leaf = BLOCK_SIZE / VRS_DENTRY_SIZE;
+	int fill = (per_leaf * 3 + 3) / 4;
+	int n = dir->size / VRS_DENTRY_SIZE;
+
+	vrs_dentry_t *dentries = malloc((n + 1) * sizeof(vrs_dentry_t));
+	dx_sort_t *all = malloc((n + 1) * sizeof(dx_sort_t));
+	int *leaf_start = malloc((n + 1) * sizeof(int));
+	char *root = malloc(2 * BLOCK_SIZE);
+	char *buffer = NULL;
+	int retstat = 0;
+	if ((dentries == NULL) || (all == NULL) || (leaf_start == NULL) || (root == NULL)) {
+		retstat = -ENOMEM;
+		goto out;
+	}
+	buffer = root + BLOCK_SIZE;
+
+	n = read_dentries(dir, dentries);
+	if (n < 0) {
+		retstat = n;
+		goto out;
+	}
+	int i = 0;
+	for (i = 0; i < n; ++i) {
+		all[i].dentry = dentries[i];
+		all[i].hash = dentries[i].hash;
+	}
+	qsort(all, n, sizeof(dx_sort_t), dx_sort_cmp);
+
+	// Pick the leaf boundaries, never between equal hashes
+	int nleaves = 0;
+	int start = 0;
+	while (start < n) {
+		int end = (start + fill < n) ? (start + fill) : n;
+		while ((end < n) && (end - start < per_leaf) && (all[end - 1].hash == all[end].hash)) {
+			++end;
+		}
+		if ((end < n) && (all[end - 1].hash == all[end].hash)) {
+			retstat = -ENOSPC;
+			goto out;
+		}
+		leaf_start[nleaves++] = start;
+		start = end;
+	}
+	if (nleaves == 0) {
+		leaf_start[nleaves++] = 0;
+	}
+	leaf_start[nleaves] = n;
+
+	if (nleaves > (int)VRS_DX_LIMIT) {
+		retstat = -ENOSPC;
+		goto out;
+	}
+
+	while (dir->nblocks < (uint32_t)nleaves + 1) {
+		if (dir_append_block(dir) == VRS_INVALID_BLOCK_NO) {
+			retstat = -ENOSPC;
+			goto out;
+		}
+	}
+	inode_bmap_truncate(dir, nleaves + 1);
+
+	dx_init_node(root);
+	int leaf = 0;
+	for (leaf = 0; leaf < nleaves; ++leaf) {
+		memset(buffer, 0, BLOCK_SIZE);
+		for (i = leaf_start[leaf]; i < leaf_start[leaf + 1]; ++i) {
+			memcpy(buffer + (i - leaf_start[leaf]) * VRS_DENTRY_SIZE, &all[i].dentry, sizeof(vrs_dentry_t));
+		}
+		dir_write_block(dir, leaf + 1, buffer);
+		dx_insert_at((vrs_dx_header_t *)root, leaf, (leaf == 0) ? 0 : all[leaf_start[leaf]].hash, leaf + 1);
+	}
+	dir_write_block(dir, 0, root);
+
+	dir->flags |= VRS_INODE_INDEXED;
+	dir->size = dir->nblocks * BLOCK_SIZE;
+	log_msg("\ndx_create_index directory %d indexed, %d entries in %d leaves", dir->ino, n, nleaves);
+
+out:
+	free(root);
+	free(leaf_start);
+	free(all);
+	free(dentries);
+	return retstat;
+}
+
+/*
+ * Read the entries of directory @inode_data into @dentries, which has
+ * room for size / VRS_DENTRY_SIZE entries.  Returns how many were read,
+ * or -ENOMEM.
+ */
+int read_dentries(vrs_inode_t *inode_data, vrs_dentry_t* dentries) {
+	if (!S_ISDIR(inode_data->mode)) {
+	    log_msg("\n Invalid inode number %d, not a directory", inode_data->ino);
+	    return 0;
+	}
+
+	int num_entries = (inode_data->size / VRS_DENTRY_SIZE);
+	int num_blocks = (inode_data->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (num_blocks > inode_data->nblocks) {
+		num_blocks = inode_data->nblocks;
+	}
+	if (num_entries > num_blocks * (BLOCK_SIZE / VRS_DENTRY_SIZE)) {
+		num_entries = num_blocks * (BLOCK_SIZE / VRS_DENTRY_SIZE);
+	}
+
+	if (num_blocks == 0) {
+		return 0;
+	}
+
+	// Read all dentry blocks in one go, then unpack the entries
+	char *buffer = malloc(num_blocks * BLOCK_SIZE);
+	block_vec_t *vec = malloc(num_blocks * sizeof(block_vec_t));
+	uint32_t *pblks = malloc(num_blocks * sizeof(uint32_t));
+	if ((buffer == NULL) || (vec == NULL) || (pblks == NULL)
+			|| (inode_bmap_range(inode_data, 0, num_blocks, pblks) < 0)) {
+		free(buffer);
+		free(vec);
+		free(pblks);
+		return -ENOMEM;
+	}
+
+	int i = 0;
+	for (i = 0; i < num_blocks; ++i) {
+		vec[i].block_num = VRS_BLOCK_DATA + pblks[i];
+		vec[i].buf = buffer + i * BLOCK_SIZE;
+	}
+
+	block_readv(vec, num_blocks);
+	free(pblks);
+	free(vec);
+
+	int count = 0;
+	if (inode_data->flags & VRS_INODE_INDEXED) {
+		// Skip the index blocks and the free slots of the leaves
+		for (i = 1; i < num_blocks; ++i) {
+			char *block = buffer + i * BLOCK_SIZE;
+			if (dx_is_index(block)) {
+				continue;
+			}
+
+			int slot = 0;
+			for (slot = 0; slot < BLOCK_SIZE / VRS_DENTRY_SIZE; ++slot) {
+				if (((vrs_dentry_t *)(block + slot * VRS_DENTRY_SIZE))->name_len != 0) {
+					memcpy(dentries + count++, block + slot * VRS_DENTRY_SIZE, sizeof(vrs_dentry_t));
+				}
+			}
+		}
+	} else {
+		log_msg("\n read_dentries num_entries=%d", num_entries);
+		for (i = 0; i < num_entries; ++i) {
+			memcpy(dentries + i, buffer + i * VRS_DENTRY_SIZE, sizeof(vrs_dentry_t));
+		}
+		count = num_entries;
+	}
+
+	free(buffer);
+	return count;
+}
+
+typedef struct {
+	uint64_t key;
+	vrs_dentry_t dentry;
+} dentry_keyed_t;
+
+typedef struct {
+	dentry_keyed_t *all;
+	int count;
+	int size;
+} dentry_keyed_list_t;
+
+static int dentry_keyed_cmp(const void *a, const void *b) {
+	uint64_t ka = ((const dentry_keyed_t *)a)->key;
+	uint64_t kb = ((const dentry_keyed_t *)b)->key;
+	return (ka > kb) - (ka < kb);
+}
+
+/* Add the entries of the first @nslots slots of @block keyed @from or above to @list */
+static int dentry_keyed_collect(dentry_keyed_list_t *list, const char *block, uint32_t nslots, uint64_t from) {
+	uint32_t slot = 0;
+	for (slot = 0; slot < nslots; ++slot) {
+		const vrs_dentry_t *dentry = (const vrs_dentry_t *)(block + slot * VRS_DENTRY_SIZE);
+		uint64_t key = dentry_key(dentry);
+		if ((dentry->name_len == 0) || (key < from)) {
+			continue;
+		}
+
+		if (list->count == list->size) {
+			int size = (list->size == 0) ? (BLOCK_SIZE / VRS_DENTRY_SIZE) : (2 * list->size);
+			dentry_keyed_t *all = realloc(list->all, size * sizeof(dentry_keyed_t));
+			if (all == NULL) {
+				return -ENOMEM;
+			}
+			list->all = all;
+			list->size = size;
+		}
+		list->all[list->count].key = key;
+		list->all[list->count].dentry = *dentry;
+		++list->count;
+	}
+
+	return 0;
+}
+
+/* Hand the entries of @list to @actor in key order, then empty it */
+static int dentry_keyed_emit(dentry_keyed_list_t *list, vrs_dentry_actor actor, void *arg) {
+	int retstat = 0;
+	int i = 0;
+	if (list->count > 1) {
+		qsort(list->all, list->count, sizeof(dentry_keyed_t), dentry_keyed_cmp);
+	}
+	for (i = 0; (i < list->count) && (retstat == 0); ++i) {
+		retstat = actor(arg, &list->all[i].dentry, list->all[i].key);
+	}
+	list->count = 0;
+
+	return retstat;
+}
+
+/* iterate_dentries() for an indexed directory, one leaf at a time in hash order */
+static int dx_iterate(vrs_inode_t *dir, uint64_t from, vrs_dentry_actor actor, void *arg) {
+	dx_frame_t frames[VRS_DX_MAX_LEVELS + 2];
+	dentry_keyed_list_t list = { NULL, 0, 0 };
+	int depth = 0;
+	int retstat = 0;
+	char *buffer = malloc(BLOCK_SIZE);
+	if (buffer == NULL) {
+		return -ENOMEM;
+	}
+	uint32_t leaf = dx_walk(dir, (uint32_t)(from >> VRS_DENTRY_KEY_LOW_BITS), frames, &depth);
+	if (leaf == VRS_INVALID_BLOCK_NO) {
+		free(buffer);
+		return -ENOMEM;
+	}
+
+	// Leaves cover ascending hash ranges, and equal hashes share a leaf
+	while ((retstat == 0) && (leaf != VRS_INVALID_BLOCK_NO)) {
+		dir_read_block(dir, leaf, buffer);
+		retstat = dentry_keyed_collect(&list, buffer, BLOCK_SIZE / VRS_DENTRY_SIZE, from);
+		if (retstat == 0) {
+			retstat = dentry_keyed_emit(&list, actor, arg);
+		}
+		leaf = dx_next_leaf(dir, frames, depth);
+	}
+
+	dx_free_frames(frames, depth);
+	free(list.all);
+	free(buffer);
+	return retstat;
+}
+
+/*
+ * Call @actor for every entry of @dir whose key (dentry_key()) is @from
+ * or above, in key order, until it returns non-zero.  The key is passed
+ * along so the caller can resume after it; keys stay put whatever is
+ * added or removed meanwhile.  An indexed directory is walked one leaf at
+ * a time, a flat one (a few blocks) read in batches of blocks and sorted
+ * as a whole.  Returns the actor's stop value, 0 once every entry was
+ * seen, or -ENOMEM.
+ */
+int iterate_dentries(vrs_inode_t *dir, uint64_t from, vrs_dentry_actor actor, void *arg) {
+	if (!S_ISDIR(dir->mode)) {
+		log_msg("\n Invalid inode number %d, not a directory", dir->ino);
+		return 0;
+	}
+	if (dir->flags & VRS_INODE_INDEXED) {
+		return dx_iterate(dir, from, actor, arg);
+	}
+
+	uint32_t per_block = BLOCK_SIZE / VRS_DENTRY_SIZE;
+	uint32_t num_entries = dir->size / VRS_DENTRY_SIZE;
+	uint32_t num_blocks = (dir->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (num_blocks > dir->nblocks) {
+		num_blocks = dir->nblocks;
+	}
+
+	dentry_keyed_list_t list = { NULL, 0, 0 };
+	char *buffer = malloc(VRS_DENTRY_BATCH * BLOCK_SIZE);
+	block_vec_t vec[VRS_DENTRY_BATCH];
+	uint32_t pblks[VRS_DENTRY_BATCH];
+	int retstat = 0;
+	if (buffer == NULL) {
+		return -ENOMEM;
+	}
+
+	uint32_t lblk = 0;
+	while ((retstat == 0) && (lblk < num_blocks)) {
+		uint32_t count = num_blocks - lblk;
+		if (count > VRS_DENTRY_BATCH) {
+			count = VRS_DENTRY_BATCH;
+		}
+		if (inode_bmap_range(dir, lblk, count, pblks) < 0) {
+			retstat = -ENOMEM;
+			break;
+		}
+
+		uint32_t i = 0;
+		for (i = 0; i < count; ++i) {
+			vec[i].block_num = VRS_BLOCK_DATA + pblks[i];
+			vec[i].buf = buffer + i * BLOCK_SIZE;
+		}
+		block_readv(vec, count);
+
+		for (i = 0; (i < count) && (retstat == 0); ++i, ++lblk) {
+			uint32_t nslots = num_entries - lblk * per_block;
+			if (nslots > per_block) {
+				nslots = per_block;
+			}
+			retstat = dentry_keyed_collect(&list, buffer + i * BLOCK_SIZE, nslots, from);
+		}
+	}
+	if (retstat == 0) {
+		retstat = dentry_keyed_emit(&list, actor, arg);
+	}
+
+	free(list.all);
+	free(buffer);
+	return retstat;
+}
+
+void free_ino(uint32_t ino) {
+	if (ino < VRS_NINODES) {
+		if (alloc_put(&VRS_DATA->inode_alloc, ino) == 0) {
+			log_msg("\nSuccess: Inode %d freed", ino);
+		} else {
+			log_msg("\nError: Inode %d already free", ino);
+		}
+	}
+}
+
+uint32_t get_ino() {
+	uint32_t ino = alloc_get(&VRS_DATA->inode_alloc);
+	if (ino >= VRS_NINODES) {
+		log_msg("\nError: Inode limit reached!!!");
+		return VRS_INVALID_INO;
+	}
+
+	log_msg("\nSuccess: Free ino found = %d", ino);
+	return ino;
+}
+
+/* The block becomes free once the operation freeing it is committed */
+void free_block_no(uint32_t b_no) {
+	if (b_no < VRS_NBLOCKS_DATA) {
+		journal_free_block(b_no);
+		log_msg("\nSuccess: Data block %d freed", b_no);
+	}
+}
+
+uint32_t get_block_no() {
+	uint32_t b_no = alloc_get(&VRS_DATA->block_alloc);
+	if (b_no >= VRS_NBLOCKS_DATA) {
+		log_msg("\nError: Data blocks limit reached!!!");
+		return VRS_INVALID_BLOCK_NO;
+	}
+
+	log_msg("\nSuccess: Free data block found = %d", b_no);
+	return b_no;
+}
+
+uint32_t get_block_run(uint32_t ino, uint32_t goal, uint32_t count, uint32_t *run_len) {
+	*run_len = 0;
+	vrs_prealloc *window = VRS_DATA->prealloc + ino;
+
+	// Carry on from the file's preallocation window if it follows the goal
+	if ((window->len > 0) && (window->start == goal)) {
+		uint32_t len = (count < window->len) ? count : window->len;
+		window->start += len;
+		window->len -= len;
+		*run_len = len;
+
+		log_msg("\nget_block_run %d blocks at %d from the window of ino %d", len, goal, ino);
+		return goal;
+	}
+
+	release_prealloc(ino);
+
+	uint32_t len = 0;
+	uint32_t b_no = alloc_get_run(&VRS_DATA->block_alloc, goal, count + VRS_DATA->prealloc_blocks, &len);
+	if (b_no >= VRS_NBLOCKS_DATA) {
+		log_msg("\nError: Data blocks limit reached!!!");
+		return VRS_INVALID_BLOCK_NO;
+	}
+
+	// Whatever we got beyond @count becomes the new window
+	if (len > count) {
+		window->start = b_no + count;
+		window->len = len - count;
+		len = count;
+	}
+
+	*run_len = len;
+	return b_no;
+}
+
+void release_prealloc(uint32_t ino) {
+	vrs_prealloc *window = VRS_DATA->prealloc + ino;
+	while (window->len > 0) {
+		alloc_put(&VRS_DATA->block_alloc, window->start);
+		++window->start;
+		--window->len;
+	}
+}
+
+/*
+ * The on-disk bitmaps are changed a bit at a time by reading, changing and
+ * writing back a whole block, which two threads must not do at once.  The
+ * lock also covers the buffer the block is changed in.
+ */
+static pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static char bitmap_buffer[BLOCK_SIZE_MAX];
+
+void update_inode_bitmap(uint32_t ino, int used) {
+	char *buffer = bitmap_buffer;
+	uint32_t bits_per_block = BLOCK_SIZE * 8;
+	pthread_mutex_lock(&bitmap_lock);
+	block_read(VRS_BLOCK_INODE_BITMAP + ino / bits_per_block, buffer);
+	if (used) {
+		bitmap_set(buffer, ino % bits_per_block);
+	} else {
+		bitmap_clear(buffer, ino % bits_per_block);
+	}
+	block_write(VRS_BLOCK_INODE_BITMAP + ino / bits_per_block, buffer);
+	pthread_mutex_unlock(&bitmap_lock);
+
+	log_msg("\nupdate_inode_bitmap Successful update");
+}
+
+void update_block_bitmap(uint32_t bno, int used) {
+	char *buffer = bitmap_buffer;
+	uint32_t bits_per_block = BLOCK_SIZE * 8;
+	pthread_mutex_lock(&bitmap_lock);
+	block_read(VRS_BLOCK_DATA_BITMAP + bno / bits_per_block, buffer);
+	if (used) {
+		bitmap_set(buffer, bno % bits_per_block);
+	} else {
+		bitmap_clear(buffer, bno % bits_per_block);
+	}
+	block_write(VRS_BLOCK_DATA_BITMAP + bno / bits_per_block, buffer);
+	pthread_mutex_unlock(&bitmap_lock);
+
+	log_msg("\nupdate_block_bitmap Successful update");
+}
+
+void update_block_bitmap_run(uint32_t bno, uint32_t count, int used) {
+	char *buffer = bitmap_buffer;
+	uint32_t bits_per_block = BLOCK_SIZE * 8;
+	pthread_mutex_lock(&bitmap_lock);
+	while (count > 0) {
+		uint32_t bitmap_block = bno / bits_per_block;
+		block_read(VRS_BLOCK_DATA_BITMAP + bitmap_block, buffer);
+		while ((count > 0) && (bno / bits_per_block == bitmap_block)) {
+			if (used) {
+				bitmap_set(buffer, bno % bits_per_block);
+			} else {
+				bitmap_clear(buffer, bno % bits_per_block);
+			}
+			++bno;
+			--count;
+		}
+		block_write(VRS_BLOCK_DATA_BITMAP + bitmap_block, buffer);
+	}
+	pthread_mutex_unlock(&bitmap_lock);
+
+	log_msg("\nupdate_block_bitmap_run Successful update");
+}
+
+/*
+ * Only the cached copy is changed, the inode table is written back by
+ * icache_flush().  Returns 0, or -ENOMEM if the inode could not be cached.
+ */
+int update_inode_data(uint32_t ino, vrs_inode_t *inode) {
+	inode->mtime = time(NULL);
+
+	if (icache_write(&VRS_DATA->icache, ino, inode, sizeof(vrs_inode_t)) < 0) {
+		log_msg("\nupdate_inode_data no memory to cache inode %d", ino);
+		return -ENOMEM;
+	}
+
+	log_msg("\nupdate_inode_data Successful update");
+	return 0;
+}
+
+void update_block_data(uint32_t bno, char* buffer) {
+	block_write(VRS_BLOCK_DATA + bno, buffer);
+
+	log_msg("\nupdate_block_data Successful update");
+}
+
+int create_dentry(const char *name, vrs_inode_t *inode, uint32_t ino_parent) {
+	log_msg("\ncreate_dentry path=%s ino = %d ino_parent=%d", name, inode->ino, ino_parent);
+	vrs_inode_t inode_parent;
+	get_inode(ino_parent, &inode_parent);
+
+	vrs_dentry_t dentry;
+	dentry_init(&dentry, name, inode->ino);
+
+	int retstat = 0;
+	int num_dentries = (inode_parent.size / VRS_DENTRY_SIZE);
+	int idx = num_dentries / (BLOCK_SIZE / VRS_DENTRY_SIZE);
+	int int_idx = num_dentries % (BLOCK_SIZE / VRS_DENTRY_SIZE);
+
+	// A flat directory that would outgrow the threshold gets indexed
+	if (!(inode_parent.flags & VRS_INODE_INDEXED) && (int_idx == 0) && (num_dentries != 0)
+			&& (inode_parent.nblocks >= VRS_DX_THRESHOLD)) {
+		if (dx_create_index(&inode_parent) < 0) {
+			log_msg("\ncreate_dentry could not index directory %d, it stays flat", ino_parent);
+		}
+	}
+
+	if (inode_parent.flags & VRS_INODE_INDEXED) {
+		retstat = dx_add(&inode_parent, &dentry);
+		inode_parent.size = inode_parent.nblocks * BLOCK_SIZE;
+	} else {
+		char *buffer = malloc(BLOCK_SIZE);
+		if (buffer == NULL) {
+			return -ENOMEM;
+		}
+		if ((int_idx == 0) && (num_dentries != 0)) {
+			if (dir_append_block(&inode_parent) == VRS_INVALID_BLOCK_NO) {
+				free(buffer);
+				return -ENOSPC;
+			}
+		}
+
+		dir_read_block(&inode_parent, idx, buffer);
+		memcpy(buffer + (int_idx * VRS_DENTRY_SIZE), &dentry, sizeof(vrs_dentry_t));
+		dir_write_block(&inode_parent, idx, buffer);
+		free(buffer);
+
+		inode_parent.size += VRS_DENTRY_SIZE;
+	}
+
+	if ((update_inode_data(inode_parent.ino, &inode_parent) < 0) && (retstat == 0)) {
+		retstat = -ENOMEM;
+	}
+
+	if (retstat == 0) {
+		dcache_add(&VRS_DATA->dcache, ino_parent, name, inode->ino);
+	}
+
+	return retstat;
+}
+
+int remove_dentry(const char *name, vrs_inode_t *inode, uint32_t ino_parent) {
+	vrs_inode_t inode_parent;
+	get_inode(ino_parent, &inode_parent);
+	if (!S_ISDIR(inode_parent.mode)) {
+		log_msg("\n Invalid inode number %d, not a directory", inode_parent.ino);
+		return -ENOTDIR;
+	}
+
+	if (inode_parent.flags & VRS_INODE_INDEXED) {
+		int retstat = dx_remove(&inode_parent, name);
+		if (retstat == 0) {
+			retstat = update_inode_data(inode_parent.ino, &inode_parent);
+			dcache_add_negative(&VRS_DATA->dcache, inode_parent.ino, name);
+		}
+		return retstat;
+	}
+
+	// Flat directories stay dense: the last entry moves into the hole
+	int per_block = BLOCK_SIZE / VRS_DENTRY_SIZE;
+	int total_entries = (inode_parent.size / VRS_DENTRY_SIZE);
+	uint32_t hash = dentry_hash(name);
+	char *buffer = malloc(2 * BLOCK_SIZE);
+	if (buffer == NULL) {
+		return -ENOMEM;
+	}
+	char *buffer_last = buffer + BLOCK_SIZE;
+	int i = 0;
+	for (i = 0; i < total_entries; i += per_block) {
+		dir_read_block(&inode_parent, i / per_block, buffer);
+		int nslots = (total_entries - i < per_block) ? (total_entries - i) : per_block;
+		int slot = dentry_block_find(buffer, nslots, name, hash);
+		if (slot < 0) {
+			continue;
+		}
+		i += slot;
+
+		log_msg("\nEntry to be deleted found");
+		int last = total_entries - 1;
+		if (last != i) {
+			dir_read_block(&inode_parent, last / per_block, buffer_last);
+			memcpy(buffer + (i % per_block) * VRS_DENTRY_SIZE, buffer_last + (last % per_block) * VRS_DENTRY_SIZE, VRS_DENTRY_SIZE);
+			dir_write_block(&inode_parent, i / per_block, buffer);
+		}
+
+		// The first block always stays, even when empty
+		if ((last % per_block == 0) && (last != 0)) {
+			inode_bmap_truncate(&inode_parent, last / per_block);
+		}
+		inode_parent.size -= VRS_DENTRY_SIZE;
+
+		int retstat = update_inode_data(inode_parent.ino, &inode_parent);
+		dcache_add_negative(&VRS_DATA->dcache, inode_parent.ino, name);
+		log_msg("\n Item deleted successfully");
+		free(buffer);
+		return retstat;
+	}
+
+	free(buffer);
+	return -ENOENT;
 }
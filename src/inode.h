@@ -15,7 +15,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdint.h>
-#include <fuse.h>
+#include <pthread.h>
 
 #define VRS_NDIR_BLOCKS		12 						// Number of direct blocks
 #define VRS_IND_BLOCK		VRS_NDIR_BLOCKS 		// Index of indirect block
@@ -23,23 +23,34 @@
 #define VRS_TIND_BLOCK		(VRS_DIND_BLOCK + 1) 	// Index of Triple indirect block
 #define VRS_N_BLOCKS		(VRS_TIND_BLOCK + 1) 	// Total number of blocks
 
-#define VRS_NIND_BLOCKS		(BLOCK_SIZE / 4) 					// 128 Blocks = 64KB
-#define VRS_NDIND_BLOCKS 	((BLOCK_SIZE / 4) * VRS_NIND_BLOCKS) // 16384 Blocks = 8MB
-#define VRS_NTIND_BLOCKS 	((BLOCK_SIZE / 4) * VRS_NDIND_BLOCKS) // 2097152 blocks = 1GB
+#define VRS_NIND_BLOCKS		(BLOCK_SIZE / 4) 					// 128 Blocks with 512B blocks, 1024 with 4KB
+#define VRS_NDIND_BLOCKS 	((uint64_t)VRS_NIND_BLOCKS * VRS_NIND_BLOCKS) // 16384 Blocks = 8MB with 512B blocks
+#define VRS_NTIND_BLOCKS 	((uint64_t)VRS_NIND_BLOCKS * VRS_NDIND_BLOCKS) // 2097152 blocks = 1GB with 512B blocks
 
-#define VRS_NINODES 256 // Max number of inodes/files
+// Largest file the block tree can map, capped by the 32 bit size field
+#define VRS_MAX_FILE_BLOCKS	(VRS_NDIR_BLOCKS + VRS_NIND_BLOCKS + VRS_NDIND_BLOCKS + VRS_NTIND_BLOCKS)
+#define VRS_MAX_FILE_SIZE	((off_t)(VRS_MAX_FILE_BLOCKS * BLOCK_SIZE < UINT32_MAX ? VRS_MAX_FILE_BLOCKS * BLOCK_SIZE : UINT32_MAX))
+
+#define VRS_NINODES_DEFAULT 256 // Max number of inodes/files on a new disk
+#define VRS_DATA_SIZE_DEFAULT (2ULL * 1024 * 1024 * 1024) // Size of the data area on a new disk, 2GB
+#define VRS_PREALLOC_DEFAULT 16 // Blocks preallocated past the end of a growing file
 #define VRS_INODE_SIZE 128 // Size in bytes of inode struct, below mentioned struct should be < 128bytes
-#define VRS_NBLOCKS_INODE (VRS_NINODES / (BLOCK_SIZE / VRS_INODE_SIZE)) // Number of blocks for inodes = 64
-#define VRS_NBLOCKS_DATA (VRS_NINODES * VRS_NDIND_BLOCKS) // Enough blocks to at least accommodate double indirection
 
-#define VRS_NBLOCKS_INODE_BITMAP 1 // Can store 512*8 inodes (More than enough for now)
-#define VRS_NBLOCKS_DATA_BITMAP (VRS_NBLOCKS_DATA / (BLOCK_SIZE * 8)) // 1024 blocks for this bitmap
+// Layout of the mounted disk, see vrs_compute_geometry()
+#define VRS_NINODES (VRS_DATA->geometry.ninodes)
+#define VRS_NBLOCKS_INODE (VRS_DATA->geometry.nblocks_inode)
+#define VRS_NBLOCKS_DATA (VRS_DATA->geometry.nblocks_data)
+#define VRS_NBLOCKS_JOURNAL (VRS_DATA->geometry.nblocks_journal)
+
+#define VRS_NBLOCKS_INODE_BITMAP (VRS_DATA->geometry.nblocks_inode_bitmap)
+#define VRS_NBLOCKS_DATA_BITMAP (VRS_DATA->geometry.nblocks_data_bitmap)
 
-#define VRS_BLOCK_SUPERBLOCK 0 // 0
-#define VRS_BLOCK_INODE_BITMAP (VRS_BLOCK_SUPERBLOCK + 1) // Only 1 super block. = 1
-#define VRS_BLOCK_DATA_BITMAP (VRS_BLOCK_INODE_BITMAP + VRS_NBLOCKS_INODE_BITMAP) // = 2
-#define VRS_BLOCK_INODES (VRS_BLOCK_DATA_BITMAP + VRS_NBLOCKS_DATA_BITMAP) // 2 + 1024 = 1026
-#define VRS_BLOCK_DATA (VRS_BLOCK_INODES + VRS_NBLOCKS_INODE) // 1026 + 64
+#define VRS_BLOCK_SUPERBLOCK 0 // Always the first block, its first 512 bytes hold the superblock
+#define VRS_BLOCK_JOURNAL (VRS_DATA->geometry.block_journal)
+#define VRS_BLOCK_INODE_BITMAP (VRS_DATA->geometry.block_inode_bitmap)
+#define VRS_BLOCK_DATA_BITMAP (VRS_DATA->geometry.block_data_bitmap)
+#define VRS_BLOCK_INODES (VRS_DATA->geometry.block_inodes)
+#define VRS_BLOCK_DATA (VRS_DATA->geometry.block_data)
 
 #define VRS_MAX_LENGTH_FILE_NAME 32
 #define VRS_DENTRY_SIZE 64
@@ -52,32 +63,190 @@ typedef struct __attribute__((packed)) {
 	uint32_t	mode;	/* Flags related to file mode (Dir/file/link)*/
     uint32_t   	nlink;   /* number of hard links */
     uint32_t    size;    /* total size, in bytes */
-    uint32_t  	nblocks;  /* number of 512B blocks allocated */
+    uint32_t  	nblocks;  /* number of blocks allocated */
     uint32_t    atime;   /* time of last access */
     uint32_t   	mtime;   /* time of last modification */
     uint32_t    ctime;   /* time of last status change */
-	uint32_t 	blocks[VRS_N_BLOCKS]; 	/* Size  = 4 * 15 = 60 bytes */
+    uint32_t	flags;	/* VRS_INODE_* format flags */
+    uint32_t	generation;	/* Bumped each time the inode number is reused */
+	uint32_t 	blocks[VRS_N_BLOCKS]; 	/* Size  = 4 * 15 = 60 bytes, block pointers or the extent tree root */
 } vrs_inode_t;
 
+#define VRS_INODE_EXTENTS	0x1 // blocks[] holds an extent tree instead of block pointers
+#define VRS_INODE_INDEXED	0x2 // Directory with a hash index rooted in its first block
+#define VRS_INODE_ORPHAN	0x4 // Removed while in use, freed once unused or at the next mount
+
+/* Header of every extent tree node, followed by its entries */
+typedef struct __attribute__((packed)) {
+	uint16_t	count;	/* entries in use */
+	uint16_t	max;	/* entries that fit in the node */
+	uint16_t	depth;	/* 0 for leaves, which hold extents */
+	uint16_t	unused;
+} vrs_extent_header_t;
+
+/* Leaf entry: a run of logical blocks stored in consecutive data blocks */
+typedef struct __attribute__((packed)) {
+	uint32_t	lblk;	/* first logical block */
+	uint32_t	start;	/* first data block */
+	uint32_t	len;	/* number of blocks */
+} vrs_extent_t;
+
+/* Interior entry: a child node and the first logical block it maps */
+typedef struct __attribute__((packed)) {
+	uint32_t	lblk;	/* first logical block below the child */
+	uint32_t	node;	/* data block holding the child */
+	uint32_t	unused;
+} vrs_extent_idx_t;
+
+#define VRS_EXTENTS_INLINE ((VRS_N_BLOCKS * 4 - sizeof(vrs_extent_header_t)) / sizeof(vrs_extent_t)) // 4 in the inode
+#define VRS_EXTENTS_PER_BLOCK ((BLOCK_SIZE - sizeof(vrs_extent_header_t)) / sizeof(vrs_extent_t)) // 42 with 512B blocks, 340 with 4KB
+
+/*
+ * A directory entry fills one VRS_DENTRY_SIZE slot.  The name hash and
+ * length let lookups skip most names without touching them; a free slot
+ * has name_len 0.  inode_number stays first so that a leaf can never be
+ * mistaken for an index block.
+ */
 typedef struct __attribute__((packed)) {
 	uint32_t inode_number;
+	uint32_t hash;                       /* dentry_hash() of the name */
+	uint8_t name_len;
 	char name[VRS_MAX_LENGTH_FILE_NAME]; /* File name */
 } vrs_dentry_t;
 
+#define VRS_DX_MAGIC 0xD1D1D1D1u // Starts every directory index block, never a valid inode number
+#define VRS_DX_THRESHOLD 4 // Blocks a flat directory may use before it gets indexed
+#define VRS_DX_MAX_LEVELS 3 // Index levels below the root
+
+/* Header of a directory index block, followed by its entries */
+typedef struct __attribute__((packed)) {
+	uint32_t	magic;	/* VRS_DX_MAGIC */
+	uint16_t	count;	/* entries in use */
+	uint16_t	limit;	/* entries that fit in the block */
+	uint16_t	levels;	/* root only: index levels below it */
+	uint16_t	unused;
+} vrs_dx_header_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t	hash;	/* lowest name hash below this entry */
+	uint32_t	block;	/* directory block of the child */
+} vrs_dx_entry_t;
+
+#define VRS_DX_LIMIT ((BLOCK_SIZE - sizeof(vrs_dx_header_t)) / sizeof(vrs_dx_entry_t)) // 62 with 512B blocks
+
+void vrs_compute_geometry(vrs_geometry *geometry, uint32_t block_size, uint32_t ninodes, uint32_t nblocks_data,
+		uint32_t nblocks_journal);
+
 uint32_t path_2_ino(const char* path);
 
+/*
+ * Every inode has a reader/writer lock.  Reading a file or searching a
+ * directory takes it shared, changing the inode or its blocks takes it
+ * exclusive.  To keep threads from deadlocking:
+ *  - a directory is locked before an inode it names, which is how
+ *    create_inode_at() and remove_inode_at() go about it;
+ *  - no other two inodes are ever held at once, path walks let go of
+ *    each directory before looking in the next;
+ *  - the allocators, the inode, dentry and block caches and the bitmap
+ *    blocks have locks of their own, only held within their calls and
+ *    never while waiting for an inode lock.
+ * Operations that change metadata join the journal's running transaction
+ * (journal_begin()) before taking any inode lock, and leave it after.
+ * The functions taking a path or an inode number lock for themselves.
+ * Those taking a vrs_inode_t expect the caller to hold its lock, the
+ * front-ends only call them through file_read(), file_write() and, for
+ * directories, with the lock taken around iterate_dentries().
+ */
+int inode_locks_init(void);
+
+void inode_locks_destroy(void);
+
+void inode_lock_shared(uint32_t ino);
+
+void inode_lock(uint32_t ino);
+
+void inode_unlock(uint32_t ino);
+
+int inode_exists(uint32_t ino);
+
 void get_inode(uint32_t ino, vrs_inode_t *inode_data);
 
-uint32_t create_inode(const char *path, mode_t mode);
+int create_inode(const char *path, mode_t mode, uint32_t *ino);
 
 int remove_inode(const char *path);
 
-int write_inode(vrs_inode_t *inode_data, const char* buffer, int size, int offset);
+int remove_directory(const char *path);
 
-int read_inode(vrs_inode_t *inode_data, char* buffer, int size, int offset);
+int create_inode_at(uint32_t ino_parent, const char *name, mode_t mode, uint32_t *ino);
+
+int remove_inode_at(uint32_t ino_parent, const char *name, int dir);
+
+uint32_t path_2_ino_internal(const char *path, uint32_t ino_parent);
+
+int dir_is_empty(vrs_inode_t *dir);
+
+int write_inode(vrs_inode_t *inode_data, const char* buffer, int size, off_t offset);
+
+int read_inode(vrs_inode_t *inode_data, char* buffer, int size, off_t offset);
 
 void fill_stat_from_ino(const vrs_inode_t* inode, struct stat *statbuf);
 
-void read_dentries(vrs_inode_t *inode_data, vrs_dentry_t* dentries);
+int read_dentries(vrs_inode_t *inode_data, vrs_dentry_t* dentries);
+
+/* Directory blocks iterate_dentries() reads at once */
+#define VRS_DENTRY_BATCH 8
+
+/* Readdir keys are the name hash followed by this many bits of another hash */
+#define VRS_DENTRY_KEY_LOW_BITS 30
+
+/* Called by iterate_dentries() for each entry; non-zero stops the walk */
+typedef int (*vrs_dentry_actor)(void *arg, const vrs_dentry_t *dentry, uint64_t key);
+
+int iterate_dentries(vrs_inode_t *dir, uint64_t from, vrs_dentry_actor actor, void *arg);
+
+void release_prealloc(uint32_t ino);
+
+#define VRS_READAHEAD_MIN 4  // Blocks read ahead once reads turn sequential
+#define VRS_READAHEAD_MAX 64 // Largest readahead window in blocks
+
+/* An open file or directory, kept in fuse_file_info->fh */
+typedef struct {
+	uint32_t ino;
+	uint64_t ra_next;	/* Offset a sequential read would start at */
+	uint32_t ra_blocks;	/* Readahead window, 0 while reads look random */
+	uint32_t ra_end;	/* First block not read ahead yet */
+	pthread_mutex_t ra_lock; /* Protects the readahead state, reads of a file run in parallel */
+	int readdir_error;	/* Error a readdir hit after listing entries, for the next one */
+} vrs_file_t;
+
+int open_inode(uint32_t ino, vrs_file_t **file);
+
+void close_inode(vrs_file_t *file);
+
+int release_orphans(void);
+
+int lookup_inode_at(uint32_t ino_parent, const char *name, vrs_inode_t *inode_data);
+
+int inode_ref(uint32_t ino, vrs_inode_t *inode_data);
+
+void inode_forget(uint32_t ino, uint64_t nlookup);
+
+int file_read(vrs_file_t *file, char *buffer, size_t size, off_t offset);
+
+int file_write(vrs_file_t *file, const char *buffer, size_t size, off_t offset);
+
+void file_readahead(vrs_file_t *file, vrs_inode_t *inode, off_t offset, size_t size);
+
+void inode_bmap_init(vrs_inode_t *inode, uint32_t flags, uint32_t first_block);
+
+uint32_t inode_bmap(vrs_inode_t *inode, uint32_t lblk);
+
+int inode_bmap_range(vrs_inode_t *inode, uint32_t lblk, uint32_t count, uint32_t *pblks);
+
+int inode_bmap_set_run(vrs_inode_t *inode, uint32_t lblk, uint32_t pblk, uint32_t count);
+
+void inode_bmap_truncate(vrs_inode_t *inode, uint32_t nblocks);
+
+void inode_free_blocks(vrs_inode_t *inode);
 
 #endif /* SRC_INODE_H_ */
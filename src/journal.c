@@ -0,0 +1,707 @@
+/*
+ * journal.c
+ *
+ * Write-ahead metadata journal, see journal.h.
+ */
+
+#include "config.h"
+#include "params.h"
+#include "block.h"
+#include "inode.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+#include "journal.h"
+#include "log.h"
+
+#define JOURNAL_IO_BLOCKS 64 // Blocks read at a time during replay
+#define JOURNAL_CHECKSUM_SEED 2166136261u
+
+static uint32_t journal_start;		// Block of the journal header
+static uint32_t journal_nblocks;	// 0 with the journal off
+static uint32_t journal_head;		// Where the next transaction goes, from journal_start
+static uint32_t journal_tid;		// Running transaction, also its sequence number
+static unsigned int durability;		// VRS_DURABILITY_*
+static unsigned int commit_ms;		// Interval of periodic commits
+
+// Operations in the running transaction.  A commit raises the barrier,
+// which holds off new operations, and waits for these to end.
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handle_cond = PTHREAD_COND_INITIALIZER;
+static int handles;
+static int barrier;
+static uint32_t commits;		// Commits started so far
+
+// Taken by a commit from start to end, so they do not overlap
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static int commit_status;		// Of the last commit, under commit_lock
+
+/*
+ * Data blocks freed by the running transaction go back to the allocator
+ * once it is committed, so they are not written over before the disk
+ * says they are free.  Blocks with a copy in the journal wait for the
+ * next checkpoint instead, or replaying the copy could overwrite what
+ * they were reused for.
+ */
+typedef struct {
+	uint32_t *bnos;
+	uint32_t count;
+	uint32_t size;
+} block_list;
+
+static block_list frees_running;	// Under handle_lock
+static block_list frees_checkpoint;	// Under commit_lock
+static uint64_t *logged;		// Data blocks with a copy in the journal, under commit_lock
+
+static pthread_t committer;
+static int committer_running;
+static int committer_stop;
+static int commit_wanted;
+static pthread_mutex_t committer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t committer_wake = PTHREAD_COND_INITIALIZER;
+
+static int block_list_add(block_list *list, uint32_t bno) {
+	if (list->count == list->size) {
+		uint32_t size = (list->size == 0) ? 64 : (list->size * 2);
+		uint32_t *bnos = realloc(list->bnos, size * sizeof(uint32_t));
+		if (bnos == NULL) {
+			return -1;
+		}
+		list->bnos = bnos;
+		list->size = size;
+	}
+
+	list->bnos[list->count++] = bno;
+	return 0;
+}
+
+static void block_list_release(block_list *list) {
+	uint32_t i = 0;
+	for (i = 0; i < list->count; ++i) {
+		alloc_put(&VRS_DATA->block_alloc, list->bnos[i]);
+	}
+	list->count = 0;
+}
+
+static uint32_t journal_checksum(uint32_t sum, const void *block) {
+	const uint32_t *word = block;
+	uint32_t i = 0;
+	for (i = 0; i < BLOCK_SIZE / sizeof(uint32_t); ++i) {
+		sum = (sum ^ word[i]) * 16777619u;
+	}
+
+	return sum;
+}
+
+/* Read @count blocks of the journal from @pos on, around the cache */
+static int journal_read(uint32_t pos, uint32_t count, char *buf) {
+	block_vec_t vec[JOURNAL_IO_BLOCKS];
+	uint32_t i = 0;
+	for (i = 0; i < count; ++i) {
+		vec[i].block_num = journal_start + pos + i;
+		vec[i].buf = buf + (size_t)i * BLOCK_SIZE;
+	}
+
+	return block_readv(vec, count);
+}
+
+static int journal_write_header(uint32_t seq) {
+	char *buffer = calloc(1, BLOCK_SIZE);
+	if (buffer == NULL) {
+		return -1;
+	}
+	vrs_journal_block_t *header = (vrs_journal_block_t *)buffer;
+	header->magic = VRS_JOURNAL_HEADER;
+	header->seq = seq;
+
+	block_vec_t vec = { journal_start, buffer };
+	int retstat = block_writev(&vec, 1);
+	free(buffer);
+	return retstat;
+}
+
+/*
+ * Check the transaction @seq starting at @pos.  @buf has room for
+ * JOURNAL_IO_BLOCKS blocks and a descriptor after them.  Returns the
+ * position of its commit block if it was committed whole, or 0.
+ */
+static uint32_t journal_scan(uint32_t pos, uint32_t seq, char *buf) {
+	char *desc = buf + (size_t)JOURNAL_IO_BLOCKS * BLOCK_SIZE;
+	vrs_journal_block_t *h = (vrs_journal_block_t *)desc;
+	uint32_t sum = JOURNAL_CHECKSUM_SEED;
+	uint32_t p = pos;
+
+	while (p < journal_nblocks) {
+		journal_read(p, 1, desc);
+		if (h->seq != seq) {
+			return 0;
+		}
+		if (h->magic == VRS_JOURNAL_COMMIT) {
+			return ((p > pos) && (h->count == p - pos) && (h->checksum == sum)) ? p : 0;
+		}
+		if ((h->magic != VRS_JOURNAL_DESC) || (h->count > VRS_JOURNAL_TAGS) ||
+		    (p + 1 + h->count >= journal_nblocks)) {
+			return 0;
+		}
+
+		sum = journal_checksum(sum, desc);
+		uint32_t done = 0;
+		while (done < h->count) {
+			uint32_t n = (h->count - done < JOURNAL_IO_BLOCKS) ? (h->count - done) : JOURNAL_IO_BLOCKS;
+			journal_read(p + 1 + done, n, buf);
+			uint32_t i = 0;
+			for (i = 0; i < n; ++i) {
+				sum = journal_checksum(sum, buf + (size_t)i * BLOCK_SIZE);
+			}
+			done += n;
+		}
+		p += 1 + h->count;
+	}
+
+	return 0;
+}
+
+/* Write the blocks of the transaction at @pos, checked by journal_scan(), to their place */
+static void journal_apply(uint32_t pos, uint32_t commit, char *buf) {
+	char *desc = buf + (size_t)JOURNAL_IO_BLOCKS * BLOCK_SIZE;
+	vrs_journal_block_t *h = (vrs_journal_block_t *)desc;
+	const uint32_t *tags = (const uint32_t *)(h + 1);
+	block_vec_t vec[JOURNAL_IO_BLOCKS];
+	uint32_t p = pos;
+
+	while (p < commit) {
+		journal_read(p, 1, desc);
+		uint32_t done = 0;
+		while (done < h->count) {
+			uint32_t n = (h->count - done < JOURNAL_IO_BLOCKS) ? (h->count - done) : JOURNAL_IO_BLOCKS;
+			journal_read(p + 1 + done, n, buf);
+
+			// Nothing is ever journaled over the journal itself
+			uint32_t i = 0, k = 0;
+			for (i = 0; i < n; ++i) {
+				uint32_t home = tags[done + i];
+				if ((home >= journal_start + journal_nblocks) && (home < VRS_BLOCK_DATA + VRS_NBLOCKS_DATA)) {
+					vec[k].block_num = home;
+					vec[k].buf = buf + (size_t)i * BLOCK_SIZE;
+					++k;
+				}
+			}
+			block_writev(vec, k);
+			done += n;
+		}
+		p += 1 + h->count;
+	}
+}
+
+/*
+ * Replay the transactions committed since the last checkpoint, and start
+ * the journal over.
+ */
+static int journal_replay(void) {
+	char *buf = malloc((size_t)(JOURNAL_IO_BLOCKS + 1) * BLOCK_SIZE);
+	if (buf == NULL) {
+		return -1;
+	}
+	char *header = buf + (size_t)JOURNAL_IO_BLOCKS * BLOCK_SIZE;
+	vrs_journal_block_t *h = (vrs_journal_block_t *)header;
+
+	journal_read(0, 1, header);
+	uint32_t seq = 1;
+	if (h->magic == VRS_JOURNAL_HEADER) {
+		seq = h->seq;
+	} else {
+		log_warn("\njournal_replay no journal header, starting over");
+	}
+
+	uint32_t pos = 1, replayed = 0;
+	for (;;) {
+		uint32_t commit = journal_scan(pos, seq, buf);
+		if (commit == 0) {
+			break;
+		}
+		journal_apply(pos, commit, buf);
+		pos = commit + 1;
+		++seq;
+		++replayed;
+	}
+	free(buf);
+	log_info("\njournal_replay %u transactions replayed, next %u", replayed, seq);
+
+	// What was replayed is in place before the header lets go of it
+	if ((replayed > 0) && (block_flush() < 0)) {
+		return -1;
+	}
+
+	journal_tid = seq;
+	journal_head = 1;
+	if ((journal_write_header(journal_tid) < 0) || (block_flush() < 0)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write transaction @tid, the @count blocks in @blocks, at the head of
+ * the journal and flush it.
+ */
+static int journal_write(uint32_t tid, const block_vec_t *blocks, uint32_t count) {
+	uint32_t ndesc = (count + VRS_JOURNAL_TAGS - 1) / VRS_JOURNAL_TAGS;
+	uint32_t len = ndesc + count + 1;
+	char *meta = calloc(ndesc + 1, BLOCK_SIZE);
+	block_vec_t *vec = malloc(len * sizeof(block_vec_t));
+	if ((meta == NULL) || (vec == NULL)) {
+		free(meta);
+		free(vec);
+		return -1;
+	}
+
+	uint32_t sum = JOURNAL_CHECKSUM_SEED;
+	uint32_t p = journal_head, k = 0, done = 0, d = 0;
+	for (d = 0; d < ndesc; ++d) {
+		char *desc = meta + (size_t)d * BLOCK_SIZE;
+		vrs_journal_block_t *h = (vrs_journal_block_t *)desc;
+		uint32_t *tags = (uint32_t *)(h + 1);
+		uint32_t n = (count - done < VRS_JOURNAL_TAGS) ? (count - done) : VRS_JOURNAL_TAGS;
+		h->magic = VRS_JOURNAL_DESC;
+		h->seq = tid;
+		h->count = n;
+
+		uint32_t i = 0;
+		for (i = 0; i < n; ++i) {
+			tags[i] = blocks[done + i].block_num;
+		}
+		sum = journal_checksum(sum, desc);
+		vec[k].block_num = journal_start + p++;
+		vec[k++].buf = desc;
+
+		for (i = 0; i < n; ++i) {
+			sum = journal_checksum(sum, blocks[done + i].buf);
+			vec[k].block_num = journal_start + p++;
+			vec[k++].buf = blocks[done + i].buf;
+		}
+		done += n;
+	}
+
+	vrs_journal_block_t *commit = (vrs_journal_block_t *)(meta + (size_t)ndesc * BLOCK_SIZE);
+	commit->magic = VRS_JOURNAL_COMMIT;
+	commit->seq = tid;
+	commit->count = len - 1;
+	commit->checksum = sum;
+	vec[k].block_num = journal_start + p;
+	vec[k++].buf = commit;
+
+	int retstat = block_writev(vec, k);
+	if (retstat == 0) {
+		retstat = block_flush();
+	}
+	if (retstat == 0) {
+		journal_head = p + 1;
+	}
+
+	free(vec);
+	free(meta);
+	return retstat;
+}
+
+/* Write everything committed in place and start the journal over */
+static int journal_do_checkpoint(void) {
+	int retstat = block_sync();
+	if (retstat == 0) {
+		retstat = block_flush();
+	}
+	if (retstat == 0) {
+		retstat = journal_write_header(journal_tid);
+	}
+	if (retstat == 0) {
+		retstat = block_flush();
+	}
+	if (retstat < 0) {
+		log_error("journal_do_checkpoint");
+		return retstat;
+	}
+
+	journal_head = 1;
+	block_list_release(&frees_checkpoint);
+	memset(logged, 0, (VRS_NBLOCKS_DATA + 63) / 64 * sizeof(uint64_t));
+	log_msg("\njournal_do_checkpoint next %u", journal_tid);
+
+	return 0;
+}
+
+/*
+ * Commit the running transaction, and checkpoint if @checkpoint is set or
+ * the journal is half used.  Called with commit_lock held.
+ */
+static int journal_commit_locked(int checkpoint) {
+	pthread_mutex_lock(&handle_lock);
+	++commits;
+	barrier = 1;
+	while (handles > 0) {
+		pthread_cond_wait(&handle_cond, &handle_lock);
+	}
+
+	// Inodes changed by the transaction go to the block cache first, then
+	// the blocks are copied as they are now
+	icache_flush(&VRS_DATA->icache);
+	uint32_t tid = journal_tid;
+	block_vec_t *blocks = NULL;
+	char *data = NULL;
+	int count = block_collect(tid, &blocks, &data);
+	block_list frees = frees_running;
+	memset(&frees_running, 0, sizeof(frees_running));
+	// Replay stops at the first number missing from the journal, so only
+	// a transaction that writes blocks takes one
+	if (count != 0) {
+		journal_tid = tid + 1;
+		block_set_transaction(journal_tid);
+	}
+
+	// A transaction too big for the journal, or one that could not be
+	// copied, is written in place with everything else at a checkpoint.
+	// It is not atomic then.
+	uint32_t len = (count > 0) ? ((count + VRS_JOURNAL_TAGS - 1) / VRS_JOURNAL_TAGS + count + 1) : 0;
+	int overflow = (count < 0) || (len > journal_nblocks - journal_head);
+	int in_place = checkpoint || overflow || (journal_head + len > journal_nblocks / 2);
+
+	// Unless it checkpoints, the commit lets new operations run while it
+	// writes the journal; their blocks stay pinned in the cache
+	if (!in_place) {
+		barrier = 0;
+		pthread_cond_broadcast(&handle_cond);
+	}
+	pthread_mutex_unlock(&handle_lock);
+
+	int retstat = 0;
+	if ((count > 0) && !overflow) {
+		retstat = journal_write(tid, blocks, count);
+		if (retstat < 0) {
+			log_error("journal_write");
+			overflow = 1;
+			in_place = 1;
+		}
+	}
+	if (overflow) {
+		log_warn("\njournal_commit transaction %u of %d blocks written in place", tid, count);
+	}
+
+	if ((count != 0) || (frees.count > 0)) {
+		int i = 0;
+		for (i = 0; !overflow && (i < count); ++i) {
+			uint32_t home = blocks[i].block_num;
+			if ((home >= VRS_BLOCK_DATA) && (home < VRS_BLOCK_DATA + VRS_NBLOCKS_DATA)) {
+				bitmap_set(logged, home - VRS_BLOCK_DATA);
+			}
+		}
+		if (count != 0) {
+			block_set_committed(tid);
+		}
+
+		uint32_t j = 0;
+		for (j = 0; j < frees.count; ++j) {
+			if (overflow || bitmap_test(logged, frees.bnos[j])) {
+				if (block_list_add(&frees_checkpoint, frees.bnos[j]) < 0) {
+					log_warn("\njournal_commit out of memory, block %u lost until remount", frees.bnos[j]);
+				}
+			} else {
+				alloc_put(&VRS_DATA->block_alloc, frees.bnos[j]);
+			}
+		}
+		log_msg("\njournal_commit transaction %u, %d blocks, %u freed", tid, count, frees.count);
+	}
+	free(frees.bnos);
+	free(blocks);
+	free(data);
+
+	if (in_place) {
+		if (journal_do_checkpoint() < 0) {
+			retstat = -1;
+		}
+
+		pthread_mutex_lock(&handle_lock);
+		barrier = 0;
+		pthread_cond_broadcast(&handle_cond);
+		pthread_mutex_unlock(&handle_lock);
+	}
+
+	return retstat;
+}
+
+/*
+ * Without a journal, write the metadata changed so far in place and flush
+ * it.  Called with commit_lock held.
+ */
+static int journal_write_in_place(void) {
+	pthread_mutex_lock(&handle_lock);
+	++commits;
+	pthread_mutex_unlock(&handle_lock);
+
+	icache_flush(&VRS_DATA->icache);
+	int retstat = block_sync();
+	if (retstat == 0) {
+		retstat = block_flush();
+	}
+	if (retstat < 0) {
+		log_error("journal_write_in_place");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Commit the running transaction and wait until it is on stable storage
+ *
+ * Callers that come in while a commit runs share the next one.  Must not
+ * be called between journal_begin() and journal_end().  Returns 0 on
+ * success, or -1 if it could not be written.
+ */
+int journal_commit(void) {
+	pthread_mutex_lock(&handle_lock);
+	uint32_t seen = commits;
+	pthread_mutex_unlock(&handle_lock);
+
+	// A commit started since we looked has taken all our changes along,
+	// and it is over once we hold the lock
+	pthread_mutex_lock(&commit_lock);
+	if (commits == seen) {
+		commit_status = (journal_nblocks != 0) ? journal_commit_locked(0) : journal_write_in_place();
+	}
+	int retstat = commit_status;
+	pthread_mutex_unlock(&commit_lock);
+
+	return retstat;
+}
+
+/** Put everything done so far on stable storage, file data included
+ *
+ * What fsync() and the durability modes rely on.  Returns 0 on success,
+ * or -1 if something could not be written.
+ */
+int journal_sync(void) {
+	int retstat = journal_commit();
+
+	// File data is written in place, and a commit with no metadata to
+	// write does not flush
+	if (block_flush() < 0) {
+		retstat = -1;
+	}
+
+	return retstat;
+}
+
+/** Commit, then write all metadata in place and empty the journal */
+int journal_checkpoint(void) {
+	if (journal_nblocks == 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&commit_lock);
+	int retstat = journal_commit_locked(1);
+	pthread_mutex_unlock(&commit_lock);
+
+	return retstat;
+}
+
+/*
+ * Commits when a transaction grows big, and every commit_ms in periodic
+ * mode.  Without a journal only the latter.
+ */
+static void *journal_committer(void *arg) {
+	pthread_mutex_lock(&committer_lock);
+	while (!committer_stop) {
+		if (!commit_wanted && (durability == VRS_DURABILITY_PERIODIC)) {
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += commit_ms / 1000;
+			until.tv_nsec += (commit_ms % 1000) * 1000000L;
+			if (until.tv_nsec >= 1000000000L) {
+				until.tv_sec += 1;
+				until.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&committer_wake, &committer_lock, &until);
+		} else if (!commit_wanted) {
+			pthread_cond_wait(&committer_wake, &committer_lock);
+		}
+		if (committer_stop) {
+			break;
+		}
+		commit_wanted = 0;
+
+		pthread_mutex_unlock(&committer_lock);
+		journal_sync();
+		pthread_mutex_lock(&committer_lock);
+	}
+	pthread_mutex_unlock(&committer_lock);
+
+	return NULL;
+}
+
+/** Lay out an empty journal of @nblocks blocks at block @start of a new disk */
+int journal_format(uint32_t start, uint32_t nblocks) {
+	if (nblocks == 0) {
+		return 0;
+	}
+
+	char *buffer = calloc(1, BLOCK_SIZE);
+	if (buffer == NULL) {
+		return -1;
+	}
+	vrs_journal_block_t *header = (vrs_journal_block_t *)buffer;
+	header->magic = VRS_JOURNAL_HEADER;
+	header->seq = 1;
+
+	int retstat = block_write(start, buffer);
+	free(buffer);
+	return retstat;
+}
+
+/* Replay the journal and tag the blocks written from now on */
+static int journal_setup(uint32_t start, uint32_t nblocks) {
+	if (nblocks < VRS_JOURNAL_BLOCKS_MIN) {
+		return -1;
+	}
+
+	journal_start = start;
+	journal_nblocks = nblocks;
+	logged = calloc((VRS_NBLOCKS_DATA + 63) / 64, sizeof(uint64_t));
+	if ((logged == NULL) || (journal_replay() < 0)) {
+		free(logged);
+		logged = NULL;
+		journal_nblocks = 0;
+		return -1;
+	}
+
+	// Blocks of uncommitted transactions have to wait in the cache
+	if (block_set_transaction(journal_tid) < 0) {
+		fprintf(stderr, "the journal needs the block cache, metadata is written unjournaled\n");
+		free(logged);
+		logged = NULL;
+		journal_nblocks = 0;
+		return 0;
+	}
+	block_set_committed(journal_tid - 1);
+
+	return 0;
+}
+
+/** Replay the journal of @nblocks blocks at block @start, and start journaling
+ *
+ * Called once the block cache, the inode cache and the geometry are set
+ * up, before any metadata is read.  A journal of 0 blocks turns journaling
+ * off.  The durability mode and the commit interval are taken from the
+ * mount options.  Returns 0 on success, or -1 if the journal could not be
+ * replayed.
+ */
+int journal_open(uint32_t start, uint32_t nblocks) {
+	journal_nblocks = 0;
+	durability = VRS_DATA->durability;
+	commit_ms = (VRS_DATA->commit_ms > 0) ? VRS_DATA->commit_ms : VRS_JOURNAL_COMMIT_MS;
+	if ((nblocks != 0) && (journal_setup(start, nblocks) < 0)) {
+		return -1;
+	}
+
+	// Without a journal there is only the periodic flush to run
+	committer_stop = 0;
+	commit_wanted = 0;
+	if ((journal_nblocks != 0) || (durability == VRS_DURABILITY_PERIODIC)) {
+		if (pthread_create(&committer, NULL, journal_committer, NULL) == 0) {
+			committer_running = 1;
+		}
+	}
+
+	return 0;
+}
+
+/** Stop journaling, leaving everything in place and the journal empty */
+void journal_close(void) {
+	if (committer_running) {
+		pthread_mutex_lock(&committer_lock);
+		committer_stop = 1;
+		pthread_cond_signal(&committer_wake);
+		pthread_mutex_unlock(&committer_lock);
+		pthread_join(committer, NULL);
+		committer_running = 0;
+	}
+	if (journal_nblocks == 0) {
+		return;
+	}
+
+	journal_checkpoint();
+	block_set_transaction(0);
+
+	free(frees_checkpoint.bnos);
+	memset(&frees_checkpoint, 0, sizeof(frees_checkpoint));
+	free(logged);
+	logged = NULL;
+	journal_nblocks = 0;
+}
+
+/** Start an operation that changes metadata
+ *
+ * Everything it writes until journal_end() is committed together.  Called
+ * before taking any inode lock, and never twice without journal_end().
+ * Without a journal, the blocks it touches are still held together until
+ * the end (block_op_begin()).
+ */
+void journal_begin(void) {
+	block_op_begin();
+	if (journal_nblocks == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&handle_lock);
+	while (barrier) {
+		pthread_cond_wait(&handle_cond, &handle_lock);
+	}
+	++handles;
+	pthread_mutex_unlock(&handle_lock);
+}
+
+/** End an operation started with journal_begin()
+ *
+ * In sync mode, waits until what the operation did is on stable storage.
+ * Returns 0, or -1 if a write failed.
+ */
+int journal_end(void) {
+	int retstat = (block_op_end() < 0) ? -1 : 0;
+	if (journal_nblocks != 0) {
+		pthread_mutex_lock(&handle_lock);
+		--handles;
+		if ((handles == 0) && barrier) {
+			pthread_cond_broadcast(&handle_cond);
+		}
+		pthread_mutex_unlock(&handle_lock);
+
+		// Keep transactions well below what the journal holds
+		if (block_transaction_size() > journal_nblocks / 8) {
+			pthread_mutex_lock(&committer_lock);
+			commit_wanted = 1;
+			pthread_cond_signal(&committer_wake);
+			pthread_mutex_unlock(&committer_lock);
+		}
+	}
+
+	if ((durability == VRS_DURABILITY_SYNC) && (journal_sync() < 0)) {
+		retstat = -1;
+	}
+
+	return retstat;
+}
+
+/** Give back data block @bno once the operation freeing it is committed */
+void journal_free_block(uint32_t bno) {
+	if (journal_nblocks != 0) {
+		pthread_mutex_lock(&handle_lock);
+		int retstat = block_list_add(&frees_running, bno);
+		pthread_mutex_unlock(&handle_lock);
+		if (retstat == 0) {
+			return;
+		}
+	}
+
+	alloc_put(&VRS_DATA->block_alloc, bno);
+}
@@ -0,0 +1,70 @@
+/*
+ * journal.h
+ *
+ * Write-ahead journal of metadata blocks.  Every operation that changes
+ * metadata runs between journal_begin() and journal_end(), and all the
+ * blocks written through the block cache meanwhile join the running
+ * transaction.  Operations running side by side share a transaction,
+ * which a commit thread writes to the journal as a whole: a descriptor
+ * block listing where the blocks belong, copies of the blocks and a
+ * commit block with a checksum over them, then a single flush.  Only
+ * then may the cache write the blocks to their place.
+ *
+ * The journal sits right after the superblock.  Its first block holds the
+ * sequence number of the first transaction to replay at mount; the
+ * transactions follow it one after the other.  Once the journal is half
+ * used, everything committed is written in place and the journal starts
+ * over.  File data is not journaled, it is written in place directly.
+ *
+ * How soon a change is on stable storage is up to the durability mode
+ * (-o durability=...): before the operation returns, at the latest at
+ * fsync(), or every few seconds from the commit thread.  Without a journal
+ * the same happens by writing everything in place instead of committing.
+ */
+
+#ifndef SRC_JOURNAL_H_
+#define SRC_JOURNAL_H_
+
+#include <stdint.h>
+
+#define VRS_JOURNAL_BLOCKS_DEFAULT 1024 // Journal size of a new disk, in blocks
+#define VRS_JOURNAL_BLOCKS_MIN 16
+#define VRS_JOURNAL_COMMIT_MS 5000 // Interval between periodic commits (-o commit=N)
+
+// Durability modes
+#define VRS_DURABILITY_PERIODIC 0	// Commit every -o commit=N milliseconds
+#define VRS_DURABILITY_FSYNC 1		// Only fsync() waits for a commit
+#define VRS_DURABILITY_SYNC 2		// Every operation commits before returning
+
+#define VRS_JOURNAL_HEADER 0x4A524E4Cu // First block of the journal
+#define VRS_JOURNAL_DESC 0x4A444553u // Descriptor, block numbers follow
+#define VRS_JOURNAL_COMMIT 0x4A434D54u // Ends a transaction
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint32_t seq;		/* Transaction, or the first to replay in the header */
+	uint32_t count;		/* Blocks listed by a descriptor, or in the whole transaction */
+	uint32_t checksum;	/* Of the descriptors and blocks, in the commit block */
+} vrs_journal_block_t;
+
+#define VRS_JOURNAL_TAGS ((BLOCK_SIZE - sizeof(vrs_journal_block_t)) / sizeof(uint32_t)) // 124 with 512B blocks
+
+int journal_format(uint32_t start, uint32_t nblocks);
+
+int journal_open(uint32_t start, uint32_t nblocks);
+
+void journal_close(void);
+
+void journal_begin(void);
+
+int journal_end(void);
+
+int journal_commit(void);
+
+int journal_sync(void);
+
+int journal_checkpoint(void);
+
+void journal_free_block(uint32_t bno);
+
+#endif /* SRC_JOURNAL_H_ */
@@ -10,24 +10,259 @@
   accomplish this.
 */
 
+#include "config.h"
 #include "params.h"
 
 #include <errno.h>
-#include <fuse.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "log.h"
 
+// Messages are not written by the thread that logs them.  Each thread
+// formats its messages into a ring buffer of its own, which a writer
+// thread empties into the logfile.  The thread logging only ever moves
+// head, the writer only tail, so neither takes a lock.  When a ring is
+// full, messages are dropped and counted rather than waited for.
+#define LOG_RING_SIZE (64 * 1024) // Power of two
+#define LOG_TEXT_MAX 240 // Longer messages are cut
+#define LOG_FLUSH_MS 20 // Writer wakes this often
+
+// One message in a ring, followed by its text.  Records are padded to
+// the size of this header so that one always fits at the end of a ring.
+typedef struct {
+    uint64_t nsec; // CLOCK_REALTIME when logged
+    uint16_t len; // Bytes of text, no terminating null
+    uint16_t size; // Bytes of the record, padding included; the rest of the ring is skipped if 0
+    uint32_t level;
+} log_record;
+
+typedef struct log_ring {
+    char *buf;
+    uint32_t head; // Bytes ever written, only moved by the owner
+    uint32_t tail; // Bytes ever read, only moved by the writer
+    uint32_t dropped; // Messages lost to a full ring
+    int exited; // The owner is gone, free once drained
+    int id; // Numbers the threads in the logfile
+    struct log_ring *next;
+} log_ring;
+
+int log_level = VRS_LOG_LEVEL_DEFAULT;
+
+static log_ring *rings; // All rings, under ring_lock
+static int nrings; // Rings ever made, under ring_lock
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static __thread log_ring *ring_self;
+
+static pthread_t writer;
+static int writer_running;
+static int writer_stop;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+
+#define LOG_RECORD_ROUND(n) (((n) + sizeof(log_record) - 1) / sizeof(log_record) * sizeof(log_record))
+
+// The writer frees the ring once it has emptied it
+static void ring_exit(void *arg){
+    log_ring *ring = arg;
+    __atomic_store_n(&ring->exited, 1, __ATOMIC_RELEASE);
+}
+
+static void ring_key_create(void){
+    pthread_key_create(&ring_key, ring_exit);
+}
+
+static log_ring *ring_get(void){
+    if (ring_self != NULL)
+	return ring_self;
+
+    pthread_once(&ring_once, ring_key_create);
+    log_ring *ring = calloc(1, sizeof(log_ring));
+    if (ring == NULL)
+	return NULL;
+    ring->buf = malloc(LOG_RING_SIZE);
+    if (ring->buf == NULL) {
+	free(ring);
+	return NULL;
+    }
+
+    pthread_mutex_lock(&ring_lock);
+    ring->id = ++nrings;
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&ring_lock);
+    pthread_setspecific(ring_key, ring);
+    ring_self = ring;
+    return ring;
+}
+
+void log_write(int level, const char *format, ...){
+    log_ring *ring = ring_get();
+    if (ring == NULL)
+	return;
+
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t pos = head & (LOG_RING_SIZE - 1);
+    uint32_t room = LOG_RING_SIZE - (head - tail);
+    uint32_t need = sizeof(log_record) + LOG_RECORD_ROUND(LOG_TEXT_MAX + 1);
+    uint32_t skip = 0;
+
+    // Records do not wrap, a message too big for the end of the ring
+    // goes to its start
+    if (LOG_RING_SIZE - pos < need)
+	skip = LOG_RING_SIZE - pos;
+    if (room < skip + need) {
+	__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+	return;
+    }
+    if (skip != 0) {
+	((log_record *)(ring->buf + pos))->size = 0;
+	pos = 0;
+    }
+
+    log_record *record = (log_record *)(ring->buf + pos);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->nsec = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    record->level = level;
+
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf((char *)(record + 1), LOG_TEXT_MAX + 1, format, ap);
+    va_end(ap);
+    if (len < 0)
+	len = 0;
+    if (len > LOG_TEXT_MAX)
+	len = LOG_TEXT_MAX;
+    record->len = len;
+    record->size = sizeof(log_record) + LOG_RECORD_ROUND(len);
+
+    __atomic_store_n(&ring->head, head + skip + record->size, __ATOMIC_RELEASE);
+
+    // Wake the writer early when a burst has half filled the ring
+    uint32_t used = head + skip + record->size - tail;
+    if (head - tail < LOG_RING_SIZE / 2 && used >= LOG_RING_SIZE / 2)
+	pthread_cond_signal(&writer_wake);
+}
+
+static void ring_drain(log_ring *ring, FILE *logfile){
+    static const char names[] = "?EWID";
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+
+    while (tail != head) {
+	uint32_t pos = tail & (LOG_RING_SIZE - 1);
+	log_record *record = (log_record *)(ring->buf + pos);
+	if (record->size == 0) {
+	    tail += LOG_RING_SIZE - pos;
+	    continue;
+	}
+
+	// Messages used to lay out the file with newlines of their own,
+	// now each goes on one line behind its time, thread and level
+	const char *text = (const char *)(record + 1);
+	int len = record->len;
+	while (len > 0 && text[0] == '\n') {
+	    ++text;
+	    --len;
+	}
+	while (len > 0 && text[len - 1] == '\n')
+	    --len;
+	if (logfile != NULL)
+	    fprintf(logfile, "%llu.%06llu %d %c %.*s\n",
+		    (unsigned long long)(record->nsec / 1000000000),
+		    (unsigned long long)(record->nsec % 1000000000 / 1000),
+		    ring->id, names[record->level < sizeof(names) - 1 ? record->level : 0], len, text);
+	tail += record->size;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    uint32_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped != 0 && logfile != NULL)
+	fprintf(logfile, "%d: %u messages dropped\n", ring->id, dropped);
+}
+
+// Empty every ring into the logfile and free those of exited threads
+static void log_drain(void){
+    FILE *logfile = VRS_DATA->logfile;
+
+    pthread_mutex_lock(&ring_lock);
+    for (log_ring **link = &rings; *link != NULL;) {
+	log_ring *ring = *link;
+	int exited = __atomic_load_n(&ring->exited, __ATOMIC_ACQUIRE);
+	ring_drain(ring, logfile);
+	if (exited) {
+	    *link = ring->next;
+	    free(ring->buf);
+	    free(ring);
+	} else {
+	    link = &ring->next;
+	}
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    if (logfile != NULL)
+	fflush(logfile);
+}
+
+static void *log_writer(void *arg){
+    pthread_mutex_lock(&writer_lock);
+    while (!writer_stop) {
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += LOG_FLUSH_MS * 1000000;
+	if (until.tv_nsec >= 1000000000) {
+	    until.tv_sec += 1;
+	    until.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&writer_wake, &writer_lock, &until);
+
+	pthread_mutex_unlock(&writer_lock);
+	log_drain();
+	pthread_mutex_lock(&writer_lock);
+    }
+    pthread_mutex_unlock(&writer_lock);
+
+    return NULL;
+}
+
+// SIGUSR1 logs more, SIGUSR2 less
+static void log_signal(int sig){
+    int level = __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+    if (sig == SIGUSR1 && level < VRS_LOG_DEBUG)
+	__atomic_store_n(&log_level, level + 1, __ATOMIC_RELAXED);
+    else if (sig == SIGUSR2 && level > 0)
+	__atomic_store_n(&log_level, level - 1, __ATOMIC_RELAXED);
+}
+
+void log_set_level(int level){
+    if (level < 0)
+	level = 0;
+    if (level > VRS_LOG_DEBUG)
+	level = VRS_LOG_DEBUG;
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
 FILE *log_open(){
     FILE *logfile;
 
+    // Nothing will be logged
+    if (VRS_LOG_LEVEL == 0)
+	return NULL;
+
     // very first thing, open up the logfile and mark that we got in
     // here.  If we can't open the logfile, we're dead.vrs
     logfile = fopen("vrsfs.log", "w");
@@ -36,34 +271,54 @@ FILE *log_open(){
 	       exit(EXIT_FAILURE);
     }
 
-    // set logfile to line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
+    // Only the writer thread writes to it, in batches
+    setvbuf(logfile, NULL, _IOFBF, 0);
 
     return logfile;
 }
 
-void log_msg(const char *format, ...){
-    va_list ap;
-    va_start(ap, format);
-    vfprintf(VRS_DATA->logfile, format, ap);
+// Start the writer thread.  Called once FUSE has daemonized, as the
+// thread would not survive the fork; until then messages wait in the
+// rings.
+void log_start(){
+    struct sigaction sa;
+
+    if (VRS_LOG_LEVEL == 0)
+	return;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = log_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+
+    if (writer_running)
+	return;
+    writer_stop = 0;
+    if (pthread_create(&writer, NULL, log_writer, NULL) == 0)
+	writer_running = 1;
 }
 
-// Report errors to logfile and give -errno to caller
-int log_error(char *func){
-    int ret = -errno;
-
-    log_msg("ERROR %s: %s\n", func, strerror(errno));
-
-    return ret;
+// Stop the writer thread and write out whatever is left
+void log_stop(){
+    if (writer_running) {
+	pthread_mutex_lock(&writer_lock);
+	writer_stop = 1;
+	pthread_cond_signal(&writer_wake);
+	pthread_mutex_unlock(&writer_lock);
+	pthread_join(writer, NULL);
+	writer_running = 0;
+    }
+    log_drain();
 }
 
 // fuse context
-void log_fuse_context(struct fuse_context *context){
+void log_dump_fuse_context(struct fuse_context *context){
     log_msg("context:\n");
 
     /** Pointer to the fuse object */
     //	struct fuse *fuse;
-    log_struct(context, fuse, %08x, );
+    log_struct(context, fuse, %p, );
 
     /** User ID of the calling process */
     //	uid_t uid;
@@ -79,8 +334,8 @@ void log_fuse_context(struct fuse_context *context){
 
     /** Private filesystem data */
     //	void *private_data;
-    log_struct(context, private_data, %08x, );
-    log_struct(((struct vrs_state *)context->private_data), logfile, %08x, );
+    log_struct(context, private_data, %p, );
+    log_struct(((struct vrs_state *)context->private_data), logfile, %p, );
     log_struct(((struct vrs_state *)context->private_data), diskfile, %s, );
 
     /** Umask of the calling process (introduced in version 2.8) */
@@ -91,7 +346,7 @@ void log_fuse_context(struct fuse_context *context){
 // struct fuse_conn_info contains information about the socket
 // connection being used.  I don't actually use any of this
 // information in vrsfs
-void log_conn(struct fuse_conn_info *conn){
+void log_dump_conn(struct fuse_conn_info *conn){
     log_msg("    conn:\n");
 
     /** Major version of the protocol (read-only) */
@@ -102,9 +357,11 @@ void log_conn(struct fuse_conn_info *conn){
     // unsigned proto_minor;
     log_struct(conn, proto_minor, %d, );
 
+#ifndef HAVE_FUSE3
     /** Is asynchronous read supported (read-write) */
     // unsigned async_read;
     log_struct(conn, async_read, %d, );
+#endif
 
     /** Maximum size of the write buffer */
     // unsigned max_write;
@@ -130,6 +387,12 @@ void log_conn(struct fuse_conn_info *conn){
     // unsigned congestion_threshold;
     log_struct(conn, congestion_threshold, %d, );
 
+#ifdef HAVE_FUSE3
+    /** Maximum size of read requests */
+    // unsigned max_read;
+    log_struct(conn, max_read, %d, );
+#endif
+
     /** For future use. */
     // unsigned reserved[23];
 }
@@ -138,16 +401,18 @@ void log_conn(struct fuse_conn_info *conn){
 // This dumps all the information in a struct fuse_file_info.  The struct
 // definition, and comments, come from /usr/include/fuse/fuse_common.h
 // Duplicated here for convenience.
-void log_fi (struct fuse_file_info *fi){
+void log_dump_fi(struct fuse_file_info *fi){
     log_msg("fi:\n");
 
     /** Open flags.  Available in open() and release() */
     //	int flags;
 	log_struct(fi, flags, 0x%08x, );
 
+#ifndef HAVE_FUSE3
     /** Old file handle, don't use */
     //	unsigned long fh_old;
 	log_struct(fi, fh_old, 0x%08lx,  );
+#endif
 
     /** In case of a write operation indicates if this was caused by a
         writepage */
@@ -170,48 +435,29 @@ void log_fi (struct fuse_file_info *fi){
     /** File handle.  May be filled in by filesystem in open().
         Available in all other file operations */
     //	uint64_t fh;
-	log_struct(fi, fh, 0x%016llx,  );
+	log_struct(fi, fh, 0x%016llx, (unsigned long long));
 
     /** Lock owner id.  Available in locking operations and flush */
     //  uint64_t lock_owner;
-	log_struct(fi, lock_owner, 0x%016llx, );
-}
-
-void log_retstat(char *func, int retstat){
-    int errsave = errno;
-    log_msg("    %s returned %d\n", func, retstat);
-    errno = errsave;
-}
-
-// make a system call, checking (and reporting) return status and
-// possibly logging error
-int log_syscall(char *func, int retstat, int min_ret){
-    log_retstat(func, retstat);
-
-    if (retstat < min_ret) {
-	       log_error(func);
-	       retstat = -errno;
-    }
-
-    return retstat;
+	log_struct(fi, lock_owner, 0x%016llx, (unsigned long long));
 }
 
 // This dumps the info from a struct stat.  The struct is defined in
 // <bits/stat.h>; this is indirectly included from <fcntl.h>
-void log_stat(struct stat *si){
+void log_dump_stat(struct stat *si){
     log_msg("si:\n");
 
     //  dev_t     st_dev;     /* ID of device containing file */
-	log_struct(si, st_dev, %lld, );
+	log_struct(si, st_dev, %llu, (unsigned long long));
 
     //  ino_t     st_ino;     /* inode number */
-	log_struct(si, st_ino, %lld, );
+	log_struct(si, st_ino, %llu, (unsigned long long));
 
     //  mode_t    st_mode;    /* protection */
 	log_struct(si, st_mode, 0%o, );
 
     //  nlink_t   st_nlink;   /* number of hard links */
-	log_struct(si, st_nlink, %d, );
+	log_struct(si, st_nlink, %lu, (unsigned long));
 
     //  uid_t     st_uid;     /* user ID of owner */
 	log_struct(si, st_uid, %d, );
@@ -220,16 +466,16 @@ void log_stat(struct stat *si){
 	log_struct(si, st_gid, %d, );
 
     //  dev_t     st_rdev;    /* device ID (if special file) */
-	log_struct(si, st_rdev, %lld,  );
+	log_struct(si, st_rdev, %llu, (unsigned long long));
 
     //  off_t     st_size;    /* total size, in bytes */
-	log_struct(si, st_size, %lld,  );
+	log_struct(si, st_size, %lld, (long long));
 
     //  blksize_t st_blksize; /* blocksize for filesystem I/O */
-	log_struct(si, st_blksize, %ld,  );
+	log_struct(si, st_blksize, %ld, (long));
 
     //  blkcnt_t  st_blocks;  /* number of blocks allocated */
-	log_struct(si, st_blocks, %lld,  );
+	log_struct(si, st_blocks, %lld, (long long));
 
     //  time_t    st_atime;   /* time of last access */
 	log_struct(si, st_atime, 0x%08lx, );
@@ -242,45 +488,45 @@ void log_stat(struct stat *si){
 
 }
 
-void log_statvfs(struct statvfs *sv){
+void log_dump_statvfs(struct statvfs *sv){
     log_msg("sv:\n");
 
     //  unsigned long  f_bsize;    /* file system block size */
-	log_struct(sv, f_bsize, %ld, );
+	log_struct(sv, f_bsize, %lu, );
 
     //  unsigned long  f_frsize;   /* fragment size */
-	log_struct(sv, f_frsize, %ld, );
+	log_struct(sv, f_frsize, %lu, );
 
     //  fsblkcnt_t     f_blocks;   /* size of fs in f_frsize units */
-	log_struct(sv, f_blocks, %lld, );
+	log_struct(sv, f_blocks, %llu, (unsigned long long));
 
     //  fsblkcnt_t     f_bfree;    /* # free blocks */
-	log_struct(sv, f_bfree, %lld, );
+	log_struct(sv, f_bfree, %llu, (unsigned long long));
 
     //  fsblkcnt_t     f_bavail;   /* # free blocks for non-root */
-	log_struct(sv, f_bavail, %lld, );
+	log_struct(sv, f_bavail, %llu, (unsigned long long));
 
     //  fsfilcnt_t     f_files;    /* # inodes */
-	log_struct(sv, f_files, %lld, );
+	log_struct(sv, f_files, %llu, (unsigned long long));
 
     //  fsfilcnt_t     f_ffree;    /* # free inodes */
-	log_struct(sv, f_ffree, %lld, );
+	log_struct(sv, f_ffree, %llu, (unsigned long long));
 
     //  fsfilcnt_t     f_favail;   /* # free inodes for non-root */
-	log_struct(sv, f_favail, %lld, );
+	log_struct(sv, f_favail, %llu, (unsigned long long));
 
     //  unsigned long  f_fsid;     /* file system ID */
-	log_struct(sv, f_fsid, %ld, );
+	log_struct(sv, f_fsid, %lu, );
 
     //  unsigned long  f_flag;     /* mount flags */
 	log_struct(sv, f_flag, 0x%08lx, );
 
     //  unsigned long  f_namemax;  /* maximum filename length */
-	log_struct(sv, f_namemax, %ld, );
+	log_struct(sv, f_namemax, %lu, );
 
 }
 
-void log_utime(struct utimbuf *buf){
+void log_dump_utime(struct utimbuf *buf){
     log_msg("buf:\n");
 
     //    time_t actime;
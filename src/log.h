@@ -7,22 +7,95 @@
 
 #ifndef _LOG_H_
 #define _LOG_H_
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
+
+// Message levels, most important first.  0 logs nothing.
+#define VRS_LOG_ERROR 1
+#define VRS_LOG_WARN  2
+#define VRS_LOG_INFO  3
+#define VRS_LOG_DEBUG 4
+
+// Messages above VRS_LOG_LEVEL are compiled out, set it with
+// configure --with-log-level=N.  The level actually logged is picked
+// at run time below that (-o loglevel=N, SIGUSR1 and SIGUSR2).
+#ifndef VRS_LOG_LEVEL
+#define VRS_LOG_LEVEL VRS_LOG_DEBUG
+#endif
+
+#define VRS_LOG_LEVEL_DEFAULT VRS_LOG_INFO
+
+extern int log_level;
+
+#define log_enabled(level) \
+  ((level) <= VRS_LOG_LEVEL && (level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+
+// Nothing is evaluated, not even the arguments, unless the level is on
+#define log_at(level, ...) \
+  do { if (log_enabled(level)) log_write(level, __VA_ARGS__); } while (0)
+
+#define log_msg(...)  log_at(VRS_LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(VRS_LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(VRS_LOG_WARN, __VA_ARGS__)
 
 //  macro to log fields in structs.
 #define log_struct(st, field, format, typecast) \
   log_msg("    " #field " = " #format "\n", typecast st->field)
 
+// Dumps of whole structures, as debug messages
+#define log_conn(conn) \
+  do { if (log_enabled(VRS_LOG_DEBUG)) log_dump_conn(conn); } while (0)
+#define log_fi(fi) \
+  do { if (log_enabled(VRS_LOG_DEBUG)) log_dump_fi(fi); } while (0)
+#define log_fuse_context(context) \
+  do { if (log_enabled(VRS_LOG_DEBUG)) log_dump_fuse_context(context); } while (0)
+#define log_stat(si) \
+  do { if (log_enabled(VRS_LOG_DEBUG)) log_dump_stat(si); } while (0)
+#define log_statvfs(sv) \
+  do { if (log_enabled(VRS_LOG_DEBUG)) log_dump_statvfs(sv); } while (0)
+#define log_utime(buf) \
+  do { if (log_enabled(VRS_LOG_DEBUG)) log_dump_utime(buf); } while (0)
+#define log_retstat(func, retstat) \
+  log_msg("    %s returned %d\n", func, retstat)
+
 FILE *log_open(void);
-void log_msg(const char *format, ...);
-void log_conn(struct fuse_conn_info *conn);
-int log_error(char *func);
-void log_fi(struct fuse_file_info *fi);
-void log_fuse_context(struct fuse_context *context);
-void log_retstat(char *func, int retstat);
-void log_stat(struct stat *si);
-void log_statvfs(struct statvfs *sv);
-int  log_syscall(char *func, int retstat, int min_ret);
-void log_utime(struct utimbuf *buf);
+void log_start(void);
+void log_stop(void);
+void log_set_level(int level);
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void log_dump_conn(struct fuse_conn_info *conn);
+void log_dump_fi(struct fuse_file_info *fi);
+void log_dump_fuse_context(struct fuse_context *context);
+void log_dump_stat(struct stat *si);
+void log_dump_statvfs(struct statvfs *sv);
+void log_dump_utime(struct utimbuf *buf);
+
+// Report errors to logfile and give -errno to caller
+static inline int log_error(char *func){
+    int ret = -errno;
+
+    if (log_enabled(VRS_LOG_ERROR)) {
+	log_write(VRS_LOG_ERROR, "ERROR %s: %s\n", func, strerror(errno));
+	errno = -ret;
+    }
+
+    return ret;
+}
+
+// make a system call, checking (and reporting) return status and
+// possibly logging error
+static inline int log_syscall(char *func, int retstat, int min_ret){
+    int errsave = errno;
+    log_retstat(func, retstat);
+    errno = errsave;
+
+    if (retstat < min_ret) {
+	log_error(func);
+	retstat = -errno;
+    }
+
+    return retstat;
+}
 
 #endif
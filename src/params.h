@@ -13,37 +13,98 @@
 
 // The FUSE API has been changed a number of times.  So, our code
 // needs to define the version of the API that we assume.  As of this
-// writing, the most current API version is 26
+// writing, the most current API version is 26.  configure --with-fuse3
+// builds against libfuse 3 instead, through API version 35.
+#ifdef HAVE_FUSE3
+#define FUSE_USE_VERSION 35
+#else
 #define FUSE_USE_VERSION 26
+#endif
 
 // need this to get pwrite().  I have to use setvbuf() instead of
 // setlinebuf() later in consequence.
 #define _XOPEN_SOURCE 500
 
+// The local fuse.h is the FUSE 2.6 copy, libfuse 3 brings its own
+#ifdef HAVE_FUSE3
+#include <fuse3/fuse.h>
+#else
+#include "fuse.h"
+#endif
+
 // maintain bbfs state in here
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include "list.h"
+#include "alloc.h"
+#include "icache.h"
+#include "dcache.h"
+
+// On-disk layout, computed at mount time from the superblock
+typedef struct {
+	uint32_t block_size;
+	uint32_t ninodes;
+	uint32_t nblocks_data;
+	uint32_t nblocks_journal;
+	uint32_t nblocks_inode;
+	uint32_t nblocks_inode_bitmap;
+	uint32_t nblocks_data_bitmap;
+	uint32_t block_journal;
+	uint32_t block_inode_bitmap;
+	uint32_t block_data_bitmap;
+	uint32_t block_inodes;
+	uint32_t block_data;
+} vrs_geometry;
 
+// Blocks set aside in memory for the next writes to a file
 typedef struct {
-	int id;
-	list_t node;
-} vrs_free_list;
+	uint32_t start;
+	uint32_t len;
+} vrs_prealloc;
+
+// Last run of contiguous blocks found in a file's block tree
+typedef struct {
+	uint32_t lblk;
+	uint32_t pblk;
+	uint32_t len;
+} vrs_bmap_cache;
 
 struct vrs_state {
     FILE *logfile;
     char *diskfile;
 
-    vrs_free_list* state_inodes; // Array of list nodes for all inodes state info
-    vrs_free_list* state_data_blocks; // Array of data block nodes for all data blocks
-
-    list_t* free_inodes;
-    list_t* free_data_blocks;
+    vrs_allocator inode_alloc; // Which inodes are in use
+    vrs_allocator block_alloc; // Which data blocks are in use
+    vrs_prealloc* prealloc; // Preallocation window of each inode
+    vrs_bmap_cache* bmap_cache; // Cached block mapping of each inode
+    pthread_rwlock_t* inode_locks; // Lock of each inode, see inode.h
+    vrs_icache icache; // Cached inode table
+    vrs_dcache dcache; // Cached directory lookups
+    uint64_t* nlookup; // References the kernel holds on each inode, see inode_ref()
 
     uint32_t ino_root;
+    vrs_geometry geometry;
+
+    unsigned long cache_size; // Memory budget of the block cache in bytes (-o cache_size=N)
+    unsigned int icache_size; // Inodes kept in memory (-o icache_size=N)
+    unsigned int dcache_size; // Directory entries kept in memory, 0 disables (-o dcache_size=N)
+    unsigned int block_size; // Block size used when formatting a new disk (-o block_size=N)
+    unsigned int ninodes; // Number of inodes when formatting a new disk (-o ninodes=N)
+    unsigned int journal_blocks; // Journal size when formatting a new disk, 0 for none (-o journal=N)
+    unsigned int durability; // When changes reach stable storage, see journal.h (-o durability=sync|fsync-only|periodic)
+    unsigned int commit_ms; // Interval of periodic commits in milliseconds (-o commit=N)
+    unsigned int prealloc_blocks; // Blocks preallocated past the end of a growing file (-o prealloc=N)
+    unsigned int extents; // Map new files with extents rather than block pointers (-o extents/noextents)
+    unsigned int lowlevel; // Serve requests through the inode-based FUSE API (-o lowlevel)
+    unsigned int writeback; // Let the kernel cache writes, FUSE 3 only (-o writeback/nowriteback)
+    unsigned int log_level; // Messages logged, see log.h (-o loglevel=N)
 };
 
-#define VRS_DATA ((struct vrs_state *) fuse_get_context()->private_data)
+// Set up by main() before FUSE starts.  Not looked up through the FUSE
+// context, which the low-level API does not have.
+extern struct vrs_state *vrs_data;
+#define VRS_DATA vrs_data
 
 #endif
@@ -18,9 +18,9 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include "fuse.h"
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -28,9 +28,19 @@
 #include <sys/types.h>
 
 #include "inode.c"
+#include "sfs_ll.h"
+#include "bitmap.h"
+#include "journal.h"
 #include "log.h"
 
-#define VRS_MAGIC_NUM 1707
+#define VRS_MAGIC_NUM 1712 // 1711 disks had no journal, 1710 inodes had no generation, 1709 dentries had no name hash, 1708 disks had no inode flags, 1707 used one character per bitmap entry
+
+// Open file of a request, set up by open(), create() or opendir()
+#define VRS_FILE(fi) (((fi) != NULL) ? (vrs_file_t *)(uintptr_t)(fi)->fh : NULL)
+
+// Largest write we ask the kernel for under FUSE 3, which also sizes its
+// read requests and readahead.  libfuse 3 buffers up to 1 MiB.
+#define VRS_MAX_WRITE (1024 * 1024)
 
 typedef struct __attribute__((packed)) {
 	uint32_t magic;
@@ -40,6 +50,8 @@ typedef struct __attribute__((packed)) {
 	uint32_t bitmap_inode_blocks;
 	uint32_t bitmap_data_blocks;
 	uint32_t inode_root;  // Root directory.
+	uint32_t block_size; // Block size chosen at format time.
+	uint32_t journal_blocks; // Size of the journal after the superblock, 0 for none.
 } vrs_superblock;
 
 // Get Full path from rootDir
@@ -49,188 +61,284 @@ static void vrs_fullpath(char fpath[PATH_MAX], const char *path){
     log_msg("vrs_fullpath:  diskfile = \"%s\", path = \"%s\", fpath = \"%s\"\n", VRS_DATA->diskfile, path, fpath);
 }
 
-void *vrs_init(struct fuse_conn_info *conn){
+/*
+ * Lay out a new filesystem on an empty disk file.  The file is sized up
+ * front and left sparse, so only the superblock, the first block of each
+ * bitmap and the root inode are written.  Inode and data blocks that were never written read
+ * back as zeros.
+ */
+static void vrs_format(uint32_t block_size){
+    log_msg("\nvrs_format(block_size=%u)", block_size);
+
+    if (disk_truncate(VRS_BLOCK_DATA + VRS_NBLOCKS_DATA) < 0) {
+    	fprintf(stderr, "failed to size the disk file\n");
+    	exit(EXIT_FAILURE);
+    }
+
+	// Step 1: Write super block to disk file
+	vrs_superblock sb = {
+			.magic = VRS_MAGIC_NUM,
+			.num_data_blocks = VRS_NBLOCKS_DATA,
+			.num_free_blocks = VRS_NBLOCKS_DATA - 1,
+			.num_inodes = VRS_NINODES,
+			.bitmap_inode_blocks = VRS_BLOCK_INODE_BITMAP,
+			.bitmap_data_blocks = VRS_BLOCK_DATA_BITMAP,
+			.inode_root = 0,
+			.block_size = block_size,
+			.journal_blocks = VRS_NBLOCKS_JOURNAL
+	};
+
+	block_write_padded(VRS_BLOCK_SUPERBLOCK, &sb, sizeof(vrs_superblock));
+
+	// Step 2: Mark inode 0 and data block 0 as taken by the root, the rest
+	// of both bitmaps stays zero (free)
+	char *bitmap = calloc(1, BLOCK_SIZE);
+	if (bitmap == NULL) {
+		fprintf(stderr, "out of memory formatting the disk\n");
+		exit(EXIT_FAILURE);
+	}
+	bitmap_set(bitmap, 0);
+	block_write(VRS_BLOCK_INODE_BITMAP, bitmap);
+	block_write(VRS_BLOCK_DATA_BITMAP, bitmap);
+
+	// Step 3: Initialize the root inode
+	vrs_inode_t inode;
+	memset(&inode, 0, sizeof(inode));
+	inode.atime = time(NULL);
+	inode.ctime = time(NULL);
+	inode.mtime = time(NULL);
+	inode.ino = 0;
+	inode_bmap_init(&inode, VRS_DATA->extents ? VRS_INODE_EXTENTS : 0, 0);
+	inode.size = 0;
+	inode.nlink = 1;
+	inode.mode = S_IFDIR;
+
+	char *buffer_inode = bitmap;
+	memset(buffer_inode, 0, BLOCK_SIZE);
+	memcpy(buffer_inode, &inode, sizeof(vrs_inode_t));
+	block_write(VRS_BLOCK_INODES, buffer_inode);
+	free(buffer_inode);
+
+	// Step 4: Start with an empty journal
+	journal_format(VRS_BLOCK_JOURNAL, VRS_NBLOCKS_JOURNAL);
+
+	block_sync();
+}
+
+/*
+ * Set up @alloc for @num_objects objects from the on-disk bitmap starting
+ * at @bitmap_block.  Returns the number of objects in use.
+ */
+static int vrs_load_bitmap(uint32_t bitmap_block, uint32_t num_objects, vrs_allocator *alloc){
+	uint32_t bits_per_block = BLOCK_SIZE * 8;
+	uint32_t first = 0;
+	char *bitmap = malloc(BLOCK_SIZE);
+
+	if ((bitmap == NULL) || (alloc_init(alloc, num_objects) < 0)) {
+		fprintf(stderr, "out of memory for the allocator\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (first = 0; first < num_objects; first += bits_per_block) {
+		uint32_t nbits = (num_objects - first < bits_per_block) ? (num_objects - first) : bits_per_block;
+		block_read(bitmap_block + first / bits_per_block, bitmap);
+		alloc_load(alloc, first, bitmap, nbits);
+	}
+	free(bitmap);
+
+	return num_objects - alloc_nfree(alloc);
+}
+
+struct vrs_state *vrs_data;
+
+#ifdef HAVE_FUSE3
+/*
+ * Ask the kernel for what FUSE 3 adds: it caches writes and sends them
+ * in large requests, reads ahead in large requests too, and overlaps
+ * reads and directory operations.
+ */
+static void vrs_negotiate(struct fuse_conn_info *conn){
+    if (VRS_DATA->writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+	conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    else
+	conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+
+    if (conn->capable & FUSE_CAP_ASYNC_READ)
+	conn->want |= FUSE_CAP_ASYNC_READ;
+    if (conn->capable & FUSE_CAP_PARALLEL_DIROPS)
+	conn->want |= FUSE_CAP_PARALLEL_DIROPS;
+    if (conn->capable & FUSE_CAP_READDIRPLUS)
+	conn->want |= FUSE_CAP_READDIRPLUS;
+
+    // Reads are only bounded by the -o max_read mount option and the
+    // request size libfuse derives from max_write.  The kernel lowers
+    // max_readahead to its own limit.
+    conn->max_write = VRS_MAX_WRITE;
+    conn->max_readahead = VRS_MAX_WRITE;
+}
+#endif
+
+/*
+ * Open the disk, formatting it first if it is empty, and set up the
+ * in-memory state.  Shared by both front-ends.
+ */
+void vrs_mount(struct fuse_conn_info *conn){
     fprintf(stderr, "in vrs-init\n");
+    log_start();
     log_msg("\nvrs_init()\n");
 
+#ifdef HAVE_FUSE3
+    vrs_negotiate(conn);
+#endif
     log_conn(conn);
-    log_fuse_context(fuse_get_context());
 
     disk_open(VRS_DATA->diskfile);
     struct stat *statbuf = (struct stat*)malloc(sizeof(struct stat));
     lstat(VRS_DATA->diskfile, statbuf);
 
-    // Check for first time initialization.
-    if (statbuf->st_size == 0) {
-
-    	// Step 1: Write super block to disk file
-    	vrs_superblock sb = {
-    			.magic = VRS_MAGIC_NUM,
-    			.num_data_blocks = VRS_NBLOCKS_DATA,
-				.num_free_blocks = VRS_NBLOCKS_DATA,
-				.num_inodes = VRS_NINODES,
-				.bitmap_inode_blocks = VRS_BLOCK_INODE_BITMAP,
-				.bitmap_data_blocks = VRS_BLOCK_DATA_BITMAP,
-				.inode_root = 0
-    	};
-
-    	block_write_padded(VRS_BLOCK_SUPERBLOCK, &sb, sizeof(vrs_superblock));
-
-    	//Step 2: Write inode bitmap
-    	int i = 0;
-    	char bitmap_inodes[BLOCK_SIZE];
-    	memset(bitmap_inodes, '1', sizeof(bitmap_inodes));
-    	for (i = 0; i < VRS_NBLOCKS_INODE_BITMAP; ++i) {
-        	block_write((VRS_BLOCK_INODE_BITMAP + i), bitmap_inodes);
+    // The superblock always sits in the first BLOCK_SIZE_MIN bytes, so it
+    // can be read before we know the block size of the disk.
+    vrs_superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    uint32_t disk_block_size = VRS_DATA->block_size;
+    if (statbuf->st_size != 0) {
+    	char buffer_super_block[BLOCK_SIZE_MIN];
+    	block_read(VRS_BLOCK_SUPERBLOCK, buffer_super_block);
+    	memcpy(&sb, buffer_super_block, sizeof(sb));
+
+    	if (sb.magic != VRS_MAGIC_NUM) {
+    		fprintf(stderr, "%s is not a VRS disk of this version (magic %u)\n", VRS_DATA->diskfile, sb.magic);
+    		exit(EXIT_FAILURE);
     	}
 
-    	//Step 3: Write data bitmap
-    	char bitmap_data[BLOCK_SIZE];
-    	memset(bitmap_data, '1', sizeof(bitmap_data));
-    	for (i = 0; i < VRS_NBLOCKS_DATA_BITMAP; ++i) {
-        	block_write((VRS_BLOCK_DATA_BITMAP + i), bitmap_data);
-    	}
+    	disk_block_size = sb.block_size;
+    }
 
-    	//Step 4: Write inode blocks
-    	char buffer_inode[BLOCK_SIZE];
-    	memset(buffer_inode, '0', sizeof(buffer_inode));
-    	for (i = 0; i < VRS_NBLOCKS_INODE; ++i) {
-        	block_write((VRS_BLOCK_INODES + i), buffer_inode);
+    if (block_set_size(disk_block_size) < 0) {
+    	fprintf(stderr, "invalid block size %u\n", disk_block_size);
+    	exit(EXIT_FAILURE);
+    }
+    block_cache_init(VRS_DATA->cache_size);
+
+    if (statbuf->st_size != 0) {
+    	vrs_compute_geometry(&VRS_DATA->geometry, disk_block_size, sb.num_inodes, sb.num_data_blocks,
+    			sb.journal_blocks);
+    } else {
+    	if (VRS_DATA->ninodes == 0) {
+    		fprintf(stderr, "a disk needs at least one inode\n");
+    		exit(EXIT_FAILURE);
     	}
-
-    	//Step 5: Write data blocks
-    	char buffer_data[BLOCK_SIZE];
-    	memset(buffer_data, '0', sizeof(buffer_data));
-    	for (i = 0; i < VRS_NBLOCKS_DATA; ++i) {
-        	block_write((VRS_BLOCK_DATA + i), buffer_data);
+    	if ((VRS_DATA->journal_blocks != 0) && (VRS_DATA->journal_blocks < VRS_JOURNAL_BLOCKS_MIN)) {
+    		fprintf(stderr, "a journal needs at least %d blocks\n", VRS_JOURNAL_BLOCKS_MIN);
+    		exit(EXIT_FAILURE);
     	}
+    	vrs_compute_geometry(&VRS_DATA->geometry, disk_block_size, VRS_DATA->ninodes,
+    			VRS_DATA_SIZE_DEFAULT / disk_block_size, VRS_DATA->journal_blocks);
+    }
 
-    	//Step 6: Initialize the root inode
-    	if (block_read(VRS_BLOCK_INODE_BITMAP, bitmap_inodes) > 0) {
-    		bitmap_inodes[0] = '0';
-    		block_write(VRS_BLOCK_INODE_BITMAP, bitmap_inodes);
-    	}
+    // Check for first time initialization.
+    if (statbuf->st_size == 0) {
+    	vrs_format(disk_block_size);
+    }
 
-		if (block_read(VRS_BLOCK_DATA_BITMAP, bitmap_data) > 0) {
-			bitmap_data[0] = '0';
-			block_write(VRS_BLOCK_DATA_BITMAP, bitmap_data);
-		}
+    if (icache_init(&VRS_DATA->icache, VRS_BLOCK_INODES, VRS_INODE_SIZE, VRS_DATA->icache_size) < 0) {
+    	fprintf(stderr, "failed to set up the inode cache\n");
+    	exit(EXIT_FAILURE);
+    }
+    if (dcache_init(&VRS_DATA->dcache, VRS_DATA->dcache_size) < 0) {
+    	fprintf(stderr, "failed to set up the directory cache\n");
+    	exit(EXIT_FAILURE);
+    }
 
-		vrs_inode_t inode;
-		memset(&inode, 0, sizeof(inode));
-		inode.atime = time(NULL);
-        inode.ctime = time(NULL);
-        inode.mtime = time(NULL);
-		inode.nblocks = 1;
-		inode.ino = 0;
-		inode.blocks[0] = VRS_BLOCK_DATA;
-		inode.size = 0;
-		inode.nlink = 0;
-		inode.mode = S_IFDIR;
-
-		block_write_padded(VRS_BLOCK_INODES, &inode, sizeof(vrs_inode_t));
+    // Finish what the last mount committed before reading any metadata.
+    // Commits flush the inode cache, so it has to be there first.
+    if (journal_open(VRS_BLOCK_JOURNAL, VRS_NBLOCKS_JOURNAL) < 0) {
+    	fprintf(stderr, "failed to replay the journal\n");
+    	exit(EXIT_FAILURE);
     }
 
     // Here we start the init process
 
     // Step 1: Cache the state of inodes availability in fuse context
 
-    VRS_DATA->state_inodes = (vrs_free_list*)malloc(VRS_NINODES * sizeof(vrs_free_list));
-    memset(VRS_DATA->state_inodes, 0, VRS_NINODES * sizeof(vrs_free_list));
-
-    int i = 0, inodes_cached = 0;
-	char bitmap_inodes[BLOCK_SIZE];
-	int num_used_inodes = 0;
-	for (i = 0; i < VRS_NBLOCKS_INODE_BITMAP; ++i) {
-		block_read((VRS_BLOCK_INODE_BITMAP + i), bitmap_inodes);
-
-		int block_ptr = 0;
-		while((block_ptr < BLOCK_SIZE) && (inodes_cached < VRS_NINODES)) {
-			vrs_free_list *node = VRS_DATA->state_inodes + inodes_cached;
-			node->id = inodes_cached;
-			INIT_LIST_HEAD(&(node->node));
-			if (bitmap_inodes[block_ptr] == '1') {
-				if (VRS_DATA->free_inodes == NULL) {
-					VRS_DATA->free_inodes = &(node->node);
-				} else {
-					list_add_tail(&(node->node), VRS_DATA->free_inodes);
-				}
-			} else {
-				num_used_inodes++;
-			}
-
-			++inodes_cached;
-			++block_ptr;
-		}
-	}
+    int num_used_inodes = vrs_load_bitmap(VRS_BLOCK_INODE_BITMAP, VRS_NINODES, &VRS_DATA->inode_alloc);
 
-    log_msg("\nvrs_init() num_used_inodes = %d", num_used_inodes);
+    log_info("\nvrs_init() num_used_inodes = %d", num_used_inodes);
 
     // Step 2: Cache the state of data block's availability in fuse context
 
-    VRS_DATA->state_data_blocks = (vrs_free_list*)malloc(VRS_NBLOCKS_DATA * sizeof(vrs_free_list));
-    memset(VRS_DATA->state_data_blocks, 0, VRS_NBLOCKS_DATA * sizeof(vrs_free_list));
-
-	int data_blocks_cached = 0;
-	char bitmap_data[BLOCK_SIZE];
-	int num_used_data_blocks = 0;
-	for (i = 0; i < VRS_NBLOCKS_DATA_BITMAP; ++i) {
-		block_read((VRS_BLOCK_DATA_BITMAP + i), bitmap_data);
-
-		int block_ptr = 0;
-		while ((block_ptr < BLOCK_SIZE) && (data_blocks_cached < VRS_NBLOCKS_DATA)) {
-			vrs_free_list *node = VRS_DATA->state_data_blocks + data_blocks_cached;
-			node->id = data_blocks_cached;
-			INIT_LIST_HEAD(&(node->node));
-			if (bitmap_data[block_ptr] == '1') {
-				if (VRS_DATA->free_data_blocks == NULL) {
-				    log_msg("\nvrs_init() here it is null");
-					VRS_DATA->free_data_blocks = &(node->node);
-				} else {
-					list_add_tail(&(node->node), VRS_DATA->free_data_blocks);
-				}
-			} else {
-				++num_used_data_blocks;
-			}
+    int num_used_data_blocks = vrs_load_bitmap(VRS_BLOCK_DATA_BITMAP, VRS_NBLOCKS_DATA, &VRS_DATA->block_alloc);
 
-			++data_blocks_cached;
-			++block_ptr;
-		}
-	}
+    log_info("\nvrs_init() num_used_data_blocks = %d", num_used_data_blocks);
 
-    log_msg("\nvrs_init() num_used_data_blocks = %d", num_used_data_blocks);
+    VRS_DATA->prealloc = (vrs_prealloc*)calloc(VRS_NINODES, sizeof(vrs_prealloc));
+    VRS_DATA->bmap_cache = (vrs_bmap_cache*)calloc(VRS_NINODES, sizeof(vrs_bmap_cache));
+    VRS_DATA->nlookup = (uint64_t*)calloc(VRS_NINODES, sizeof(uint64_t));
+    if (VRS_DATA->nlookup == NULL) {
+    	fprintf(stderr, "out of memory for the lookup counts\n");
+    	exit(EXIT_FAILURE);
+    }
+    if (inode_locks_init() < 0) {
+    	fprintf(stderr, "out of memory for the inode locks\n");
+    	exit(EXIT_FAILURE);
+    }
 
     // Step 3: Cache root's inode number
-    char buffer_super_block[BLOCK_SIZE];
+    char *buffer_super_block = malloc(BLOCK_SIZE);
+    if (buffer_super_block == NULL) {
+    	fprintf(stderr, "out of memory reading the superblock\n");
+    	exit(EXIT_FAILURE);
+    }
 	block_read(VRS_BLOCK_SUPERBLOCK, buffer_super_block);
-	vrs_superblock sb;
 	memcpy(&sb, buffer_super_block, sizeof(sb));
+	free(buffer_super_block);
 
 	VRS_DATA->ino_root = sb.inode_root;
     log_msg("\nvrs_init() ino_root = %d", VRS_DATA->ino_root);
 
+    // Step 4: Free the files that were removed while open before a crash
+    int num_orphans = release_orphans();
+
+    log_info("\nvrs_init() num_orphans = %d", num_orphans);
+}
+
+#ifdef HAVE_FUSE3
+void *vrs_init(struct fuse_conn_info *conn, struct fuse_config *cfg){
+#else
+void *vrs_init(struct fuse_conn_info *conn){
+#endif
+    log_fuse_context(fuse_get_context());
+    vrs_mount(conn);
+
     return VRS_DATA;
 }
 
 void vrs_destroy(void *userdata){
-    log_msg("\nvrs_destroy(userdata=0x%08x)\n", userdata);
+    log_msg("\nvrs_destroy(userdata=%p)\n", userdata);
+    journal_close();
+    icache_flush(&VRS_DATA->icache);
     disk_close();
-
-    free(VRS_DATA->state_inodes);
-    VRS_DATA->state_inodes = NULL;
-
-    free(VRS_DATA->state_data_blocks);
-    VRS_DATA->state_data_blocks = NULL;
-
-    VRS_DATA->free_inodes = NULL;
-    VRS_DATA->free_data_blocks = NULL;
+    icache_destroy(&VRS_DATA->icache);
+    dcache_destroy(&VRS_DATA->dcache);
+
+    free(VRS_DATA->prealloc);
+    VRS_DATA->prealloc = NULL;
+    free(VRS_DATA->bmap_cache);
+    VRS_DATA->bmap_cache = NULL;
+    free(VRS_DATA->nlookup);
+    VRS_DATA->nlookup = NULL;
+    inode_locks_destroy();
+
+    alloc_destroy(&VRS_DATA->inode_alloc);
+    alloc_destroy(&VRS_DATA->block_alloc);
+    log_stop();
 }
 
 int vrs_getattr(const char *path, struct stat *statbuf){
     int retstat = 0;
     char fpath[PATH_MAX];
 
-    log_msg("\nvrs_getattr(path=\"%s\", statbuf=0x%08x)\n", path, statbuf);
+    log_msg("\nvrs_getattr(path=\"%s\", statbuf=%p)\n", path, statbuf);
 
     uint32_t ino = path_2_ino(path);
     if (ino != VRS_INVALID_INO) {
@@ -262,7 +370,7 @@ int vrs_getattr(const char *path, struct stat *statbuf){
 int vrs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi){
     int retstat = 0;
 
-    log_msg("\nvrs_fgetattr(path=\"%s\", statbuf=0x%08x, fi=0x%08x)\n", path, statbuf, fi);
+    log_msg("\nvrs_fgetattr(path=\"%s\", statbuf=%p, fi=%p)\n", path, statbuf, fi);
     log_fi(fi);
 
     // On FreeBSD, trying to do anything with the mountpoint ends up
@@ -272,22 +380,49 @@ int vrs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *
     if (!strcmp(path, "/"))
         return vrs_getattr(path, statbuf);
 
-    retstat = fstat(fi->fh, statbuf);
-    if (retstat < 0)
-	   retstat = log_error("vrs_fgetattr fstat");
+    vrs_file_t *file = VRS_FILE(fi);
+    if (file == NULL)
+        return vrs_getattr(path, statbuf);
+
+    vrs_inode_t inode;
+    get_inode(file->ino, &inode);
+    fill_stat_from_ino(&inode, statbuf);
 
     log_stat(statbuf);
 
     return retstat;
 }
 
+#ifdef HAVE_FUSE3
+/* FUSE 3 folds fgetattr() into getattr(), with fi set for open files */
+int vrs_getattr_fi(const char *path, struct stat *statbuf, struct fuse_file_info *fi){
+    if (fi != NULL)
+	return vrs_fgetattr(path, statbuf, fi);
+
+    return vrs_getattr(path, statbuf);
+}
+#endif
+
 int vrs_create(const char *path, mode_t mode, struct fuse_file_info *fi){
     int retstat = 0;
 
-    log_msg("\nvrs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n", path, mode, fi);
-    uint32_t ino = create_inode(path, mode);
+    log_msg("\nvrs_create(path=\"%s\", mode=0%03o, fi=%p)\n", path, mode, fi);
+    uint32_t ino = VRS_INVALID_INO;
+    retstat = create_inode(path, mode, &ino);
+    if (retstat < 0) {
+	log_msg("\nvrs_create could not create %s", path);
+	return retstat;
+    }
     log_msg("\nFile creation success inode = %d", ino);
 
+    // The new file is open until release()
+    vrs_file_t *file = NULL;
+    retstat = open_inode(ino, &file);
+    if (retstat < 0) {
+	return retstat;
+    }
+    fi->fh = (uintptr_t)file;
+
     return retstat;
 }
 
@@ -302,14 +437,18 @@ int vrs_unlink(const char *path){
 
 int vrs_open(const char *path, struct fuse_file_info *fi){
     int retstat = -ENOENT;
-    log_msg("\nvrs_open(path\"%s\", fi=0x%08x)\n", path, fi);
+    log_msg("\nvrs_open(path\"%s\", fi=%p)\n", path, fi);
 
 	uint32_t ino = path_2_ino(path);
 	if (ino != VRS_INVALID_INO) {
 		vrs_inode_t inode;
 		get_inode(ino, &inode);
 		if (S_ISREG(inode.mode)) {
-			retstat = 0;
+			vrs_file_t *file = NULL;
+			retstat = open_inode(ino, &file);
+			if (retstat == 0) {
+				fi->fh = (uintptr_t)file;
+			}
 		}
 	}
     else {
@@ -321,58 +460,73 @@ int vrs_open(const char *path, struct fuse_file_info *fi){
 
 int vrs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
     int retstat = 0;
-    log_msg("\nvrs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
+    log_msg("\nvrs_read(path=\"%s\", buf=%p, size=%zu, offset=%lld, fi=%p)\n", path, buf, size, (long long)offset, fi);
 
-	uint32_t ino = path_2_ino(path);
-	if (ino != VRS_INVALID_INO) {
-		log_msg("\nvrs_read path found");
-		vrs_inode_t inode;
-		get_inode(ino, &inode);
-		log_msg("\nvrs_read got the inode");
-		retstat = read_inode(&inode, buf, size, offset);
-		log_msg("\nData read = %s", buf);
-	}
-    else {
-		log_msg("\nvrs_read path not found");
-		retstat = -ENOENT;
-	}
+	retstat = file_read(VRS_FILE(fi), buf, size, offset);
 
     return retstat;
 }
 
 int vrs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
     int retstat = 0;
-    log_msg("\nvrs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
+    log_msg("\nvrs_write(path=\"%s\", buf=%p, size=%zu, offset=%lld, fi=%p)\n", path, buf, size, (long long)offset, fi);
 
-	uint32_t ino = path_2_ino(path);
-	if (ino != VRS_INVALID_INO) {
-		log_msg("\nvrs_write path found");
-		vrs_inode_t inode;
-		get_inode(ino, &inode);
-		retstat = write_inode(&inode, buf, size, offset);
-	}
-    else {
-		log_msg("\nvrs_write path not found");
-		retstat = -ENOENT;
-	}
+	retstat = file_write(VRS_FILE(fi), buf, size, offset);
 
     return retstat;
 }
 
 int vrs_release(const char *path, struct fuse_file_info *fi){
     int retstat = 0;
-    log_msg("\nvrs_release(path=\"%s\", fi=0x%08x)\n", path, fi);
+    log_msg("\nvrs_release(path=\"%s\", fi=%p)\n", path, fi);
 
-    // No saved data related to any file which needs to be freed.
+    vrs_file_t *file = VRS_FILE(fi);
+    if (file != NULL) {
+	close_inode(file);
+	fi->fh = 0;
+    }
 
     return retstat;
 }
 
+/** Put everything done so far on stable storage
+ *
+ * Shared by fsync and fsyncdir of both front-ends.  The whole disk goes
+ * at once, as a commit takes every operation along anyway.  Returns 0 or
+ * -EIO.
+ */
+int vrs_sync(void){
+    int retstat = journal_sync();
+    if (retstat < 0) {
+	log_warn("\nvrs_sync failed");
+	return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes never linger in the handle, and close() promises nothing about
+ * stable storage, so there is nothing to do.
+ */
+int vrs_flush(const char *path, struct fuse_file_info *fi){
+    log_msg("\nvrs_flush(path=\"%s\", fi=%p)\n", path, fi);
+
+    return 0;
+}
+
+/* File data is flushed with the metadata, so @datasync makes no difference */
+int vrs_fsync(const char *path, int datasync, struct fuse_file_info *fi){
+    log_msg("\nvrs_fsync(path=\"%s\", datasync=%d, fi=%p)\n", path, datasync, fi);
+
+    return vrs_sync();
+}
+
 int vrs_statfs(const char *path, struct statvfs *statv){
     int retstat = 0;
     char fpath[PATH_MAX];
 
-    log_msg("\nvrs_statfs(path=\"%s\", statv=0x%08x)\n", path, statv);
+    log_msg("\nvrs_statfs(path=\"%s\", statv=%p)\n", path, statv);
     vrs_fullpath(fpath, path);
 
     // get stats for underlying filesystem
@@ -388,7 +542,13 @@ int vrs_mkdir(const char *path, mode_t mode){
     int retstat = 0;
     log_msg("\nvrs_mkdir(path=\"%s\", mode=0%3o)\n", path, mode);
 
-    uint32_t ino = create_inode(path, mode);
+    // FUSE only passes the permission bits
+    uint32_t ino = VRS_INVALID_INO;
+    retstat = create_inode(path, mode | S_IFDIR, &ino);
+    if (retstat < 0) {
+	log_msg("\nvrs_mkdir could not create %s", path);
+	return retstat;
+    }
     log_msg("\nFile creation success inode = %d", ino);
 
     return retstat;
@@ -398,20 +558,27 @@ int vrs_mkdir(const char *path, mode_t mode){
 int vrs_rmdir(const char *path){
     int retstat = 0;
     log_msg("vrs_rmdir(path=\"%s\")\n", path);
+    retstat = remove_directory(path);
 
     return retstat;
 }
 
 int vrs_opendir(const char *path, struct fuse_file_info *fi){
-    int retstat = 0;
-    log_msg("\nvrs_opendir(path=\"%s\", fi=0x%08x)\n", path, fi);
+    int retstat = -ENOENT;
+    log_msg("\nvrs_opendir(path=\"%s\", fi=%p)\n", path, fi);
 
 	uint32_t ino = path_2_ino(path);
 	if (ino != VRS_INVALID_INO) {
         vrs_inode_t inode;
         get_inode(ino, &inode);
-        if (S_ISDIR(inode.mode)) {
-			retstat = 0;
+        if (!S_ISDIR(inode.mode)) {
+			return -ENOTDIR;
+        }
+
+        vrs_file_t *file = NULL;
+        retstat = open_inode(ino, &file);
+        if (retstat == 0) {
+			fi->fh = (uintptr_t)file;
         }
     }
     else {
@@ -421,52 +588,221 @@ int vrs_opendir(const char *path, struct fuse_file_info *fi){
     return retstat;
 }
 
-int vrs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi){
-    int retstat = 0;
+/*
+ * readdir cookies: "." and ".." come first, then each entry is known by
+ * its key (iterate_dentries()), which only depends on its name.  A later
+ * call resumes right after the last entry that fit however the directory
+ * changed meanwhile: entries are neither listed twice nor skipped, bar
+ * those added or removed in between.  The offset handed to filler is the
+ * entry's key plus one, the lowest key to resume from.
+ */
+#define VRS_READDIR_DOT 0
+#define VRS_READDIR_DOTDOT 1
+#define VRS_READDIR_SLOTS 2
+
+/* Entries handed to filler together, their inodes read in one go */
+#define VRS_READDIR_BATCH 64
+
+typedef struct {
+	void *buf;
+	vrs_fill_t filler;
+	uint32_t ino_dir;
+	int count;
+	int filled;		/* Whether filler has taken an entry */
+	vrs_dentry_t dentries[VRS_READDIR_BATCH];
+	uint64_t keys[VRS_READDIR_BATCH];
+	uint32_t inos[VRS_READDIR_BATCH];
+} vrs_readdir_ctx;
 
-    log_msg("\nvrs_readdir(path=\"%s\")\n", path);
+/*
+ * Pass the batched entries to filler along with their attributes, so
+ * listing a directory does not cost a getattr per entry.  The names go
+ * into the dentry cache too, for the lookups that usually follow, but at
+ * its cold end so that listing a large directory does not flush it.
+ * Returns non-zero once filler is full.
+ */
+static int vrs_readdir_flush(vrs_readdir_ctx *ctx) {
+	icache_prefetch(&VRS_DATA->icache, ctx->inos, ctx->count);
 
-    filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-	uint32_t ino = path_2_ino(path);
-	if (ino != VRS_INVALID_INO) {
-		log_msg("\nvrs_readdir path found");
+	int retstat = 0;
+	int i = 0;
+	for (i = 0; (i < ctx->count) && (retstat == 0); ++i) {
 		vrs_inode_t inode;
-		get_inode(ino, &inode);
+		struct stat statbuf;
+		get_inode(ctx->inos[i], &inode);
+		memset(&statbuf, 0, sizeof(statbuf));
+		fill_stat_from_ino(&inode, &statbuf);
+		dcache_add_cold(&VRS_DATA->dcache, ctx->ino_dir, ctx->dentries[i].name, ctx->inos[i]);
+		retstat = ctx->filler(ctx->buf, ctx->dentries[i].name, &statbuf, VRS_READDIR_SLOTS + (off_t)ctx->keys[i] + 1);
+		ctx->filled |= (retstat == 0);
+	}
+	ctx->count = 0;
 
-		int num_dentries = (inode.size / VRS_DENTRY_SIZE);
-		vrs_dentry_t* dentries = malloc(sizeof(vrs_dentry_t) * num_dentries);
-	    read_dentries(&inode, dentries);
+	return retstat;
+}
+
+static int vrs_readdir_entry(void *arg, const vrs_dentry_t *dentry, uint64_t key) {
+	vrs_readdir_ctx *ctx = arg;
+	ctx->dentries[ctx->count] = *dentry;
+	ctx->keys[ctx->count] = key;
+	ctx->inos[ctx->count] = dentry->inode_number;
+	if (++ctx->count < VRS_READDIR_BATCH) {
+		return 0;
+	}
+
+	return vrs_readdir_flush(ctx);
+}
 
-	    int i = 0;
-	    for (i = 0; i < num_dentries; ++i) {
-	    	filler(buf, dentries[i].name, NULL, 0);
-	    }
+/*
+ * List directory @ino from cookie @offset on, through @filler until it
+ * reports a full buffer.  Shared by both front-ends.  An error hit after
+ * some entries went to @filler is kept in @file, if there is one, and
+ * returned by the next call instead, so the entries are not lost.
+ */
+int vrs_readdir_ino(uint32_t ino, vrs_file_t *file, off_t offset, vrs_fill_t filler, void *buf){
+    int retstat = 0;
 
-	    free(dentries);
+	if ((file != NULL) && (file->readdir_error < 0)) {
+		retstat = file->readdir_error;
+		file->readdir_error = 0;
+		return retstat;
 	}
-    else {
-		log_msg("\nvrs_readdir path not found");
+
+	vrs_inode_t inode;
+	get_inode(ino, &inode);
+	struct stat statbuf;
+	memset(&statbuf, 0, sizeof(statbuf));
+	fill_stat_from_ino(&inode, &statbuf);
+
+	int filled = 0;
+	if (offset <= VRS_READDIR_DOT) {
+		if (filler(buf, ".", &statbuf, VRS_READDIR_DOT + 1)) {
+			return retstat;
+		}
+		filled = 1;
+	}
+	if (offset <= VRS_READDIR_DOTDOT) {
+		if (filler(buf, "..", NULL, VRS_READDIR_DOTDOT + 1)) {
+			return retstat;
+		}
+		filled = 1;
 	}
 
+	uint64_t from = (offset > VRS_READDIR_SLOTS) ? (uint64_t)(offset - VRS_READDIR_SLOTS) : 0;
+	vrs_readdir_ctx *ctx = malloc(sizeof(vrs_readdir_ctx));
+	if (ctx == NULL) {
+		return -ENOMEM;
+	}
+	ctx->buf = buf;
+	ctx->filler = filler;
+	ctx->ino_dir = ino;
+	ctx->count = 0;
+	ctx->filled = filled;
+
+	// Entries go into the dentry cache too, which only stays in step with
+	// the directory if nothing changes it meanwhile
+	inode_lock_shared(ino);
+	get_inode(ino, &inode);
+	retstat = iterate_dentries(&inode, from, vrs_readdir_entry, ctx);
+	if ((retstat <= 0) && (ctx->count > 0)) {
+		vrs_readdir_flush(ctx);
+	}
+	inode_unlock(ino);
+
+	if (retstat > 0) {
+		retstat = 0;
+	} else if ((retstat < 0) && ctx->filled) {
+		log_msg("\nvrs_readdir_ino error %d after listing entries, reported next", retstat);
+		if (file != NULL) {
+			file->readdir_error = retstat;
+		}
+		retstat = 0;
+	}
+	free(ctx);
+
     return retstat;
 }
 
+static uint32_t vrs_readdir_dir(const char *path, struct fuse_file_info *fi){
+	vrs_file_t *file = VRS_FILE(fi);
+	uint32_t ino = (file != NULL) ? file->ino : path_2_ino(path);
+	if (ino == VRS_INVALID_INO) {
+		log_msg("\nvrs_readdir path not found");
+	}
+
+	return ino;
+}
+
+#ifdef HAVE_FUSE3
+// FUSE 3 filler, and whether it asked for readdirplus
+typedef struct {
+	void *buf;
+	fuse_fill_dir_t filler;
+	enum fuse_fill_dir_flags flags;
+} vrs_fill3_buf;
+
+static int vrs_fill3(void *buf, const char *name, const struct stat *statbuf, off_t offset){
+	vrs_fill3_buf *fb = buf;
+
+	// Every entry but ".." comes with its full attributes
+	return fb->filler(fb->buf, name, statbuf, offset, (statbuf != NULL) ? fb->flags : 0);
+}
+
+int vrs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+		enum fuse_readdir_flags flags){
+    log_msg("\nvrs_readdir(path=\"%s\", offset=%lld, flags=0x%x)\n", path, (long long)offset, (unsigned)flags);
+
+	uint32_t ino = vrs_readdir_dir(path, fi);
+	if (ino == VRS_INVALID_INO) {
+		return -ENOENT;
+	}
+
+	vrs_fill3_buf fb = { buf, filler, (flags & FUSE_READDIR_PLUS) ? FUSE_FILL_DIR_PLUS : 0 };
+	return vrs_readdir_ino(ino, VRS_FILE(fi), offset, vrs_fill3, &fb);
+}
+#else
+int vrs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi){
+    log_msg("\nvrs_readdir(path=\"%s\", offset=%lld)\n", path, (long long)offset);
+
+	uint32_t ino = vrs_readdir_dir(path, fi);
+	if (ino == VRS_INVALID_INO) {
+		return -ENOENT;
+	}
+
+	return vrs_readdir_ino(ino, VRS_FILE(fi), offset, filler, buf);
+}
+#endif
+
 int vrs_releasedir(const char *path, struct fuse_file_info *fi){
     int retstat = 0;
 
-    log_msg("\nvrs_releasedir(path=\"%s\", fi=0x%08x)\n", path, fi);
+    log_msg("\nvrs_releasedir(path=\"%s\", fi=%p)\n", path, fi);
     log_fi(fi);
-    closedir((DIR *) (uintptr_t) fi->fh);
+
+    vrs_file_t *file = VRS_FILE(fi);
+    if (file != NULL) {
+	close_inode(file);
+	fi->fh = 0;
+    }
 
     return retstat;
 }
 
+int vrs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi){
+    log_msg("\nvrs_fsyncdir(path=\"%s\", datasync=%d, fi=%p)\n", path, datasync, fi);
+
+    return vrs_sync();
+}
+
 struct fuse_operations vrs_oper = {
     .init = vrs_init,
     .destroy = vrs_destroy,
+#ifdef HAVE_FUSE3
+    .getattr = vrs_getattr_fi,
+#else
     .getattr = vrs_getattr,
     .fgetattr = vrs_fgetattr,
+#endif
 
     .create = vrs_create,
     .unlink = vrs_unlink,
@@ -475,6 +811,8 @@ struct fuse_operations vrs_oper = {
     .release = vrs_release,
     .read = vrs_read,
     .write = vrs_write,
+    .flush = vrs_flush,
+    .fsync = vrs_fsync,
     .statfs = vrs_statfs,
 
     .mkdir = vrs_mkdir,
@@ -482,17 +820,57 @@ struct fuse_operations vrs_oper = {
 
     .opendir = vrs_opendir,
     .readdir = vrs_readdir,
-    .releasedir = vrs_releasedir
+    .releasedir = vrs_releasedir,
+    .fsyncdir = vrs_fsyncdir
 };
 
 void vrs_usage(){
     fprintf(stderr, "usage:  ./sfs [FUSE and mount options] rootDir mountPoint\n");
+    fprintf(stderr, "VRS options:\n");
+    fprintf(stderr, "    -o cache_size=N        block cache memory budget in bytes (default %d, 0 keeps nothing between operations)\n", BLOCK_CACHE_SIZE_DEFAULT);
+    fprintf(stderr, "    -o icache_size=N       number of inodes cached in memory (default %d)\n", ICACHE_SIZE_DEFAULT);
+    fprintf(stderr, "    -o dcache_size=N       number of directory entries cached in memory (default %d, 0 disables)\n", DCACHE_SIZE_DEFAULT);
+    fprintf(stderr, "    -o prealloc=N          blocks preallocated past the end of a growing file (default %d)\n", VRS_PREALLOC_DEFAULT);
+    fprintf(stderr, "    -o [no]extents         map new files with extents rather than block pointers (default on)\n");
+    fprintf(stderr, "    -o lowlevel            serve requests by inode number through the low-level FUSE API\n");
+    fprintf(stderr, "    -o [no]writeback       let the kernel cache writes, FUSE 3 builds only (default on)\n");
+    fprintf(stderr, "    -o block_size=N        block size of a newly formatted disk, %d to %d (default %d)\n",
+	    BLOCK_SIZE_MIN, BLOCK_SIZE_MAX, BLOCK_SIZE_DEFAULT);
+    fprintf(stderr, "    -o ninodes=N           number of inodes of a newly formatted disk (default %d)\n", VRS_NINODES_DEFAULT);
+    fprintf(stderr, "    -o journal=N           journal blocks of a newly formatted disk, 0 for none (default %d)\n",
+	    VRS_JOURNAL_BLOCKS_DEFAULT);
+    fprintf(stderr, "    -o durability=MODE     when changes reach the disk: sync before each call returns,\n");
+    fprintf(stderr, "                           fsync-only when fsync() asks, or periodic (default)\n");
+    fprintf(stderr, "    -o commit=N            milliseconds between periodic commits (default %d)\n", VRS_JOURNAL_COMMIT_MS);
+    fprintf(stderr, "    -o loglevel=N          0 logs nothing, then errors, warnings, info and debug up to %d (default %d)\n",
+	    VRS_LOG_LEVEL, VRS_LOG_LEVEL_DEFAULT);
+    fprintf(stderr, "                           SIGUSR1 and SIGUSR2 raise and lower it while mounted\n");
     abort();
 }
 
+static struct fuse_opt vrs_opts[] = {
+    { "cache_size=%lu", offsetof(struct vrs_state, cache_size), 0 },
+    { "block_size=%u", offsetof(struct vrs_state, block_size), 0 },
+    { "ninodes=%u", offsetof(struct vrs_state, ninodes), 0 },
+    { "journal=%u", offsetof(struct vrs_state, journal_blocks), 0 },
+    { "durability=periodic", offsetof(struct vrs_state, durability), VRS_DURABILITY_PERIODIC },
+    { "durability=fsync-only", offsetof(struct vrs_state, durability), VRS_DURABILITY_FSYNC },
+    { "durability=sync", offsetof(struct vrs_state, durability), VRS_DURABILITY_SYNC },
+    { "commit=%u", offsetof(struct vrs_state, commit_ms), 0 },
+    { "icache_size=%u", offsetof(struct vrs_state, icache_size), 0 },
+    { "dcache_size=%u", offsetof(struct vrs_state, dcache_size), 0 },
+    { "prealloc=%u", offsetof(struct vrs_state, prealloc_blocks), 0 },
+    { "extents", offsetof(struct vrs_state, extents), 1 },
+    { "noextents", offsetof(struct vrs_state, extents), 0 },
+    { "lowlevel", offsetof(struct vrs_state, lowlevel), 1 },
+    { "writeback", offsetof(struct vrs_state, writeback), 1 },
+    { "nowriteback", offsetof(struct vrs_state, writeback), 0 },
+    { "loglevel=%u", offsetof(struct vrs_state, log_level), 0 },
+    FUSE_OPT_END
+};
+
 int main(int argc, char *argv[]){
     int fuse_stat;
-    struct vrs_state *vrs_data;
 
     // Perform some sanity checking on the command line:  make sure
     // there are enough arguments, and that neither of the last two
@@ -502,11 +880,23 @@ int main(int argc, char *argv[]){
     if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
 	vrs_usage();
 
-    vrs_data = malloc(sizeof(struct vrs_state));
+    vrs_data = calloc(1, sizeof(struct vrs_state));
     if (vrs_data == NULL) {
 	       perror("main calloc");
 	       abort();
     }
+    vrs_data->cache_size = BLOCK_CACHE_SIZE_DEFAULT;
+    vrs_data->block_size = BLOCK_SIZE_DEFAULT;
+    vrs_data->ninodes = VRS_NINODES_DEFAULT;
+    vrs_data->journal_blocks = VRS_JOURNAL_BLOCKS_DEFAULT;
+    vrs_data->durability = VRS_DURABILITY_PERIODIC;
+    vrs_data->commit_ms = VRS_JOURNAL_COMMIT_MS;
+    vrs_data->icache_size = ICACHE_SIZE_DEFAULT;
+    vrs_data->dcache_size = DCACHE_SIZE_DEFAULT;
+    vrs_data->prealloc_blocks = VRS_PREALLOC_DEFAULT;
+    vrs_data->extents = 1;
+    vrs_data->writeback = 1;
+    vrs_data->log_level = VRS_LOG_LEVEL_DEFAULT;
 
     // Pull the diskfile out of the argument list and save it in my internal data
     vrs_data->diskfile = realpath(argv[argc-2], NULL);
@@ -514,12 +904,34 @@ int main(int argc, char *argv[]){
     argv[argc-1] = NULL;
     argc--;
 
+    // Pick out our own -o options, everything else goes to fuse
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, vrs_data, vrs_opts, NULL) == -1)
+	vrs_usage();
+
+#ifdef HAVE_FUSE3
+    // Worker threads each get their own /dev/fuse descriptor, unless -s
+    // keeps a single thread anyway
+    fuse_opt_add_arg(&args, "-oclone_fd");
+#endif
+
     vrs_data->logfile = log_open();
+    log_set_level(vrs_data->log_level);
 
     // turn over control to fuse
-    fprintf(stderr, "about to call fuse_main\n");
-    fuse_stat = fuse_main(argc, argv, &vrs_oper, vrs_data);
-    fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+    if (vrs_data->lowlevel) {
+	fuse_stat = vrs_ll_main(&args);
+    } else {
+	// Removing an open file makes it an orphan until its last release,
+	// rather than the .fuse_hidden rename the library does by default,
+	// which needs a rename handler
+	fuse_opt_add_arg(&args, "-ohard_remove");
+	fprintf(stderr, "about to call fuse_main\n");
+	fuse_stat = fuse_main(args.argc, args.argv, &vrs_oper, vrs_data);
+	fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+    }
+
+    fuse_opt_free_args(&args);
 
     return fuse_stat;
 }
@@ -0,0 +1,538 @@
+/*
+ * sfs_ll.c
+ *
+ * Inode-based front-end, see sfs_ll.h.
+ */
+
+#include "config.h"
+#include "params.h"
+#include "block.h"
+#include "inode.h"
+#include "log.h"
+#include "sfs_ll.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_FUSE3
+#include <fuse3/fuse_lowlevel.h>
+#else
+#include <fuse_lowlevel.h>
+#endif
+
+// The root is inode 0 on disk and FUSE_ROOT_ID for the kernel, which
+// never uses 0, so every inode number is shifted by one
+#define VRS_LL_INO(ino) ((fuse_ino_t)(ino) + FUSE_ROOT_ID)
+#define VRS_INO(fino) ((uint32_t)((fino) - FUSE_ROOT_ID))
+
+// How long the kernel may trust the names and attributes it gets, in
+// seconds.  Nothing but this process changes the disk.
+#define VRS_LL_TIMEOUT 1.0
+
+#define VRS_LL_FILE(fi) ((vrs_file_t *)(uintptr_t)(fi)->fh)
+
+static int vrs_ll_valid(fuse_ino_t fino) {
+	return inode_exists(VRS_INO(fino));
+}
+
+static void vrs_ll_stat(uint32_t ino, struct stat *statbuf) {
+	vrs_inode_t inode;
+	get_inode(ino, &inode);
+	memset(statbuf, 0, sizeof(*statbuf));
+	fill_stat_from_ino(&inode, statbuf);
+	statbuf->st_ino = VRS_LL_INO(ino);
+}
+
+static void vrs_ll_entry(const vrs_inode_t *inode, struct fuse_entry_param *e) {
+	memset(e, 0, sizeof(*e));
+	e->ino = VRS_LL_INO(inode->ino);
+	e->generation = inode->generation;
+	e->attr_timeout = VRS_LL_TIMEOUT;
+	e->entry_timeout = VRS_LL_TIMEOUT;
+	fill_stat_from_ino(inode, &e->attr);
+	e->attr.st_ino = e->ino;
+}
+
+/*
+ * Reply with the entry of @inode, whose reference the caller counted
+ * with inode_ref() or lookup_inode_at(): the kernel keeps it until it
+ * forgets the inode.  A reply that doesn't get through drops it again.
+ */
+static void vrs_ll_reply_entry(fuse_req_t req, const vrs_inode_t *inode) {
+	struct fuse_entry_param e;
+	vrs_ll_entry(inode, &e);
+	if (fuse_reply_entry(req, &e) != 0) {
+		inode_forget(inode->ino, 1);
+	}
+}
+
+/* Hand a new handle to the kernel, taking it back if the request is gone */
+static void vrs_ll_reply_open(fuse_req_t req, struct fuse_file_info *fi, vrs_file_t *file) {
+	fi->fh = (uintptr_t)file;
+	if (fuse_reply_open(req, fi) != 0) {
+		close_inode(file);
+	}
+}
+
+static void vrs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+	vrs_mount(conn);
+}
+
+static void vrs_ll_destroy(void *userdata) {
+	vrs_destroy(userdata);
+}
+
+static void vrs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	log_msg("\nvrs_ll_lookup(parent=%lu, name=\"%s\")\n", (unsigned long)parent, name);
+
+	vrs_inode_t inode;
+	if (lookup_inode_at(VRS_INO(parent), name, &inode) < 0) {
+		// An entry without an inode lets the kernel cache the miss
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = VRS_LL_TIMEOUT;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	vrs_ll_reply_entry(req, &inode);
+}
+
+/*
+ * The kernel drops @nlookup of the references its entry replies gave it.
+ * A removed inode goes with the last of them, unless it is still open.
+ */
+#ifdef HAVE_FUSE3
+static void vrs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+#else
+static void vrs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+#endif
+	log_msg("\nvrs_ll_forget(ino=%lu, nlookup=%llu)\n", (unsigned long)ino, (unsigned long long)nlookup);
+
+	inode_forget(VRS_INO(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void vrs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	log_msg("\nvrs_ll_getattr(ino=%lu)\n", (unsigned long)ino);
+
+	if (!vrs_ll_valid(ino)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	struct stat statbuf;
+	vrs_ll_stat(VRS_INO(ino), &statbuf);
+	fuse_reply_attr(req, &statbuf, VRS_LL_TIMEOUT);
+}
+
+static void vrs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	log_msg("\nvrs_ll_mkdir(parent=%lu, name=\"%s\", mode=0%3o)\n", (unsigned long)parent, name, mode);
+
+	uint32_t ino = VRS_INVALID_INO;
+	vrs_inode_t inode;
+	int retstat = create_inode_at(VRS_INO(parent), name, mode | S_IFDIR, &ino);
+	if (retstat == 0) {
+		retstat = inode_ref(ino, &inode);
+	}
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+		return;
+	}
+
+	vrs_ll_reply_entry(req, &inode);
+}
+
+static void vrs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	log_msg("\nvrs_ll_unlink(parent=%lu, name=\"%s\")\n", (unsigned long)parent, name);
+	fuse_reply_err(req, -remove_inode_at(VRS_INO(parent), name, 0));
+}
+
+static void vrs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	log_msg("\nvrs_ll_rmdir(parent=%lu, name=\"%s\")\n", (unsigned long)parent, name);
+	fuse_reply_err(req, -remove_inode_at(VRS_INO(parent), name, 1));
+}
+
+static void vrs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+		struct fuse_file_info *fi) {
+	log_msg("\nvrs_ll_create(parent=%lu, name=\"%s\", mode=0%03o)\n", (unsigned long)parent, name, mode);
+
+	uint32_t ino = VRS_INVALID_INO;
+	int retstat = create_inode_at(VRS_INO(parent), name, mode, &ino);
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+		return;
+	}
+
+	vrs_file_t *file = NULL;
+	retstat = open_inode(ino, &file);
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+		return;
+	}
+	vrs_inode_t inode;
+	retstat = inode_ref(ino, &inode);
+	if (retstat < 0) {
+		close_inode(file);
+		fuse_reply_err(req, -retstat);
+		return;
+	}
+	fi->fh = (uintptr_t)file;
+
+	struct fuse_entry_param e;
+	vrs_ll_entry(&inode, &e);
+	if (fuse_reply_create(req, &e, fi) != 0) {
+		close_inode(file);
+		inode_forget(ino, 1);
+	}
+}
+
+static void vrs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	log_msg("\nvrs_ll_open(ino=%lu)\n", (unsigned long)ino);
+
+	if (!vrs_ll_valid(ino)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	vrs_inode_t inode;
+	get_inode(VRS_INO(ino), &inode);
+	if (S_ISDIR(inode.mode)) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+
+	vrs_file_t *file = NULL;
+	int retstat = open_inode(VRS_INO(ino), &file);
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+		return;
+	}
+	vrs_ll_reply_open(req, fi, file);
+}
+
+static void vrs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+	log_msg("\nvrs_ll_read(ino=%lu, size=%d, offset=%lld)\n", (unsigned long)ino, (int)size, (long long)offset);
+
+	char *buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	int retstat = file_read(VRS_LL_FILE(fi), buf, size, offset);
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+	} else {
+		fuse_reply_buf(req, buf, retstat);
+	}
+
+	free(buf);
+}
+
+static void vrs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi) {
+	log_msg("\nvrs_ll_write(ino=%lu, size=%d, offset=%lld)\n", (unsigned long)ino, (int)size, (long long)offset);
+
+	int retstat = file_write(VRS_LL_FILE(fi), buf, size, offset);
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+	} else {
+		fuse_reply_write(req, retstat);
+	}
+}
+
+static void vrs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	log_msg("\nvrs_ll_release(ino=%lu)\n", (unsigned long)ino);
+
+	close_inode(VRS_LL_FILE(fi));
+	fuse_reply_err(req, 0);
+}
+
+// Nothing is buffered in a handle, see vrs_flush()
+static void vrs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	log_msg("\nvrs_ll_flush(ino=%lu)\n", (unsigned long)ino);
+
+	fuse_reply_err(req, 0);
+}
+
+static void vrs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	log_msg("\nvrs_ll_fsync(ino=%lu, datasync=%d)\n", (unsigned long)ino, datasync);
+
+	fuse_reply_err(req, -vrs_sync());
+}
+
+static void vrs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	log_msg("\nvrs_ll_opendir(ino=%lu)\n", (unsigned long)ino);
+
+	if (!vrs_ll_valid(ino)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	vrs_inode_t inode;
+	get_inode(VRS_INO(ino), &inode);
+	if (!S_ISDIR(inode.mode)) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	vrs_file_t *file = NULL;
+	int retstat = open_inode(VRS_INO(ino), &file);
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+		return;
+	}
+	vrs_ll_reply_open(req, fi, file);
+}
+
+// Reply buffer of a readdir request, filled by vrs_readdir_ino()
+typedef struct {
+	fuse_req_t req;
+	fuse_ino_t ino_dir;
+	char *buf;
+	size_t size;
+	size_t used;
+	uint32_t *refs;		/* Inodes readdirplus counted a reference on */
+	size_t nrefs;
+	size_t maxrefs;
+} vrs_ll_dirbuf;
+
+#ifdef HAVE_FUSE3
+/*
+ * Same as vrs_ll_fill() for readdirplus, which hands the kernel full
+ * entries so it does not look each name up again.  Each of them counts
+ * as a lookup, but for "." and "..".  ".." goes without an entry, an
+ * inode number of 0 tells the kernel so.
+ */
+static int vrs_ll_fill_plus(void *buf, const char *name, const struct stat *statbuf, off_t offset) {
+	vrs_ll_dirbuf *db = buf;
+
+	// Only an entry that fits counts
+	if (fuse_add_direntry_plus(db->req, NULL, 0, name, NULL, 0) > db->size - db->used) {
+		return 1;
+	}
+
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	if (statbuf == NULL) {
+		e.attr.st_ino = db->ino_dir;
+		e.attr.st_mode = S_IFDIR;
+	} else if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+		e.ino = VRS_LL_INO(statbuf->st_ino);
+		e.attr = *statbuf;
+		e.attr.st_ino = e.ino;
+	} else {
+		if (db->nrefs == db->maxrefs) {
+			size_t maxrefs = (db->maxrefs == 0) ? 64 : (2 * db->maxrefs);
+			uint32_t *refs = realloc(db->refs, maxrefs * sizeof(uint32_t));
+			if (refs == NULL) {
+				return 1;
+			}
+			db->refs = refs;
+			db->maxrefs = maxrefs;
+		}
+
+		vrs_inode_t inode;
+		if (inode_ref(statbuf->st_ino, &inode) < 0) {
+			return 0;
+		}
+		db->refs[db->nrefs++] = inode.ino;
+		vrs_ll_entry(&inode, &e);
+	}
+
+	db->used += fuse_add_direntry_plus(db->req, db->buf + db->used, db->size - db->used, name, &e, offset);
+
+	return 0;
+}
+#endif
+
+static int vrs_ll_fill(void *buf, const char *name, const struct stat *statbuf, off_t offset) {
+	vrs_ll_dirbuf *db = buf;
+
+	// Only the inode number and the file type matter to the kernel
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	if (statbuf != NULL) {
+		st.st_ino = VRS_LL_INO(statbuf->st_ino);
+		st.st_mode = statbuf->st_mode;
+	} else {
+		st.st_ino = db->ino_dir;
+		st.st_mode = S_IFDIR;
+	}
+
+	size_t entsize = fuse_add_direntry(db->req, db->buf + db->used, db->size - db->used, name, &st, offset);
+	if (entsize > db->size - db->used) {
+		return 1;
+	}
+	db->used += entsize;
+
+	return 0;
+}
+
+static void vrs_ll_list(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi,
+		vrs_fill_t fill) {
+	vrs_ll_dirbuf db = { req, ino, malloc(size), size, 0, NULL, 0, 0 };
+	if (db.buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	int retstat = vrs_readdir_ino(VRS_LL_FILE(fi)->ino, VRS_LL_FILE(fi), offset, fill, &db);
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+	} else if (fuse_reply_buf(req, db.buf, db.used) == 0) {
+		db.nrefs = 0; // The kernel holds them now
+	}
+
+	// Entries the kernel never got, it won't forget either
+	size_t i = 0;
+	for (i = 0; i < db.nrefs; ++i) {
+		inode_forget(db.refs[i], 1);
+	}
+
+	free(db.refs);
+	free(db.buf);
+}
+
+static void vrs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+	log_msg("\nvrs_ll_readdir(ino=%lu, size=%d, offset=%lld)\n", (unsigned long)ino, (int)size, (long long)offset);
+	vrs_ll_list(req, ino, size, offset, fi, vrs_ll_fill);
+}
+
+#ifdef HAVE_FUSE3
+static void vrs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+	log_msg("\nvrs_ll_readdirplus(ino=%lu, size=%d, offset=%lld)\n", (unsigned long)ino, (int)size, (long long)offset);
+	vrs_ll_list(req, ino, size, offset, fi, vrs_ll_fill_plus);
+}
+#endif
+
+static void vrs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	log_msg("\nvrs_ll_releasedir(ino=%lu)\n", (unsigned long)ino);
+
+	close_inode(VRS_LL_FILE(fi));
+	fuse_reply_err(req, 0);
+}
+
+static void vrs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	log_msg("\nvrs_ll_fsyncdir(ino=%lu, datasync=%d)\n", (unsigned long)ino, datasync);
+
+	fuse_reply_err(req, -vrs_sync());
+}
+
+static void vrs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+	struct statvfs statv;
+	int retstat = vrs_statfs("/", &statv);
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+	} else {
+		fuse_reply_statfs(req, &statv);
+	}
+}
+
+static struct fuse_lowlevel_ops vrs_ll_oper = {
+    .init = vrs_ll_init,
+    .destroy = vrs_ll_destroy,
+    .lookup = vrs_ll_lookup,
+    .forget = vrs_ll_forget,
+    .getattr = vrs_ll_getattr,
+
+    .create = vrs_ll_create,
+    .unlink = vrs_ll_unlink,
+
+    .open = vrs_ll_open,
+    .release = vrs_ll_release,
+    .read = vrs_ll_read,
+    .write = vrs_ll_write,
+    .flush = vrs_ll_flush,
+    .fsync = vrs_ll_fsync,
+    .statfs = vrs_ll_statfs,
+
+    .mkdir = vrs_ll_mkdir,
+    .rmdir = vrs_ll_rmdir,
+
+    .opendir = vrs_ll_opendir,
+    .readdir = vrs_ll_readdir,
+#ifdef HAVE_FUSE3
+    .readdirplus = vrs_ll_readdirplus,
+#endif
+    .releasedir = vrs_ll_releasedir,
+    .fsyncdir = vrs_ll_fsyncdir
+};
+
+#ifdef HAVE_FUSE3
+/** Mount and serve requests through the low-level API until unmounted
+ *
+ * Requests are spread over worker threads, each reading its own clone
+ * of /dev/fuse, unless -s asks for a single thread.  Returns the exit
+ * status for main().
+ */
+int vrs_ll_main(struct fuse_args *args) {
+	struct fuse_cmdline_opts opts;
+	int retstat = 1;
+
+	if (fuse_parse_cmdline(args, &opts) != 0) {
+		return 1;
+	}
+
+	struct fuse_session *se = fuse_session_new(args, &vrs_ll_oper, sizeof(vrs_ll_oper), VRS_DATA);
+	if (se != NULL) {
+		if (fuse_set_signal_handlers(se) == 0) {
+			if (fuse_session_mount(se, opts.mountpoint) == 0) {
+				fuse_daemonize(opts.foreground);
+				if (opts.singlethread) {
+					retstat = fuse_session_loop(se);
+				} else {
+					struct fuse_loop_config config;
+					config.clone_fd = opts.clone_fd;
+					config.max_idle_threads = opts.max_idle_threads;
+					retstat = fuse_session_loop_mt(se, &config);
+				}
+				retstat = (retstat == 0) ? 0 : 1;
+				fuse_session_unmount(se);
+			}
+			fuse_remove_signal_handlers(se);
+		}
+		fuse_session_destroy(se);
+	}
+
+	free(opts.mountpoint);
+	return retstat;
+}
+#else
+/** Mount and serve requests through the low-level API until unmounted
+ *
+ * Requests are spread over worker threads unless -s asks for a single
+ * thread.  Returns the exit status for main().
+ */
+int vrs_ll_main(struct fuse_args *args) {
+	char *mountpoint = NULL;
+	int multithreaded = 0;
+	int foreground = 0;
+	int retstat = 1;
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {
+		return 1;
+	}
+
+	struct fuse_chan *ch = fuse_mount(mountpoint, args);
+	if (ch != NULL) {
+		struct fuse_session *se = fuse_lowlevel_new(args, &vrs_ll_oper, sizeof(vrs_ll_oper), VRS_DATA);
+		if (se != NULL) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				retstat = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				retstat = (retstat == 0) ? 0 : 1;
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+
+	free(mountpoint);
+	return retstat;
+}
+#endif
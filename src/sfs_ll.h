@@ -0,0 +1,34 @@
+/*
+ * sfs_ll.h
+ *
+ * Front-end for the low-level FUSE API, selected with -o lowlevel.  The
+ * kernel names files by inode number there, so requests reach the core
+ * in inode.c without paths being built by libfuse or walked again by
+ * us.  The parts of sfs.c both front-ends share are declared here too.
+ */
+
+#ifndef SRC_SFS_LL_H_
+#define SRC_SFS_LL_H_
+
+#include <stdint.h>
+#include <sys/statvfs.h>
+
+#include "params.h"
+#include "inode.h"
+
+void vrs_mount(struct fuse_conn_info *conn);
+
+void vrs_destroy(void *userdata);
+
+int vrs_statfs(const char *path, struct statvfs *statv);
+
+int vrs_sync(void);
+
+/* Called by vrs_readdir_ino() for each entry, as fuse_fill_dir_t is in FUSE 2 */
+typedef int (*vrs_fill_t)(void *buf, const char *name, const struct stat *statbuf, off_t offset);
+
+int vrs_readdir_ino(uint32_t ino, vrs_file_t *file, off_t offset, vrs_fill_t filler, void *buf);
+
+int vrs_ll_main(struct fuse_args *args);
+
+#endif /* SRC_SFS_LL_H_ */
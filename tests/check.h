@@ -0,0 +1,48 @@
+/*
+  Helpers shared by the tests under make check.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Unlike assert(), not compiled out by NDEBUG
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+/* Name of a scratch disk image for this test, removed before use */
+static const char *check_image(const char *name)
+{
+	static char path[256];
+	snprintf(path, sizeof(path), "%s.img", name);
+	unlink(path);
+	return path;
+}
+
+/* Copy the disk as it is now, as a crash would leave it */
+static void check_copy(const char *from, const char *to)
+{
+	static char buf[1 << 16];
+	ssize_t n = 0;
+	int in = open(from, O_RDONLY);
+	int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	CHECK((in >= 0) && (out >= 0));
+	while ((n = read(in, buf, sizeof(buf))) > 0)
+		CHECK(write(out, buf, n) == n);
+	close(in);
+	close(out);
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+  The in-memory allocator: every object is handed out once until all
+  are taken, freed objects come back, loading marks the bitmap's used
+  bits, and the summary keeps up with words filling and emptying.
+*/
+
+#include "config.h"
+#include "alloc.h"
+#include "bitmap.h"
+#include "check.h"
+
+// Two summary words and a partial map word at the end
+#define NBITS (64 * 64 + 64 * 3 + 37)
+
+static uint8_t taken[NBITS];
+
+static void check_exhaust(vrs_allocator *alloc, uint32_t nfree)
+{
+	uint32_t i = 0, bit = 0;
+
+	memset(taken, 0, sizeof(taken));
+	for (i = 0; i < nfree; ++i) {
+		bit = alloc_get(alloc);
+		CHECK(bit < NBITS);
+		CHECK(!taken[bit]);
+		taken[bit] = 1;
+	}
+	CHECK(alloc_nfree(alloc) == 0);
+	CHECK(alloc_get(alloc) == NBITS);
+}
+
+int main(int argc, char *argv[])
+{
+	vrs_allocator alloc;
+	uint8_t bitmap[NBITS / 8 + 8];
+	uint32_t i = 0;
+
+	CHECK(alloc_init(&alloc, NBITS) == 0);
+	CHECK(alloc_nfree(&alloc) == NBITS);
+	check_exhaust(&alloc, NBITS);
+
+	// Frees anywhere are found again, the search wrapping around from
+	// the end of the map where the last one left off
+	CHECK(alloc_put(&alloc, 5) == 0);
+	CHECK(alloc_put(&alloc, 64 * 64 + 1) == 0);
+	CHECK(alloc_put(&alloc, NBITS - 1) == 0);
+	CHECK(alloc_put(&alloc, 5) == -1);
+	CHECK(alloc_put(&alloc, NBITS) == -1);
+	CHECK(!alloc_is_used(&alloc, 5) && alloc_is_used(&alloc, 6));
+	CHECK(alloc_nfree(&alloc) == 3);
+	CHECK(alloc_get(&alloc) == 5);
+	CHECK(alloc_get(&alloc) == 64 * 64 + 1);
+	CHECK(alloc_get(&alloc) == NBITS - 1);
+	CHECK(alloc_get(&alloc) == NBITS);
+
+	// Free whole words so the summary has to open them again
+	for (i = 128; i < 256; ++i)
+		CHECK(alloc_put(&alloc, i) == 0);
+	CHECK(alloc_nfree(&alloc) == 128);
+	check_exhaust(&alloc, 128);
+	for (i = 0; i < NBITS; ++i)
+		CHECK(taken[i] == (i >= 128 && i < 256));
+	alloc_destroy(&alloc);
+
+	// A mount loads every other object as used
+	memset(bitmap, 0, sizeof(bitmap));
+	for (i = 0; i < NBITS; i += 2)
+		bitmap_set(bitmap, i);
+	CHECK(alloc_init(&alloc, NBITS) == 0);
+	alloc_load(&alloc, 0, bitmap, 64 * 64);
+	alloc_load(&alloc, 64 * 64, bitmap + 64 * 64 / 8, NBITS - 64 * 64);
+	CHECK(alloc_nfree(&alloc) == NBITS / 2);
+	check_exhaust(&alloc, NBITS / 2);
+	for (i = 0; i < NBITS; ++i)
+		CHECK(taken[i] == (i % 2));
+	alloc_destroy(&alloc);
+	return 0;
+}
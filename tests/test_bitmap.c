@@ -0,0 +1,90 @@
+/*
+  Bit-level bitmaps: the on-disk bit order, the word at a time search
+  and count at the edges of words and maps, and one bit per inode in
+  the inode bitmap a mount leaves on disk.
+*/
+
+#include "vrstest.h"
+#include "bitmap.h"
+
+#define NBITS 200
+
+static void check_search(void)
+{
+	uint8_t map[32];
+	uint32_t i = 0;
+
+	memset(map, 0, sizeof(map));
+	bitmap_set(map, 0);
+	bitmap_set(map, 9);
+	bitmap_set(map, 63);
+	bitmap_set(map, 64);
+	CHECK(map[0] == 0x01 && map[1] == 0x02 && map[7] == 0x80 && map[8] == 0x01);
+	CHECK(bitmap_test(map, 9) && !bitmap_test(map, 10));
+	CHECK(bitmap_count(map, NBITS) == 4);
+	bitmap_clear(map, 9);
+	CHECK(!bitmap_test(map, 9) && bitmap_count(map, NBITS) == 3);
+
+	CHECK(bitmap_find_zero(map, NBITS, 0) == 1);
+	CHECK(bitmap_find_zero(map, NBITS, 63) == 65);
+	CHECK(bitmap_find_zero(map, NBITS, NBITS) == NBITS);
+
+	// Full words are skipped, and a search never returns a bit past
+	// the end of the map even if the last word has it clear
+	for (i = 0; i < NBITS; ++i)
+		bitmap_set(map, i);
+	CHECK(bitmap_count(map, NBITS) == NBITS);
+	CHECK(bitmap_find_zero(map, NBITS, 0) == NBITS);
+	bitmap_clear(map, 130);
+	CHECK(bitmap_find_zero(map, NBITS, 0) == 130);
+	CHECK(bitmap_find_zero(map, NBITS, 131) == NBITS);
+
+	// Set bits past the end are not counted
+	for (i = NBITS; i < 256; ++i)
+		bitmap_set(map, i);
+	CHECK(bitmap_count(map, NBITS) == NBITS - 1);
+}
+
+static void check_disk(void)
+{
+	const char *img = check_image("test_bitmap");
+	uint32_t ino[5];
+	uint32_t bitmap_block = 0, disk_block_size = 0;
+	char name[32];
+	uint8_t *map = NULL;
+	int i = 0, fd = -1;
+
+	vrstest_state(img);
+	vrstest_mount();
+	CHECK(VRS_NBLOCKS_INODE_BITMAP == (VRS_NINODES + 8 * BLOCK_SIZE - 1) / (8 * BLOCK_SIZE));
+	CHECK(VRS_NBLOCKS_DATA_BITMAP == (VRS_NBLOCKS_DATA + 8 * BLOCK_SIZE - 1) / (8 * BLOCK_SIZE));
+	for (i = 0; i < 5; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		CHECK(create_inode_at(VRS_DATA->ino_root, name, S_IFREG | 0644, &ino[i]) == 0);
+	}
+	CHECK(remove_inode_at(VRS_DATA->ino_root, "f2", 0) == 0);
+	bitmap_block = VRS_BLOCK_INODE_BITMAP;
+	disk_block_size = BLOCK_SIZE;
+	vrstest_umount();
+
+	// Read behind the block layer, which forgot the size at unmount
+	map = malloc(disk_block_size);
+	CHECK(map != NULL);
+	fd = open(img, O_RDONLY);
+	CHECK(fd >= 0);
+	CHECK(pread(fd, map, disk_block_size, (off_t)bitmap_block * disk_block_size) == disk_block_size);
+	close(fd);
+	CHECK(bitmap_test(map, 0));
+	for (i = 0; i < 5; ++i)
+		CHECK(bitmap_test(map, ino[i]) == (i != 2));
+	CHECK(bitmap_count(map, 8 * disk_block_size) == 5);
+	free(map);
+	unlink(img);
+}
+
+int main(int argc, char *argv[])
+{
+	check_search();
+	check_disk();
+	return 0;
+}
@@ -0,0 +1,79 @@
+/*
+  Write-back block cache: blocks written stay in memory until evicted or
+  synced, and reads see them either way.
+*/
+
+#include "config.h"
+#include "block.h"
+#include "check.h"
+
+#define NBLOCKS 200
+#define CACHE_BLOCKS 64
+
+static void fill(char *buf, int block_num, int round)
+{
+	int i = 0;
+	for (i = 0; i < BLOCK_SIZE; ++i)
+		buf[i] = (char)(block_num * 31 + i + round);
+}
+
+/* Whether block @block_num of the disk file itself holds round @round */
+static int on_disk(int fd, int block_num, int round)
+{
+	char want[BLOCK_SIZE_MIN], got[BLOCK_SIZE_MIN];
+	fill(want, block_num, round);
+	if (pread(fd, got, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE) != BLOCK_SIZE)
+		return 0;
+	return memcmp(want, got, BLOCK_SIZE) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_block_cache");
+	char buf[BLOCK_SIZE_MIN], out[BLOCK_SIZE_MIN];
+	int i = 0, fd = -1;
+
+	disk_open(img);
+	CHECK(block_set_size(BLOCK_SIZE_MIN) == 0);
+	CHECK(block_set_size(1000) < 0);
+	block_cache_init(CACHE_BLOCKS * BLOCK_SIZE_MIN);
+	fd = open(img, O_RDONLY);
+	CHECK(fd >= 0);
+
+	// Never written blocks read as zeros
+	CHECK(block_read(5, out) == 0);
+	for (i = 0; i < BLOCK_SIZE; ++i)
+		CHECK(out[i] == 0);
+
+	for (i = 0; i < NBLOCKS; ++i) {
+		fill(buf, i, 0);
+		CHECK(block_write(i, buf) == BLOCK_SIZE);
+	}
+
+	// The oldest blocks were evicted and written, the last ones not yet
+	CHECK(on_disk(fd, 0, 0));
+	CHECK(!on_disk(fd, NBLOCKS - 1, 0));
+
+	for (i = 0; i < NBLOCKS; ++i) {
+		fill(buf, i, 0);
+		CHECK(block_read(i, out) == BLOCK_SIZE);
+		CHECK(memcmp(buf, out, BLOCK_SIZE) == 0);
+	}
+
+	// Rewrites of cached blocks are not written through either
+	fill(buf, NBLOCKS - 1, 1);
+	CHECK(block_write(NBLOCKS - 1, buf) == BLOCK_SIZE);
+	CHECK(block_read(NBLOCKS - 1, out) == BLOCK_SIZE && memcmp(buf, out, BLOCK_SIZE) == 0);
+	CHECK(!on_disk(fd, NBLOCKS - 1, 1));
+
+	CHECK(block_sync() == 0);
+	CHECK(block_flush() == 0);
+	CHECK(on_disk(fd, NBLOCKS - 1, 1));
+	for (i = 0; i < NBLOCKS - 1; ++i)
+		CHECK(on_disk(fd, i, 0));
+
+	disk_close();
+	close(fd);
+	unlink(img);
+	return 0;
+}
@@ -0,0 +1,138 @@
+/*
+  Block sizes: a disk keeps the block size it was formatted with across
+  mounts that ask for another, and the smallest and largest sizes both
+  work.  The work under the largest one, holes and partial writes
+  included, runs on a small thread stack, which only fits if no block
+  buffers live on the stack.
+*/
+
+#include "vrstest.h"
+
+#include <pthread.h>
+
+#define NFILES 300
+#define SMALL_STACK (128 * 1024)
+
+static uint32_t dir_ino;
+
+static void *dir_work(void *arg)
+{
+	char name[32];
+	uint32_t ino = 0;
+	int i = 0;
+
+	// Enough names to grow the directory an index at 512 byte blocks
+	for (i = 0; i < NFILES; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		CHECK(create_inode_at(dir_ino, name, S_IFREG | 0644, &ino) == 0);
+	}
+	for (i = 0; i < NFILES; i += 2) {
+		snprintf(name, sizeof(name), "file%d", i);
+		CHECK(remove_inode_at(dir_ino, name, 0) == 0);
+	}
+	CHECK(vrstest_count(dir_ino) == 2 + NFILES / 2);
+	for (i = 0; i < NFILES; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		CHECK((path_2_ino_internal(name, dir_ino) == VRS_INVALID_INO) == (i % 2 == 0));
+	}
+	return NULL;
+}
+
+/* Check @size bytes of @ino at @offset read back as zeros */
+static void verify_zero(uint32_t ino, off_t offset, size_t size)
+{
+	vrs_file_t *file = NULL;
+	char *buf = malloc(size);
+	size_t i = 0;
+	CHECK(buf != NULL);
+	CHECK(open_inode(ino, &file) == 0);
+	CHECK(file_read(file, buf, size, offset) == (int)size);
+	close_inode(file);
+	for (i = 0; i < size; ++i)
+		CHECK(buf[i] == 0);
+	free(buf);
+}
+
+static void *write_work(void *arg)
+{
+	uint32_t ino = *(uint32_t *)arg;
+
+	// The file ends mid-block, and a write past its end leaves a hole
+	vrstest_write(ino, 0, BLOCK_SIZE + 100, 2);
+	vrstest_write(ino, 4 * BLOCK_SIZE + 50, BLOCK_SIZE, 2);
+	verify_zero(ino, BLOCK_SIZE + 100, 3 * BLOCK_SIZE - 50);
+
+	// An overwrite straddling two blocks merges at both ends
+	vrstest_write(ino, BLOCK_SIZE / 2, BLOCK_SIZE, 3);
+	vrstest_verify(ino, 0, BLOCK_SIZE / 2, 2);
+	vrstest_verify(ino, BLOCK_SIZE / 2, BLOCK_SIZE, 3);
+	verify_zero(ino, 3 * BLOCK_SIZE / 2, 5 * BLOCK_SIZE / 2 + 50);
+	vrstest_verify(ino, 4 * BLOCK_SIZE + 50, BLOCK_SIZE, 2);
+	return NULL;
+}
+
+static void *read_work(void *arg)
+{
+	uint32_t ino = *(uint32_t *)arg;
+
+	// Unaligned at both ends, so partial blocks are read too
+	vrstest_verify(ino, 100, 3 * BLOCK_SIZE, 1);
+	vrstest_verify(ino, 0, 4 * BLOCK_SIZE + 100, 1);
+	return NULL;
+}
+
+/* Run @fn on a thread with a small stack */
+static void run_small(void *(*fn)(void *), void *arg)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	CHECK(pthread_attr_init(&attr) == 0);
+	CHECK(pthread_attr_setstacksize(&attr, SMALL_STACK) == 0);
+	CHECK(pthread_create(&thread, &attr, fn, arg) == 0);
+	CHECK(pthread_join(thread, NULL) == 0);
+	pthread_attr_destroy(&attr);
+}
+
+static void check_size(uint32_t block_size, uint32_t remount_size)
+{
+	char name[32];
+	const char *img = NULL;
+	uint32_t ino = 0, holes_ino = 0;
+
+	snprintf(name, sizeof(name), "test_block_size_%u", block_size);
+	img = check_image(name);
+	vrstest_state(img)->block_size = block_size;
+	VRS_DATA->ninodes = 2 * NFILES;
+	vrstest_mount();
+	CHECK(BLOCK_SIZE == block_size);
+
+	CHECK(create_inode_at(VRS_DATA->ino_root, "dir", S_IFDIR | 0755, &dir_ino) == 0);
+	run_small(dir_work, NULL);
+	CHECK(create_inode_at(VRS_DATA->ino_root, "data", S_IFREG | 0644, &ino) == 0);
+	vrstest_write(ino, 0, 4 * BLOCK_SIZE + 100, 1);
+	run_small(read_work, &ino);
+	CHECK(create_inode_at(VRS_DATA->ino_root, "holes", S_IFREG | 0644, &holes_ino) == 0);
+	run_small(write_work, &holes_ino);
+	vrstest_umount();
+
+	// The superblock wins over the block size this mount asks for
+	vrstest_state(img)->block_size = remount_size;
+	vrstest_mount();
+	CHECK(BLOCK_SIZE == block_size);
+	CHECK(path_2_ino("/data") == ino);
+	run_small(read_work, &ino);
+	dir_ino = path_2_ino("/dir");
+	CHECK(vrstest_count(dir_ino) == 2 + NFILES / 2);
+	CHECK(path_2_ino("/holes") == holes_ino);
+	verify_zero(holes_ino, 3 * BLOCK_SIZE / 2, 5 * BLOCK_SIZE / 2 + 50);
+	vrstest_verify(holes_ino, 4 * BLOCK_SIZE + 50, BLOCK_SIZE, 2);
+	vrstest_umount();
+	unlink(img);
+}
+
+int main(int argc, char *argv[])
+{
+	check_size(BLOCK_SIZE_MIN, BLOCK_SIZE_DEFAULT);
+	check_size(BLOCK_SIZE_MAX, BLOCK_SIZE_MIN);
+	return 0;
+}
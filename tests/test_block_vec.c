@@ -0,0 +1,76 @@
+/*
+  Vectored block I/O: unsorted vectors with gaps are written and read
+  back in runs, and the cache stays coherent with them.
+*/
+
+#include "config.h"
+#include "block.h"
+#include "check.h"
+
+#define NVEC 40
+
+static void fill(char *buf, int block_num, int round)
+{
+	int i = 0;
+	for (i = 0; i < BLOCK_SIZE; ++i)
+		buf[i] = (char)(block_num * 7 + i * 3 + round);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_block_vec");
+	static char data[NVEC][BLOCK_SIZE_MIN], out[NVEC][BLOCK_SIZE_MIN], want[BLOCK_SIZE_MIN];
+	block_vec_t vec[NVEC];
+	int i = 0, fd = -1;
+
+	disk_open(img);
+	CHECK(block_set_size(BLOCK_SIZE_MIN) == 0);
+	block_cache_init(16 * BLOCK_SIZE_MIN);
+	fd = open(img, O_RDONLY);
+	CHECK(fd >= 0);
+
+	// A cached copy of a block the vector overwrites
+	fill(want, 12, 9);
+	CHECK(block_write(12, want) == BLOCK_SIZE);
+
+	// Two runs, 10..29 and 50..69, listed backwards and interleaved
+	for (i = 0; i < NVEC; ++i) {
+		int block_num = (i % 2) ? 29 - i / 2 : 69 - i / 2;
+		vec[i].block_num = block_num;
+		vec[i].buf = data[i];
+		fill(data[i], block_num, 0);
+	}
+	CHECK(block_writev(vec, NVEC) == 0);
+
+	// Written through to the disk file, and over the cached copy
+	for (i = 0; i < NVEC; ++i) {
+		CHECK(pread(fd, want, BLOCK_SIZE, (off_t)vec[i].block_num * BLOCK_SIZE) == BLOCK_SIZE);
+		CHECK(memcmp(want, data[i], BLOCK_SIZE) == 0);
+	}
+	CHECK(block_read(12, want) == BLOCK_SIZE);
+	fill(out[0], 12, 0);
+	CHECK(memcmp(want, out[0], BLOCK_SIZE) == 0);
+
+	// Reads mix cached blocks, blocks on the disk and blocks past its end
+	fill(want, 20, 5);
+	CHECK(block_write(20, want) == BLOCK_SIZE);
+	for (i = 0; i < NVEC; ++i) {
+		vec[i].block_num = (i < NVEC - 2) ? vec[i].block_num : 1000 + i;
+		vec[i].buf = out[i];
+		memset(out[i], 'x', BLOCK_SIZE);
+	}
+	CHECK(block_readv(vec, NVEC) == 0);
+	for (i = 0; i < NVEC; ++i) {
+		if (vec[i].block_num >= 1000) {
+			memset(want, 0, BLOCK_SIZE);
+		} else {
+			fill(want, vec[i].block_num, (vec[i].block_num == 20) ? 5 : 0);
+		}
+		CHECK(memcmp(want, out[i], BLOCK_SIZE) == 0);
+	}
+
+	disk_close();
+	close(fd);
+	unlink(img);
+	return 0;
+}
@@ -0,0 +1,100 @@
+/*
+  Contiguous allocation: runs come from the goal or the next free block
+  after it and stop at a block in use, a single large write is laid out
+  as one run, and files growing side by side stay in runs of their
+  preallocation windows, which go back to the allocator on close.
+*/
+
+#include "vrstest.h"
+
+#define NBLOCKS 32
+
+static void check_runs(void)
+{
+	vrs_allocator alloc;
+	uint32_t len = 0;
+
+	CHECK(alloc_init(&alloc, 1000) == 0);
+	CHECK(alloc_get_run(&alloc, 100, 10, &len) == 100 && len == 10);
+	CHECK(alloc_get_run(&alloc, 105, 10, &len) == 110 && len == 10);
+	CHECK(alloc_put(&alloc, 103) == 0);
+	CHECK(alloc_get_run(&alloc, 103, 10, &len) == 103 && len == 1);
+	CHECK(alloc_get_run(&alloc, 995, 10, &len) == 995 && len == 5);
+	CHECK(alloc_get_run(&alloc, 0, 0, &len) == 1000 && len == 0);
+	CHECK(alloc_nfree(&alloc) == 1000 - 25);
+	alloc_destroy(&alloc);
+}
+
+/* Number of places @ino's first @nblocks blocks are not one after another */
+static int count_breaks(uint32_t ino, uint32_t nblocks)
+{
+	vrs_inode_t inode;
+	uint32_t lblk = 0;
+	int breaks = 0;
+
+	get_inode(ino, &inode);
+	for (lblk = 1; lblk < nblocks; ++lblk) {
+		if (inode_bmap(&inode, lblk) != inode_bmap(&inode, lblk - 1) + 1)
+			++breaks;
+	}
+	return breaks;
+}
+
+static uint32_t nblocks_of(uint32_t ino)
+{
+	vrs_inode_t inode;
+	get_inode(ino, &inode);
+	return inode.nblocks;
+}
+
+static void check_files(void)
+{
+	const char *img = check_image("test_contig");
+	vrs_file_t *file[2];
+	uint32_t ino[3], nfree = 0;
+	char *buf = NULL;
+	int i = 0, n = 0;
+
+	vrstest_state(img);
+	vrstest_mount();
+	buf = calloc(1, BLOCK_SIZE);
+	CHECK(buf != NULL);
+	journal_checkpoint();
+	nfree = alloc_nfree(&VRS_DATA->block_alloc);
+
+	CHECK(create_inode_at(VRS_DATA->ino_root, "big", S_IFREG | 0644, &ino[2]) == 0);
+	vrstest_write(ino[2], 0, 2 * NBLOCKS * BLOCK_SIZE, 1);
+	CHECK(count_breaks(ino[2], 2 * NBLOCKS) == 0);
+
+	// One block at a time to each file in turn.  The files got their
+	// first blocks when they were created, side by side.
+	CHECK(create_inode_at(VRS_DATA->ino_root, "a", S_IFREG | 0644, &ino[0]) == 0);
+	CHECK(create_inode_at(VRS_DATA->ino_root, "b", S_IFREG | 0644, &ino[1]) == 0);
+	CHECK(open_inode(ino[0], &file[0]) == 0);
+	CHECK(open_inode(ino[1], &file[1]) == 0);
+	for (n = 0; n < NBLOCKS; ++n) {
+		for (i = 0; i < 2; ++i)
+			CHECK(file_write(file[i], buf, BLOCK_SIZE, (off_t)n * BLOCK_SIZE) == BLOCK_SIZE);
+	}
+	for (i = 0; i < 2; ++i)
+		CHECK(count_breaks(ino[i], NBLOCKS) <= 1 + NBLOCKS / (1 + VRS_PREALLOC_DEFAULT));
+
+	// Closed files keep only the blocks they use
+	close_inode(file[0]);
+	close_inode(file[1]);
+	journal_checkpoint();
+	CHECK(alloc_nfree(&VRS_DATA->block_alloc)
+			== nfree - nblocks_of(ino[0]) - nblocks_of(ino[1]) - nblocks_of(ino[2]));
+	CHECK(nblocks_of(ino[0]) >= NBLOCKS && nblocks_of(ino[0]) <= NBLOCKS + 1);
+
+	free(buf);
+	vrstest_umount();
+	unlink(img);
+}
+
+int main(int argc, char *argv[])
+{
+	check_runs();
+	check_files();
+	return 0;
+}
@@ -0,0 +1,63 @@
+/*
+  Creating a file when the inode cache has no memory for the new inode
+  fails with ENOMEM and gives back everything it took: no name, no
+  inode and no block are left behind.  Memory runs out by failing the
+  allocations of inode cache entries, which needs glibc to wrap malloc.
+*/
+
+#include "vrstest.h"
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+
+static size_t fail_size; // Allocations of this size fail while set
+
+void *malloc(size_t size)
+{
+	if ((fail_size != 0) && (size == fail_size))
+		return NULL;
+	return __libc_malloc(size);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_create_nomem");
+	uint32_t ino = 0, nfree = 0, nfree_inodes = 0;
+	int count = 0;
+
+	vrstest_state(img)->block_size = BLOCK_SIZE_MIN;
+	vrstest_mount();
+	CHECK(create_inode_at(VRS_DATA->ino_root, "a", S_IFREG | 0644, &ino) == 0);
+	nfree = vrstest_nfree();
+	nfree_inodes = alloc_nfree(&VRS_DATA->inode_alloc);
+	count = vrstest_count(VRS_DATA->ino_root);
+
+	fail_size = sizeof(vrs_icache_entry) + VRS_DATA->icache.record_size;
+	CHECK(create_inode_at(VRS_DATA->ino_root, "b", S_IFREG | 0644, &ino) == -ENOMEM);
+	fail_size = 0;
+	CHECK(path_2_ino("/b") == VRS_INVALID_INO);
+	CHECK(vrstest_count(VRS_DATA->ino_root) == count);
+	CHECK(alloc_nfree(&VRS_DATA->inode_alloc) == nfree_inodes);
+	CHECK(vrstest_nfree() == nfree);
+
+	// With memory back, the same name works and survives a remount
+	CHECK(create_inode_at(VRS_DATA->ino_root, "b", S_IFREG | 0644, &ino) == 0);
+	vrstest_write(ino, 0, 2 * BLOCK_SIZE, 1);
+	vrstest_umount();
+
+	vrstest_state(img);
+	vrstest_mount();
+	CHECK(path_2_ino("/b") == ino);
+	vrstest_verify(ino, 0, 2 * BLOCK_SIZE, 1);
+	CHECK(alloc_nfree(&VRS_DATA->inode_alloc) == nfree_inodes - 1);
+	vrstest_umount();
+
+	unlink(img);
+	return 0;
+}
+#else
+int main(int argc, char *argv[])
+{
+	return 77;
+}
+#endif
@@ -0,0 +1,99 @@
+/*
+  Directory entry cache: hits, negative entries and misses, names kept
+  apart by parent, least recently used eviction, purging a directory
+  with the generation check of dcache_add_since(), names added cold
+  that never push out more than one used entry, and a cache of size
+  zero that caches nothing.
+*/
+
+#include "config.h"
+#include "dcache.h"
+#include "check.h"
+
+#define BUDGET 8
+
+int main(int argc, char *argv[])
+{
+	vrs_dcache dcache;
+	uint32_t ino = 0, generation = 0;
+	char name[32];
+	int i = 0;
+
+	CHECK(dcache_init(&dcache, BUDGET) == 0);
+	CHECK(dcache_lookup(&dcache, 1, "a", &ino) == DCACHE_MISS);
+	dcache_add(&dcache, 1, "a", 10);
+	dcache_add(&dcache, 2, "a", 20);
+	dcache_add_negative(&dcache, 1, "b");
+	CHECK(dcache_lookup(&dcache, 1, "a", &ino) == DCACHE_HIT && ino == 10);
+	CHECK(dcache_lookup(&dcache, 2, "a", &ino) == DCACHE_HIT && ino == 20);
+	CHECK(dcache_lookup(&dcache, 1, "b", &ino) == DCACHE_NEGATIVE);
+	CHECK(dcache_lookup(&dcache, 1, "ab", &ino) == DCACHE_MISS);
+
+	// Entries change from negative to positive and back in place
+	dcache_add(&dcache, 1, "b", 11);
+	CHECK(dcache_lookup(&dcache, 1, "b", &ino) == DCACHE_HIT && ino == 11);
+	dcache_add_negative(&dcache, 2, "a");
+	CHECK(dcache_lookup(&dcache, 2, "a", &ino) == DCACHE_NEGATIVE);
+	CHECK(dcache.num_entries == 3);
+
+	// Filling the cache evicts the least recently used, and a lookup
+	// counts as a use
+	for (i = 0; i < BUDGET - 3; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		dcache_add(&dcache, 3, name, 100 + i);
+	}
+	CHECK(dcache_lookup(&dcache, 1, "a", &ino) == DCACHE_HIT);
+	dcache_add(&dcache, 3, "new", 200);
+	CHECK(dcache.num_entries == BUDGET);
+	CHECK(dcache_lookup(&dcache, 1, "b", &ino) == DCACHE_MISS);
+	CHECK(dcache_lookup(&dcache, 1, "a", &ino) == DCACHE_HIT && ino == 10);
+	CHECK(dcache_lookup(&dcache, 3, "new", &ino) == DCACHE_HIT && ino == 200);
+
+	// Purging a directory drops its names only, and names found before
+	// the purge are not added after it
+	generation = dcache_generation(&dcache);
+	dcache_purge_parent(&dcache, 3);
+	CHECK(dcache_lookup(&dcache, 3, "f4", &ino) == DCACHE_MISS);
+	CHECK(dcache_lookup(&dcache, 1, "a", &ino) == DCACHE_HIT);
+	dcache_add_since(&dcache, 3, "f4", 104, generation);
+	CHECK(dcache_lookup(&dcache, 3, "f4", &ino) == DCACHE_MISS);
+	dcache_add_since(&dcache, 3, "f4", 104, dcache_generation(&dcache));
+	CHECK(dcache_lookup(&dcache, 3, "f4", &ino) == DCACHE_HIT && ino == 104);
+	dcache_destroy(&dcache);
+
+	// Names added cold take the place of the least recently used entry,
+	// then of each other, so a listing of any size keeps every used entry
+	// but one.  A cold name a lookup used counts as used.
+	CHECK(dcache_init(&dcache, BUDGET) == 0);
+	for (i = 0; i < BUDGET; ++i) {
+		snprintf(name, sizeof(name), "hot%d", i);
+		dcache_add(&dcache, 1, name, i);
+	}
+	dcache_add_cold(&dcache, 1, "hot3", 3);
+	for (i = 0; i < 4 * BUDGET; ++i) {
+		snprintf(name, sizeof(name), "cold%d", i);
+		dcache_add_cold(&dcache, 2, name, 100 + i);
+		if (i == BUDGET)
+			CHECK(dcache_lookup(&dcache, 2, name, &ino) == DCACHE_HIT && ino == 100 + i);
+	}
+	CHECK(dcache.num_entries == BUDGET);
+	CHECK(dcache_lookup(&dcache, 1, "hot0", &ino) == DCACHE_MISS);
+	CHECK(dcache_lookup(&dcache, 1, "hot1", &ino) == DCACHE_MISS);
+	for (i = 2; i < BUDGET; ++i) {
+		snprintf(name, sizeof(name), "hot%d", i);
+		CHECK(dcache_lookup(&dcache, 1, name, &ino) == DCACHE_HIT && ino == i);
+	}
+	snprintf(name, sizeof(name), "cold%d", BUDGET);
+	CHECK(dcache_lookup(&dcache, 2, name, &ino) == DCACHE_HIT);
+	snprintf(name, sizeof(name), "cold%d", 4 * BUDGET - 1);
+	CHECK(dcache_lookup(&dcache, 2, name, &ino) == DCACHE_HIT);
+	dcache_destroy(&dcache);
+
+	CHECK(dcache_init(&dcache, 0) == 0);
+	dcache_add(&dcache, 1, "a", 10);
+	dcache_add_negative(&dcache, 1, "b");
+	CHECK(dcache_lookup(&dcache, 1, "a", &ino) == DCACHE_MISS);
+	CHECK(dcache_lookup(&dcache, 1, "b", &ino) == DCACHE_MISS);
+	dcache_destroy(&dcache);
+	return 0;
+}
@@ -0,0 +1,62 @@
+/*
+  Dentry lookup by stored name hash: every name is found in its slot
+  whatever its position against the vector width, a matching hash with
+  another name or a free slot is passed over, and only the first
+  @nslots slots are searched.
+*/
+
+#include "vrstest.h"
+
+#define NSLOTS 64
+
+static char block[NSLOTS * VRS_DENTRY_SIZE];
+
+static vrs_dentry_t *slot_at(int slot)
+{
+	return (vrs_dentry_t *)(block + slot * VRS_DENTRY_SIZE);
+}
+
+static int find(int nslots, const char *name)
+{
+	return dentry_block_find(block, nslots, name, dentry_hash(name));
+}
+
+int main(int argc, char *argv[])
+{
+	char name[VRS_MAX_LENGTH_FILE_NAME + 1];
+	int i = 0;
+
+	for (i = 0; i < NSLOTS; ++i) {
+		snprintf(name, sizeof(name), "entry%d", i);
+		dentry_init(slot_at(i), name, 100 + i);
+	}
+	for (i = 0; i < NSLOTS; ++i) {
+		snprintf(name, sizeof(name), "entry%d", i);
+		CHECK(find(NSLOTS, name) == i);
+		CHECK(find(i + 1, name) == i);
+		CHECK(find(i, name) == -1);
+	}
+	CHECK(find(NSLOTS, "entry") == -1);
+	CHECK(find(NSLOTS, "entry10x") == -1);
+
+	// A slot whose hash matches but whose name does not is skipped,
+	// so are free slots, whatever hash they were left with
+	dentry_init(slot_at(5), "other", 7);
+	slot_at(5)->hash = dentry_hash("entry9");
+	slot_at(6)->name_len = 0;
+	slot_at(6)->hash = dentry_hash("entry9");
+	CHECK(find(NSLOTS, "entry9") == 9);
+	CHECK(find(NSLOTS, "other") == -1);
+	CHECK(find(NSLOTS, "entry6") == -1);
+
+	// Names that only differ in length, and the longest name there is
+	memset(name, 'n', VRS_MAX_LENGTH_FILE_NAME);
+	name[VRS_MAX_LENGTH_FILE_NAME] = '\0';
+	dentry_init(slot_at(40), name, 1);
+	name[VRS_MAX_LENGTH_FILE_NAME - 1] = '\0';
+	dentry_init(slot_at(41), name, 2);
+	CHECK(find(NSLOTS, name) == 41);
+	name[VRS_MAX_LENGTH_FILE_NAME - 1] = 'n';
+	CHECK(find(NSLOTS, name) == 40);
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+  Durability modes: in sync mode an operation is on the disk when it
+  returns, in fsync-only mode not before fsync(), and in periodic mode
+  within a few commit intervals.  A copy of the disk taken at those
+  points stands for a crash.
+*/
+
+#include "vrstest.h"
+
+#define NBLOCKS 5
+#define COMMIT_MS 20
+#define NWAIT 25 // Commit intervals to wait for in periodic mode
+
+static char *img;
+
+/* Mount @img with the durability mode @durability */
+static void mount_mode(unsigned int durability, uint32_t journal_blocks)
+{
+	vrstest_state(img)->block_size = BLOCK_SIZE_MIN;
+	VRS_DATA->durability = durability;
+	VRS_DATA->journal_blocks = journal_blocks;
+	VRS_DATA->commit_ms = COMMIT_MS;
+	vrstest_mount();
+}
+
+/* Whether the crash copy @crash holds "/f" written with @seed */
+static int crash_has(const char *crash, int seed)
+{
+	uint32_t ino = 0;
+	int found = 0;
+
+	vrstest_state(crash)->block_size = BLOCK_SIZE_MIN;
+	vrstest_mount();
+	ino = path_2_ino("/f");
+	found = (ino != VRS_INVALID_INO);
+	if (found)
+		vrstest_verify(ino, 0, NBLOCKS * BLOCK_SIZE, seed);
+	vrstest_umount();
+	unlink(crash);
+	return found;
+}
+
+/* Create "/f" and write it with @seed */
+static void make_file(int seed)
+{
+	uint32_t ino = 0;
+	CHECK(create_inode_at(VRS_DATA->ino_root, "f", S_IFREG | 0644, &ino) == 0);
+	vrstest_write(ino, 0, NBLOCKS * BLOCK_SIZE, seed);
+}
+
+static void check_sync(uint32_t journal_blocks)
+{
+	const char *crash = "test_durability_crash.img";
+
+	unlink(img);
+	mount_mode(VRS_DURABILITY_SYNC, journal_blocks);
+	make_file(1);
+	check_copy(img, crash);
+	vrstest_umount();
+	CHECK(crash_has(crash, 1));
+}
+
+static void check_fsync(void)
+{
+	const char *before = "test_durability_before.img";
+	const char *after = "test_durability_after.img";
+
+	unlink(img);
+	mount_mode(VRS_DURABILITY_FSYNC, VRS_JOURNAL_BLOCKS_DEFAULT);
+	make_file(2);
+	check_copy(img, before);
+	CHECK(vrs_fsync("/f", 0, NULL) == 0);
+	check_copy(img, after);
+	vrstest_umount();
+	CHECK(!crash_has(before, 2));
+	CHECK(crash_has(after, 2));
+}
+
+static void check_periodic(void)
+{
+	const char *crash = "test_durability_crash.img";
+
+	unlink(img);
+	mount_mode(VRS_DURABILITY_PERIODIC, VRS_JOURNAL_BLOCKS_DEFAULT);
+	make_file(3);
+	usleep(NWAIT * COMMIT_MS * 1000);
+	check_copy(img, crash);
+	vrstest_umount();
+	CHECK(crash_has(crash, 3));
+}
+
+int main(int argc, char *argv[])
+{
+	img = strdup(check_image("test_durability"));
+	CHECK(img != NULL);
+	check_sync(VRS_JOURNAL_BLOCKS_DEFAULT);
+	check_sync(0);
+	check_fsync();
+	check_periodic();
+	unlink(img);
+	free(img);
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+  Directory index under ENOSPC: with only the blocks a plain leaf split
+  needs left free, every create that also has to index the directory or
+  split or grow the index fails without changing the directory, and
+  succeeds once there is room.  Every name created stays reachable
+  throughout.
+*/
+
+#include "vrstest.h"
+
+#define NNAMES 700
+
+static uint32_t dir_ino;
+
+static uint32_t levels_of(vrs_inode_t *dir)
+{
+	char *buf = malloc(BLOCK_SIZE);
+	uint32_t levels = 0;
+	CHECK(buf != NULL);
+	dir_read_block(dir, 0, buf);
+	levels = ((vrs_dx_header_t *)buf)->levels;
+	free(buf);
+	return levels;
+}
+
+static void check_names(int n)
+{
+	char name[32];
+	int i = 0;
+
+	for (i = 0; i < n; ++i) {
+		snprintf(name, sizeof(name), "name%d", i);
+		CHECK(path_2_ino_internal(name, dir_ino) != VRS_INVALID_INO);
+	}
+	CHECK(vrstest_count(dir_ino) == 2 + n);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_dx");
+	vrs_inode_t before, after;
+	char name[32];
+	uint32_t ino = 0, nfree_inodes = 0, levels = 0;
+	int i = 0, failed = 0, grown = 0;
+
+	vrstest_state(img)->block_size = BLOCK_SIZE_MIN;
+	VRS_DATA->ninodes = 2 * NNAMES;
+	VRS_DATA->dcache_size = 0;
+	vrstest_mount();
+	CHECK(create_inode_at(VRS_DATA->ino_root, "dir", S_IFDIR | 0755, &dir_ino) == 0);
+
+	for (i = 0; i < NNAMES; ++i) {
+		snprintf(name, sizeof(name), "name%d", i);
+
+		// A block for the file and one for a leaf split
+		vrstest_reserve(2);
+		nfree_inodes = alloc_nfree(&VRS_DATA->inode_alloc);
+		get_inode(dir_ino, &before);
+		levels = (before.flags & VRS_INODE_INDEXED) ? levels_of(&before) : 0;
+		if (create_inode_at(dir_ino, name, S_IFREG | 0644, &ino) == 0)
+			continue;
+
+		++failed;
+		get_inode(dir_ino, &after);
+		CHECK(after.nblocks == before.nblocks && after.size == before.size);
+		CHECK(after.flags == before.flags);
+		if (after.flags & VRS_INODE_INDEXED)
+			CHECK(levels_of(&after) == levels);
+		CHECK(vrstest_nfree() == 2);
+		CHECK(alloc_nfree(&VRS_DATA->inode_alloc) == nfree_inodes);
+		CHECK(path_2_ino_internal(name, dir_ino) == VRS_INVALID_INO);
+		check_names(i);
+
+		vrstest_reserve(2 + VRS_DX_MAX_LEVELS + 1);
+		CHECK(create_inode_at(dir_ino, name, S_IFREG | 0644, &ino) == 0);
+		get_inode(dir_ino, &after);
+		if ((after.flags & VRS_INODE_INDEXED) && (levels_of(&after) > levels))
+			++grown;
+	}
+	CHECK(failed > 0 && grown > 0);
+	check_names(NNAMES);
+
+	vrstest_unreserve();
+	vrstest_umount();
+	vrstest_state(img);
+	vrstest_mount();
+	check_names(NNAMES);
+	vrstest_umount();
+	unlink(img);
+	return 0;
+}
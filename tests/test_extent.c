@@ -0,0 +1,152 @@
+/*
+  Extent trees: a file too fragmented to merge its extents grows a two
+  level tree, an append that runs out of blocks for new tree nodes fails
+  with ENOSPC and frees what it took exactly once, and the tree carries
+  on growing once there is room again.
+*/
+
+#include "vrstest.h"
+
+static uint32_t ino;
+
+/* Blocks held back from the allocator, to be given back at the end */
+static uint32_t *held;
+static uint32_t nheld;
+
+static void hold(uint32_t bno, uint32_t count)
+{
+	uint32_t i = 0;
+	held = realloc(held, (nheld + count) * sizeof(uint32_t));
+	CHECK(held != NULL);
+	for (i = 0; i < count; ++i)
+		held[nheld++] = bno + i;
+}
+
+static void unhold(uint32_t count)
+{
+	while ((count-- > 0) && (nheld > 0))
+		CHECK(alloc_put(&VRS_DATA->block_alloc, held[--nheld]) == 0);
+}
+
+/* Append a block that does not continue the file's last extent */
+static int append_fragment(void)
+{
+	vrs_inode_t inode;
+	vrs_file_t *file = NULL;
+	uint32_t len = 0, next = 0;
+	char *buf = malloc(BLOCK_SIZE);
+	int retstat = 0;
+
+	CHECK(buf != NULL);
+	get_inode(ino, &inode);
+	memset(buf, (char)inode.nblocks, BLOCK_SIZE);
+	next = inode_bmap(&inode, inode.nblocks - 1) + 1;
+	if (!alloc_is_used(&VRS_DATA->block_alloc, next)
+			&& (alloc_get_run(&VRS_DATA->block_alloc, next, 1, &len) == next))
+		hold(next, len);
+
+	CHECK(open_inode(ino, &file) == 0);
+	retstat = file_write(file, buf, BLOCK_SIZE, (off_t)inode.nblocks * BLOCK_SIZE);
+	close_inode(file);
+	free(buf);
+	return retstat;
+}
+
+/* Whether the next extent needs a new leaf and a new interior node */
+static int tail_full(void)
+{
+	vrs_inode_t inode;
+	extent_path_t *path = NULL;
+	int full = 0;
+
+	get_inode(ino, &inode);
+	if (extent_root(&inode)->depth != 2)
+		return 0;
+	path = extent_load_tail(&inode);
+	CHECK(path != NULL);
+	full = (path[1].eh->count == path[1].eh->max) && (path[2].eh->count == path[2].eh->max);
+	extent_free_path(path, 2);
+	return full;
+}
+
+static uint32_t nblocks_of(uint32_t ino)
+{
+	vrs_inode_t inode;
+	get_inode(ino, &inode);
+	return inode.nblocks;
+}
+
+static uint32_t nfree(void)
+{
+	journal_checkpoint();
+	return alloc_nfree(&VRS_DATA->block_alloc);
+}
+
+static void check_blocks(uint32_t nblocks)
+{
+	vrs_inode_t inode;
+	vrs_file_t *file = NULL;
+	char *buf = malloc(BLOCK_SIZE);
+	uint32_t lblk = 0;
+	int i = 0;
+
+	CHECK(buf != NULL);
+	get_inode(ino, &inode);
+	CHECK(inode.nblocks == nblocks);
+	CHECK(inode.size == nblocks * BLOCK_SIZE);
+	CHECK(open_inode(ino, &file) == 0);
+	for (lblk = 1; lblk < nblocks; lblk += 97) {
+		CHECK(file_read(file, buf, BLOCK_SIZE, (off_t)lblk * BLOCK_SIZE) == BLOCK_SIZE);
+		for (i = 0; i < BLOCK_SIZE; ++i)
+			CHECK(buf[i] == (char)lblk);
+	}
+	close_inode(file);
+	free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_extent");
+	uint32_t start = 0, before = 0, nblocks = 0, len = 0;
+
+	vrstest_state(img)->block_size = BLOCK_SIZE_MIN;
+	VRS_DATA->prealloc_blocks = 0;
+	vrstest_mount();
+	start = nfree();
+
+	CHECK(create_inode_at(VRS_DATA->ino_root, "file", S_IFREG | 0644, &ino) == 0);
+	while (!tail_full())
+		CHECK(append_fragment() == BLOCK_SIZE);
+	nblocks = nblocks_of(ino);
+
+	// Leave a block for the data and one for a new leaf, but none for
+	// the interior node above it
+	while (nfree() > 2) {
+		uint32_t bno = alloc_get_run(&VRS_DATA->block_alloc, 0, nfree() - 2, &len);
+		hold(bno, len);
+	}
+	CHECK(append_fragment() == -ENOSPC);
+	CHECK(nfree() == 2);
+	check_blocks(nblocks);
+
+	unhold(1);
+	CHECK(append_fragment() == BLOCK_SIZE);
+	CHECK(nfree() == 0);
+	check_blocks(nblocks + 1);
+
+	// The bitmap on disk agrees with the allocator
+	unhold(nheld);
+	before = nfree();
+	vrstest_umount();
+	vrstest_state(img);
+	vrstest_mount();
+	CHECK(nfree() == before);
+	check_blocks(nblocks + 1);
+
+	CHECK(remove_inode_at(VRS_DATA->ino_root, "file", 0) == 0);
+	CHECK(nfree() == start);
+	vrstest_umount();
+	free(held);
+	unlink(img);
+	return 0;
+}
@@ -0,0 +1,106 @@
+/*
+  Low-level lookup counts and generations: an inode removed while the
+  kernel still holds references to it lives on until it forgets the
+  last of them and no handle is open, and an inode number handed out
+  again comes with a new generation, which entry replies carry and
+  which survives a remount.
+*/
+
+#include "vrstest.h"
+
+#define NBLOCKS 8
+
+static uint32_t create_file(const char *name)
+{
+	uint32_t ino = 0;
+	CHECK(create_inode_at(VRS_DATA->ino_root, name, S_IFREG | 0644, &ino) == 0);
+	vrstest_write(ino, 0, NBLOCKS * BLOCK_SIZE, 1);
+	return ino;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_forget");
+	struct fuse_entry_param e;
+	vrs_file_t *file = NULL;
+	vrs_inode_t inode, again;
+	uint32_t ino = 0, other = 0, nfree = 0, generation = 0;
+	char name[32];
+	int i = 0;
+
+	vrstest_state(img)->block_size = BLOCK_SIZE_MIN;
+	vrstest_mount();
+	nfree = vrstest_nfree();
+
+	// Two lookups, then the name goes: the inode stays for the kernel
+	ino = create_file("f");
+	CHECK(lookup_inode_at(VRS_DATA->ino_root, "f", &inode) == 0);
+	CHECK(inode.ino == ino && inode.nlink == 1 && inode.generation != 0);
+	CHECK(lookup_inode_at(VRS_DATA->ino_root, "f", &inode) == 0);
+	CHECK(lookup_inode_at(VRS_DATA->ino_root, "g", &inode) == -ENOENT);
+	generation = inode.generation;
+	CHECK(remove_inode_at(VRS_DATA->ino_root, "f", 0) == 0);
+	CHECK(lookup_inode_at(VRS_DATA->ino_root, "f", &inode) == -ENOENT);
+	CHECK(inode_exists(ino));
+	get_inode(ino, &inode);
+	CHECK((inode.flags & VRS_INODE_ORPHAN) && inode.nlink == 0);
+	vrstest_verify(ino, 0, NBLOCKS * BLOCK_SIZE, 1);
+	inode_forget(ino, 1);
+	CHECK(inode_exists(ino));
+	inode_forget(ino, 1);
+	CHECK(!inode_exists(ino));
+	CHECK(vrstest_nfree() == nfree);
+
+	// The number comes back with the next generation
+	for (i = 0; (other != ino) && (i < VRS_NINODES); ++i) {
+		snprintf(name, sizeof(name), "n%d", i);
+		CHECK(create_inode_at(VRS_DATA->ino_root, name, S_IFREG | 0644, &other) == 0);
+	}
+	CHECK(other == ino);
+	CHECK(inode_ref(ino, &inode) == 0);
+	CHECK(inode.generation == generation + 1);
+	vrs_ll_entry(&inode, &e);
+	CHECK(e.ino == VRS_LL_INO(ino) && e.generation == generation + 1 && e.attr.st_ino == e.ino);
+	inode_forget(ino, 1);
+	CHECK(inode_exists(ino));
+	while (--i > 0) {
+		snprintf(name, sizeof(name), "n%d", i - 1);
+		CHECK(remove_inode_at(VRS_DATA->ino_root, name, 0) == 0);
+	}
+
+	// An open handle and a reference: whichever goes last frees it
+	ino = create_file("o");
+	CHECK(lookup_inode_at(VRS_DATA->ino_root, "o", &inode) == 0);
+	CHECK(open_inode(ino, &file) == 0);
+	CHECK(remove_inode_at(VRS_DATA->ino_root, "o", 0) == 0);
+	inode_forget(ino, 5);
+	CHECK(inode_exists(ino));
+	close_inode(file);
+	CHECK(!inode_exists(ino));
+
+	ino = create_file("p");
+	CHECK(lookup_inode_at(VRS_DATA->ino_root, "p", &inode) == 0);
+	CHECK(open_inode(ino, &file) == 0);
+	CHECK(remove_inode_at(VRS_DATA->ino_root, "p", 0) == 0);
+	close_inode(file);
+	CHECK(inode_exists(ino));
+	inode_forget(ino, 1);
+	CHECK(!inode_exists(ino));
+
+	// Forgetting a file that keeps its name frees nothing
+	ino = create_file("q");
+	CHECK(lookup_inode_at(VRS_DATA->ino_root, "q", &inode) == 0);
+	generation = inode.generation;
+	inode_forget(ino, 1);
+	CHECK(inode_exists(ino));
+	vrstest_umount();
+
+	vrstest_state(img);
+	vrstest_mount();
+	CHECK(lookup_inode_at(VRS_DATA->ino_root, "q", &again) == 0);
+	CHECK(again.ino == ino && again.generation == generation);
+	vrstest_verify(ino, 0, NBLOCKS * BLOCK_SIZE, 1);
+	vrstest_umount();
+	unlink(img);
+	return 0;
+}
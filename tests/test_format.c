@@ -0,0 +1,46 @@
+/*
+  Formatting: a new disk is sized to its full geometry but stays sparse,
+  only the metadata the format writes takes space, and it mounts again
+  as an empty filesystem.
+*/
+
+#include "vrstest.h"
+
+#include <sys/stat.h>
+
+static void check_empty(void)
+{
+	CHECK(alloc_nfree(&VRS_DATA->block_alloc) == VRS_NBLOCKS_DATA - 1);
+	CHECK(alloc_nfree(&VRS_DATA->inode_alloc) == VRS_NINODES - 1);
+	CHECK(VRS_DATA->ino_root == 0);
+	CHECK(vrstest_count(VRS_DATA->ino_root) == 2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_format");
+	struct stat st;
+	off_t written = 0;
+
+	vrstest_state(img);
+	vrstest_mount();
+	check_empty();
+
+	// Everything up to the end of the data area is there to read, but
+	// only the superblock, bitmaps, root inode and journal were written
+	written = (off_t)(4 + VRS_NBLOCKS_JOURNAL) * BLOCK_SIZE;
+	CHECK(stat(img, &st) == 0);
+	CHECK(st.st_size == (off_t)(VRS_BLOCK_DATA + VRS_NBLOCKS_DATA) * BLOCK_SIZE);
+	CHECK((off_t)st.st_blocks * 512 <= written);
+	vrstest_umount();
+
+	vrstest_state(img);
+	vrstest_mount();
+	check_empty();
+	vrstest_umount();
+
+	CHECK(stat(img, &st) == 0);
+	CHECK((off_t)st.st_blocks * 512 <= written);
+	unlink(img);
+	return 0;
+}
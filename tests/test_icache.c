@@ -0,0 +1,99 @@
+/*
+  Inode cache: with a budget far below the number of inodes, evicted
+  dirty inodes are written back, prefetching reads in only what is not
+  cached, pinned inodes outlive the budget, forgotten inodes are never
+  written, and a new cache finds everything in the table.
+*/
+
+#include "config.h"
+#include "block.h"
+#include "icache.h"
+#include "check.h"
+
+#define TABLE 10
+#define RECORD 128
+#define NINODES 40
+#define BUDGET 4
+
+typedef struct {
+	uint32_t ino;
+	uint32_t value;
+} record_t;
+
+static void put(vrs_icache *icache, uint32_t ino, uint32_t value)
+{
+	record_t rec = { ino, value };
+	CHECK(icache_write(icache, ino, &rec, sizeof(rec)) == 0);
+}
+
+static uint32_t get(vrs_icache *icache, uint32_t ino)
+{
+	record_t rec;
+	CHECK(icache_read(icache, ino, &rec, sizeof(rec)) == 0);
+	CHECK(rec.ino == ino || rec.ino == 0);
+	return rec.value;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_icache");
+	vrs_icache icache;
+	uint32_t inos[NINODES];
+	uint32_t i = 0;
+
+	disk_open(img);
+	CHECK(block_set_size(BLOCK_SIZE_MIN) == 0);
+	block_cache_init(64 * BLOCK_SIZE_MIN);
+	CHECK(icache_init(&icache, TABLE, RECORD, BUDGET) == 0);
+
+	// Writing far more inodes than fit evicts and writes back
+	for (i = 0; i < NINODES; ++i)
+		put(&icache, i, 1000 + i);
+	CHECK(icache.num_entries == BUDGET);
+	for (i = 0; i < NINODES; ++i)
+		CHECK(get(&icache, i) == 1000 + i);
+
+	// Prefetching reads in only inodes that are not cached
+	for (i = 0; i < NINODES; ++i)
+		inos[i] = i;
+	CHECK(icache_prefetch(&icache, inos + NINODES - 2, 2) == 0);
+	CHECK(icache_prefetch(&icache, inos, 3) == 3);
+	CHECK(get(&icache, 1) == 1001);
+
+	// Pinned inodes stay past the budget and keep their changes
+	for (i = 0; i < 2 * BUDGET; ++i) {
+		CHECK(icache_pin(&icache, 20 + i) == 0);
+		put(&icache, 20 + i, 2000 + i);
+	}
+	CHECK(icache_pin(&icache, 20) == 0);
+	CHECK(icache.num_entries >= 2 * BUDGET);
+	for (i = 0; i < NINODES; ++i)
+		get(&icache, i);
+	for (i = 0; i < 2 * BUDGET; ++i) {
+		CHECK(icache_pinned(&icache, 20 + i) == 1 + (i == 0));
+		CHECK(get(&icache, 20 + i) == 2000 + i);
+		icache_unpin(&icache, 20 + i);
+	}
+	icache_unpin(&icache, 20);
+	CHECK(icache_pinned(&icache, 20) == 0);
+
+	// A forgotten inode's last change never reaches the table
+	CHECK(icache_flush(&icache) == 0);
+	put(&icache, 5, 5555);
+	icache_forget(&icache, 5);
+	CHECK(get(&icache, 5) == 1005);
+
+	// A new cache reads what the old one wrote back
+	CHECK(icache_flush(&icache) == 0);
+	icache_destroy(&icache);
+	CHECK(icache_init(&icache, TABLE, RECORD, BUDGET) == 0);
+	CHECK(icache_prefetch(&icache, inos, NINODES) == NINODES);
+	CHECK(icache.num_entries == BUDGET);
+	for (i = 0; i < NINODES; ++i)
+		CHECK(get(&icache, i) == ((i >= 20 && i < 20 + 2 * BUDGET) ? 2000 + i - 20 : 1000 + i));
+	icache_destroy(&icache);
+
+	disk_close();
+	unlink(img);
+	return 0;
+}
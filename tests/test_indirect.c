@@ -0,0 +1,74 @@
+/*
+  Block maps without extents: a file grown through the direct, single,
+  double and triple indirect blocks reads back what was written and
+  zeros in between, across a remount, and gives every block back when
+  it is removed.
+*/
+
+#include "vrstest.h"
+
+static uint32_t check_file(uint32_t ino, const off_t *offsets, int n)
+{
+	vrs_inode_t inode;
+	char *buf = malloc(BLOCK_SIZE);
+	int i = 0;
+
+	CHECK(buf != NULL);
+	for (i = 0; i < n; ++i)
+		vrstest_verify(ino, offsets[i], 100, i);
+
+	// Between two writes is a hole
+	vrs_file_t *file = NULL;
+	CHECK(open_inode(ino, &file) == 0);
+	CHECK(file_read(file, buf, BLOCK_SIZE, offsets[n - 1] - 2 * BLOCK_SIZE) == BLOCK_SIZE);
+	close_inode(file);
+	for (i = 0; i < BLOCK_SIZE; ++i)
+		CHECK(buf[i] == 0);
+	free(buf);
+
+	get_inode(ino, &inode);
+	CHECK(!(inode.flags & VRS_INODE_EXTENTS));
+	CHECK(inode.blocks[VRS_TIND_BLOCK] != 0);
+	CHECK(inode_bmap(&inode, offsets[n - 1] / BLOCK_SIZE) < VRS_NBLOCKS_DATA);
+	CHECK(inode_bmap(&inode, offsets[n - 1] / BLOCK_SIZE + 2) == VRS_INVALID_BLOCK_NO);
+	return inode.nblocks;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_indirect");
+	off_t offsets[4];
+	uint32_t ino = 0, nfree = 0, nblocks = 0;
+	int i = 0;
+
+	vrstest_state(img)->block_size = BLOCK_SIZE_MIN;
+	VRS_DATA->extents = 0;
+	vrstest_mount();
+	journal_checkpoint();
+	nfree = alloc_nfree(&VRS_DATA->block_alloc);
+
+	// One write in each part of the map, the last crossing a block
+	offsets[0] = 10;
+	offsets[1] = (off_t)(VRS_NDIR_BLOCKS + 3) * BLOCK_SIZE;
+	offsets[2] = (off_t)(VRS_NDIR_BLOCKS + VRS_NIND_BLOCKS + 300) * BLOCK_SIZE + 7;
+	offsets[3] = (off_t)(VRS_NDIR_BLOCKS + VRS_NIND_BLOCKS + VRS_NDIND_BLOCKS + 5) * BLOCK_SIZE - 50;
+	CHECK(create_inode_at(VRS_DATA->ino_root, "file", S_IFREG | 0644, &ino) == 0);
+	for (i = 0; i < 4; ++i)
+		vrstest_write(ino, offsets[i], 100, i);
+	nblocks = check_file(ino, offsets, 4);
+	CHECK(nblocks == offsets[3] / BLOCK_SIZE + 2);
+	vrstest_umount();
+
+	vrstest_state(img);
+	vrstest_mount();
+	CHECK(BLOCK_SIZE == BLOCK_SIZE_MIN);
+	CHECK(check_file(ino, offsets, 4) == nblocks);
+
+	// Data blocks and every indirect block go back
+	CHECK(remove_inode_at(VRS_DATA->ino_root, "file", 0) == 0);
+	journal_checkpoint();
+	CHECK(alloc_nfree(&VRS_DATA->block_alloc) == nfree);
+	vrstest_umount();
+	unlink(img);
+	return 0;
+}
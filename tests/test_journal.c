@@ -0,0 +1,48 @@
+/*
+  Journal replay: a commit that only frees blocks writes nothing to the
+  journal, and must not leave a gap in the transaction numbers that
+  stops the replay before the commits after it.
+*/
+
+#include "vrstest.h"
+
+int main(int argc, char *argv[])
+{
+	char *img = strdup(check_image("test_journal"));
+	const char *crash = check_image("test_journal_crash");
+	uint32_t ino = 0, other = 0, bno = 0, nfree = 0;
+
+	vrstest_state(img)->block_size = BLOCK_SIZE_MIN;
+	vrstest_mount();
+	CHECK(create_inode_at(VRS_DATA->ino_root, "before", S_IFREG | 0644, &other) == 0);
+	CHECK(journal_checkpoint() == 0);
+	nfree = vrstest_nfree();
+
+	// A transaction with nothing but a free
+	bno = alloc_get(&VRS_DATA->block_alloc);
+	CHECK(bno != VRS_INVALID_BLOCK_NO);
+	journal_begin();
+	journal_free_block(bno);
+	CHECK(journal_end() == 0);
+	CHECK(journal_commit() == 0);
+	CHECK(alloc_nfree(&VRS_DATA->block_alloc) == nfree);
+
+	// Then a normal one, left in the journal by the crash
+	CHECK(create_inode_at(VRS_DATA->ino_root, "after", S_IFREG | 0644, &ino) == 0);
+	vrstest_write(ino, 0, 3 * BLOCK_SIZE, 1);
+	CHECK(journal_sync() == 0);
+	check_copy(img, crash);
+	vrstest_umount();
+
+	vrstest_state(crash);
+	vrstest_mount();
+	CHECK(path_2_ino("/before") == other);
+	CHECK(path_2_ino("/after") == ino);
+	vrstest_verify(ino, 0, 3 * BLOCK_SIZE, 1);
+	vrstest_umount();
+
+	unlink(img);
+	unlink(crash);
+	free(img);
+	return 0;
+}
@@ -0,0 +1,119 @@
+/*
+  Large requests: writes and reads of the size the FUSE 3 build lets the
+  kernel send go through the front-end whole, at unaligned offsets, land
+  in a couple of extents, and read back in any split.  A stream of small
+  appends, as the writeback cache turns into large writes, ends up the
+  same.  The FUSE 3 build also checks what is negotiated.
+*/
+
+#include "vrstest.h"
+
+#define OFFSET 1000
+
+static char *pattern(size_t size, int seed)
+{
+	char *buf = malloc(size);
+	size_t i = 0;
+	CHECK(buf != NULL);
+	for (i = 0; i < size; ++i)
+		buf[i] = (char)(i * 7 + seed);
+	return buf;
+}
+
+#ifdef HAVE_FUSE3
+static void check_negotiate(void)
+{
+	struct fuse_conn_info conn;
+
+	memset(&conn, 0, sizeof(conn));
+	conn.capable = FUSE_CAP_WRITEBACK_CACHE | FUSE_CAP_ASYNC_READ | FUSE_CAP_PARALLEL_DIROPS | FUSE_CAP_READDIRPLUS;
+	conn.want = FUSE_CAP_WRITEBACK_CACHE;
+	VRS_DATA->writeback = 1;
+	vrs_negotiate(&conn);
+	CHECK(conn.want == conn.capable);
+	CHECK(conn.max_write == VRS_MAX_WRITE);
+
+	VRS_DATA->writeback = 0;
+	vrs_negotiate(&conn);
+	CHECK(!(conn.want & FUSE_CAP_WRITEBACK_CACHE));
+
+	// Nothing is asked for that the kernel can't do
+	memset(&conn, 0, sizeof(conn));
+	VRS_DATA->writeback = 1;
+	vrs_negotiate(&conn);
+	CHECK(conn.want == 0);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_large_io");
+	struct fuse_file_info fi;
+	vrs_inode_t inode;
+	char *data = pattern(VRS_MAX_WRITE, 3);
+	char *buf = malloc(VRS_MAX_WRITE);
+	size_t done = 0, chunk = 0;
+
+	CHECK(buf != NULL);
+	vrstest_state(img);
+#ifdef HAVE_FUSE3
+	check_negotiate();
+#endif
+	vrstest_mount();
+
+	// One request of the largest size, then read back whole and in pieces
+	memset(&fi, 0, sizeof(fi));
+	CHECK(vrs_create("/big", S_IFREG | 0644, &fi) == 0);
+	CHECK(vrs_write("/big", data, VRS_MAX_WRITE, OFFSET, &fi) == VRS_MAX_WRITE);
+	CHECK(vrs_read("/big", buf, VRS_MAX_WRITE, OFFSET, &fi) == VRS_MAX_WRITE);
+	CHECK(memcmp(buf, data, VRS_MAX_WRITE) == 0);
+	for (done = 0; done < VRS_MAX_WRITE; done += chunk) {
+		chunk = (done % 3 + 1) * 4093;
+		if (chunk > VRS_MAX_WRITE - done)
+			chunk = VRS_MAX_WRITE - done;
+		CHECK(vrs_read("/big", buf, chunk, OFFSET + done, &fi) == (int)chunk);
+		CHECK(memcmp(buf, data + done, chunk) == 0);
+	}
+	CHECK(vrs_read("/big", buf, VRS_MAX_WRITE, OFFSET + VRS_MAX_WRITE - 10, &fi) == 10);
+	CHECK(vrs_release("/big", &fi) == 0);
+	get_inode(path_2_ino("/big"), &inode);
+	CHECK(inode.size == OFFSET + VRS_MAX_WRITE);
+	CHECK(extent_root(&inode)->count <= 2);
+
+	// A create that fails says why
+	CHECK(vrs_create("/big", S_IFREG | 0644, &fi) == -EEXIST);
+	CHECK(vrs_create("/none/f", S_IFREG | 0644, &fi) == -ENOENT);
+
+	// Small appends, then large reads
+	memset(&fi, 0, sizeof(fi));
+	CHECK(vrs_create("/stream", S_IFREG | 0644, &fi) == 0);
+	for (done = 0; done < VRS_MAX_WRITE; done += chunk) {
+		chunk = 100 + done % 900;
+		if (chunk > VRS_MAX_WRITE - done)
+			chunk = VRS_MAX_WRITE - done;
+		CHECK(vrs_write("/stream", data + done, chunk, done, &fi) == (int)chunk);
+	}
+	CHECK(vrs_read("/stream", buf, VRS_MAX_WRITE, 0, &fi) == VRS_MAX_WRITE);
+	CHECK(memcmp(buf, data, VRS_MAX_WRITE) == 0);
+	CHECK(vrs_release("/stream", &fi) == 0);
+	vrstest_umount();
+
+	// Both as they were after a remount
+	vrstest_state(img);
+	vrstest_mount();
+	memset(&fi, 0, sizeof(fi));
+	CHECK(vrs_open("/stream", &fi) == 0);
+	CHECK(vrs_read("/stream", buf, VRS_MAX_WRITE, 0, &fi) == VRS_MAX_WRITE);
+	CHECK(memcmp(buf, data, VRS_MAX_WRITE) == 0);
+	CHECK(vrs_release("/stream", &fi) == 0);
+	CHECK(vrs_open("/big", &fi) == 0);
+	CHECK(vrs_read("/big", buf, VRS_MAX_WRITE, OFFSET, &fi) == VRS_MAX_WRITE);
+	CHECK(memcmp(buf, data, VRS_MAX_WRITE) == 0);
+	CHECK(vrs_release("/big", &fi) == 0);
+	vrstest_umount();
+
+	free(buf);
+	free(data);
+	unlink(img);
+	return 0;
+}
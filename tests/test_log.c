@@ -0,0 +1,126 @@
+/*
+  Logger: messages above the run-time level are skipped without their
+  arguments being evaluated, SIGUSR1 and SIGUSR2 move the level, each
+  thread's messages come out whole and in order on lines of their own,
+  long ones are cut, and a full ring drops and counts rather than waits.
+*/
+
+#include "vrstest.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+#define NTHREADS 4
+#define NMSGS 50
+#define NFLOOD 10000
+
+static int evaluated;
+
+static int side_effect(void)
+{
+	return ++evaluated;
+}
+
+static void *logger(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	int i = 0;
+	for (i = 0; i < NMSGS; ++i)
+		log_info("\nthread %d message %d\n", id, i);
+	return NULL;
+}
+
+static void *flood(void *arg)
+{
+	int i = 0;
+	for (i = 0; i < NFLOOD; ++i)
+		log_warn("flood %d", i);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[NTHREADS];
+	char line[1024], text[512], level = 0;
+	int next[NTHREADS], i = 0, id = 0, n = 0, ring = 0, floods = 0, dropped = 0, longest = 0;
+	unsigned long long sec = 0, usec = 0;
+	char *big = malloc(1000);
+	FILE *logfile = tmpfile();
+
+	CHECK((big != NULL) && (logfile != NULL));
+	vrs_data = calloc(1, sizeof(struct vrs_state));
+	CHECK(vrs_data != NULL);
+	vrs_data->logfile = logfile;
+
+	// Arguments of skipped messages are not evaluated
+	log_set_level(VRS_LOG_WARN);
+	log_msg("%d", side_effect());
+	log_info("%d", side_effect());
+	CHECK(evaluated == 0);
+	log_warn("warn %d", side_effect());
+	CHECK(evaluated == 1);
+	log_set_level(VRS_LOG_DEBUG + 5);
+	CHECK(log_level == VRS_LOG_DEBUG);
+	log_set_level(-1);
+	CHECK(log_level == 0);
+	log_warn("%d", side_effect());
+	CHECK(evaluated == 1);
+
+	log_set_level(VRS_LOG_INFO);
+	log_start();
+	CHECK(raise(SIGUSR2) == 0);
+	CHECK(log_level == VRS_LOG_WARN);
+	CHECK(raise(SIGUSR1) == 0);
+	CHECK(raise(SIGUSR1) == 0);
+	CHECK(log_level == VRS_LOG_DEBUG);
+	CHECK(raise(SIGUSR1) == 0);
+	CHECK(log_level == VRS_LOG_DEBUG);
+	log_set_level(VRS_LOG_INFO);
+
+	memset(big, 'x', 999);
+	big[999] = '\0';
+	log_info("%s", big);
+	for (i = 0; i < NTHREADS; ++i)
+		CHECK(pthread_create(&threads[i], NULL, logger, (void *)(intptr_t)i) == 0);
+	for (i = 0; i < NTHREADS; ++i)
+		CHECK(pthread_join(threads[i], NULL) == 0);
+	log_stop();
+
+	// Without the writer a flood overflows its ring
+	CHECK(pthread_create(&threads[0], NULL, flood, NULL) == 0);
+	CHECK(pthread_join(threads[0], NULL) == 0);
+	log_stop();
+
+	memset(next, 0, sizeof(next));
+	rewind(logfile);
+	while (fgets(line, sizeof(line), logfile) != NULL) {
+		CHECK(line[strlen(line) - 1] == '\n');
+		if (sscanf(line, "%d: %d messages dropped", &ring, &n) == 2) {
+			dropped += n;
+			continue;
+		}
+		CHECK(sscanf(line, "%llu.%6llu %d %c %511[^\n]", &sec, &usec, &ring, &level, text) == 5);
+		if (sscanf(text, "thread %d message %d", &id, &n) == 2) {
+			CHECK(level == 'I');
+			CHECK((id >= 0) && (id < NTHREADS) && (n == next[id]));
+			++next[id];
+		} else if (strncmp(text, "flood ", 6) == 0) {
+			CHECK(level == 'W');
+			CHECK(atoi(text + 6) == floods);
+			++floods;
+		} else if (text[0] == 'x') {
+			longest = strlen(text);
+		} else {
+			CHECK(strcmp(text, "warn 1") == 0);
+		}
+	}
+	for (i = 0; i < NTHREADS; ++i)
+		CHECK(next[i] == NMSGS);
+	CHECK((longest > 0) && (longest < 999));
+	CHECK((floods > 0) && (dropped > 0) && (floods + dropped == NFLOOD));
+
+	fclose(logfile);
+	free(vrs_data);
+	free(big);
+	return 0;
+}
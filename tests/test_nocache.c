@@ -0,0 +1,131 @@
+/*
+  Block cache off (cache_size=0): blocks written by running operations
+  are held until the last of them ends, or until an operation ends with
+  too many held, and written through otherwise.  Creates, writes and
+  removes come out the same as with the cache on, remount included.
+*/
+
+#include "vrstest.h"
+
+#define OP_BLOCKS 256 // CACHE_OP_BLOCKS in block.c
+#define NFILES 40
+#define FILE_SIZE (5 * 4096 + 77)
+
+static void fill(char *buf, int block_num, int round)
+{
+	int i = 0;
+	for (i = 0; i < BLOCK_SIZE; ++i)
+		buf[i] = (char)(block_num * 31 + round * 7 + i);
+}
+
+/* Whether block @block_num of the disk file itself holds round @round */
+static int on_disk(int fd, int block_num, int round)
+{
+	char want[BLOCK_SIZE_MIN], got[BLOCK_SIZE_MIN];
+	fill(want, block_num, round);
+	if (pread(fd, got, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE) != BLOCK_SIZE)
+		return 0;
+	return memcmp(want, got, BLOCK_SIZE) == 0;
+}
+
+static void write_block(int block_num, int round)
+{
+	char buf[BLOCK_SIZE_MIN];
+	fill(buf, block_num, round);
+	CHECK(block_write(block_num, buf) == BLOCK_SIZE);
+}
+
+static void check_ops(void)
+{
+	const char *img = check_image("test_nocache_ops");
+	char buf[BLOCK_SIZE_MIN], out[BLOCK_SIZE_MIN];
+	int i = 0, fd = -1;
+
+	disk_open(img);
+	CHECK(block_set_size(BLOCK_SIZE_MIN) == 0);
+	block_cache_init(0);
+	fd = open(img, O_RDONLY);
+	CHECK(fd >= 0);
+
+	// Outside an operation writes go straight to the disk
+	write_block(0, 0);
+	CHECK(on_disk(fd, 0, 0));
+
+	// An operation holds its blocks, and so does one ending while
+	// another still runs
+	block_op_begin();
+	write_block(1, 0);
+	block_op_begin();
+	write_block(2, 0);
+	CHECK(block_op_end() == 0);
+	CHECK(!on_disk(fd, 1, 0) && !on_disk(fd, 2, 0));
+	fill(buf, 2, 0);
+	CHECK(block_read(2, out) == BLOCK_SIZE && memcmp(buf, out, BLOCK_SIZE) == 0);
+
+	// Past OP_BLOCKS held, blocks are written through, and the inner
+	// operation ending writes and lets go of all of them
+	block_op_begin();
+	for (i = 3; i < OP_BLOCKS + 10; ++i)
+		write_block(i, 0);
+	CHECK(!on_disk(fd, OP_BLOCKS - 1, 0));
+	CHECK(on_disk(fd, OP_BLOCKS + 9, 0));
+	CHECK(block_op_end() == 0);
+	for (i = 1; i < OP_BLOCKS + 10; ++i)
+		CHECK(on_disk(fd, i, 0));
+
+	// The outer operation holds blocks again until it ends
+	write_block(1, 1);
+	CHECK(!on_disk(fd, 1, 1));
+	CHECK(block_op_end() == 0);
+	CHECK(on_disk(fd, 1, 1));
+
+	disk_close();
+	close(fd);
+	unlink(img);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_nocache");
+	char name[32];
+	uint32_t ino = 0, nfree = 0, nfree_inodes = 0;
+	int i = 0;
+
+	check_ops();
+
+	// The journal needs the cache, so there is none
+	vrstest_state(img)->cache_size = 0;
+	VRS_DATA->journal_blocks = 0;
+	vrstest_mount();
+	nfree = vrstest_nfree();
+	nfree_inodes = alloc_nfree(&VRS_DATA->inode_alloc);
+	for (i = 0; i < NFILES; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		CHECK(create_inode_at(VRS_DATA->ino_root, name, S_IFREG | 0644, &ino) == 0);
+		vrstest_write(ino, 0, FILE_SIZE, i);
+	}
+	for (i = 0; i < NFILES; i += 2) {
+		snprintf(name, sizeof(name), "f%d", i);
+		CHECK(remove_inode_at(VRS_DATA->ino_root, name, 0) == 0);
+	}
+	vrstest_umount();
+
+	vrstest_state(img)->cache_size = 0;
+	vrstest_mount();
+	CHECK(vrstest_count(VRS_DATA->ino_root) == 2 + NFILES / 2);
+	for (i = 0; i < NFILES; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		ino = path_2_ino_internal(name, VRS_DATA->ino_root);
+		CHECK((ino == VRS_INVALID_INO) == (i % 2 == 0));
+		if (ino != VRS_INVALID_INO) {
+			vrstest_verify(ino, 0, FILE_SIZE, i);
+			CHECK(remove_inode_at(VRS_DATA->ino_root, name, 0) == 0);
+		}
+	}
+	CHECK(vrstest_nfree() == nfree);
+	CHECK(alloc_nfree(&VRS_DATA->inode_alloc) == nfree_inodes);
+	vrstest_umount();
+
+	unlink(img);
+	return 0;
+}
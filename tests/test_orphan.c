@@ -0,0 +1,63 @@
+/*
+  Orphans: a file removed while open keeps its blocks until its last
+  release, and if the filesystem crashes first, the next mount frees
+  them along with the inode.
+*/
+
+#include "vrstest.h"
+
+#define NBLOCKS 20
+
+int main(int argc, char *argv[])
+{
+	char *img = strdup(check_image("test_orphan"));
+	const char *crash = check_image("test_orphan_crash");
+	vrs_file_t *file = NULL;
+	vrs_inode_t inode;
+	uint32_t ino = 0, nfree = 0, nfree_inodes = 0;
+
+	vrstest_state(img)->block_size = BLOCK_SIZE_MIN;
+	vrstest_mount();
+	nfree = vrstest_nfree();
+	nfree_inodes = alloc_nfree(&VRS_DATA->inode_alloc);
+
+	CHECK(create_inode_at(VRS_DATA->ino_root, "f", S_IFREG | 0644, &ino) == 0);
+	vrstest_write(ino, 0, NBLOCKS * BLOCK_SIZE, 1);
+	CHECK(open_inode(ino, &file) == 0);
+	CHECK(remove_inode_at(VRS_DATA->ino_root, "f", 0) == 0);
+	CHECK(path_2_ino("/f") == VRS_INVALID_INO);
+	get_inode(ino, &inode);
+	CHECK(inode.flags & VRS_INODE_ORPHAN);
+	CHECK(vrstest_nfree() <= nfree - NBLOCKS);
+	vrstest_verify(ino, 0, NBLOCKS * BLOCK_SIZE, 1);
+
+	// Crash with the file still open
+	CHECK(journal_sync() == 0);
+	check_copy(img, crash);
+
+	// Releasing it frees everything
+	close_inode(file);
+	CHECK(vrstest_nfree() == nfree);
+	CHECK(alloc_nfree(&VRS_DATA->inode_alloc) == nfree_inodes);
+	vrstest_umount();
+
+	// So does mounting what the crash left
+	vrstest_state(crash);
+	vrstest_mount();
+	CHECK(!alloc_is_used(&VRS_DATA->inode_alloc, ino));
+	CHECK(alloc_nfree(&VRS_DATA->inode_alloc) == nfree_inodes);
+	CHECK(vrstest_nfree() == nfree);
+	vrstest_umount();
+
+	// And for good: the next mount finds the same
+	vrstest_state(crash);
+	vrstest_mount();
+	CHECK(alloc_nfree(&VRS_DATA->inode_alloc) == nfree_inodes);
+	CHECK(vrstest_nfree() == nfree);
+	vrstest_umount();
+
+	unlink(img);
+	unlink(crash);
+	free(img);
+	return 0;
+}
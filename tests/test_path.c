@@ -0,0 +1,77 @@
+/*
+  Path resolution: nested directories resolve component by component,
+  a path through a file or a missing directory resolves to nothing, a
+  directory's path is cached once walked, and removing a directory
+  drops the paths cached through it.
+*/
+
+#include "vrstest.h"
+
+#define DEPTH 6
+
+static int path_cached(const char *dir, uint32_t *ino)
+{
+	return dcache_lookup(&VRS_DATA->dcache, VRS_DCACHE_PATHS, dir, ino) == DCACHE_HIT;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_path");
+	char path[256];
+	uint32_t dirs[DEPTH], ino = 0, file = 0;
+	int i = 0;
+
+	vrstest_state(img);
+	vrstest_mount();
+
+	// /d0/d1/.../d5, each with a file f
+	path[0] = '\0';
+	for (i = 0; i < DEPTH; ++i) {
+		snprintf(path + strlen(path), sizeof(path) - strlen(path), "/d%d", i);
+		CHECK(create_inode(path, S_IFDIR | 0755, &dirs[i]) == 0);
+	}
+	for (i = 0; i < DEPTH; ++i)
+		CHECK(create_inode_at(dirs[i], "f", S_IFREG | 0644, &file) == 0);
+
+	CHECK(path_2_ino("/") == VRS_DATA->ino_root);
+	CHECK(path_2_ino("/d0") == dirs[0]);
+	CHECK(path_2_ino("/d0/d1/d2") == dirs[2]);
+	CHECK(path_2_ino("/d0/d1/d2/d3/d4/d5") == dirs[5]);
+	CHECK(path_2_ino("/d0//d1") == dirs[1]);
+	file = path_2_ino("/d0/d1/d2/d3/d4/d5/f");
+	CHECK(file != VRS_INVALID_INO && file != path_2_ino("/d0/f"));
+	CHECK(path_2_ino("/d0/d2") == VRS_INVALID_INO);
+	CHECK(path_2_ino("/d0/nothing/d2") == VRS_INVALID_INO);
+	CHECK(path_2_ino("/d0/f/d1") == VRS_INVALID_INO);
+	CHECK(path_2_ino("d0") == VRS_INVALID_INO);
+
+	// The directory of a resolved path is cached whole, the walk to a
+	// sibling is a single lookup
+	CHECK(path_cached("/d0/d1/d2/d3/d4/d5", &ino) && ino == dirs[5]);
+	CHECK(!path_cached("/d0/nothing", &ino));
+	CHECK(create_inode("/d0/d1/d2/d3/d4/d5/g", S_IFREG | 0644, &ino) == 0);
+	CHECK(path_2_ino("/d0/d1/d2/d3/d4/d5/g") != VRS_INVALID_INO);
+
+	// A removed directory takes its cached paths along, and a file by
+	// the same name does not resolve as a directory
+	CHECK(remove_inode("/d0/d1/d2/d3/d4/d5/f") == 0);
+	CHECK(remove_inode("/d0/d1/d2/d3/d4/d5/g") == 0);
+	CHECK(remove_directory("/d0/d1/d2/d3/d4/d5") == 0);
+	CHECK(!path_cached("/d0/d1/d2/d3/d4/d5", &ino));
+	CHECK(path_2_ino("/d0/d1/d2/d3/d4/d5") == VRS_INVALID_INO);
+	CHECK(create_inode("/d0/d1/d2/d3/d4/d5", S_IFREG | 0644, &ino) == 0);
+	CHECK(path_2_ino("/d0/d1/d2/d3/d4/d5/f") == VRS_INVALID_INO);
+	CHECK(create_inode("/d0/d1/d2/d3/d4/d5/f", S_IFREG | 0644, &ino) == -ENOENT);
+	CHECK(create_inode("/d0/nothing/f", S_IFREG | 0644, &ino) == -ENOENT);
+	CHECK(create_inode("/d0/d1", S_IFDIR | 0755, &ino) == -EEXIST);
+
+	// Paths resolve the same on a fresh mount
+	vrstest_umount();
+	vrstest_state(img);
+	vrstest_mount();
+	CHECK(path_2_ino("/d0/d1/d2/d3/d4") == dirs[4]);
+	CHECK(path_2_ino("/d0/d1/d2/d3/d4/f") != VRS_INVALID_INO);
+	vrstest_umount();
+	unlink(img);
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+  Readdir resuming from a cookie: listing a directory a few entries at a
+  time, with names removed and created between calls, never lists a
+  name twice and never skips one that was there throughout, whether the
+  removals compact a flat directory or the creates split the leaves of
+  an indexed one.
+*/
+
+#include "vrstest.h"
+
+#define NMAX 2000
+#define PAGE 7
+
+typedef struct {
+	int limit;
+	int count;
+	off_t last;
+	char names[PAGE][32];
+} page_t;
+
+static uint32_t dir_ino;
+static int present[NMAX], original[NMAX], removed[NMAX], seen[NMAX];
+
+static int page_fill(void *buf, const char *name, const struct stat *statbuf, off_t offset)
+{
+	page_t *page = buf;
+	if (page->count == page->limit)
+		return 1;
+	CHECK(offset > page->last);
+	snprintf(page->names[page->count++], 32, "%s", name);
+	page->last = offset;
+	return 0;
+}
+
+static void name_create(int i)
+{
+	char name[32];
+	uint32_t ino = 0;
+	snprintf(name, sizeof(name), "f%d", i);
+	CHECK(create_inode_at(dir_ino, name, S_IFREG | 0644, &ino) == 0);
+	present[i] = 1;
+}
+
+static void name_remove(int i)
+{
+	char name[32];
+	if (!present[i])
+		return;
+	snprintf(name, sizeof(name), "f%d", i);
+	CHECK(remove_inode_at(dir_ino, name, 0) == 0);
+	present[i] = 0;
+	removed[i] = 1;
+}
+
+/* List a new directory @dir of @n names PAGE at a time, removing two and creating @ncreate between pages */
+static void check_paged(const char *dir, int n, int ncreate)
+{
+	page_t page;
+	int i = 0, step = 0, next = n;
+
+	memset(present, 0, sizeof(present));
+	memset(removed, 0, sizeof(removed));
+	memset(seen, 0, sizeof(seen));
+	CHECK(create_inode_at(VRS_DATA->ino_root, dir, S_IFDIR | 0755, &dir_ino) == 0);
+	for (i = 0; i < n; ++i)
+		name_create(i);
+	memcpy(original, present, sizeof(original));
+
+	memset(&page, 0, sizeof(page));
+	do {
+		page.limit = PAGE;
+		page.count = 0;
+		CHECK(vrs_readdir_ino(dir_ino, NULL, page.last, page_fill, &page) == 0);
+		for (i = 0; i < page.count; ++i) {
+			if ((strcmp(page.names[i], ".") == 0) || (strcmp(page.names[i], "..") == 0))
+				continue;
+			CHECK(page.names[i][0] == 'f');
+			++seen[atoi(page.names[i] + 1)];
+		}
+
+		// Removes compact a flat directory, creates split leaves
+		name_remove(2 * step);
+		name_remove(n - 1 - 2 * step);
+		for (i = 0; (i < ncreate) && (next < NMAX); ++i)
+			name_create(next++);
+		++step;
+	} while (page.count == PAGE);
+
+	for (i = 0; i < NMAX; ++i) {
+		CHECK(seen[i] <= 1);
+		if (original[i] && !removed[i])
+			CHECK(seen[i] == 1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_readdir");
+	vrs_inode_t dir;
+
+	vrstest_state(img)->block_size = BLOCK_SIZE_MIN;
+	VRS_DATA->ninodes = 2 * NMAX;
+	vrstest_mount();
+
+	check_paged("flat", 24, 1);
+	get_inode(dir_ino, &dir);
+	CHECK(!(dir.flags & VRS_INODE_INDEXED));
+
+	check_paged("indexed", 500, 3);
+	get_inode(dir_ino, &dir);
+	CHECK(dir.flags & VRS_INODE_INDEXED);
+
+	vrstest_umount();
+	unlink(img);
+	return 0;
+}
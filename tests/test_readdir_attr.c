@@ -0,0 +1,67 @@
+/*
+  Readdir attributes: every entry comes with the attributes getattr
+  would give, and listing a directory much larger than the dentry cache
+  leaves the names looked up before it cached.
+*/
+
+#include "vrstest.h"
+
+#define NFILES 400
+#define NHOT 16
+
+static uint32_t dir_ino;
+static int nlisted;
+
+static int attr_fill(void *buf, const char *name, const struct stat *statbuf, off_t offset)
+{
+	struct stat expected;
+	vrs_inode_t inode;
+
+	if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0))
+		return 0;
+	CHECK(statbuf != NULL);
+	CHECK(inode_exists(statbuf->st_ino));
+	get_inode(statbuf->st_ino, &inode);
+	CHECK(atoi(name + 1) % 3 ? S_ISREG(inode.mode) : S_ISDIR(inode.mode));
+	memset(&expected, 0, sizeof(expected));
+	fill_stat_from_ino(&inode, &expected);
+	CHECK(memcmp(statbuf, &expected, sizeof(expected)) == 0);
+	++nlisted;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_readdir_attr");
+	char name[32];
+	uint32_t ino = 0;
+	int i = 0;
+
+	vrstest_state(img)->block_size = BLOCK_SIZE_MIN;
+	VRS_DATA->ninodes = 2 * NFILES;
+	VRS_DATA->dcache_size = 4 * NHOT;
+	vrstest_mount();
+	CHECK(create_inode_at(VRS_DATA->ino_root, "dir", S_IFDIR | 0755, &dir_ino) == 0);
+	for (i = 0; i < NFILES; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		CHECK(create_inode_at(dir_ino, name, ((i % 3) ? S_IFREG : S_IFDIR) | 0640, &ino) == 0);
+		if (i % 5 == 0)
+			vrstest_write(ino, 0, i * 7, i);
+	}
+
+	// Names looked up just before the listing, as a shell would
+	for (i = 0; i < NHOT; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		CHECK(path_2_ino_internal(name, dir_ino) != VRS_INVALID_INO);
+	}
+	CHECK(vrs_readdir_ino(dir_ino, NULL, 0, attr_fill, NULL) == 0);
+	CHECK(nlisted == NFILES);
+	for (i = 1; i < NHOT; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		CHECK(dcache_lookup(&VRS_DATA->dcache, dir_ino, name, &ino) == DCACHE_HIT);
+	}
+
+	vrstest_umount();
+	unlink(img);
+	return 0;
+}
@@ -0,0 +1,83 @@
+/*
+  Readdir errors: a listing that fails before any entry went to the
+  filler returns the error, and one that fails after returns the
+  entries it has and the error on the next call on the same handle,
+  from where a later listing picks up.  The directory blocks fail to
+  be read for want of memory, which needs glibc to wrap malloc.
+*/
+
+#include "vrstest.h"
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+
+#define NFILES 10
+
+static size_t fail_size; // Allocations of this size fail while set
+
+void *malloc(size_t size)
+{
+	if ((fail_size != 0) && (size == fail_size))
+		return NULL;
+	return __libc_malloc(size);
+}
+
+typedef struct {
+	int count;
+	off_t last;
+} listed_t;
+
+static int listed_fill(void *buf, const char *name, const struct stat *statbuf, off_t offset)
+{
+	listed_t *listed = buf;
+	++listed->count;
+	listed->last = offset;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_readdir_error");
+	vrs_file_t *file = NULL;
+	listed_t listed = { 0, 0 };
+	char name[32];
+	uint32_t dir_ino = 0, ino = 0;
+	int i = 0;
+
+	vrstest_state(img);
+	vrstest_mount();
+	CHECK(create_inode_at(VRS_DATA->ino_root, "d", S_IFDIR | 0755, &dir_ino) == 0);
+	for (i = 0; i < NFILES; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		CHECK(create_inode_at(dir_ino, name, S_IFREG | 0644, &ino) == 0);
+	}
+	CHECK(open_inode(dir_ino, &file) == 0);
+
+	// "." and ".." go out, the error waits for the next call
+	fail_size = VRS_DENTRY_BATCH * BLOCK_SIZE;
+	CHECK(vrs_readdir_ino(dir_ino, file, 0, listed_fill, &listed) == 0);
+	CHECK(listed.count == 2);
+	CHECK(vrs_readdir_ino(dir_ino, file, listed.last, listed_fill, &listed) == -ENOMEM);
+	CHECK(listed.count == 2);
+
+	// With nothing listed, the error comes right away
+	CHECK(vrs_readdir_ino(dir_ino, file, listed.last, listed_fill, &listed) == -ENOMEM);
+	CHECK(vrs_readdir_ino(dir_ino, NULL, listed.last, listed_fill, &listed) == -ENOMEM);
+	CHECK(listed.count == 2);
+
+	// With memory back the listing goes on where it stopped
+	fail_size = 0;
+	CHECK(vrs_readdir_ino(dir_ino, file, listed.last, listed_fill, &listed) == 0);
+	CHECK(listed.count == 2 + NFILES);
+	close_inode(file);
+	vrstest_umount();
+
+	unlink(img);
+	return 0;
+}
+#else
+int main(int argc, char *argv[])
+{
+	return 77;
+}
+#endif
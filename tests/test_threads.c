@@ -0,0 +1,113 @@
+/*
+  Threads: several threads create, write, read back and remove files in
+  one shared directory while others list it and read a shared file.
+  Every thread sees its own data, the directory ends up with exactly the
+  names that were kept, and removing them all gives back every block.
+*/
+
+#include "vrstest.h"
+
+#include <pthread.h>
+
+#define NTHREADS 6
+#define NFILES 40
+#define FILE_SIZE (3 * 4096 + 123)
+
+static uint32_t dir_ino, shared_ino;
+static volatile int writers_done;
+
+static void *writer(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	char name[32];
+	uint32_t ino = 0;
+	int i = 0;
+
+	for (i = 0; i < NFILES; ++i) {
+		snprintf(name, sizeof(name), "t%d_%d", id, i);
+		CHECK(create_inode_at(dir_ino, name, S_IFREG | 0644, &ino) == 0);
+		vrstest_write(ino, 0, FILE_SIZE, id * NFILES + i);
+		vrstest_verify(ino, 0, FILE_SIZE, id * NFILES + i);
+		CHECK(path_2_ino_internal(name, dir_ino) == ino);
+	}
+	for (i = 0; i < NFILES; i += 2) {
+		snprintf(name, sizeof(name), "t%d_%d", id, i);
+		CHECK(remove_inode_at(dir_ino, name, 0) == 0);
+		CHECK(path_2_ino_internal(name, dir_ino) == VRS_INVALID_INO);
+	}
+	return NULL;
+}
+
+static void *lister(void *arg)
+{
+	int n = 0;
+	while (!__atomic_load_n(&writers_done, __ATOMIC_ACQUIRE)) {
+		n = vrstest_count(dir_ino);
+		CHECK(n >= 2 && n <= 2 + NTHREADS * NFILES);
+	}
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	while (!__atomic_load_n(&writers_done, __ATOMIC_ACQUIRE))
+		vrstest_verify(shared_ino, 100, 5 * 4096, 9);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *img = check_image("test_threads");
+	pthread_t threads[NTHREADS + 2];
+	char name[32];
+	uint32_t nfree = 0, ino = 0;
+	int i = 0, j = 0;
+
+	vrstest_state(img);
+	VRS_DATA->ninodes = 2 * NTHREADS * NFILES;
+	vrstest_mount();
+	CHECK(create_inode_at(VRS_DATA->ino_root, "dir", S_IFDIR | 0755, &dir_ino) == 0);
+	CHECK(create_inode_at(VRS_DATA->ino_root, "shared", S_IFREG | 0644, &shared_ino) == 0);
+	vrstest_write(shared_ino, 0, 6 * 4096, 9);
+	nfree = vrstest_nfree();
+
+	CHECK(pthread_create(&threads[NTHREADS], NULL, lister, NULL) == 0);
+	CHECK(pthread_create(&threads[NTHREADS + 1], NULL, reader, NULL) == 0);
+	for (i = 0; i < NTHREADS; ++i)
+		CHECK(pthread_create(&threads[i], NULL, writer, (void *)(intptr_t)i) == 0);
+	for (i = 0; i < NTHREADS; ++i)
+		CHECK(pthread_join(threads[i], NULL) == 0);
+	__atomic_store_n(&writers_done, 1, __ATOMIC_RELEASE);
+	CHECK(pthread_join(threads[NTHREADS], NULL) == 0);
+	CHECK(pthread_join(threads[NTHREADS + 1], NULL) == 0);
+
+	CHECK(vrstest_count(dir_ino) == 2 + NTHREADS * NFILES / 2);
+	for (i = 0; i < NTHREADS; ++i) {
+		for (j = 1; j < NFILES; j += 2) {
+			snprintf(name, sizeof(name), "t%d_%d", i, j);
+			ino = path_2_ino_internal(name, dir_ino);
+			CHECK(ino != VRS_INVALID_INO);
+			vrstest_verify(ino, 0, FILE_SIZE, i * NFILES + j);
+		}
+	}
+	vrstest_umount();
+
+	// What the threads left is what a remount finds
+	vrstest_state(img);
+	vrstest_mount();
+	dir_ino = path_2_ino("/dir");
+	CHECK(vrstest_count(dir_ino) == 2 + NTHREADS * NFILES / 2);
+	for (i = 0; i < NTHREADS; ++i) {
+		for (j = 1; j < NFILES; j += 2) {
+			snprintf(name, sizeof(name), "t%d_%d", i, j);
+			ino = path_2_ino_internal(name, dir_ino);
+			CHECK(ino != VRS_INVALID_INO);
+			vrstest_verify(ino, 0, FILE_SIZE, i * NFILES + j);
+			CHECK(remove_inode_at(dir_ino, name, 0) == 0);
+		}
+	}
+	CHECK(vrstest_nfree() == nfree);
+	vrstest_umount();
+	unlink(img);
+	return 0;
+}
@@ -0,0 +1,139 @@
+/*
+  Helpers for tests of the whole filesystem.  The test program builds
+  sfs.c and sfs_ll.c in, with main() renamed, and calls into them the
+  way the FUSE front-ends do.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _VRSTEST_H_
+#define _VRSTEST_H_
+
+#define main vrs_main
+#include "sfs.c"
+#undef main
+#include "sfs_ll.c"
+
+#include "check.h"
+
+/* A new state for the disk @diskfile, with the defaults main() sets */
+static struct vrs_state *vrstest_state(const char *diskfile)
+{
+	vrs_data = calloc(1, sizeof(struct vrs_state));
+	CHECK(vrs_data != NULL);
+	vrs_data->cache_size = BLOCK_CACHE_SIZE_DEFAULT;
+	vrs_data->block_size = BLOCK_SIZE_DEFAULT;
+	vrs_data->ninodes = VRS_NINODES_DEFAULT;
+	vrs_data->journal_blocks = VRS_JOURNAL_BLOCKS_DEFAULT;
+	vrs_data->durability = VRS_DURABILITY_PERIODIC;
+	vrs_data->commit_ms = VRS_JOURNAL_COMMIT_MS;
+	vrs_data->icache_size = ICACHE_SIZE_DEFAULT;
+	vrs_data->dcache_size = DCACHE_SIZE_DEFAULT;
+	vrs_data->prealloc_blocks = VRS_PREALLOC_DEFAULT;
+	vrs_data->extents = 1;
+	vrs_data->writeback = 1;
+	vrs_data->log_level = VRS_LOG_ERROR;
+	vrs_data->diskfile = strdup(diskfile);
+	log_set_level(vrs_data->log_level);
+	return vrs_data;
+}
+
+/* Mount the disk of the current state, formatting it if it is new */
+static void vrstest_mount(void)
+{
+	struct fuse_conn_info conn;
+	memset(&conn, 0, sizeof(conn));
+	vrs_mount(&conn);
+}
+
+/* Unmount cleanly and drop the state */
+static void vrstest_umount(void)
+{
+	vrs_destroy(vrs_data);
+	free(vrs_data->diskfile);
+	free(vrs_data);
+	vrs_data = NULL;
+}
+
+/* Write @size bytes of a pattern picked by @seed at @offset of @ino */
+static void vrstest_write(uint32_t ino, off_t offset, size_t size, int seed)
+{
+	vrs_file_t *file = NULL;
+	char *buf = malloc(size);
+	size_t i = 0;
+	CHECK(buf != NULL);
+	for (i = 0; i < size; ++i)
+		buf[i] = (char)((offset + i) * 13 + seed);
+	CHECK(open_inode(ino, &file) == 0);
+	CHECK(file_write(file, buf, size, offset) == (int)size);
+	close_inode(file);
+	free(buf);
+}
+
+/* Check @ino holds what vrstest_write() put at @offset */
+static void vrstest_verify(uint32_t ino, off_t offset, size_t size, int seed)
+{
+	vrs_file_t *file = NULL;
+	char *buf = malloc(size);
+	size_t i = 0;
+	CHECK(buf != NULL);
+	CHECK(open_inode(ino, &file) == 0);
+	CHECK(file_read(file, buf, size, offset) == (int)size);
+	close_inode(file);
+	for (i = 0; i < size; ++i)
+		CHECK(buf[i] == (char)((offset + i) * 13 + seed));
+	free(buf);
+}
+
+/* Blocks taken out of the allocator by vrstest_reserve() */
+static uint32_t *vrstest_reserved;
+static uint32_t vrstest_nreserved;
+
+/* Free blocks once the running operations are committed */
+static uint32_t vrstest_nfree(void)
+{
+	journal_checkpoint();
+	return alloc_nfree(&VRS_DATA->block_alloc);
+}
+
+/* Take blocks out of the allocator or give them back until @nfree are left */
+static void vrstest_reserve(uint32_t nfree)
+{
+	uint32_t len = 0, bno = 0;
+
+	while (vrstest_nfree() > nfree) {
+		bno = alloc_get_run(&VRS_DATA->block_alloc, 0, vrstest_nfree() - nfree, &len);
+		vrstest_reserved = realloc(vrstest_reserved, (vrstest_nreserved + len) * sizeof(uint32_t));
+		CHECK(vrstest_reserved != NULL);
+		while (len-- > 0)
+			vrstest_reserved[vrstest_nreserved++] = bno++;
+	}
+	while ((vrstest_nfree() < nfree) && (vrstest_nreserved > 0))
+		CHECK(alloc_put(&VRS_DATA->block_alloc, vrstest_reserved[--vrstest_nreserved]) == 0);
+}
+
+/* Give back every block vrstest_reserve() took */
+static void vrstest_unreserve(void)
+{
+	while (vrstest_nreserved > 0)
+		CHECK(alloc_put(&VRS_DATA->block_alloc, vrstest_reserved[--vrstest_nreserved]) == 0);
+	free(vrstest_reserved);
+	vrstest_reserved = NULL;
+}
+
+static int vrstest_count_entry(void *buf, const char *name, const struct stat *statbuf, off_t offset)
+{
+	++*(int *)buf;
+	return 0;
+}
+
+/* Number of entries readdir lists in @ino, . and .. included */
+static int vrstest_count(uint32_t ino)
+{
+	int n = 0;
+	CHECK(vrs_readdir_ino(ino, NULL, 0, vrstest_count_entry, &n) == 0);
+	return n;
+}
+
+#endif